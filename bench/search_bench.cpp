@@ -0,0 +1,110 @@
+﻿////////////////////////////////////////////////////////////////////////////////
+// Module Name:  search_bench.cpp
+////////////////////////////////////////////////////////////////////////////////
+//
+// Compares lookups in BTreeIntAdapter through the virtual comparator,
+// through the templated node search kernel and through the vector kernel
+// the adapter installs for int keys.
+//
+// Usage: btree_search_bench [file] [keys] [lookups] [order]
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <string>
+#include <cstdlib>
+
+#include "btree_adapters.h"
+#include "node_search.h"
+
+
+using namespace std;
+using namespace xi;
+
+
+/** \brief Результат одного прогона. */
+struct RunResult {
+    double insertMs;
+    double searchMs;
+    UInt found;
+};
+
+
+/** \brief Ядро поиска внутри узла, с которым идет прогон. */
+enum Kernel
+{
+    kComparator,                ///< Без ядра, все сравнения через IComparator.
+    kTemplated,                 ///< BTreeNodeSearch<BTreeAdapterTraits<int> >.
+    kSimd                       ///< Векторное ядро, которое ставит сам адаптер.
+};
+
+
+/** \brief Строит дерево из \c keys и ищет в нем \c probes с ядром поиска \c kernel. */
+RunResult run(const string& fn, UShort order, Kernel kernel, const vector<int>& keys,
+    const vector<int>& probes)
+{
+    typedef chrono::steady_clock Clock;
+
+    BTreeIntAdapter bt;
+    bt.getTree().setCacheCapacity(1 << 16);         // the whole tree stays in memory
+    bt.create(order, fn);
+    if (kernel == kComparator)
+        bt.getTree().setSearchKernel(nullptr, nullptr);
+    else if (kernel == kTemplated)
+        bt.getTree().setSearchKernel(&BTreeNodeSearch<BTreeAdapterTraits<int> >::lowerBound,
+            &BTreeNodeSearch<BTreeAdapterTraits<int> >::upperBound);
+
+    RunResult res;
+
+    Clock::time_point t0 = Clock::now();
+    for (int k : keys)
+        bt.insert(k);
+    Clock::time_point t1 = Clock::now();
+
+    res.found = 0;
+    int dst;
+    for (int k : probes)
+        if (bt.search(k, dst))
+            ++res.found;
+    Clock::time_point t2 = Clock::now();
+
+    res.insertMs = chrono::duration<double, milli>(t1 - t0).count();
+    res.searchMs = chrono::duration<double, milli>(t2 - t1).count();
+    return res;
+}
+
+
+int main(int argc, char* argv[])
+{
+    string fn = argc > 1 ? argv[1] : "search_bench.xibt";
+    size_t keysNum = argc > 2 ? strtoul(argv[2], nullptr, 10) : 200000;
+    size_t probesNum = argc > 3 ? strtoul(argv[3], nullptr, 10) : 1000000;
+    UShort order = argc > 4 ? (UShort)strtoul(argv[4], nullptr, 10) : 128;
+
+    mt19937 gen(42);
+    vector<int> keys(keysNum);
+    for (size_t i = 0; i < keysNum; ++i)
+        keys[i] = (int)(gen() >> 1);
+
+    // half of the probes hit, half (most likely) miss
+    vector<int> probes(probesNum);
+    for (size_t i = 0; i < probesNum; ++i)
+        probes[i] = (i % 2) ? keys[gen() % keysNum] : (int)(gen() >> 1);
+
+    cout << "keys: " << keysNum << ", lookups: " << probesNum << ", order: " << order << endl;
+
+    const char* isaNames[] = { "scalar", "SSE4.2", "AVX2" };
+    string names[] = { "virtual IComparator", "templated kernel",
+        string("SIMD kernel (") + isaNames[detectSimdIsa()] + ")" };
+    for (int kernel = kComparator; kernel <= kSimd; ++kernel)
+    {
+        RunResult r = run(fn, order, (Kernel)kernel, keys, probes);
+        cout << names[kernel] << ": insert " << r.insertMs << " ms, search " << r.searchMs
+            << " ms (" << (r.searchMs * 1e6 / probesNum) << " ns/lookup), found " << r.found << endl;
+    }
+
+    return 0;
+}
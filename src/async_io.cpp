@@ -0,0 +1,423 @@
+﻿////////////////////////////////////////////////////////////////////////////////
+// Module Name:  async_io.h/cpp
+////////////////////////////////////////////////////////////////////////////////
+
+
+#include "async_io.h"
+
+#include <stdexcept>        // std::runtime_error
+#include <algorithm>        // std::min
+#include <cerrno>
+#include <cstring>          // memset
+
+// io_uring is driven through raw system calls, so only the kernel header is needed
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define BTREE_WITH_URING
+#endif
+#endif
+
+#ifdef BTREE_WITH_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+namespace xi {
+
+
+//==============================================================================
+// class UringPageIO
+//==============================================================================
+
+
+UringPageIO::UringPageIO()
+    : _fd(-1)
+    , _ringFd(-1)
+    , _depth(0)
+    , _inFlight(0)
+    , _toSubmit(0)
+    , _sqRing(nullptr)
+    , _sqRingSize(0)
+    , _cqRing(nullptr)
+    , _cqRingSize(0)
+    , _sqes(nullptr)
+    , _sqesSize(0)
+    , _sqTail(nullptr)
+    , _sqMask(0)
+    , _sqArray(nullptr)
+    , _cqHead(nullptr)
+    , _cqTail(nullptr)
+    , _cqMask(0)
+    , _cqes(nullptr)
+{
+}
+
+
+UringPageIO::~UringPageIO()
+{
+    close();
+}
+
+
+#ifdef BTREE_WITH_URING
+
+
+bool UringPageIO::open(int fd, UInt depth)
+{
+    if (isOpen())
+        throw std::runtime_error("io_uring is already open");
+    if (depth == 0)
+        throw std::invalid_argument("Depth of asynchronous reads must be positive");
+
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int ringFd = (int)syscall(__NR_io_uring_setup, depth, &p);
+    if (ringFd < 0)
+        return false;               // no io_uring in the kernel, or it is forbidden here
+
+    // IORING_OP_READ comes in 5.6 along with this feature flag
+    if (!(p.features & IORING_FEAT_RW_CUR_POS))
+    {
+        ::close(ringFd);
+        return false;
+    }
+
+    _ringFd = ringFd;
+    _sqRingSize = p.sq_off.array + p.sq_entries * sizeof(__u32);
+    _cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+    _sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+
+    _sqRing = mmap(nullptr, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        _ringFd, IORING_OFF_SQ_RING);
+    if (_sqRing == MAP_FAILED)
+        _sqRing = nullptr;
+    else if (p.features & IORING_FEAT_SINGLE_MMAP)
+        _cqRing = _sqRing;
+    else
+    {
+        _cqRing = mmap(nullptr, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            _ringFd, IORING_OFF_CQ_RING);
+        if (_cqRing == MAP_FAILED)
+            _cqRing = nullptr;
+    }
+    _sqes = mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        _ringFd, IORING_OFF_SQES);
+    if (_sqes == MAP_FAILED)
+        _sqes = nullptr;
+
+    if (!_sqRing || !_cqRing || !_sqes)
+    {
+        close();
+        return false;
+    }
+
+    Byte* sq = (Byte*)_sqRing;
+    Byte* cq = (Byte*)_cqRing;
+    _sqTail = (UInt*)(sq + p.sq_off.tail);
+    _sqMask = *(UInt*)(sq + p.sq_off.ring_mask);
+    _sqArray = (UInt*)(sq + p.sq_off.array);
+    _cqHead = (UInt*)(cq + p.cq_off.head);
+    _cqTail = (UInt*)(cq + p.cq_off.tail);
+    _cqMask = *(UInt*)(cq + p.cq_off.ring_mask);
+    _cqes = cq + p.cq_off.cqes;
+
+    // the kernel may round the rings up, but no more than depth requests are ever queued
+    _fd = fd;
+    _depth = depth;
+    _requests.resize(depth);
+    _freeSlots.clear();
+    for (UInt i = depth; i > 0; --i)
+        _freeSlots.push_back(i - 1);
+
+    return true;
+}
+
+
+void UringPageIO::close()
+{
+    // the kernel writes into the buffers of the requests in flight until they complete
+    Completion c;
+    while (_ringFd != -1 && _inFlight && getCompletion(c, true))
+        ;
+
+    if (_sqes)
+        munmap(_sqes, _sqesSize);
+    if (_cqRing && _cqRing != _sqRing)
+        munmap(_cqRing, _cqRingSize);
+    if (_sqRing)
+        munmap(_sqRing, _sqRingSize);
+    if (_ringFd != -1)
+        ::close(_ringFd);
+
+    _sqes = _sqRing = _cqRing = nullptr;
+    _ringFd = -1;
+    _fd = -1;
+    _depth = _inFlight = _toSubmit = 0;
+    _requests.clear();
+    _freeSlots.clear();
+}
+
+
+void UringPageIO::submitRead(ULong ofs, void* dst, UInt sz, UInt tag)
+{
+    if (!isOpen())
+        throw std::runtime_error("io_uring is not open");
+    if (_freeSlots.empty())
+        throw std::logic_error("Too many asynchronous reads in flight");
+
+    UInt slot = _freeSlots.back();
+    _freeSlots.pop_back();
+    Request& r = _requests[slot];
+    r.ofs = ofs;
+    r.dst = (Byte*)dst;
+    r.sz = sz;
+    r.tag = tag;
+
+    queue(slot);
+    ++_inFlight;
+}
+
+
+bool UringPageIO::getCompletion(Completion& c, bool wait)
+{
+    for (;;)
+    {
+        if (!_inFlight)
+            return false;
+
+        // the tail is moved by the kernel after it fills the entry
+        UInt head = *_cqHead;
+        if (head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE))
+        {
+            if (!wait && !_toSubmit)
+                return false;
+
+            enter(wait);
+            continue;
+        }
+
+        const io_uring_cqe& cqe = ((const io_uring_cqe*)_cqes)[head & _cqMask];
+        UInt slot = (UInt)cqe.user_data;
+        int res = cqe.res;
+        __atomic_store_n(_cqHead, head + 1, __ATOMIC_RELEASE);
+
+        Request& r = _requests[slot];
+        if (res == -EINTR || res == -EAGAIN || (res > 0 && (UInt)res < r.sz))
+        {
+            // a short read is finished by another one, as pread() loops do
+            if (res > 0)
+            {
+                r.ofs += res;
+                r.dst += res;
+                r.sz -= res;
+            }
+            queue(slot);
+            continue;
+        }
+
+        c.tag = r.tag;
+        c.ok = res >= 0 && (UInt)res == r.sz;
+        _freeSlots.push_back(slot);
+        --_inFlight;
+        return true;
+    }
+}
+
+
+void UringPageIO::queue(UInt slot)
+{
+    // there are as many entries as slots, so the ring always has room for a slot
+    UInt tail = *_sqTail;
+    UInt idx = tail & _sqMask;
+    io_uring_sqe& sqe = ((io_uring_sqe*)_sqes)[idx];
+    const Request& r = _requests[slot];
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = _fd;
+    sqe.off = r.ofs;
+    sqe.addr = (__u64)(size_t)r.dst;
+    sqe.len = r.sz;
+    sqe.user_data = slot;
+
+    _sqArray[idx] = idx;
+    __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++_toSubmit;
+}
+
+
+void UringPageIO::enter(bool wait)
+{
+    for (;;)
+    {
+        int r = (int)syscall(__NR_io_uring_enter, _ringFd, _toSubmit, wait ? 1 : 0,
+            wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (r >= 0)
+        {
+            _toSubmit -= std::min((UInt)r, _toSubmit);
+            return;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            throw std::runtime_error("io_uring_enter failed");
+    }
+}
+
+
+#else // BTREE_WITH_URING
+
+
+bool UringPageIO::open(int /*fd*/, UInt /*depth*/)
+{
+    return false;
+}
+
+void UringPageIO::close()
+{
+}
+
+void UringPageIO::submitRead(ULong /*ofs*/, void* /*dst*/, UInt /*sz*/, UInt /*tag*/)
+{
+    throw std::runtime_error("io_uring is not supported on this platform");
+}
+
+bool UringPageIO::getCompletion(Completion& /*c*/, bool /*wait*/)
+{
+    return false;
+}
+
+void UringPageIO::queue(UInt /*slot*/)
+{
+}
+
+void UringPageIO::enter(bool /*wait*/)
+{
+}
+
+
+#endif // BTREE_WITH_URING
+
+
+
+//==============================================================================
+// class ThreadPoolPageIO
+//==============================================================================
+
+
+ThreadPoolPageIO::ThreadPoolPageIO()
+    : _io(nullptr)
+    , _depth(0)
+    , _inFlight(0)
+    , _stop(false)
+{
+}
+
+
+ThreadPoolPageIO::~ThreadPoolPageIO()
+{
+    close();
+}
+
+
+void ThreadPoolPageIO::open(IPageIO* io, UInt depth)
+{
+    if (isOpen())
+        throw std::runtime_error("Thread pool is already open");
+    if (!io || depth == 0)
+        throw std::invalid_argument("Thread pool needs a storage and a positive depth");
+
+    _io = io;
+    _depth = depth;
+    _inFlight = 0;
+    _stop = false;
+    for (UInt i = 0; i < std::min(depth, (UInt)MAX_THREADS); ++i)
+        _threads.push_back(std::thread(&ThreadPoolPageIO::work, this));
+}
+
+
+void ThreadPoolPageIO::close()
+{
+    if (!isOpen())
+        return;
+
+    // the queued requests are done first: the caller may still own the buffers
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _queued.notify_all();
+    for (std::thread& t : _threads)
+        t.join();
+
+    _threads.clear();
+    _queue.clear();
+    _done.clear();
+    _inFlight = 0;
+    _depth = 0;
+    _io = nullptr;
+}
+
+
+void ThreadPoolPageIO::submitRead(ULong ofs, void* dst, UInt sz, UInt tag)
+{
+    if (!isOpen())
+        throw std::runtime_error("Thread pool is not open");
+    if (_inFlight == _depth)
+        throw std::logic_error("Too many asynchronous reads in flight");
+
+    Request r = { ofs, dst, sz, tag };
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _queue.push_back(r);
+    }
+    _queued.notify_one();
+    ++_inFlight;
+}
+
+
+bool ThreadPoolPageIO::getCompletion(Completion& c, bool wait)
+{
+    if (!_inFlight)
+        return false;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (wait)
+        _completed.wait(lock, [this] { return !_done.empty(); });
+    else if (_done.empty())
+        return false;
+
+    c = _done.front();
+    _done.pop_front();
+    --_inFlight;
+    return true;
+}
+
+
+void ThreadPoolPageIO::work()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;)
+    {
+        _queued.wait(lock, [this] { return _stop || !_queue.empty(); });
+        if (_queue.empty())
+            return;                 // stopped, and nothing is left
+
+        Request r = _queue.front();
+        _queue.pop_front();
+
+        // reads go in parallel, only the queues are shared
+        lock.unlock();
+        Completion c = { r.tag, _io->readAt(r.ofs, r.dst, r.sz) };
+        lock.lock();
+
+        _done.push_back(c);
+        _completed.notify_one();
+    }
+}
+
+
+} // namespace xi
@@ -0,0 +1,227 @@
+﻿/// \file
+/// \brief     Асинхронное чтение страниц B-дерева: io_uring и пул потоков
+///
+/// Реализация соответствующих методов располагается в файле async_io.cpp.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef BTREE_ASYNC_IO_H_
+#define BTREE_ASYNC_IO_H_
+
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "utils.h"
+#include "page_io.h"
+
+
+
+namespace xi {
+
+
+/** \brief Интерфейс асинхронного чтения: запросы ставятся в очередь submitRead(), а их
+ *  результаты забираются getCompletion() в порядке завершения, поэтому на устройстве
+ *  одновременно может находиться до getDepth() чтений.
+ *
+ *  Объект не потокобезопасен: запросы ставит и результаты забирает один поток за раз.
+ */
+class IAsyncPageIO {
+public:
+    /** \brief Результат одного чтения. */
+    struct Completion {
+        UInt tag;                   ///< Метка, переданная в submitRead().
+        bool ok;                    ///< Прочитаны ли все запрошенные байты.
+    }; // struct Completion
+
+public:
+    /** \brief Ставит в очередь чтение \c sz байт по смещению \c ofs в \c dst с меткой \c tag.
+     *
+     *  Память \c dst не должна освобождаться до получения результата. Запрос уходит
+     *  на устройство не позже следующего getCompletion(). Если в полете уже getDepth()
+     *  запросов, кидает std::logic_error.
+     */
+    virtual void submitRead(ULong ofs, void* dst, UInt sz, UInt tag) = 0;
+
+    /** \brief Забирает в \c c результат одного завершенного чтения.
+     *
+     *  Если \c wait == true, ждет завершения; возвращает ложь, только если ждать нечего
+     *  (запросов в полете нет) или, при \c wait == false, ни один еще не завершен.
+     */
+    virtual bool getCompletion(Completion& c, bool wait) = 0;
+
+    /** \brief Возвращает число поставленных запросов, результаты которых еще не забраны. */
+    virtual UInt getInFlight() const = 0;
+
+    /** \brief Возвращает наибольшее число запросов в полете. */
+    virtual UInt getDepth() const = 0;
+
+    /** \brief Возвращает истину, если механизм готов к работе. */
+    virtual bool isOpen() const = 0;
+
+protected:
+    ~IAsyncPageIO() {};
+}; // class IAsyncPageIO
+
+
+
+/** \brief Асинхронное чтение через io_uring (Linux 5.6 и новее) из файлового дескриптора.
+ *
+ *  Запросы накапливаются в очереди отправки (SQ) и уходят в ядро одним системным вызовом
+ *  при getCompletion(), результаты читаются из очереди завершений (CQ) без системных
+ *  вызовов, пока она не пуста. Библиотека liburing не нужна: кольца отображаются
+ *  в память напрямую.
+ *
+ *  Ядро может не поддерживать io_uring или запрещать его (seccomp, контейнеры); тогда
+ *  open() возвращает ложь, и вызывающий переходит на ThreadPoolPageIO.
+ */
+class UringPageIO : public IAsyncPageIO {
+public:
+    UringPageIO();
+
+    /** \brief Деструктор. Дожидается запросов в полете и освобождает кольца. */
+    ~UringPageIO();
+
+protected:
+    UringPageIO(const UringPageIO&);                    ///< КК не доступен.
+    UringPageIO& operator= (UringPageIO&);              ///< Оператор присваивания недоступен.
+
+public:
+    /** \brief Создает кольца на \c depth запросов для чтения из файла \c fd.
+     *
+     *  Возвращает ложь, если io_uring на этой системе недоступен. Если уже открыт, кидает
+     *  std::runtime_error.
+     */
+    bool open(int fd, UInt depth);
+
+    /** \brief Дожидается запросов в полете и освобождает кольца. Если не открыт, ничего не делает. */
+    void close();
+
+public:
+    virtual void submitRead(ULong ofs, void* dst, UInt sz, UInt tag) override;
+    virtual bool getCompletion(Completion& c, bool wait) override;
+    virtual UInt getInFlight() const override { return _inFlight; }
+    virtual UInt getDepth() const override { return _depth; }
+    virtual bool isOpen() const override { return _ringFd != -1; }
+
+protected:
+    /** \brief Запрос в полете: недочитанный остаток после короткого чтения отправляется заново. */
+    struct Request {
+        ULong ofs;                  ///< Смещение еще не прочитанной части.
+        Byte* dst;                  ///< Куда ее читать.
+        UInt sz;                    ///< Ее длина.
+        UInt tag;                   ///< Метка запроса.
+    }; // struct Request
+
+protected:
+    /** \brief Помещает в очередь отправки чтение запроса номер \c slot. */
+    void queue(UInt slot);
+
+    /** \brief Отправляет в ядро накопленные запросы, ожидая, если \c wait == true, хотя бы
+     *  одного завершения.
+     */
+    void enter(bool wait);
+
+protected:
+    int _fd;                                        ///< Файл, из которого читаем.
+    int _ringFd;                                    ///< Дескриптор io_uring, -1 — не открыт.
+    UInt _depth;                                    ///< Наибольшее число запросов в полете.
+    UInt _inFlight;                                 ///< Число запросов в полете.
+    UInt _toSubmit;                                 ///< Запросов в SQ, не отправленных в ядро.
+
+    void* _sqRing;                                  ///< Отображение кольца отправки.
+    size_t _sqRingSize;                             ///< Его размер.
+    void* _cqRing;                                  ///< Отображение кольца завершений (может совпадать с _sqRing).
+    size_t _cqRingSize;                             ///< Его размер.
+    void* _sqes;                                    ///< Отображение массива элементов отправки.
+    size_t _sqesSize;                               ///< Его размер.
+
+    // поля колец внутри отображений; хвост CQ двигает ядро
+    UInt* _sqTail;                                  ///< Хвост кольца отправки.
+    UInt _sqMask;                                   ///< Маска номера элемента кольца отправки.
+    UInt* _sqArray;                                 ///< Номера элементов отправки в кольце.
+    UInt* _cqHead;                                  ///< Голова кольца завершений.
+    UInt* _cqTail;                                  ///< Хвост кольца завершений.
+    UInt _cqMask;                                   ///< Маска номера элемента кольца завершений.
+    void* _cqes;                                    ///< Элементы кольца завершений.
+
+    std::vector<Request> _requests;                 ///< Запросы по номерам слотов.
+    std::vector<UInt> _freeSlots;                   ///< Свободные слоты.
+}; // class UringPageIO
+
+
+
+/** \brief Асинхронное чтение пулом потоков поверх любого IPageIO: каждый поток пула
+ *  выполняет синхронный readAt(), так что в полете столько чтений, сколько потоков.
+ *
+ *  Используется там, где io_uring недоступен. Хранилище должно допускать одновременное
+ *  чтение из нескольких потоков (см. IPageIO).
+ */
+class ThreadPoolPageIO : public IAsyncPageIO {
+public:
+    /** \brief Наибольшее число потоков пула. */
+    static const UInt MAX_THREADS = 16;
+
+public:
+    ThreadPoolPageIO();
+
+    /** \brief Деструктор. Останавливает потоки. */
+    ~ThreadPoolPageIO();
+
+protected:
+    ThreadPoolPageIO(const ThreadPoolPageIO&);          ///< КК не доступен.
+    ThreadPoolPageIO& operator= (ThreadPoolPageIO&);    ///< Оператор присваивания недоступен.
+
+public:
+    /** \brief Запускает min(\c depth, MAX_THREADS) потоков, читающих из \c io, и допускает
+     *  \c depth запросов в полете. Если уже открыт или \c depth == 0, кидает исключение.
+     */
+    void open(IPageIO* io, UInt depth);
+
+    /** \brief Дожидается запросов в полете и останавливает потоки. Если не открыт, ничего не делает. */
+    void close();
+
+public:
+    virtual void submitRead(ULong ofs, void* dst, UInt sz, UInt tag) override;
+    virtual bool getCompletion(Completion& c, bool wait) override;
+    virtual UInt getInFlight() const override { return _inFlight; }
+    virtual UInt getDepth() const override { return _depth; }
+    virtual bool isOpen() const override { return _io != nullptr; }
+
+protected:
+    /** \brief Запрос, ждущий свободного потока. */
+    struct Request {
+        ULong ofs;                  ///< Смещение.
+        void* dst;                  ///< Куда читать.
+        UInt sz;                    ///< Длина.
+        UInt tag;                   ///< Метка запроса.
+    }; // struct Request
+
+protected:
+    /** \brief Тело потока пула: берет запросы из очереди, пока пул не остановлен. */
+    void work();
+
+protected:
+    IPageIO* _io;                                   ///< Хранилище, nullptr — не открыт.
+    UInt _depth;                                    ///< Наибольшее число запросов в полете.
+    UInt _inFlight;                                 ///< Число запросов в полете.
+    bool _stop;                                     ///< Потокам пора завершаться.
+
+    std::vector<std::thread> _threads;              ///< Потоки пула.
+    std::deque<Request> _queue;                     ///< Запросы, ждущие потока.
+    std::deque<Completion> _done;                   ///< Результаты, ждущие getCompletion().
+
+    std::mutex _mutex;                              ///< Защищает очереди и _stop.
+    std::condition_variable _queued;                ///< Появился запрос или пул остановлен.
+    std::condition_variable _completed;             ///< Появился результат.
+}; // class ThreadPoolPageIO
+
+
+} // namespace xi
+
+
+#endif // BTREE_ASYNC_IO_H_
@@ -14,7 +14,10 @@
 
 #include <stdexcept>        // std::invalid_argument
 #include <cstring>          // memset
-#include <set>
+#include <vector>
+#include <algorithm>        // std::min
+#include <limits>           // std::numeric_limits
+#include <cstdio>           // std::remove
 
 
 namespace xi {
@@ -28,28 +31,57 @@ namespace xi {
 
 bool BaseBTree::Header::checkIntegrity()
 {
-    return (sign == VALID_SIGN) && (order >= 1) && (recSize > 0);
+    return (sign == VALID_SIGN) && (version == FORMAT_VERSION) && (order >= 1) && (recSize > 0)
+        && (format <= pfBLink) && (valueSize < recSize);
 }
 
 
+UInt BaseBTree::MetaSlot::calcChecksum() const
+{
+    UInt h = 2166136261u;
+    const Byte* fields = (const Byte*)this;
+    for (UInt i = 0; i < sizeof(MetaSlot) - sizeof(checksum); ++i)
+        h = (h ^ fields[i]) * 16777619u;
+
+    return h;
+}
+
 
-BaseBTree::BaseBTree(UShort order, UShort recSize, IComparator* comparator, std::iostream* stream)
+
+BaseBTree::BaseBTree(UShort order, UShort recSize, IComparator* comparator, IPageIO* io)
     : _order(order), 
     _recSize(recSize), 
-    _comparator(comparator),
-    _stream(stream), 
+    _keySize(recSize),
+    _format(pfBTree),
     _lastPageNum(0),
-    _rootPageNum(0)
+    _rootPageNum(0),
+    _freePageNum(0)
+    , _metaSeq(0)
+    , _metaDirty(false)
+    , _cowEnabled(false)
+    , _lastSlotNum(0)
+    , _cowEpoch(1)
+    , _durableEpoch(1)
+    , _io(io)
+    , _asyncIO(nullptr)
     , _rootPage(this)
+    , _workPage(this)
+    , _comparator(comparator)
+    , _cacheCapacity(DEFAULT_CACHE_CAPACITY)
+    , _cache(this)
+    , _linearSearchThreshold(DEFAULT_LINEAR_SEARCH_THRESHOLD)
+    , _lowerBoundFunc(nullptr)
+    , _upperBoundFunc(nullptr)
+    , _optimisticReads(false)
 {
 }
 
 
-BaseBTree::BaseBTree(IComparator* comparator, std::iostream* stream):
+BaseBTree::BaseBTree(IComparator* comparator, IPageIO* io):
     BaseBTree(
         0,      // порядок, 0 — д.б. прочитан из файла!
         0,      // размер ключа, 0 —  --//--
-        comparator, stream)
+        comparator, io)
 {
 
 }
@@ -58,6 +90,7 @@ BaseBTree::BaseBTree(IComparator* comparator, std::iostream* stream):
 
 BaseBTree::~BaseBTree()
 {
+    detachSnapshots();
 }
 
 
@@ -65,8 +98,39 @@ void BaseBTree::resetBTree()
 {
     _order = 0;
     _recSize = 0;
-    _stream = nullptr;
+    _keySize = 0;
+    _format = pfBTree;
+    _lastPageNum = 0;
+    _rootPageNum = 0;
+    _freePageNum = 0;
+    _metaSeq = 0;
+    _metaDirty = false;
+    detachSnapshots();
+    _pageMap.reset();
+    _lastSlotNum = 0;
+    _freshSlots.clear();
+    _freeSlots.clear();
+    _retiredSlots.clear();
+    _pageTableSlots.clear();
+    _cowEpoch = 1;
+    _durableEpoch = 1;
+    _io = nullptr;
+    _asyncIO = nullptr;
+    _pageLatches.clear();
+    detachWorkPages();          // work pages could look into the mapping
     _comparator = nullptr;      // для порядку его тоже сбасываем, но это не очень обязательно
+    _cache.reset(_cacheCapacity, 0);    // пул выключен до следующего открытия
+}
+
+
+void BaseBTree::setCacheCapacity(UInt capacity)
+{
+    TreeLatchGuard tree(_treeLatch, true);
+    if (_cache.isEnabled())
+        _cache.flush();
+
+    _cacheCapacity = capacity;
+    _cache.reset(isMapped() ? 0 : _cacheCapacity, isOpen() ? _nodePageSize : 0);
 }
 
 
@@ -78,7 +142,10 @@ void BaseBTree::readPage(UInt pnum, Byte* dst)
     if (pnum == 0 || pnum > getLastPageNum())
         throw std::invalid_argument("Can't read a non-existing page");
 
-    readPageInternal(pnum, dst);
+    if (_cache.isEnabled())
+        _cache.read(pnum, dst);
+    else
+        readPageInternal(pnum, dst);
 }
 
 
@@ -89,14 +156,26 @@ void BaseBTree::writePage(UInt pnum, const Byte* dst)
     if (pnum == 0 || pnum > getLastPageNum())
         throw std::invalid_argument("Can't write a non-existing page");
 
-    writePageInternal(pnum, dst);
+    if (_pageMap)
+        shadowPage(pnum);           // a page that someone else may see goes to a new slot
 
+    // write-back: the page is likely to be modified again soon, so it only gets dirty
+    // and reaches the storage on eviction or flush, in the order of page numbers
+    if (_cache.isEnabled())
+        _cache.write(pnum, dst, true);
+    else
+        writePageInternal(pnum, dst);
 }
 
 
-bool BaseBTree::checkKeysNumber(UShort keysNum, bool isRoot)
+bool BaseBTree::checkKeysNumber(UShort keysNum, bool isRoot, bool isLeaf)
 {
-    if (keysNum > getMaxKeys())
+    // a slotted page is limited by bytes, the number of keys only has to fit
+    if (isSlotted())
+        return keysNum <= _maxKeys;
+
+    bool inner = isBPlus() && !isLeaf;      // внутренние узлы B+-дерева вмещают больше ключей
+    if (keysNum > (inner ? _innerMaxKeys : _maxKeys))
         return false;                       // превышение по максимуму
 
     // NOTE: для корня пока даже 0 допустим, потом уточним, надо ли до 1 сокращать
@@ -104,13 +183,13 @@ bool BaseBTree::checkKeysNumber(UShort keysNum, bool isRoot)
     //if (nt == nRoot)
         return true;
 
-    return (keysNum >= getMinKeys());        
+    return (keysNum >= (inner ? _innerMinKeys : _minKeys));
 }
 
 
-void BaseBTree::checkKeysNumberExc(UShort keysNum, bool isRoot)
+void BaseBTree::checkKeysNumberExc(UShort keysNum, bool isRoot, bool isLeaf)
 {
-    if (!checkKeysNumber(keysNum,  isRoot))
+    if (!checkKeysNumber(keysNum,  isRoot, isLeaf))
         throw std::invalid_argument("Invalid number of keys for a node");
 }
 
@@ -118,7 +197,7 @@ void BaseBTree::checkKeysNumberExc(UShort keysNum, bool isRoot)
 UInt BaseBTree::allocPage(PageWrapper& pw, UShort keysNum, bool isLeaf /*= false*/)
 {
     checkForOpenStream();
-    checkKeysNumberExc(keysNum, pw.isRoot());  // nt);
+    checkKeysNumberExc(keysNum, pw.isRoot(), isLeaf);  // nt);
 
     return allocPageInternal(pw, keysNum, pw.isRoot(),  isLeaf);
 }
@@ -135,649 +214,4072 @@ xi::UInt BaseBTree::allocNewRootPage(PageWrapper& pw)
 
 Byte* BaseBTree::search(const Byte* k)
 {
-    _rootPage.readPage(_rootPageNum);
-    return _rootPage.search(k);
+    Byte* retPtr = new Byte[_recSize];
+    if (search(k, retPtr))
+        return retPtr;
+
+    delete[] retPtr;
+    return nullptr;
 }
 
-int BaseBTree::searchAll(const Byte* k, std::list<Byte*>& keys)
+
+bool BaseBTree::search(const Byte* k, Byte* dst)
 {
-    _rootPage.readPage(_rootPageNum);
-    return _rootPage.searchAll(k, keys);
+    // optimistic attempts give up on conflicting writes, then the search waits for
+    // the writers as usual, so a stream of inserts to the same pages can't starve it
+    if (isOptimistic())
+    {
+        for (UInt attempt = 0; attempt < OPTIMISTIC_ATTEMPTS; ++attempt)
+        {
+            bool found;
+            if (findOptimistic(k, dst, found))
+                return found;
+        }
+    }
+
+    // searches never change pages, so they go in parallel in every mode
+    TreeLatchGuard tree(_treeLatch, false);
+    return findLatched(k, dst);
 }
 
-//UInt BaseBTree::allocPageInternal(UShort keysNum, NodeType nt, PageWrapper& pw)
-UInt BaseBTree::allocPageInternal(PageWrapper& pw, UShort keysNum, bool isRoot, bool isLeaf)
+
+const Byte* BaseBTree::findValue(const Byte* k)
 {
-    // подготовим страничку для вывода
-    pw.clear();
-    pw.setKeyNumLeaf(keysNum, isRoot, isLeaf);    // nt);
+    const Byte* found = find(k);
+    return found ? found + _keySize : nullptr;
+}
 
-    // пока что просто позиционируемся в конец, считая, что так и будет, но держать под контролем
-    _stream->seekg(0, std::ios_base::end);    
-    _stream->write((const char*)pw.getData(), getNodePageSize());
 
-    ++_lastPageNum;
-    writePageCounter();
+bool BaseBTree::getValue(const Byte* k, Byte* value)
+{
+    std::vector<Byte> rec(_recSize);
+    if (!search(k, &rec[0]))
+        return false;
+
+    memcpy(value, &rec[_keySize], getValueSize());
+    return true;
+}
 
 
-    // TODO: flush-им на диск сразу?!
-    //_stream->flush();
+const Byte* BaseBTree::find(const Byte* k)
+{
+    // This method is based on Cormen implementation, but goes down iteratively:
+    // every level below the root is read into the same work page
+    _rootPage.readPage(_rootPageNum);
+    PageWrapper* node = &_rootPage;
 
-    return _lastPageNum;
-}
+    for (;;)
+    {
+        // a B-link page whose split has not reached the parent yet keeps the rest of
+        // the keys to the right
+        while (node->isBeyond(k))
+        {
+            _workPage.readPage(node->getRightLink());
+            node = &_workPage;
+        }
 
+        UShort offset = node->lowerBound(k);
 
+        // B+ separators can stay bigger than the keys left under them after removals,
+        // so the first not less key may be the first one of the next leaf
+        if (node->isLeaf() && isBPlus() && offset == node->getKeysNum() && node->getNextLeaf())
+        {
+            _workPage.readPage(node->getNextLeaf());
+            node = &_workPage;
+            offset = 0;
+        }
 
-void BaseBTree::readPageInternal(UInt pnum, Byte* dst)
+        // B+ separators are not records, only leaves hold them
+        if (offset < node->getKeysNum() && (node->isLeaf() || !isBPlus())
+            && _comparator->isEqual(node->getKey(offset), k, _keySize))
+            return node->getKey(offset); // if this key is what we were searched for, simply return it
+
+        if (node->isLeaf())
+            return nullptr; // if nothing was found
+
+        _workPage.readPageFromChild(*node, offset); // going down to specified child
+        node = &_workPage;
+    }
+}
+
+
+bool BaseBTree::findLatched(const Byte* k, Byte* dst)
 {
-    // позиционируемся и читаем
-    gotoPage(pnum);
-    _stream->read((char*)dst, getNodePageSize());
+    // the same descent as in find(), but a page is latched before the latch of the one
+    // it is reached from is released, so no split can move the key away in between
+    PageWrapper first(this);
+    PageWrapper second(this);
+    PageWrapper* node = &first;
+    PageWrapper* next = &second;
+
+    // B-link inserts latch parents while holding children (see postBLink()), so there pages
+    // are latched one at a time: a page that splits in between is left by its right link
+    bool coupled = !isBLink();
+
+    LatchGuard root(_rootLatch, false);     // the root page number is the parent of the root
+    UInt pnum = _rootPageNum;
+    if (!coupled)
+        root.unlock();
+    node->latch(pnum, false);
+    node->readPage(pnum);
+    root.unlock();
+
+    for (;;)
+    {
+        moveRight(node, next, k, false, false);     // a B-link page may have split meanwhile
+        UShort offset = node->lowerBound(k);
+
+        // leaves are latched left to right only, as splits do, so the step never deadlocks
+        if (node->isLeaf() && isBPlus() && offset == node->getKeysNum() && node->getNextLeaf())
+        {
+            pnum = node->getNextLeaf();
+            next->latch(pnum, false);
+            next->readPage(pnum);
+            node->unlatch();
+            std::swap(node, next);
+            offset = 0;
+        }
+
+        if (offset < node->getKeysNum() && (node->isLeaf() || !isBPlus())
+            && _comparator->isEqual(node->getKey(offset), k, _keySize))
+        {
+            const Byte* found = node->getKey(offset);
+            memcpy(dst, found, getRecLen(found));
+            return true;
+        }
+
+        if (node->isLeaf())
+            return false;
+
+        pnum = node->getCursor(offset);
+        if (!coupled)
+            node->unlatch();
+        next->latch(pnum, false);
+        next->readPage(pnum);
+        node->unlatch();
+        std::swap(node, next);
+    }
 }
 
 
-void BaseBTree::writePageInternal(UInt pnum, const Byte* dst)
+bool BaseBTree::readOptimistic(PageWrapper& pw, UInt pnum, UInt fromPage, UInt fromVersion,
+    UInt treeVersion, UInt& version)
 {
-    // позиционируемся и пишем
-    gotoPage(pnum);
-    _stream->write((const char*)dst, getNodePageSize());
+    const Latch& latch = _pageLatches.get(pnum);
+    version = latch.readVersion();
+
+    // the link is checked after the version is taken: had the page been split off or
+    // the root been replaced before, the link would have changed as well
+    if (fromPage ? !_pageLatches.get(fromPage).validate(fromVersion) : _rootPageNum != pnum)
+        return false;
+
+    // the copy may be torn by a writer, so nothing in it is looked at before the check;
+    // operations on the whole tree change pages without latching them
+    pw.readPageCopy(pnum);
+    return latch.validate(version) && _treeLatch.validate(treeVersion);
 }
 
 
-void BaseBTree::gotoPage(UInt pnum)
+bool BaseBTree::findOptimistic(const Byte* k, Byte* dst, bool& found)
 {
-    // рассчитаем смещение до нужной страницы
-    UInt pageOfs = FIRST_PAGE_OFS + getNodePageSize() * (pnum - 1);     // т.к. нумеруются с единицы
-    _stream->seekg(pageOfs, std::ios_base::beg);
+    // the same descent as in findLatched(), every step checks versions instead of latching
+    PageWrapper first(this);
+    PageWrapper second(this);
+    PageWrapper* node = &first;
+    PageWrapper* next = &second;
+
+    UInt treeVersion = _treeLatch.readVersion();
+    UInt version;
+    UInt nextVersion;
+    if (!readOptimistic(*node, _rootPageNum, 0, 0, treeVersion, version))
+        return false;
+
+    for (;;)
+    {
+        while (node->isBeyond(k))
+        {
+            if (!readOptimistic(*next, node->getRightLink(), node->getPageNum(), version,
+                    treeVersion, nextVersion))
+                return false;
+
+            std::swap(node, next);
+            version = nextVersion;
+        }
+
+        UShort offset = node->lowerBound(k);
+
+        if (node->isLeaf() && isBPlus() && offset == node->getKeysNum() && node->getNextLeaf())
+        {
+            if (!readOptimistic(*next, node->getNextLeaf(), node->getPageNum(), version,
+                    treeVersion, nextVersion))
+                return false;
+
+            std::swap(node, next);
+            version = nextVersion;
+            offset = 0;
+        }
+
+        found = offset < node->getKeysNum() && (node->isLeaf() || !isBPlus())
+            && _comparator->isEqual(node->getKey(offset), k, _keySize);
+        if (found)
+        {
+            const Byte* rec = node->getKey(offset);
+            memcpy(dst, rec, getRecLen(rec));
+            return true;
+        }
+
+        if (node->isLeaf())
+            return true;
+
+        if (!readOptimistic(*next, node->getCursor(offset), node->getPageNum(), version,
+                treeVersion, nextVersion))
+            return false;
+
+        std::swap(node, next);
+        version = nextVersion;
+    }
 }
 
 
-void BaseBTree::loadTree()
+bool BaseBTree::searchAllOptimistic(const Byte* k, std::vector<Byte>& recs)
 {
-    // _stream->seekg(0, std::ios_base::beg);       // пока загружаем с текущего места в потоке!
-    // читаем заголовок
-    
-    Header hdr;
-    readHeader(hdr);
+    recs.clear();
 
-    // если при чтении случилась пичалька
-    if (_stream->fail())
+    PageWrapper first(this);
+    PageWrapper second(this);
+    PageWrapper* node = &first;
+    PageWrapper* next = &second;
+
+    UInt treeVersion = _treeLatch.readVersion();
+    UInt version;
+    UInt nextVersion;
+    if (!readOptimistic(*node, _rootPageNum, 0, 0, treeVersion, version))
+        return false;
+
+    if (!isBPlus())
+        return collectOptimistic(k, *node, version, treeVersion, recs);
+
+    // equal keys of a B+ tree go in a row along the leaf list from the leaf find() comes to
+    for (;;)
     {
-        //_stream->close();
-        throw std::runtime_error("Can't read header");
+        UInt pnum = node->isBeyond(k) ? node->getRightLink() : 0;
+        if (!pnum && node->isLeaf())
+            break;
+
+        if (!pnum)
+            pnum = node->getCursor(node->lowerBound(k));
+        if (!readOptimistic(*next, pnum, node->getPageNum(), version, treeVersion, nextVersion))
+            return false;
+
+        std::swap(node, next);
+        version = nextVersion;
     }
+    UShort offset = node->lowerBound(k);
 
-    // проверяет заголовок на корректность
-    if (!hdr.checkIntegrity())
+    for (;;)
     {
-        //_stream->close();
-        throw std::runtime_error("Stream is not a valid xi B-tree file");
+        UShort keyNum = node->getKeysNum();
+        for (; offset < keyNum && _comparator->isEqual(node->getKey(offset), k, _keySize); ++offset)
+            appendRecord(recs, node->getKey(offset));
+
+        if (offset < keyNum || !node->getNextLeaf())
+            return true;
+
+        if (!readOptimistic(*next, node->getNextLeaf(), node->getPageNum(), version,
+                treeVersion, nextVersion))
+            return false;
+
+        std::swap(node, next);
+        version = nextVersion;
+        offset = 0;
     }
+}
 
-    // задаем порядок и т.д.
-    setOrder(hdr.order, hdr.recSize);
 
-    // далее без проверки читаем два следующих поля
-    readPageCounter();             // номер текущей свободной страницы
-    readRootPageNum();             // номер корневой страницы
+bool BaseBTree::collectOptimistic(const Byte* k, PageWrapper& node, UInt version, UInt treeVersion,
+    std::vector<Byte>& recs)
+{
+    UShort keyNum = node.getKeysNum();
+    UShort first = node.lowerBound(k);
+    UShort last = first;
+    while (last < keyNum && _comparator->isEqual(node.getKey(last), k, _keySize))
+        ++last;
 
-    // если при чтении случилась пичалька
-    if (_stream->fail())
+    if (node.isLeaf())
     {
-        //_fileStream.close();
-        throw std::runtime_error("Can't read necessary fields. File corrupted");
+        for (UShort offset = first; offset < last; ++offset)
+            appendRecord(recs, node.getKey(offset));
+        return true;
     }
 
-    // загрузить корневую страницу
-    loadRootPage();
+    // every child is reached through the checked copy of the node, so a split of
+    // an already visited child, which changes the node, can't pass unnoticed
+    PageWrapper child(this);
+    for (UShort offset = first; offset <= last; ++offset)
+    {
+        UInt childVersion;
+        if (!readOptimistic(child, node.getCursor(offset), node.getPageNum(), version,
+                treeVersion, childVersion)
+            || !collectOptimistic(k, child, childVersion, treeVersion, recs))
+            return false;
+
+        if (offset < last)
+            appendRecord(recs, node.getKey(offset));
+    }
 
+    return true;
 }
 
 
-void BaseBTree::loadRootPage()  //PageWrapper& pw)
+void BaseBTree::appendRecord(std::vector<Byte>& recs, const Byte* rec) const
 {
-    if (getRootPageNum() == 0)
-        throw std::runtime_error("Root page is not defined");
+    size_t ofs = recs.size();
+    recs.resize(ofs + _recSize);
+    memcpy(&recs[ofs], rec, getRecLen(rec));
+}
 
-    _rootPage.readPage(getRootPageNum());
-    _rootPage.setAsRoot(false);               // в файл номер страницы не пишем, т.к. только что прочитали оттуда его
 
-}
+struct BaseBTree::AsyncLookup {
+    AsyncLookup(BaseBTree* tree)
+        : page(tree), key(nullptr), rec(nullptr), index(0), pnum(0), version(0), attempts(0)
+        , loaded(false), found(false)
+    {
+    }
 
+    PageWrapper page;       // the page read last
+    const Byte* key;        // the key looked for, nullptr — the lookup is finished
+    Byte* rec;              // where the record goes
+    UInt index;             // number of the key in the batch
+    UInt pnum;              // number of the page read last, 0 — nothing is read yet
+    UInt version;           // version of its latch taken before the read
+    UInt attempts;          // restarts after conflicting writes
+    bool loaded;            // the page came from the storage, not from the pool
+    bool found;
+}; // struct BaseBTree::AsyncLookup
 
-void BaseBTree::createTree(UShort order, UShort recSize)
+
+UInt BaseBTree::searchAsync(const Byte* keys, UInt n, Byte* dst, std::vector<bool>& found)
 {
-    setOrder(order, recSize);
+    found.assign(n, false);
+    UInt count = 0;
 
-    writeHeader();                  // записываем заголовок файла
-    writePageCounter();             // и номер текущей свободной страницы
-    writeRootPageNum();             // и номер корневой страницы
+    // a mapped file has nothing to wait for
+    if (!_asyncIO || isMapped())
+    {
+        for (UInt i = 0; i < n; ++i)
+            if (search(keys + (size_t)i * _keySize, dst + (size_t)i * _recSize))
+            {
+                found[i] = true;
+                ++count;
+            }
+
+        return count;
+    }
 
+    std::lock_guard<std::mutex> io(_asyncMutex);
+    TreeLatchGuard tree(_treeLatch, false);
 
-    // создать корневую страницу
-    createRootPage();
+    // every lookup is a tag of the engine; a finished one takes the next key
+    std::vector<std::unique_ptr<AsyncLookup> > lookups;
+    std::vector<UInt> ready;
+    for (UInt tag = 0; tag < std::min(n, _asyncIO->getDepth()); ++tag)
+    {
+        lookups.push_back(std::unique_ptr<AsyncLookup>(new AsyncLookup(this)));
+        ready.push_back(tag);
+    }
+
+    try {
+        UInt next = 0;
+        for (;;)
+        {
+            while (!ready.empty())
+            {
+                UInt tag = ready.back();
+                ready.pop_back();
+                AsyncLookup& l = *lookups[tag];
+                while (!stepAsync(l, tag))
+                {
+                    if (l.found)
+                    {
+                        found[l.index] = true;
+                        ++count;
+                        l.found = false;
+                    }
+                    if (next == n)
+                        break;
+
+                    l.key = keys + (size_t)next * _keySize;
+                    l.rec = dst + (size_t)next * _recSize;
+                    l.index = next++;
+                    l.pnum = 0;
+                    l.attempts = 0;
+                }
+            }
+
+            IAsyncPageIO::Completion c;
+            if (!_asyncIO->getCompletion(c, true))
+                return count;
+            if (!c.ok)
+                throw std::runtime_error("Can't read a page. File corrupted");
+            ready.push_back(c.tag);
+        }
+    }
+    catch (...)
+    {
+        // the reads in flight still write into the pages of the lookups
+        IAsyncPageIO::Completion c;
+        while (_asyncIO->getCompletion(c, true))
+            ;
+        throw;
+    }
 }
 
 
-void BaseBTree::createRootPage()
-{
-    _rootPage.allocPage(0, true);
-    _rootPage.setAsRoot();
-}
+struct BaseBTree::MultiGetBatch {
+    MultiGetBatch(BaseBTree* t, const Byte* k, Byte* d, std::vector<bool>& f)
+        : tree(t), keys(k), dst(d), found(f), treeVersion(0), count(0)
+    {
+    }
 
+    /** \brief Ключ номер \c i. */
+    const Byte* key(UInt i) const { return keys + (size_t)i * tree->_keySize; }
 
-void BaseBTree::checkForOpenStream()
-{
-    if (!isOpen())
-        throw std::runtime_error("Stream is not ready");
+    /** \brief Место для записи ключа номер \c i. */
+    Byte* rec(UInt i) const { return dst + (size_t)i * tree->_recSize; }
 
-}
+    /** \brief Запоминает найденную запись \c r ключа номер \c i. */
+    void take(UInt i, const Byte* r)
+    {
+        memcpy(rec(i), r, tree->getRecLen(r));
+        found[i] = true;
+        ++count;
+    }
 
+    BaseBTree* tree;
+    const Byte* keys;
+    Byte* dst;
+    std::vector<bool>& found;
+    UInt treeVersion;
+    UInt count;
+}; // struct BaseBTree::MultiGetBatch
 
-void BaseBTree::writeHeader()
-{    
-    Header hdr(_order, _recSize);    
-    _stream->write((const char*)(void*)&hdr, HEADER_SIZE);
 
+UInt BaseBTree::multiGet(const Byte* keys, UInt n, Byte* dst, std::vector<bool>& found)
+{
+    found.assign(n, false);
+    if (n == 0)
+        return 0;
+
+    // equal keys stay next to each other and in their order
+    std::vector<UInt> order(n);
+    for (UInt i = 0; i < n; ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [keys, this](UInt a, UInt b)
+    {
+        return _comparator->compare(keys + (size_t)a * _keySize, keys + (size_t)b * _keySize,
+            _keySize);
+    });
+
+    MultiGetBatch b(this, keys, dst, found);
+    TreeLatchGuard tree(_treeLatch, false);
+    b.treeVersion = _treeLatch.readVersion();
+
+    PageWrapper root(this);
+    UInt version;
+    if (readOptimistic(root, _rootPageNum, 0, 0, b.treeVersion, version))
+        multiGetPage(b, root, version, &order[0], n);
+    else
+        multiGetLatched(b, &order[0], n);
+
+    return b.count;
 }
 
-void BaseBTree::readHeader(Header& hdr)
+
+UInt BaseBTree::multiGetPage(MultiGetBatch& b, PageWrapper& node, UInt version, const UInt* idx,
+    UInt cnt)
 {
-    _stream->seekg(HEADER_OFS, std::ios_base::beg);
-    _stream->read((char*)&hdr, HEADER_SIZE);
+    PageWrapper spare(this);
+    PageWrapper* cur = &node;
+    PageWrapper* other = &spare;
+    for (;;)
+    {
+        // the keys beyond the high key of a B-link page are the last ones
+        UInt here = cnt;
+        while (here && cur->isBeyond(b.key(idx[here - 1])))
+            --here;
+
+        UInt carry = cur->isLeaf() ? multiGetLeaf(b, *cur, idx, here)
+            : multiGetInner(b, *cur, version, idx, here);
+        if (!isBLink() || carry + cnt - here == 0)
+            return carry;
+
+        // a B-link page passes whatever goes on to the right along its own link: its
+        // right neighbour may be missing in the parent yet
+        UInt first = here - carry;
+        UInt nextVersion;
+        if (!readOptimistic(*other, cur->getRightLink(), cur->getPageNum(), version, b.treeVersion,
+                nextVersion))
+        {
+            multiGetLatched(b, idx + first, cnt - first);
+            return 0;
+        }
 
+        std::swap(cur, other);
+        version = nextVersion;
+        idx += first;
+        cnt -= first;
+    }
 }
 
 
-
-void BaseBTree::writePageCounter() //UInt pc)
+UInt BaseBTree::multiGetInner(MultiGetBatch& b, PageWrapper& node, UInt version, const UInt* idx,
+    UInt cnt)
 {
-    _stream->seekg(PAGE_COUNTER_OFS, std::ios_base::beg);
-    _stream->write((const char*)&_lastPageNum, PAGE_COUNTER_SZ);
-}
+    UShort keysNum = node.getKeysNum();
+    PageWrapper child(this);
+    UInt i = 0;
+    while (i < cnt)
+    {
+        UShort offset = node.lowerBound(b.key(idx[i]));
 
+        // a B-tree separator is a record itself
+        if (!isBPlus() && offset < keysNum
+            && _comparator->isEqual(node.getKey(offset), b.key(idx[i]), _keySize))
+        {
+            b.take(idx[i], node.getKey(offset));
+            ++i;
+            continue;
+        }
 
+        // the next keys go to the same child while they are not beyond its separator;
+        // the ones left by a child join the part of the next one
+        UInt j = i + 1;
+        for (;;)
+        {
+            const Byte* sep = offset < keysNum ? node.getKey(offset) : nullptr;
+            while (j < cnt && (!sep || (isBPlus() ? !_comparator->compare(sep, b.key(idx[j]), _keySize)
+                    : _comparator->compare(b.key(idx[j]), sep, _keySize))))
+                ++j;
+
+            UInt carry;
+            UInt childVersion;
+            if (readOptimistic(child, node.getCursor(offset), node.getPageNum(), version,
+                    b.treeVersion, childVersion))
+                carry = multiGetPage(b, child, childVersion, idx + i, j - i);
+            else
+            {
+                multiGetLatched(b, idx + i, j - i);
+                carry = 0;
+            }
+
+            i = j - carry;
+            if (!carry)
+                break;
+            if (offset == keysNum)
+                return carry;           // the next subtree is under another parent
+
+            ++offset;
+        }
+    }
 
-//xi::UInt 
-void BaseBTree::readPageCounter()
-{
-    _stream->seekg(PAGE_COUNTER_OFS, std::ios_base::beg);    
-    _stream->read((char*)&_lastPageNum, PAGE_COUNTER_SZ);
+    return 0;
 }
 
 
-
-void BaseBTree::writeRootPageNum() //UInt rpn)
+UInt BaseBTree::multiGetLeaf(MultiGetBatch& b, PageWrapper& leaf, const UInt* idx, UInt cnt)
 {
-    _stream->seekg(ROOT_PAGE_NUM_OFS, std::ios_base::beg);
-    _stream->write((const char*)&_rootPageNum, ROOT_PAGE_NUM_SZ);
-
-}
+    UShort keysNum = leaf.getKeysNum();
+    for (UInt i = 0; i < cnt; ++i)
+    {
+        const Byte* k = b.key(idx[i]);
+        UShort offset = leaf.lowerBound(k);
 
+        // as in find(): the first not less key may be the first one of the next leaf, and
+        // so it is for all the keys after this one
+        if (isBPlus() && offset == keysNum && leaf.getNextLeaf())
+            return cnt - i;
 
+        if (offset < keysNum && _comparator->isEqual(leaf.getKey(offset), k, _keySize))
+            b.take(idx[i], leaf.getKey(offset));
+    }
 
-//xi::UInt 
-void BaseBTree::readRootPageNum()
-{
-    _stream->seekg(ROOT_PAGE_NUM_OFS, std::ios_base::beg);
-    _stream->read((char*)&_rootPageNum, ROOT_PAGE_NUM_SZ);
+    return 0;
 }
 
 
-
-void BaseBTree::setRootPageNum(UInt pnum, bool writeFlag /*= true*/)
+void BaseBTree::multiGetLatched(MultiGetBatch& b, const UInt* idx, UInt cnt)
 {
-    _rootPageNum = pnum;
-    if (writeFlag)
-        writeRootPageNum();
+    for (UInt i = 0; i < cnt; ++i)
+    {
+        std::vector<Byte> rec(_recSize);
+        if (findLatched(b.key(idx[i]), &rec[0]))
+            b.take(idx[i], &rec[0]);
+    }
 }
 
 
-
-void BaseBTree::setOrder(UShort order, UShort recSize)
+bool BaseBTree::stepAsync(AsyncLookup& l, UInt tag)
 {
-    // метод закрытый, корректность параметров должно проверять в вызывающих методах
+    for (;;)
+    {
+        if (!l.key)
+            return false;
+
+        UInt from = l.pnum;
+        UInt fromVersion = l.version;
+        UInt pnum = _rootPageNum;
+        bool valid = true;
+        if (from)
+        {
+            // the copy may be torn by a writer, so nothing in it is looked at before the check
+            Latch& latch = _pageLatches.get(from);
+            valid = latch.validate(l.version);
+            if (valid && l.loaded && _cache.isEnabled())
+            {
+                // a writer latches the page before it changes its pool frame, so an intact
+                // copy never overwrites a newer one
+                LatchGuard guard(latch, false);
+                if (latch.validate(l.version))
+                    _cache.fill(from, l.page.getData());
+            }
+        }
 
-    _order = order;
-    _recSize = recSize;
+        if (valid && from)
+        {
+            // the same step as in find()
+            PageWrapper& node = l.page;
+            if (node.isBeyond(l.key))
+                pnum = node.getRightLink();
+            else
+            {
+                UShort offset = node.lowerBound(l.key);
+                if (node.isLeaf() && isBPlus() && offset == node.getKeysNum() && node.getNextLeaf())
+                    pnum = node.getNextLeaf();
+                else
+                {
+                    l.found = offset < node.getKeysNum() && (node.isLeaf() || !isBPlus())
+                        && _comparator->isEqual(node.getKey(offset), l.key, _keySize);
+                    if (l.found)
+                        memcpy(l.rec, node.getKey(offset), getRecLen(node.getKey(offset)));
+                    if (l.found || node.isLeaf())
+                    {
+                        l.key = nullptr;
+                        return false;
+                    }
+
+                    pnum = node.getCursor(offset);
+                }
+            }
+        }
 
-    _minKeys = order - 1;
-    _maxKeys = 2 * order - 1;
+        // as in readOptimistic(): the link is checked after the version is taken
+        if (valid)
+        {
+            l.version = _pageLatches.get(pnum).readVersion();
+            valid = from ? _pageLatches.get(from).validate(fromVersion) : _rootPageNum == pnum;
+        }
 
-    // проверим максимальное число ключей
-    if (_maxKeys > MAX_KEYS_NUM)
-        throw std::invalid_argument("For a given B-tree order, there is an excess of the maximum number of keys");
+        if (!valid)
+        {
+            if (++l.attempts < OPTIMISTIC_ATTEMPTS)
+            {
+                l.pnum = 0;
+                continue;
+            }
+
+            // a stream of writes to the same pages is waited for, as search() does
+            l.found = findLatched(l.key, l.rec);
+            l.key = nullptr;
+            return false;
+        }
 
-    _keysSize = _recSize * _maxKeys;                // область памяти под ключи
-    _cursorsOfs = _keysSize + KEYS_OFS;             // смещение области курсоров на дочерние
-    _nodePageSize = _cursorsOfs + CURSOR_SZ * (2 * order);  // размер узла целиком, опр. концом области страницы
+        if (pnum == 0 || pnum > getLastPageNum())
+            throw std::invalid_argument("Can't read a non-existing page");
 
-    // Q: номер текущей корневой надо устанавливать?
+        l.pnum = pnum;
+        Byte* data = l.page.prepareRead(pnum);
+        l.loaded = !(_cache.isEnabled() && _cache.readCached(pnum, data));
+        if (!l.loaded)
+            continue;
 
-    // пока-что распределяем память под рабочую страницу/узел здесь, но это сомнительно
-    reallocWorkPages();
+        _asyncIO->submitRead(getPageOfs(pnum), data, getNodePageSize(), tag);
+        return true;
+    }
 }
 
 
-void BaseBTree::reallocWorkPages()
+/** \brief Посетитель, копирующий найденные ключи в список (для searchAll() со списком). */
+class KeyListCollector : public BaseBTree::IKeyVisitor {
+public:
+    KeyListCollector(std::list<Byte*>& keys, const BaseBTree* tree) : _keys(keys), _tree(tree) {}
+
+    virtual bool visitKey(const Byte* key) override
+    {
+        Byte* retPtr = new Byte[_tree->getRecSize()];
+        memcpy(retPtr, key, _tree->getRecLen(key));
+        _keys.push_back(retPtr);
+        return true;
+    }
+
+protected:
+    std::list<Byte*>& _keys;
+    const BaseBTree* _tree;
+}; // class KeyListCollector
+
+
+int BaseBTree::searchAll(const Byte* k, std::list<Byte*>& keys)
 {
-    _rootPage.reallocData(_nodePageSize);
+    KeyListCollector collector(keys, this);
+    searchAll(k, collector);
+    return keys.size();
 }
 
-void BaseBTree::insert(const Byte *k)
+
+int BaseBTree::searchAll(const Byte* k, IKeyVisitor& visitor)
 {
-    // this method is based on Cormen realisation
-    UInt r = _rootPage.getPageNum(); // memorizing previous root
+    int count = 0;
 
-    if(_rootPage.isFull()) // if root is full
+    // optimistic attempts collect copies of the keys first, so the visitor may take
+    // its time without holding anyone up
+    if (isOptimistic())
     {
-        _rootPage.allocNewRootPage(); // creating new root
-        _rootPageNum = _rootPage.getPageNum(); // updating page num
-
-        _rootPage.setKeyNum(0); // setting number of keys to 0
-        _rootPage.setCursor(0, r); // linking new root to the previous
+        std::vector<Byte> recs;
+        for (UInt attempt = 0; attempt < OPTIMISTIC_ATTEMPTS; ++attempt)
+        {
+            if (!searchAllOptimistic(k, recs))
+                continue;
+
+            for (size_t ofs = 0; ofs < recs.size(); ofs += _recSize)
+            {
+                ++count;
+                if (!visitor.visitKey(&recs[ofs]))
+                    break;
+            }
+            return count;
+        }
+    }
 
-        _rootPage.splitChild(0); // splitting child
-        _rootPage.insertNonFull(k); // inserting key
-    } else // if root is not full simply insert to it
-        _rootPage.insertNonFull(k);
-}
+    // the visitor sees keys in place, so the pages must not change until it is done
+    TreeLatchGuard tree(_treeLatch, true);
 
+    // equal keys of a B+ tree go in a row along the leaf list
+    if (isBPlus())
+    {
+        Cursor cur(this);
+        for (bool ok = cur.seek(k); ok && _comparator->isEqual(cur.getKey(), k, _keySize); ok = cur.next())
+        {
+            ++count;
+            if (!visitor.visitKey(cur.getKey()))
+                break;
+        }
+        return count;
+    }
 
-//==============================================================================
-// class BaseBTree::PageWrapper
-//==============================================================================
+    _rootPage.readPage(_rootPageNum);
+    _rootPage.searchAll(k, visitor, count);
+    return count;
+}
 
 
+#ifdef BTREE_WITH_DELETION
 
-BaseBTree::PageWrapper::PageWrapper(BaseBTree* tr) :
-    _data(nullptr)
-    , _tree(tr)
-    , _pageNum(0)
+bool BaseBTree::remove(const Byte* k)
 {
-    // если к моменту создания странички дерево уже в работе (открыто), надо
-    // сразу распределить память!
-    if (_tree->isOpen())
-        reallocData(_tree->getNodePageSize());
-
+    TreeLatchGuard tree(_treeLatch, true);
+    return removeInternal(k, false) != 0;
 }
 
 
-BaseBTree::PageWrapper::~PageWrapper()
+int BaseBTree::removeAll(const Byte* k)
 {
-    reallocData(0);
+    TreeLatchGuard tree(_treeLatch, true);
+    return (int)removeInternal(k, true);
 }
 
 
-void BaseBTree::PageWrapper::reallocData(UInt sz)
+UInt BaseBTree::removeInternal(const Byte* k, bool all)
 {
-    if (_data)
-        delete[] _data;
+    checkForOpenStream();
+    if (isBLink())
+        throw std::logic_error("Removal is not supported for B-link pages");
 
-    if (sz)
-        _data = new Byte[sz];
-        
+    _rootPage.readPage(_rootPageNum);   // inserts change the root in wrappers of their own
+    UInt num = all ? _rootPage.removeRun(k) : isBPlus() ? removeBPlus(k, 1) : _rootPage.removeNonMin(k, 1);
+
+    // the root has lost its last key to a merge of its two children, which becomes the new root;
+    // after a run of keys is removed, the child may have no keys either
+    while (_rootPage.getKeysNum() == 0 && !_rootPage.isLeaf())
+    {
+        UInt oldRoot = _rootPageNum;
+        _rootPage.readPageFromChild(_rootPage, 0);
+        _rootPage.setAsRoot();
+        freePage(oldRoot);
+    }
+
+    commitOperation();
+    return num;
 }
 
-void BaseBTree::PageWrapper::clear()
+
+UInt BaseBTree::removeBPlus(const Byte* k, UInt maxNum)
 {
-    if (!_data)
-        return;
+    if (!_comparator)
+        throw std::runtime_error("Comparator not set. Can't remove");
+
+    // separators may be stale, so the routed leaf can have no equal keys while the next one
+    // has; the cursor finds the first not less key and keeps the whole path to its leaf
+    Cursor cur(this);
+    if (!cur.seekPath(k) || !_comparator->isEqual(cur.getKey(), k, _keySize))
+        return 0;
+
+    size_t level = cur._depth - 1;
+    PageWrapper& leaf = *cur._pages[level];
+    UShort keyNum = leaf.getKeysNum();
+    UShort i = cur._pos[level];
+
+    UShort last = i; // equal keys go in a row
+    while (last < keyNum && _comparator->isEqual(leaf.getKey(last), k, _keySize))
+        ++last;
+
+    // a non-root leaf may drop one key below the minimum, a single borrow or merge restores it
+    UInt num = last - i;
+    UInt spare = level == 0 ? keyNum : keyNum - getMinKeys() + 1;
+    if (num > spare)
+        num = spare;
+    if (num > maxNum)
+        num = maxNum;
+
+    leaf.removeKeys(i, (UShort)num);
+    leaf.writePage();
+
+    // a merge takes a separator from the parent, which may underflow in turn
+    for (; level > 0; --level)
+    {
+        PageWrapper& node = *cur._pages[level];
+        if (!node.isUnderfull())
+            break;
 
-    // работая с сырыми блоками данных единственно и можно применять низкоуровневые C-функции
-    memset(_data, 0, _tree->getNodePageSize());
-}
+        cur._pages[level - 1]->fillChild(cur._pos[level - 1], node);
+    }
 
+    _rootPage.readPage(_rootPageNum); // the cursor has changed its own copy of the root
+    return num;
+}
 
 
-void BaseBTree::PageWrapper::setKeyNumLeaf(UShort keysNum, bool isRoot, bool isLeaf) //NodeType nt)
+UInt BaseBTree::freeSubtree(UInt pnum, UInt* leafLinks, bool& leftmost)
 {
-    _tree->checkKeysNumberExc(keysNum, isRoot);
+    PageWrapper pw(this);
+    pw.readPage(pnum);
+    UShort keyNum = pw.getKeysNum();
+    UInt num = 0;
 
-    // логически приплюсовываем
-    if (isLeaf)
-        keysNum |= LEAF_NODE_MASK; // 0x8000;
+    if (pw.isLeaf())
+    {
+        num = keyNum;
+        if (isBPlus())
+        {
+            if (leftmost)
+                leafLinks[0] = pw.getPrevLeaf();
+            leafLinks[1] = pw.getNextLeaf();
+            leftmost = false;
+        }
+    }
+    else
+    {
+        if (!isBPlus())
+            num = keyNum;                   // B+ separators are only copies
+        for (UShort i = 0; i <= keyNum; ++i)
+            num += freeSubtree(pw.getCursor(i), leafLinks, leftmost);
+    }
 
-    // способ записи типизированного объекта, начиная с адреса [0]
-    *((UShort*)&_data[0]) = keysNum;
+    freePage(pnum);
+    return num;
 }
 
+#endif // BTREE_WITH_DELETION
+
+struct BaseBTree::BulkLevel {
+    BulkLevel(BaseBTree* tree, UShort level, float fillFactor)
+        : page(tree), keys(0), level(level), leaf(level == 0), pnum(0)
+    {
+        page.clear();
+        page.setLeaf(leaf);                 // the node geometry depends on it
+
+        // every node but the last ones of the levels gets exactly target keys
+        UInt maxKeys = page.getMaxKeysNum();
+        UInt t = (UInt)(maxKeys * fillFactor + 0.5f);
+        if (t < page.getMinKeysNum())
+            t = page.getMinKeysNum();
+        if (t < 1)
+            t = 1;
+        if (t > maxKeys)
+            t = maxKeys;
+        target = (UShort)t;
+
+        // slotted pages are filled by bytes
+        fillBytes = (UInt)(tree->getKeysSize() * fillFactor);
+    }
+
+    PageWrapper page;                       ///< Данные открытого узла.
+    UShort keys;                            ///< Число ключей в нем.
+    UShort level;                           ///< Номер уровня, 0 — листья.
+    bool leaf;                              ///< Уровень листьев.
+    UInt pnum;                              ///< Заранее выделенный узлу номер страницы, 0 — нет.
+    UShort target;                          ///< До скольких ключей заполняются узлы уровня.
+    UInt fillBytes;                         ///< До скольких байт заполняются страницы со слотами.
+    std::vector<Byte> low;                  ///< Нижняя граница открытой сжатой страницы.
+}; // struct BaseBTree::BulkLevel
 
 
-void BaseBTree::PageWrapper::setKeyNum(UShort keysNum, bool isRoot) //NodeType nt)
+UInt BaseBTree::bulkLoad(IKeySource& src, float fillFactor)
 {
-    _tree->checkKeysNumberExc(keysNum, isRoot);
+    TreeLatchGuard tree(_treeLatch, true);
+    checkForOpenStream();
 
+    if (!_comparator)
+        throw std::runtime_error("Comparator not set. Can't bulk load");
+    if (!(fillFactor > 0 && fillFactor <= 1))
+        throw std::invalid_argument("Fill factor must be in (0, 1]");
 
-    UShort kldata = *((UShort*)&_data[0]);      // взяли сущ. значение
-    kldata &= LEAF_NODE_MASK;                   // оставили от него только флаг "лист"
-    kldata |= keysNum;                          // приилили число ключей (там точно не будет 1 в старшем)
 
-    *((UShort*)&_data[0]) = kldata;             // записали
+    _rootPage.readPage(_rootPageNum);
+    if (!_rootPage.isLeaf() || _rootPage.getKeysNum() != 0)
+        throw std::runtime_error("Bulk load needs an empty tree");
+
+    std::vector<std::unique_ptr<BulkLevel> > levels;        // 0 — leaves
+    std::vector<Byte> prev(_recSize);
+    UInt loaded = 0;
+    UInt lastPage = _lastPageNum;
+    UInt committedPage = lastPage;
+    bool metaDirty = _metaDirty;
+
+    for (const Byte* k = src.nextKey(); k; k = src.nextKey())
+    {
+        // nothing refers to the new pages until the root is switched, so a log takes them
+        // in groups of their own instead of keeping the whole load in memory
+        if (_io->isLogged() && _lastPageNum - committedPage >= BULK_COMMIT_PAGES)
+        {
+            _io->commit();
+            committedPage = _lastPageNum;
+        }
+
+        if (loaded && _comparator->compare(k, &prev[0], _keySize))
+        {
+            // nothing refers to the pages written so far, they are given back
+            // and the tree stays as it was
+            if (_pageMap)
+            {
+                PageMap& map = getMutablePageMap();
+                for (UInt pnum = lastPage + 1; pnum <= _lastPageNum; ++pnum)
+                    _freeSlots.push_back(map[pnum]);
+                map.resize(lastPage + 1);
+            }
+            _lastPageNum = lastPage;
+            _metaDirty = metaDirty;
+            throw std::invalid_argument("Keys for bulk load are not sorted");
+        }
+
+        memcpy(&prev[0], k, getRecLen(k));
+        bulkPush(levels, 0, k, 0, fillFactor);
+        ++loaded;
+    }
+
+    if (!loaded)
+        return 0;
+
+    // closing the open nodes bottom-up, each one is the last child of the next level
+    UInt child = 0;
+    for (size_t l = 0; l < levels.size(); ++l)
+    {
+        BulkLevel& lv = *levels[l];
+        if (l > 0)
+        {
+            // the top level may have got nothing but its first child
+            if (l == levels.size() - 1 && lv.keys == 0)
+                break;
+            if (isSlotted())
+                lv.page.setCursor(lv.keys, child);
+            else
+                *((UInt*)(lv.page.getData() + lv.page.getNodeCursorsOfs() + lv.keys * CURSOR_SZ)) = child;
+        }
+        child = bulkWriteLevel(lv);
+    }
+    _metaDirty = true;
+
+    UInt oldRoot = _rootPageNum;
+    _rootPage.readPage(child);
+    _rootPage.setAsRoot();
+    freePage(oldRoot);
+
+    // the right spine can hold underfull nodes, they are evened out with their left siblings
+    bool changed = true;
+    while (changed)
+    {
+        std::vector<UInt> spine;
+        PageWrapper pw(this);
+        for (UInt pnum = _rootPageNum; ; pnum = pw.getCursor(pw.getKeysNum()))
+        {
+            spine.push_back(pnum);
+            pw.readPage(pnum);
+            if (pw.isLeaf())
+                break;
+        }
+
+        changed = false;
+        for (size_t i = spine.size() - 1; i-- > 0; )      // parents from the lowest one up
+            changed = rebalanceLastChild(spine[i]) || changed;
+
+        // a merge can take the last key of the root
+        _rootPage.readPage(_rootPageNum);
+        while (!_rootPage.isLeaf() && _rootPage.getKeysNum() == 0)
+        {
+            oldRoot = _rootPageNum;
+            _rootPage.readPageFromChild(_rootPage, 0);
+            _rootPage.setAsRoot();
+            freePage(oldRoot);
+        }
+    }
+
+    commitOperation();              // the spine, the root and the header are one atomic group
+    return loaded;
 }
 
 
+void BaseBTree::bulkPush(std::vector<std::unique_ptr<BulkLevel> >& levels, size_t level,
+    const Byte* key, UInt leftChild, float fillFactor)
+{
+    if (level == levels.size())
+        levels.push_back(std::unique_ptr<BulkLevel>(new BulkLevel(this, (UShort)level, fillFactor)));
+
+    BulkLevel& lv = *levels[level];
+    Byte* data = lv.page.getData();
 
-void BaseBTree::PageWrapper::setLeaf(bool isLeaf)
+    if (level > 0)
+    {
+        if (isSlotted())
+            lv.page.setCursor(lv.keys, leftChild);  // it leads the entry of the previous key
+        else
+            *((UInt*)(data + lv.page.getNodeCursorsOfs() + lv.keys * CURSOR_SZ)) = leftChild;
+    }
+
+    if (isSlotted())
+    {
+        // the cursor of the entry is set by the next key or when the node is closed;
+        // a node takes at least one key whatever the fill
+        UInt entrySize = (lv.leaf ? 0 : CURSOR_SZ) + getRecLen(key) + SLOT_SZ;
+        if (lv.keys == 0 || _keysSize - lv.page.getFreeSpace() + entrySize <= lv.fillBytes)
+        {
+            lv.page.insertEntry(lv.keys, key, 0);
+            ++lv.keys;
+            return;
+        }
+    }
+    else if (lv.keys < lv.target)
+    {
+        // a B+ separator keeps only the key of the record
+        UShort slot = lv.page.getSlotSize();
+        memcpy(data + KEYS_OFS + lv.keys * slot, key, slot);
+        ++lv.keys;
+        return;
+    }
+
+    // the node is full: it is written, and the key separates it from the next one
+    if (lv.leaf && isBPlus())
+    {
+        // a compressed leaf is separated by the shortest prefix of the key that will do
+        std::vector<Byte> sep(key, key + getRecLen(key));
+        if (isCompressed())
+            shortenSeparator(lv.page.getKey(lv.keys - 1), sep);
+
+        // a B+ leaf links to the next one, so the page of the next leaf is taken now;
+        // a copy of the key goes up, and the key itself opens the next leaf
+        UInt pnum = lv.pnum ? lv.pnum : appendPageNum();
+        UInt next = appendPageNum();
+        lv.pnum = pnum;
+        lv.page.setNextLeaf(next);
+        bulkWriteLevel(lv, &sep[0]);
+
+        lv.pnum = next;
+        lv.page.setPrevLeaf(pnum);
+        bulkPush(levels, level + 1, &sep[0], pnum, fillFactor);
+        bulkPush(levels, level, key, 0, fillFactor);
+        return;
+    }
+
+    // a B-link inner node links to the next one as well
+    UInt next = 0;
+    if (isBLink())
+    {
+        lv.pnum = lv.pnum ? lv.pnum : appendPageNum();
+        next = appendPageNum();
+        lv.page.setRightLink(next);
+    }
+
+    UInt pnum = bulkWriteLevel(lv, key);
+    lv.pnum = next;
+    bulkPush(levels, level + 1, key, pnum, fillFactor);
+}
+
+
+UInt BaseBTree::bulkWriteLevel(BulkLevel& lv, const Byte* high)
 {
-    UShort kldata = *((UShort*)&_data[0]);      // взяли сущ. значение
-    kldata &= ~LEAF_NODE_MASK;                  // оставили от него только часть с числом ключей
-    if (isLeaf)
-        kldata |= LEAF_NODE_MASK;   // 0x8000;  // приилили флаг, если надо
+    // the last nodes of the levels may be underfull until the spine is evened out,
+    // so the count is set without the check for the minimum
+    lv.page.setKeyNumLeaf(lv.keys, true, lv.leaf);
 
-    *((UShort*)&_data[0]) = kldata;             // записали
+    // a B-link page ends where the next one of its level starts, the last one has no link
+    if (isBLink())
+    {
+        lv.page.setLevel(lv.level);
+        if (high)
+            lv.page.setHighKey(high);
+    }
+
+    // the records of a compressed page are squeezed once its range is known
+    if (isCompressed())
+    {
+        lv.page.setFences(lv.low.empty() ? nullptr : &lv.low[0], high);
+        if (high)
+            lv.low.assign(high, high + getRecLen(high));
+    }
+
+    // appending without the page counter, it is written once at the end
+    UInt pnum = lv.pnum ? lv.pnum : appendPageNum();
+    _io->writeAt(getPageOfs(pnum), lv.page.getData(), getNodePageSize());
+
+    lv.page.clear();
+    lv.page.setLeaf(lv.leaf);
+    lv.keys = 0;
+    lv.pnum = 0;
+    return pnum;
 }
 
 
+bool BaseBTree::rebalanceLastChild(UInt pnum)
+{
+    PageWrapper x(this);
+    x.readPage(pnum);
+    UShort n = x.getKeysNum();
+    if (n == 0)
+        return false;                       // no left sibling yet, it appears after the parent is fixed
+
+    PageWrapper c(this);
+    c.readPageFromChild(x, n);
+    if (!c.isUnderfull())
+        return false;
+
+    PageWrapper s(this);
+    s.readPageFromChild(x, n - 1);
+
+    // slotted pages are evened out by bytes; as even as they get, they are not handled again
+    if (isSlotted())
+        return x.rebalanceSlotted(n - 1, s, c);
+
+    UShort sn = s.getKeysNum();
+    UShort cn = c.getKeysNum();
+    bool leaf = c.isLeaf();
+    bool bplusLeaf = leaf && isBPlus();     // B+ leaves hold all keys, the separator is a copy
+    UShort sepNum = bplusLeaf ? 0 : 1;
+    UInt total = sn + sepNum + cn;
+    UInt cursorsOfs = c.getNodeCursorsOfs();
+    UShort slot = c.getSlotSize();          // the separator has the same size unless it is dropped
+
+    // keys of both nodes with the separator between them, and their cursors, in order
+    std::vector<Byte> keys(total * slot);
+    memcpy(&keys[0], s.getData() + KEYS_OFS, sn * slot);
+    if (!bplusLeaf)
+        memcpy(&keys[sn * slot], x.getKey(n - 1), slot);
+    memcpy(&keys[(sn + sepNum) * slot], c.getData() + KEYS_OFS, cn * slot);
+
+    std::vector<Byte> cursors((total + 1) * CURSOR_SZ);
+    if (!leaf)
+    {
+        memcpy(&cursors[0], s.getData() + cursorsOfs, (sn + 1) * CURSOR_SZ);
+        memcpy(&cursors[(sn + 1) * CURSOR_SZ], c.getData() + cursorsOfs, (cn + 1) * CURSOR_SZ);
+    }
+
+    if (total <= c.getMaxKeysNum())
+    {
+        // merging into the left sibling, the parent loses the separator and the last cursor
+        s.setKeyNumLeaf(total, false, leaf);
+        memcpy(s.getData() + KEYS_OFS, &keys[0], total * slot);
+        if (!leaf)
+            memcpy(s.getData() + cursorsOfs, &cursors[0], (total + 1) * CURSOR_SZ);
+        if (bplusLeaf)
+            s.setNextLeaf(c.getNextLeaf());
+        if (isBLink())
+        {
+            // the left sibling takes over the right link and the high key as well
+            const Byte* high = c.getHighKey();
+            if (!leaf)
+                s.setRightLink(c.getRightLink());
+            if (high)
+                s.setHighKey(high);
+        }
+        s.writePage();
 
-bool BaseBTree::PageWrapper::isLeaf() const
+        x.setKeyNumLeaf(n - 1, true, false);
+        x.writePage();
+        freePage(c.getPageNum());
+        return true;
+    }
+
+    // halving: total > maxKeys = 2 * order - 1, so both halves get at least order - 1 keys
+    UShort a = total / 2;
+    UShort b = total - sepNum - a;
+
+    s.setKeyNumLeaf(a, false, leaf);
+    memcpy(s.getData() + KEYS_OFS, &keys[0], a * slot);
+    c.setKeyNumLeaf(b, false, leaf);
+    memcpy(c.getData() + KEYS_OFS, &keys[(a + sepNum) * slot], b * slot);
+    if (!leaf)
+    {
+        memcpy(s.getData() + cursorsOfs, &cursors[0], (a + 1) * CURSOR_SZ);
+        memcpy(c.getData() + cursorsOfs, &cursors[(a + 1) * CURSOR_SZ], (b + 1) * CURSOR_SZ);
+    }
+    x.copyKey(x.getKey(n - 1), &keys[a * slot]);
+    if (isBLink())
+        s.setHighKey(x.getKey(n - 1));
+
+    s.writePage();
+    c.writePage();
+    x.writePage();
+    return true;
+}
+
+
+//UInt BaseBTree::allocPageInternal(UShort keysNum, NodeType nt, PageWrapper& pw)
+UInt BaseBTree::allocPageInternal(PageWrapper& pw, UShort keysNum, bool isRoot, bool isLeaf)
 {
-    UShort info = *((UShort*)&_data[0]);
+    // parallel inserts split pages at once; a new page is seen by nobody else until
+    // its parent refers to it, so only taking a number is ordered
+    std::lock_guard<std::mutex> lock(_allocMutex);
 
-    return (info & LEAF_NODE_MASK) != 0;
+    // freed pages are reused first, so the file does not grow while it has holes
+    if (_freePageNum)
+    {
+        UInt pnum = _freePageNum;
+        pw.readPage(pnum);
+        _freePageNum = *((const UInt*)(pw.getData() + getCursorsOfs())); // the next one is in cursor 0
+        _metaDirty = true;
+
+        pw.clear();
+        pw.setKeyNumLeaf(keysNum, isRoot, isLeaf);
+        writePage(pnum, pw.getData());
+        return pnum;
+    }
+
+    UInt pnum = appendPageNum();    // checks that the file can grow, the header gets it later
+    ULong ofs = getPageOfs(pnum);
+
+    // for a mapped storage the file is extended first, and the wrapper is attached
+    // to the new page right inside the mapping
+    Byte* mp = _io->map(ofs, getNodePageSize());
+    if (mp)
+        pw.attachData(mp);
+
+    // подготовим страничку для вывода
+    pw.clear();
+    pw.setKeyNumLeaf(keysNum, isRoot, isLeaf);    // nt);
+
+    // a freshly allocated page is almost always touched right after, so with the pool
+    // it reaches the file (right after the last one) with its real content
+    if (_cache.isEnabled())
+        _cache.write(pnum, pw.getData(), true);
+    else if (!mp)
+        _io->writeAt(ofs, pw.getData(), getNodePageSize());
+
+    // no sync here: durability is up to the write-ahead log, if any (see WalPageIO)
+
+    return pnum;
 }
 
-UShort BaseBTree::PageWrapper::getKeysNum() const
+
+UInt BaseBTree::appendPageNum()
 {
-    UShort info = *((UShort*)&_data[0]);
+    // page numbers are 32-bit and offsets have to fit off_t: neither may wrap around
+    UInt last = std::max(getLastPageNum(), getLastSlotNum());
+    if (last == std::numeric_limits<UInt>::max()
+        || (MAX_FILE_SIZE - FIRST_PAGE_OFS) / getNodePageSize() <= last)
+        throw std::overflow_error("B-tree file can't grow any more");
 
-    return (info & ~LEAF_NODE_MASK);
+    ++_lastPageNum;
+    _metaDirty = true;
+    if (_pageMap)
+    {
+        UInt slot = allocSlot();
+        getMutablePageMap().push_back(slot);
+    }
+
+    return _lastPageNum;
 }
 
 
 
-Byte* BaseBTree::PageWrapper::getKey(UShort num)
+void BaseBTree::freePage(UInt pnum)
 {
-    // рассчитываем смещение
-    //UInt kofst = KEYS_OFS + _tree->getRecSize() * num;
-    int kofst = getKeyOfs(num);
-    if (kofst == -1)
-        return nullptr;
+    checkForOpenStream();
+    if (pnum == 0 || pnum > _lastPageNum || pnum == _rootPageNum)
+        throw std::invalid_argument("Can't free the page");
 
-    return (_data + kofst);
+    std::lock_guard<std::mutex> lock(_allocMutex);
+
+    // an empty leaf with a link to the next free page in its first cursor
+    std::vector<Byte> data(getNodePageSize(), 0);
+    *((UInt*)&data[getCursorsOfs()]) = _freePageNum;
+    writePage(pnum, &data[0]);
+
+    _freePageNum = pnum;
+    _metaDirty = true;
 }
 
 
-const Byte* BaseBTree::PageWrapper::getKey(UShort num) const
+void BaseBTree::readPageInternal(UInt pnum, Byte* dst)
 {
-    int kofst = getKeyOfs(num);
-    if (kofst == -1)
+    if (!_io->readAt(getPageOfs(pnum), dst, getNodePageSize()))
+        throw std::runtime_error("Can't read a page. File corrupted");
+}
+
+
+void BaseBTree::writePageInternal(UInt pnum, const Byte* dst)
+{
+    _io->writeAt(getPageOfs(pnum), dst, getNodePageSize());
+}
+
+
+Byte* BaseBTree::mapPage(UInt pnum)
+{
+    if (!isMapped())
         return nullptr;
 
-    return (_data + kofst);
+    if (pnum == 0 || pnum > getLastPageNum())
+        throw std::invalid_argument("Can't read a non-existing page");
+
+    return _io->map(getPageOfs(pnum), getNodePageSize());
+}
+
+
+void BaseBTree::loadPage(UInt pnum, Byte* dst)
+{
+    readPageInternal(pnum, dst);
+}
+
+
+void BaseBTree::storePage(UInt pnum, const Byte* src)
+{
+    writePageInternal(pnum, src);
+}
+
+
+void BaseBTree::setCowEnabled(bool enabled)
+{
+    if (isOpen())
+        throw std::runtime_error("Can't change the copy-on-write mode of an open B-tree");
+
+    _cowEnabled = enabled;
+}
+
+
+void BaseBTree::openSnapshot(Snapshot& snap)
+{
+    snap.release();
+
+    TreeLatchGuard tree(_treeLatch, true);
+    checkForOpenStream();
+    if (!_pageMap)
+        throw std::logic_error("Snapshots need the copy-on-write mode");
+
+    // from now on every page the snapshot sees stays where it is
+    freezePages();
+
+    snap._tree = this;
+    snap._pageMap = _pageMap;
+    snap._rootPageNum = _rootPageNum;
+    snap._epoch = _cowEpoch;
+    snap._frames.assign(_pageMap->size(), PageFrame());
+    _snapshots.insert(&snap);
+}
+
+
+BaseBTree::PageFrame BaseBTree::readSnapshotPage(const Snapshot& snap, UInt pnum)
+{
+    const PageMap& map = *snap._pageMap;
+    if (pnum == 0 || pnum >= map.size())
+        throw std::invalid_argument("Can't read a non-existing page");
+
+    PageFrame frame = std::atomic_load(&snap._frames[pnum]);
+    if (frame)
+        return frame;
+
+    // the pool was flushed when the snapshot was frozen, and writers move a page to a new
+    // slot before changing it, so the slot of the snapshot has what it saw
+    std::shared_ptr<std::vector<Byte> > page = std::make_shared<std::vector<Byte> >(getNodePageSize());
+    if (!_io->readAt(getSlotOfs(map[pnum]), page->data(), getNodePageSize()))
+        throw std::runtime_error("Can't read a page. File corrupted");
+
+    // inner pages are passed by every search, leaves are mostly read once by a scan
+    frame = page;
+    if (!(*((const UShort*)page->data()) & LEAF_NODE_MASK))
+        std::atomic_store(&snap._frames[pnum], frame);
+
+    return frame;
+}
+
+
+void BaseBTree::initPageMap()
+{
+    _pageMap = std::make_shared<PageMap>(_lastPageNum + 1);
+    for (UInt pnum = 0; pnum <= _lastPageNum; ++pnum)
+        (*_pageMap)[pnum] = pnum;
+
+    _lastSlotNum = _lastPageNum;
+}
+
+
+BaseBTree::PageMap& BaseBTree::getMutablePageMap()
+{
+    // snapshots keep the table they were opened with, so it is copied once per snapshot
+    if (_pageMap.use_count() > 1)
+        _pageMap = std::make_shared<PageMap>(*_pageMap);
+
+    return *_pageMap;
+}
+
+
+void BaseBTree::shadowPage(UInt pnum)
+{
+    UInt slot = (*_pageMap)[pnum];
+    if (slot < _freshSlots.size() && _freshSlots[slot])
+        return;                     // nobody else sees the page, it is rewritten in place
+
+    UInt fresh = allocSlot();
+    getMutablePageMap()[pnum] = fresh;
+    _retiredSlots.push_back(std::make_pair(_cowEpoch, slot));
+    _metaDirty = true;
+}
+
+
+UInt BaseBTree::allocSlot()
+{
+    UInt slot;
+    if (!_freeSlots.empty())
+    {
+        slot = _freeSlots.back();
+        _freeSlots.pop_back();
+    }
+    else
+        slot = ++_lastSlotNum;
+
+    if (_freshSlots.size() <= slot)
+        _freshSlots.resize(slot + 1, false);
+    _freshSlots[slot] = true;
+
+    return slot;
+}
+
+
+void BaseBTree::freezePages()
+{
+    // the pool writes a dirty page to the slot it has now, so they go first
+    if (_cache.isEnabled())
+        _cache.flush();
+
+    _freshSlots.assign(_freshSlots.size(), false);
+    ++_cowEpoch;
+}
+
+
+void BaseBTree::writePageTable()
+{
+    // the slot numbers of pages 1..N, preceded in each slot by the number of the next one
+    UInt pageSize = getNodePageSize();
+    UInt perSlot = pageSize / CURSOR_SZ - 1;
+    UInt slotsNum = (_lastPageNum + perSlot - 1) / perSlot;
+
+    _pageTableSlots.resize(slotsNum);
+    for (UInt i = 0; i < slotsNum; ++i)
+        _pageTableSlots[i] = allocSlot();
+
+    const PageMap& map = *_pageMap;
+    std::vector<Byte> buf(pageSize, 0);
+    for (UInt i = 0; i < slotsNum; ++i)
+    {
+        UInt next = i + 1 < slotsNum ? _pageTableSlots[i + 1] : 0;
+        UInt first = 1 + i * perSlot;
+        UInt num = std::min(perSlot, _lastPageNum + 1 - first);
+
+        memcpy(&buf[0], &next, CURSOR_SZ);
+        memcpy(&buf[CURSOR_SZ], &map[first], num * CURSOR_SZ);
+        _io->writeAt(getSlotOfs(_pageTableSlots[i]), &buf[0], pageSize);
+    }
+}
+
+
+bool BaseBTree::readPageTable(UInt first)
+{
+    UInt pageSize = getNodePageSize();
+    UInt perSlot = pageSize / CURSOR_SZ - 1;
+    std::vector<Byte> buf(pageSize);
+
+    // every slot is referred to at most once, which also stops a looped chain
+    std::vector<bool> used(_lastSlotNum + 1, false);
+    std::shared_ptr<PageMap> map = std::make_shared<PageMap>(_lastPageNum + 1, 0);
+    _pageTableSlots.clear();
+
+    UInt slot = first;
+    for (UInt pnum = 1; pnum <= _lastPageNum; )
+    {
+        if (slot == 0 || slot > _lastSlotNum || used[slot])
+            return false;
+        used[slot] = true;
+        _pageTableSlots.push_back(slot);
+
+        if (!_io->readAt(getSlotOfs(slot), &buf[0], pageSize))
+            return false;
+
+        for (UInt i = 1; i <= perSlot && pnum <= _lastPageNum; ++i, ++pnum)
+        {
+            UInt pslot;
+            memcpy(&pslot, &buf[i * CURSOR_SZ], CURSOR_SZ);
+            if (pslot == 0 || pslot > _lastSlotNum || used[pslot])
+                return false;
+
+            used[pslot] = true;
+            (*map)[pnum] = pslot;
+        }
+
+        memcpy(&slot, &buf[0], CURSOR_SZ);
+    }
+
+    // slots of older versions of pages and tables are free, lower ones are taken first
+    _pageMap = map;
+    _freeSlots.clear();
+    for (UInt s = _lastSlotNum; s > 0; --s)
+        if (!used[s])
+            _freeSlots.push_back(s);
+
+    return true;
+}
+
+
+void BaseBTree::reclaimSlots()
+{
+    // a slot left in some epoch is seen only by the versions frozen before or at its start
+    UInt oldest = _durableEpoch;
+    for (const Snapshot* snap : _snapshots)
+        oldest = std::min(oldest, snap->_epoch);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < _retiredSlots.size(); ++i)
+    {
+        if (_retiredSlots[i].first < oldest)
+            _freeSlots.push_back(_retiredSlots[i].second);
+        else
+            _retiredSlots[kept++] = _retiredSlots[i];
+    }
+    _retiredSlots.resize(kept);
+}
+
+
+void BaseBTree::releaseSnapshot(Snapshot* snap)
+{
+    // the slots it frees go to writers
+    TreeLatchGuard tree(_treeLatch, true);
+    _snapshots.erase(snap);
+    snap->_tree = nullptr;
+    snap->_pageMap.reset();
+    snap->_frames.clear();
+
+    reclaimSlots();
+}
+
+
+void BaseBTree::detachSnapshots()
+{
+    for (Snapshot* snap : _snapshots)
+    {
+        snap->_tree = nullptr;
+        snap->_pageMap.reset();
+        snap->_frames.clear();
+    }
+    _snapshots.clear();
+}
+
+
+void BaseBTree::loadTree()
+{
+    // _stream->seekg(0, std::ios_base::beg);       // пока загружаем с текущего места в потоке!
+    // читаем заголовок
+    
+    Header hdr;
+
+    // если при чтении случилась пичалька
+    if (!readHeader(hdr))
+    {
+        //_stream->close();
+        throw std::runtime_error("Can't read header");
+    }
+
+    // файлы прежней раскладки (без слотов, форматов страниц и значений) не читаются
+    if (hdr.sign == Header::LEGACY_SIGN)
+        throw std::runtime_error("The B-tree file has an outdated layout without a version");
+    if (hdr.sign == Header::VALID_SIGN && hdr.version != Header::FORMAT_VERSION)
+        throw std::runtime_error("Unsupported version of the B-tree file format");
+
+    // проверяет заголовок на корректность
+    if (!hdr.checkIntegrity())
+    {
+        //_stream->close();
+        throw std::runtime_error("Stream is not a valid xi B-tree file");
+    }
+
+    // задаем порядок и т.д.
+    setOrder(hdr.order, hdr.recSize, hdr.valueSize, (PageFormat)hdr.format);
+
+    // номера последней, корневой и первой свободной страниц — из действующего слота
+    if (!readMeta())
+    {
+        //_fileStream.close();
+        throw std::runtime_error("Can't read necessary fields. File corrupted");
+    }
+
+    if (_pageMap && (isMapped() || _io->isLogged()))
+        throw std::logic_error("Copy-on-write mode is not supported for mapped storage or with a log");
+
+    // pages written back after the last checkpoint are taken in; the mapped storage has no
+    // pool and is grown with a margin, so its size tells nothing
+    if (!_pageMap && !isMapped())
+    {
+        UInt pages = countFilePages();
+        if (pages != _lastPageNum)
+        {
+            _lastPageNum = pages;
+            _metaDirty = true;
+        }
+    }
+
+    // загрузить корневую страницу
+    loadRootPage();
+
+}
+
+
+void BaseBTree::loadRootPage()  //PageWrapper& pw)
+{
+    if (getRootPageNum() == 0)
+        throw std::runtime_error("Root page is not defined");
+
+    _rootPage.readPage(getRootPageNum());
+    _rootPage.setAsRoot(false);               // в файл номер страницы не пишем, т.к. только что прочитали оттуда его
+
+}
+
+
+void BaseBTree::createTree(UShort order, UShort recSize, PageFormat format, UShort valueSize)
+{
+    setOrder(order, recSize, valueSize, format);
+
+    writeHeader();                  // записываем заголовок файла
+
+    // оба слота изменяемой части пока пусты
+    MetaSlot empty;
+    _io->writeAt(META_SLOTS_OFS, &empty, META_SLOT_SZ);
+    _io->writeAt(META_SLOTS_OFS + META_SLOT_SZ, &empty, META_SLOT_SZ);
+
+    if (_cowEnabled)
+        initPageMap();
+
+    // создать корневую страницу
+    createRootPage();
+
+    checkpoint();                   // the first slot describes the tree with its root
+}
+
+
+void BaseBTree::createRootPage()
+{
+    _rootPage.allocPage(0, true);
+    _rootPage.setAsRoot();
+}
+
+
+void BaseBTree::commitOperation(TreeLatchGuard* shared)
+{
+    // a log has to get every page of the operation and the header slot before its commit record
+    if (_io->isLogged())
+    {
+        ULong mark;
+        if (shared)
+        {
+            // parallel inserts may have logged half of their pages, and a commit record
+            // would make them part of this group; so it goes in while none of them runs
+            shared->unlock();
+            TreeLatchGuard quiet(_treeLatch, true);
+            mark = markLogged();
+        }
+        else
+            mark = markLogged();
+
+        // the wait is outside of the latch, so the inserts finishing meanwhile share the fsync
+        _io->waitCommit(mark);
+        return;
+    }
+
+    _io->commit();
+}
+
+
+ULong BaseBTree::markLogged()
+{
+    _cache.flush();
+    if (_metaDirty)
+        writeMeta();
+
+    return _io->markCommit();
+}
+
+
+void BaseBTree::checkForOpenStream()
+{
+    if (!isOpen())
+        throw std::runtime_error("Stream is not ready");
+
+}
+
+
+void BaseBTree::writeHeader()
+{    
+    Header hdr(_order, _recSize, _format, getValueSize());
+    _io->writeAt(HEADER_OFS, &hdr, HEADER_SIZE);
+
+}
+
+bool BaseBTree::readHeader(Header& hdr)
+{
+    return _io->readAt(HEADER_OFS, &hdr, HEADER_SIZE);
+
+}
+
+
+
+void BaseBTree::writeMeta()
+{
+    // the older slot is overwritten, the current one stays intact until this one is done
+    MetaSlot slot;
+    slot.seq = _metaSeq + 1;
+    slot.lastPageNum = _lastPageNum;
+    slot.rootPageNum = _rootPageNum;
+    slot.freePageNum = _freePageNum;
+    slot.pageTableNum = _pageTableSlots.empty() ? 0 : _pageTableSlots[0];
+    slot.lastSlotNum = getLastSlotNum();
+    slot.checksum = slot.calcChecksum();
+
+    _io->writeAt(META_SLOTS_OFS + (slot.seq % 2) * META_SLOT_SZ, &slot, META_SLOT_SZ);
+    _metaSeq = slot.seq;
+    _metaDirty = false;
+}
+
+
+
+bool BaseBTree::readMeta()
+{
+    MetaSlot slots[2];
+    if (!_io->readAt(META_SLOTS_OFS, slots, 2 * META_SLOT_SZ))
+        return false;
+
+    const MetaSlot* cur = nullptr;
+    for (const MetaSlot& slot : slots)
+        if (slot.checkIntegrity() && (!cur || slot.seq > cur->seq))
+            cur = &slot;
+
+    if (!cur)
+        return false;
+
+    _metaSeq = cur->seq;
+    _lastPageNum = cur->lastPageNum;
+    _rootPageNum = cur->rootPageNum;
+    _freePageNum = cur->freePageNum;
+    _lastSlotNum = cur->lastSlotNum;
+    _metaDirty = false;
+
+    // a file written in the copy-on-write mode is always read through its page table
+    if (cur->pageTableNum)
+        return readPageTable(cur->pageTableNum);
+    if (_cowEnabled)
+        initPageMap();
+
+    return true;
+}
+
+
+UInt BaseBTree::countFilePages()
+{
+    // a page is in the file if its last byte is; the end is found by doubling the step
+    // and then by bisection, so a long tail takes a few reads
+    const ULong maxPages = std::min<ULong>(std::numeric_limits<UInt>::max(),
+        (MAX_FILE_SIZE - FIRST_PAGE_OFS) / getNodePageSize());
+    auto inFile = [this](ULong pnum) {
+        Byte last;
+        return _io->readAt(getPageOfs((UInt)pnum) + getNodePageSize() - 1, &last, 1);
+    };
+
+    ULong known = _lastPageNum;         // the last page known to be in the file
+    ULong beyond = known + 1;           // a page known not to be, or past the limit
+    for (ULong step = 1; beyond <= maxPages && inFile(beyond); step *= 2)
+    {
+        known = beyond;
+        beyond = known + 2 * step;
+    }
+    beyond = std::min(beyond, maxPages + 1);
+
+    while (beyond - known > 1)
+    {
+        ULong mid = known + (beyond - known) / 2;
+        if (inFile(mid))
+            known = mid;
+        else
+            beyond = mid;
+    }
+
+    return (UInt)known;
+}
+
+
+void BaseBTree::checkpoint()
+{
+    // the pages go first, so the new slot never refers to what the file does not have yet
+    if (_cache.isEnabled())
+        _cache.flush();
+
+    // the new page table goes to free slots with them, the current header slot still
+    // refers to the old one, and the pages of both versions stay intact
+    std::vector<UInt> oldTable;
+    if (_pageMap && _metaDirty)
+    {
+        freezePages();
+        oldTable.swap(_pageTableSlots);
+        writePageTable();
+    }
+    _io->sync();
+
+    if (!_metaDirty)
+        return;
+
+    writeMeta();
+    _io->sync();
+
+    if (_pageMap)
+    {
+        _durableEpoch = _cowEpoch;
+        _freeSlots.insert(_freeSlots.end(), oldTable.begin(), oldTable.end());
+        reclaimSlots();
+    }
+}
+
+
+
+void BaseBTree::setRootPageNum(UInt pnum, bool writeFlag /*= true*/)
+{
+    _rootPageNum = pnum;
+    if (writeFlag)
+        _metaDirty = true;
+}
+
+
+
+void BaseBTree::setOrder(UShort order, UShort recSize, UShort valueSize, PageFormat format)
+{
+    // метод закрытый, корректность параметров должно проверять в вызывающих методах
+
+    _order = order;
+    _recSize = recSize;
+    _keySize = recSize - valueSize;
+    _format = format;
+    _linkOfs = 0;
+
+    if (isSlotted())
+    {
+        setSlottedOrder();
+        return;
+    }
+
+    _minKeys = order - 1;
+    _maxKeys = 2 * order - 1;
+
+    // проверим максимальное число ключей
+    if (_maxKeys > MAX_KEYS_NUM)
+        throw std::invalid_argument("For a given B-tree order, there is an excess of the maximum number of keys");
+
+    _keysSize = _recSize * _maxKeys;                // область памяти под ключи
+    _cursorsOfs = _keysSize + KEYS_OFS;             // смещение области курсоров на дочерние
+    _nodePageSize = _cursorsOfs + CURSOR_SZ * (2 * order);  // размер узла целиком, опр. концом области страницы
+
+    // B+ inner nodes keep keys only, so as many of them (2t' - 1, with 2t' cursors)
+    // as fit into the same page
+    _innerOrder = order;
+    if ((format == pfBPlusTree || format == pfBLink) && _keySize < _recSize)
+    {
+        UInt fit = (_nodePageSize - KEYS_OFS + _keySize) / (_keySize + CURSOR_SZ);   // 2t'
+        if (fit > MAX_KEYS_NUM + 1)
+            fit = MAX_KEYS_NUM + 1;
+        _innerOrder = (UShort)(fit / 2);
+    }
+    _innerMinKeys = _innerOrder - 1;
+    _innerMaxKeys = 2 * _innerOrder - 1;
+    _innerCursorsOfs = KEYS_OFS + _keySize * _innerMaxKeys;
+
+    // a B-link page ends with the right link of an inner node, the level and the high key
+    if (format == pfBLink)
+    {
+        _linkOfs = _nodePageSize;
+        _nodePageSize += CURSOR_SZ + LEVEL_SZ + _keySize;
+    }
+
+    // Q: номер текущей корневой надо устанавливать?
+
+    // пока-что распределяем память под рабочую страницу/узел здесь, но это сомнительно
+    reallocWorkPages();
+}
+
+
+void BaseBTree::setSlottedOrder()
+{
+    // the page has room for 2t - 1 records of the maximum length, each with a slot and a cursor;
+    // then a byte-balanced split of a full node leaves room for one more in either half
+    // (a compressed page also keeps both bounds of its key range before the slots)
+    UInt entrySize = SLOT_SZ + CURSOR_SZ + _recSize;
+    _slotsOfs = isCompressed() ? FENCES_OFS + 2 * _recSize : SLOTS_OFS;
+    _nodePageSize = _slotsOfs + entrySize * (2 * _order - 1);
+    if (_nodePageSize > 0xFFFF)
+        throw std::invalid_argument("For a given B-tree order, slotted pages exceed 16-bit offsets");
+
+    _keysSize = _nodePageSize - _slotsOfs;
+    _cursorsOfs = SLOTTED_CURSORS_OFS;
+
+    // the number of keys is bounded by the shortest records, the fill is controlled by bytes
+    _maxKeys = _keysSize / (SLOT_SZ + VAR_LEN_SZ);
+    if (_maxKeys > MAX_KEYS_NUM)
+        _maxKeys = MAX_KEYS_NUM;
+    _minKeys = 0;
+
+    _innerOrder = _order;
+    _innerMaxKeys = _maxKeys;
+    _innerMinKeys = 0;
+    _innerCursorsOfs = _cursorsOfs;
+
+    reallocWorkPages();
+}
+
+
+UShort BaseBTree::getCommonPrefixLen(const Byte* low, const Byte* high) const
+{
+    if (!low || !high)
+        return 0;
+
+    UShort maxLen = std::min(*((const UShort*)low), *((const UShort*)high));
+    UShort len = 0;
+    while (len < maxLen && low[VAR_LEN_SZ + len] == high[VAR_LEN_SZ + len])
+        ++len;
+
+    return len;
+}
+
+
+void BaseBTree::shortenSeparator(const Byte* last, std::vector<Byte>& sep) const
+{
+    // one byte past the common prefix already makes it bigger than the last record
+    UShort sepNum = *((const UShort*)&sep[0]);
+    UShort common = getCommonPrefixLen(last, &sep[0]);
+    if (common < sepNum)
+    {
+        *((UShort*)&sep[0]) = common + 1;
+        sep.resize(VAR_LEN_SZ + common + 1);
+    }
+}
+
+
+void BaseBTree::reallocWorkPages()
+{
+    _rootPage.reallocData(_nodePageSize);
+    _workPage.reallocData(_nodePageSize);
+
+    // the kernel page cache does the job for a mapped file
+    _cache.reset(isMapped() ? 0 : _cacheCapacity, _nodePageSize);
+}
+
+void BaseBTree::detachWorkPages()
+{
+    _rootPage.detachData();
+    _workPage.detachData();
+}
+
+
+void BaseBTree::insert(const Byte *k)
+{
+    if (isSlotted() && getRecLen(k) > _recSize)
+        throw std::invalid_argument("Record is longer than the maximum record size");
+
+    insertGroup(&k, 1);
+}
+
+
+UInt BaseBTree::insertBatch(const Byte* keys, UInt n)
+{
+    checkForOpenStream();
+    if (!_comparator)
+        throw std::runtime_error("Comparator not set. Can't insert");
+
+    std::vector<const Byte*> recs(n);
+    for (UInt i = 0; i < n; ++i)
+    {
+        recs[i] = keys + i * _recSize;
+        if (isSlotted() && getRecLen(recs[i]) > _recSize)
+            throw std::invalid_argument("Record is longer than the maximum record size");
+    }
+
+    // equal keys keep their order, so they end up as if inserted one by one
+    std::stable_sort(recs.begin(), recs.end(), [this](const Byte* a, const Byte* b)
+    {
+        return _comparator->compare(a, b, _keySize);
+    });
+
+    UInt descents = 0;
+    for (UInt i = 0; i < n; ++descents)
+        i += insertGroup(&recs[i], n - i);
+
+    return descents;
+}
+
+
+UInt BaseBTree::insertGroup(const Byte* const* recs, UInt cnt)
+{
+    checkForOpenStream();
+    TreeLatchGuard tree(_treeLatch, !isConcurrent());
+
+    if (isBLink())
+    {
+        UInt num = insertBLink(recs, cnt);
+        commitOperation(isConcurrent() ? &tree : nullptr);
+        return num;
+    }
+
+    // this method is based on Cormen realisation; the root latch guards the root page number
+    // as a parent guards a child, so it is kept only while the root may split
+    LatchGuard rootLatch(_rootLatch, true);
+    UInt r = _rootPageNum; // memorizing previous root
+    PageWrapper root(this);
+    root.latch(r, true);
+    root.readPage(r);
+
+    UInt num;
+    if(root.isFull()) // if root is full
+    {
+        PageWrapper top(this);
+        top.allocNewRootPage(); // creating new root
+        top.latch(top.getPageNum(), true);
+        top.setAsRoot(); // updating page num (and storing it in the file)
+
+        top.setKeyNum(0); // setting number of keys to 0
+        top.setCursor(0, r); // linking new root to the previous
+
+        top.splitChild(0); // splitting child
+
+        // both halves of the old root are reachable through the new one only
+        root.unlatch();
+        rootLatch.unlock();
+        num = top.insertNonFull(recs, cnt, nullptr); // inserting keys
+    }
+    else // if root is not full simply insert to it
+    {
+        rootLatch.unlock();
+        num = root.insertNonFull(recs, cnt, nullptr);
+    }
+
+    commitOperation(isConcurrent() ? &tree : nullptr); // all pages of the insert make one atomic group
+    return num;
+}
+
+
+void BaseBTree::insert(const Byte* key, const Byte* value)
+{
+    std::vector<Byte> rec(_recSize);
+    memcpy(&rec[0], key, _keySize);
+    memcpy(&rec[_keySize], value, getValueSize());
+    insert(&rec[0]);
+}
+
+
+UInt BaseBTree::insertBLink(const Byte* const* recs, UInt cnt)
+{
+    if (!_comparator)
+        throw std::runtime_error("Comparator not set. Can't insert");
+
+    const Byte* k = recs[0];
+    std::vector<UInt> path;
+    UInt pnum = descendBLink(k, true, 0, path);
+
+    // the leaf was read under a shared latch only; it may have split before the exclusive one
+    PageWrapper first(this);
+    PageWrapper second(this);
+    PageWrapper* node = &first;
+    PageWrapper* next = &second;
+    node->latch(pnum, true);
+    node->readPage(pnum);
+    moveRight(node, next, k, true, true);
+
+    // the following records go into the same leaf while it has room and they are below
+    // its high key; the rest are left to the next descent
+    UInt num = 0;
+    if (!node->isFull())
+    {
+        do
+        {
+            node->insertRecord(node->upperBound(recs[num]), recs[num]);
+            ++num;
+        } while (num < cnt && !node->isFull() && !node->isBeyond(recs[num], true));
+
+        node->writePage();
+        return num;
+    }
+
+    // the leaf splits on its own: until the parent learns the separator, the right half
+    // is reached through the right link of the left one
+    std::vector<Byte> sep(_keySize);
+    node->splitBLink(*next, &sep[0]);
+    for (PageWrapper* half = node; num < cnt; ++num)
+    {
+        if (half == node && !_comparator->compare(recs[num], &sep[0], _keySize))
+            half = next;
+        if (num && (half->isFull() || half->isBeyond(recs[num], true)))
+            break;
+        half->insertRecord(half->upperBound(recs[num]), recs[num]);
+    }
+    next->writePage();
+    node->writePage();
+    postBLink(node, next, &sep[0], path);
+    return num;
+}
+
+
+UInt BaseBTree::descendBLink(const Byte* k, bool upper, UShort level, std::vector<UInt>& path)
+{
+    // one page at a time: a child that splits before it is latched still has the key
+    // somewhere along its right links
+    PageWrapper first(this);
+    PageWrapper second(this);
+    PageWrapper* node = &first;
+    PageWrapper* next = &second;
+
+    LatchGuard root(_rootLatch, false);
+    UInt pnum = _rootPageNum;
+    root.unlock();
+
+    node->latch(pnum, false);
+    node->readPage(pnum);
+    if (node->getLevel() < level)
+        throw std::runtime_error("The root is below the level of a split page. File corrupted");
+
+    path.assign(node->getLevel() + 1, 0);
+    for (;;)
+    {
+        moveRight(node, next, k, false, upper);
+        UShort height = node->getLevel();
+        path[height] = node->getPageNum();
+        if (height == level)
+            return node->getPageNum();
+
+        pnum = node->getCursor(upper ? node->upperBound(k) : node->lowerBound(k));
+        node->unlatch();
+        node->latch(pnum, false);
+        node->readPage(pnum);
+    }
+}
+
+
+void BaseBTree::postBLink(PageWrapper* node, PageWrapper* next, Byte* sep,
+    std::vector<UInt>& path)
+{
+    // both halves stay latched until the parent links them: neither splits again before
+    // that, so downlinks come to a level in the order of its pages
+    PageWrapper first(this);
+    PageWrapper second(this);
+    PageWrapper* parent = &first;
+    PageWrapper* half = &second;
+    std::vector<Byte> up(_keySize);
+
+    for (;;)
+    {
+        UInt left = node->getPageNum();
+        UInt right = next->getPageNum();
+        UShort level = node->getLevel();
+        UInt pnum = path.size() > level + 1u ? path[level + 1] : 0;
+        if (!pnum)
+        {
+            // the root latch comes after every page latch, as the new root is above them all
+            LatchGuard rootLatch(_rootLatch, true);
+            if (_rootPageNum == left)
+            {
+                parent->allocNewRootPage();
+                parent->setKeyNum(1, true);
+                parent->setLevel(level + 1);
+                parent->copyKey(parent->getKey(0), sep);
+                parent->setCursor(0, left);
+                parent->setCursor(1, right);
+                parent->writePage();
+                parent->setAsRoot();
+                return;
+            }
+            rootLatch.unlock();
+
+            // the root has grown since the descent; the level above is found anew from
+            // the leftmost page the separator may go to
+            pnum = descendBLink(sep, false, level + 1, path);
+        }
+
+        parent->latch(pnum, true);
+        parent->readPage(pnum);
+
+        // the downlink of the left page is in place, it was posted before the page could
+        // split again; the parent may have split since it was read, though
+        UShort i;
+        while ((i = parent->findChild(left)) > parent->getKeysNum())
+        {
+            if (!parent->isBeyond(sep, true))
+                throw std::runtime_error("A split page is not linked from its parent. File corrupted");
+
+            pnum = parent->getRightLink();
+            half->latch(pnum, true);
+            half->readPage(pnum);
+            parent->unlatch();
+            std::swap(parent, half);
+        }
+
+        if (!parent->isFull())
+        {
+            parent->insertChild(i, sep, right);
+            parent->writePage();
+            return;
+        }
+
+        // the parent keeps cursors [0, keys] after the split, the rest goes to the new page
+        parent->splitBLink(*half, &up[0]);
+        UShort kept = parent->getKeysNum() + 1;
+        if (i < kept)
+            parent->insertChild(i, sep, right);
+        else
+            half->insertChild(i - kept, sep, right);
+        half->writePage();
+        parent->writePage();
+
+        // the children are linked now; the parent halves are the split pages one level up
+        node->unlatch();
+        next->unlatch();
+        std::swap(node, parent);
+        std::swap(next, half);
+        memcpy(sep, &up[0], _keySize);
+    }
+}
+
+
+void BaseBTree::moveRight(PageWrapper*& node, PageWrapper*& next, const Byte* k, bool exclusive,
+    bool upper)
+{
+    // pages of a level are latched left to right, as leaf steps and splits do
+    while (node->isBeyond(k, upper))
+    {
+        UInt pnum = node->getRightLink();
+        next->latch(pnum, exclusive);
+        next->readPage(pnum);
+        node->unlatch();
+        std::swap(node, next);
+    }
+}
+
+
+//==============================================================================
+// class BaseBTree::PageWrapper
+//==============================================================================
+
+
+
+BaseBTree::PageWrapper::PageWrapper(BaseBTree* tr) :
+    _data(nullptr)
+    , _ownData(nullptr)
+    , _tree(tr)
+    , _pageNum(0)
+    , _nextKeyBuf(0)
+    , _snapshot(nullptr)
+    , _latchedPage(0)
+    , _latchedExclusive(false)
+{
+    // если к моменту создания странички дерево уже в работе (открыто), надо
+    // сразу распределить память!
+    if (_tree->isOpen())
+        reallocData(_tree->getNodePageSize());
+
+}
+
+
+BaseBTree::PageWrapper::~PageWrapper()
+{
+    unlatch();
+    reallocData(0);
+}
+
+
+void BaseBTree::PageWrapper::reallocData(UInt sz)
+{
+    if (_ownData)
+        delete[] _ownData;
+
+    _ownData = sz ? new Byte[sz] : nullptr;
+    _data = _ownData;
+}
+
+void BaseBTree::PageWrapper::clear()
+{
+    if (!_data)
+        return;
+
+    // работая с сырыми блоками данных единственно и можно применять низкоуровневые C-функции
+    memset(_data, 0, _tree->getNodePageSize());
+}
+
+
+
+void BaseBTree::PageWrapper::setKeyNumLeaf(UShort keysNum, bool isRoot, bool isLeaf) //NodeType nt)
+{
+    _tree->checkKeysNumberExc(keysNum, isRoot, isLeaf);
+
+    // логически приплюсовываем
+    if (isLeaf)
+        keysNum |= LEAF_NODE_MASK; // 0x8000;
+
+    // способ записи типизированного объекта, начиная с адреса [0]
+    *((UShort*)&_data[0]) = keysNum;
+}
+
+
+
+void BaseBTree::PageWrapper::setKeyNum(UShort keysNum, bool isRoot) //NodeType nt)
+{
+    _tree->checkKeysNumberExc(keysNum, isRoot, isLeaf());
+
+
+    UShort kldata = *((UShort*)&_data[0]);      // взяли сущ. значение
+    kldata &= LEAF_NODE_MASK;                   // оставили от него только флаг "лист"
+    kldata |= keysNum;                          // приилили число ключей (там точно не будет 1 в старшем)
+
+    *((UShort*)&_data[0]) = kldata;             // записали
+}
+
+
+
+void BaseBTree::PageWrapper::setLeaf(bool isLeaf)
+{
+    UShort kldata = *((UShort*)&_data[0]);      // взяли сущ. значение
+    kldata &= ~LEAF_NODE_MASK;                  // оставили от него только часть с числом ключей
+    if (isLeaf)
+        kldata |= LEAF_NODE_MASK;   // 0x8000;  // приилили флаг, если надо
+
+    *((UShort*)&_data[0]) = kldata;             // записали
+}
+
+
+
+bool BaseBTree::PageWrapper::isLeaf() const
+{
+    UShort info = *((UShort*)&_data[0]);
+
+    return (info & LEAF_NODE_MASK) != 0;
+}
+
+UShort BaseBTree::PageWrapper::getKeysNum() const
+{
+    UShort info = *((UShort*)&_data[0]);
+
+    return (info & ~LEAF_NODE_MASK);
+}
+
+
+
+Byte* BaseBTree::PageWrapper::getKey(UShort num)
+{
+    if (_tree->isCompressed())
+        return num < getKeysNum() ? expandKey(num) : nullptr;
+
+    // рассчитываем смещение
+    //UInt kofst = KEYS_OFS + _tree->getRecSize() * num;
+    int kofst = getKeyOfs(num);
+    if (kofst == -1)
+        return nullptr;
+
+    return (_data + kofst);
+}
+
+
+const Byte* BaseBTree::PageWrapper::getKey(UShort num) const
+{
+    if (_tree->isCompressed())
+        return num < getKeysNum() ? expandKey(num) : nullptr;
+
+    int kofst = getKeyOfs(num);
+    if (kofst == -1)
+        return nullptr;
+
+    return (_data + kofst);
+}
+
+
+void BaseBTree::PageWrapper::copyKey(Byte* dst, const Byte* src)
+{
+    memcpy(
+        dst,                        // куда
+        src,                        // откуда
+        _tree->isSlotted() ? _tree->getRecLen(src) : getSlotSize()); // размер ключа
+}
+
+void BaseBTree::PageWrapper::copyKeys(Byte* dst, const Byte* src, UShort num)
+{
+    memcpy(
+        dst,                        // куда
+        src,                        // откуда
+        getSlotSize() * num         // размер: размер записи на число элементов
+        );
+
+}
+
+void BaseBTree::PageWrapper::copyCursors(Byte* dst, const Byte* src, UShort num)
+{
+    memcpy(
+        dst,                        // куда
+        src,                        // откуда
+        num * CURSOR_SZ             // размер
+        );
+}
+
+void BaseBTree::PageWrapper::copyCursor(Byte* dst, const Byte* src)
+{
+    memcpy(
+            dst,                        // куда
+            src,                        // откуда
+            CURSOR_SZ             // размер
+    );
+}
+
+UInt BaseBTree::PageWrapper::getCursor(UShort cnum)
+{
+    //if (cnum > getKeysNum())
+    int curOfs = getCursorOfs(cnum);
+    if (curOfs == -1)
+        throw std::invalid_argument("Wrong cursor number");
+
+    return *((const UInt*)(_data + curOfs));
+}
+
+
+Byte* BaseBTree::PageWrapper::getCursorPtr(UShort cnum)
+{
+    int curOfs = getCursorOfs(cnum);
+    if (curOfs == -1)
+        throw std::invalid_argument("Wrong cursor number");
+
+    return (_data + curOfs);
+
+}
+
+void BaseBTree::PageWrapper::setCursor(UShort cnum, UInt cval)
+{
+    int curOfs = getCursorOfs(cnum);
+    if (curOfs == -1)
+        throw std::invalid_argument("Wrong cursor number");
+
+    *((UInt*)(_data + curOfs)) = cval;
+}
+
+
+int BaseBTree::PageWrapper::getCursorOfs(UShort cnum) const
+{
+    if (cnum > getKeysNum())
+        return -1;
+
+    // cursor 0 of a slotted page is in its header, the others lead the entries
+    if (_tree->isSlotted())
+        return cnum ? getEntryOfs(cnum - 1) : _tree->getCursorsOfs();
+
+    // рассчитываем смещением
+    return getNodeCursorsOfs() + CURSOR_SZ * cnum;
+}
+
+int BaseBTree::PageWrapper::getKeyOfs(UShort num) const
+{
+    if (num >= getKeysNum())
+        return -1;
+
+    if (_tree->isSlotted())
+        return getEntryOfs(num) + (isLeaf() ? 0 : CURSOR_SZ);
+
+    // рассчитываем смещение
+    return KEYS_OFS + getSlotSize() * num;
+}
+
+
+UInt BaseBTree::PageWrapper::getEntrySize(UShort num) const
+{
+    UInt curOfs = isLeaf() ? 0 : CURSOR_SZ;
+    return curOfs + _tree->getRecLen(_data + getEntryOfs(num) + curOfs);
+}
+
+
+UInt BaseBTree::PageWrapper::getHeapTop() const
+{
+    UShort top = *((const UShort*)(_data + HEAP_TOP_OFS));
+    return top ? top : _tree->getNodePageSize(); // a cleared page has an empty heap
+}
+
+
+UInt BaseBTree::PageWrapper::getFreeSpace() const
+{
+    UShort keyNum = getKeysNum();
+    UInt used = _tree->_slotsOfs + keyNum * SLOT_SZ;
+    for (UShort i = 0; i < keyNum; ++i)
+        used += getEntrySize(i);
+
+    return _tree->getNodePageSize() - used;
+}
+
+
+void BaseBTree::PageWrapper::insertEntry(UShort num, const Byte* rec, UInt child)
+{
+    UShort keyNum = getKeysNum();
+    UShort bytesNum = *((const UShort*)rec);
+
+    // a compressed page stores only what follows the common prefix of its range
+    UShort prefixLen = _tree->isCompressed() ? getPrefixLen() : 0;
+    if (prefixLen && (bytesNum < prefixLen
+            || memcmp(rec + VAR_LEN_SZ, getLowFence() + VAR_LEN_SZ, prefixLen) != 0))
+        throw std::logic_error("Record is out of the page range. Records must be ordered by bytes");
+
+    UInt storedLen = _tree->getRecLen(rec) - prefixLen;
+    UInt entrySize = (isLeaf() ? 0 : CURSOR_SZ) + storedLen;
+    if (getFreeSpace() < entrySize + SLOT_SZ)
+        throw std::domain_error("Node is full. Can't insert");
+
+    // the free space may be scattered over holes left by truncated entries
+    if (getHeapTop() < _tree->_slotsOfs + (keyNum + 1) * SLOT_SZ + entrySize)
+        compactHeap();
+
+    UShort ofs = (UShort)(getHeapTop() - entrySize);
+    Byte* entry = _data + ofs;
+    if (!isLeaf())
+    {
+        *((UInt*)entry) = child;
+        entry += CURSOR_SZ;
+    }
+    *((UShort*)entry) = bytesNum - prefixLen;
+    memcpy(entry + VAR_LEN_SZ, rec + VAR_LEN_SZ + prefixLen, bytesNum - prefixLen);
+    *((UShort*)(_data + HEAP_TOP_OFS)) = ofs;
+
+    UShort* slots = (UShort*)(_data + _tree->_slotsOfs);
+    memmove(slots + num + 1, slots + num, (keyNum - num) * SLOT_SZ);
+    slots[num] = ofs;
+    setKeyNum(keyNum + 1);
+}
+
+
+void BaseBTree::PageWrapper::compactHeap()
+{
+    std::vector<Byte> old(_data, _data + _tree->getNodePageSize());
+    UShort keyNum = getKeysNum();
+    UShort* slots = (UShort*)(_data + _tree->_slotsOfs);
+    UInt curOfs = isLeaf() ? 0 : CURSOR_SZ;
+    UInt top = _tree->getNodePageSize();
+
+    for (UShort i = 0; i < keyNum; ++i)
+    {
+        const Byte* entry = &old[slots[i]];
+        UInt entrySize = curOfs + _tree->getRecLen(entry + curOfs);
+        top -= entrySize;
+        memcpy(_data + top, entry, entrySize);
+        slots[i] = (UShort)top;
+    }
+
+    *((UShort*)(_data + HEAP_TOP_OFS)) = (UShort)top;
+}
+
+
+const Byte* BaseBTree::PageWrapper::getLowFence() const
+{
+    UShort mask = *((const UShort*)(_data + FENCE_MASK_OFS));
+    return (mask & 1) ? _data + FENCES_OFS : nullptr;
+}
+
+
+const Byte* BaseBTree::PageWrapper::getHighFence() const
+{
+    UShort mask = *((const UShort*)(_data + FENCE_MASK_OFS));
+    return (mask & 2) ? _data + FENCES_OFS + _tree->getRecSize() : nullptr;
+}
+
+
+void BaseBTree::PageWrapper::setFences(const Byte* low, const Byte* high)
+{
+    // the records are taken out in full before the prefix changes
+    UShort keyNum = getKeysNum();
+    std::vector<Byte> recs;
+    std::vector<UInt> children(keyNum);
+    for (UShort i = 0; i < keyNum; ++i)
+    {
+        const Byte* rec = getKey(i);
+        recs.insert(recs.end(), rec, rec + _tree->getRecLen(rec));
+        if (!isLeaf())
+            children[i] = getCursor(i + 1);
+    }
+
+    UShort mask = 0;
+    if (low)
+    {
+        memcpy(_data + FENCES_OFS, low, _tree->getRecLen(low));
+        mask |= 1;
+    }
+    if (high)
+    {
+        memcpy(_data + FENCES_OFS + _tree->getRecSize(), high, _tree->getRecLen(high));
+        mask |= 2;
+    }
+    *((UShort*)(_data + FENCE_MASK_OFS)) = mask;
+
+    // every record between the bounds starts with their common prefix
+    *((UShort*)(_data + PREFIX_LEN_OFS)) = _tree->getCommonPrefixLen(low, high);
+
+    *((UShort*)(_data + HEAP_TOP_OFS)) = 0;
+    setKeyNum(0);
+    const Byte* rec = recs.data();
+    for (UShort i = 0; i < keyNum; ++i)
+    {
+        insertEntry(i, rec, children[i]);
+        rec += _tree->getRecLen(rec);
+    }
+}
+
+
+Byte* BaseBTree::PageWrapper::expandKey(UShort num) const
+{
+    UShort recSize = _tree->getRecSize();
+    if (_keyBufs.size() < 2u * recSize)
+        _keyBufs.resize(2 * recSize);
+    Byte* dst = &_keyBufs[_nextKeyBuf * recSize];
+    _nextKeyBuf ^= 1;
+
+    const Byte* stored = _data + getEntryOfs(num) + (isLeaf() ? 0 : CURSOR_SZ);
+    UShort prefixLen = getPrefixLen();
+    UShort storedNum = *((const UShort*)stored);
+
+    *((UShort*)dst) = prefixLen + storedNum;
+    if (prefixLen)
+        memcpy(dst + VAR_LEN_SZ, getLowFence() + VAR_LEN_SZ, prefixLen);
+    memcpy(dst + VAR_LEN_SZ + prefixLen, stored + VAR_LEN_SZ, storedNum);
+    return dst;
+}
+
+
+UShort BaseBTree::PageWrapper::compressedBound(const Byte* key, bool upper) const
+{
+    UShort keyNum = getKeysNum();
+    UShort prefixLen = getPrefixLen();
+    UShort keyLen = *((const UShort*)key);
+    const Byte* keyBytes = key + VAR_LEN_SZ;
+
+    // the key is either out of the page range or has the common prefix too
+    if (prefixLen)
+    {
+        int res = memcmp(keyBytes, getLowFence() + VAR_LEN_SZ, std::min(keyLen, prefixLen));
+        if (res < 0 || (res == 0 && keyLen < prefixLen))
+            return 0;
+        if (res > 0)
+            return keyNum;
+
+        keyBytes += prefixLen;
+        keyLen -= prefixLen;
+    }
+
+    UInt curOfs = isLeaf() ? 0 : CURSOR_SZ;
+    UShort lo = 0;
+    UShort hi = keyNum;
+    while (lo < hi)
+    {
+        UShort mid = lo + (hi - lo) / 2;
+        const Byte* stored = _data + getEntryOfs(mid) + curOfs;
+        UShort storedLen = *((const UShort*)stored);
+        int res = memcmp(stored + VAR_LEN_SZ, keyBytes, std::min(storedLen, keyLen));
+        if (res == 0)
+            res = (int)storedLen - (int)keyLen;     // a shorter one is less
+
+        if (res < 0 || (upper && res == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+
+void BaseBTree::PageWrapper::setAsRoot(bool writeFlag /*= true*/)
+{
+    _tree->_rootPageNum = _pageNum;         // ид корень по номеру страницы в памяти
+
+    if (!writeFlag)
+        return;
+
+    // если же надо записать в файл...
+    if (_pageNum == 0)
+        throw std::runtime_error("Can't set a page as root until allocate a page in a file");
+
+    // если же под страницу есть номер, он попадет в заголовок на контрольной точке
+    _tree->setRootPageNum(_pageNum, true);
+}
+
+
+
+void BaseBTree::PageWrapper::readPageFromChild(PageWrapper& pw, UShort chNum)
+{
+    UInt cur = pw.getCursor(chNum);
+    if (cur == 0)
+        throw std::invalid_argument("Cursor does not point to a existing node/page");
+    
+    readPage(cur);
+}
+
+
+void BaseBTree::PageWrapper::writePage()
+{
+    if (getPageNum() == 0)
+        throw std::runtime_error("Page number not set. Can't write");
+
+    _tree->writePage(getPageNum(), _data);
+}
+
+
+void BaseBTree::PageWrapper::latch(UInt pnum, bool exclusive)
+{
+    if (pnum == 0)
+        throw std::invalid_argument("Can't latch a non-existing page");
+    if (_latchedPage)
+        throw std::logic_error("The wrapper already holds a page latch");
+
+    _tree->_pageLatches.get(pnum).lock(exclusive);
+    _latchedPage = pnum;
+    _latchedExclusive = exclusive;
+}
+
+
+void BaseBTree::PageWrapper::unlatch()
+{
+    if (!_latchedPage)
+        return;
+
+    _tree->_pageLatches.get(_latchedPage).unlock(_latchedExclusive);
+    _latchedPage = 0;
+}
+
+
+
+void BaseBTree::PageWrapper::splitChild(UShort iChild)
+{
+    if (isFull())
+        throw std::domain_error("A parent node is full, so its child can't be splitted");
+
+    if (iChild > getKeysNum())
+        throw std::invalid_argument("Cursor not exists");
+
+    // This method is based on Cormen's realization
+    PageWrapper y(_tree); // left child (in near future)
+    PageWrapper z(_tree); // right child (in near future)
+
+    y.readPageFromChild(*this, iChild); // by now y will contain hole node we want to split
+    if (_tree->isSlotted())
+    {
+        splitSlottedChild(iChild, y, z);
+        return;
+    }
+    if (_tree->isBPlus() && y.isLeaf())
+    {
+        splitLeafChild(iChild, y, z);
+        return;
+    }
+
+    UShort t = y.getNodeOrder(); // B+ inner nodes have an order of their own
+    z.allocPage(t - 1, y.isLeaf()); // real creation of z (future sibling of y)
+
+    for(UShort i = 0; i < t - 1; i++) // coping keys after median of y to the sibling z
+        z.copyKey(z.getKey(i), y.getKey(t + i));
+
+    if(!y.isLeaf()) // if splitting child is not leaf and has his own children
+    {
+        for (UShort i = 0; i < t; i++) // coping child after median of y to the sibling z
+            z.copyCursor(z.getCursorPtr(i), y.getCursorPtr(t + i));
+    }
+
+    setKeyNum(getKeysNum() + 1); // increasing the number of keys in parent
+
+    for(int i = getKeysNum() - 1; i >= iChild + 1; i--) // shifting right part of parent's children to the right
+        copyCursor(getCursorPtr(i + 1), getCursorPtr(i));
+
+    setCursor(iChild + 1, z.getPageNum()); // inserting link to the new child z
+
+    for(int i = getKeysNum() - 2; i >= iChild; i--) // shifting right part of parent keys to the right
+        copyKey(getKey(i + 1), getKey(i));
+
+    copyKey(getKey(iChild), y.getKey(t - 1)); // inserting new key to the parent
+    y.setKeyNum(t - 1); // cutting right part of splitting node
+
+    // saving changes to the storage
+    y.writePage();
+    z.writePage();
+    writePage();
+}
+
+
+void BaseBTree::PageWrapper::splitLeafChild(UShort iChild, PageWrapper& y, PageWrapper& z)
+{
+    UShort t = y.getNodeOrder();
+
+    // y keeps order - 1 keys, z gets the other order ones, the parent gets a copy of the first of z
+    z.allocPage(t, true);
+    z.copyKeys(z.getKey(0), y.getKey(t - 1), t);
+    z.linkLeafAfter(y);
+
+    insertChild(iChild, z.getKey(0), z.getPageNum()); // only the key goes into a B+ inner node
+    y.setKeyNum(t - 1);
+
+    y.writePage();
+    z.writePage();
+    writePage();
+}
+
+
+void BaseBTree::PageWrapper::splitSlottedChild(UShort iChild, PageWrapper& y, PageWrapper& z)
+{
+    UShort keyNum = y.getKeysNum();
+    bool leaf = y.isLeaf();
+
+    // y keeps [0, m); a leaf gives [m, n) to z and a copy of its first record to the parent,
+    // an inner node gives (m, n) to z and moves the record m up. Both halves must not be empty
+    std::vector<UInt> sizes(keyNum);
+    UInt total = 0;
+    for (UShort i = 0; i < keyNum; ++i)
+    {
+        sizes[i] = y.getEntrySize(i) + SLOT_SZ;
+        total += sizes[i];
+    }
+
+    UShort m = 1;
+    UInt best = (UInt)-1;
+    UInt left = 0;
+    for (UShort i = 0; i < keyNum; ++i)
+    {
+        if (i >= 1 && i + (leaf ? 0 : 1) < keyNum)
+        {
+            UInt right = total - left - (leaf ? 0 : sizes[i]);
+            UInt bigger = left > right ? left : right;
+            if (bigger < best)
+            {
+                best = bigger;
+                m = i;
+            }
+        }
+        left += sizes[i];
+    }
+
+    // the separator is kept aside, since keys of a compressed page are assembled in a buffer
+    const Byte* rec = y.getKey(m);
+    std::vector<Byte> sep(rec, rec + _tree->getRecLen(rec));
+    if (leaf && _tree->isCompressed())
+        _tree->shortenSeparator(y.getKey(m - 1), sep); // the shortest prefix of z bigger than y
+
+    std::vector<Byte> low;
+    std::vector<Byte> high;
+    if (_tree->isCompressed())
+    {
+        if (y.getLowFence())
+            low.assign(y.getLowFence(), y.getLowFence() + _tree->getRecLen(y.getLowFence()));
+        if (y.getHighFence())
+            high.assign(y.getHighFence(), y.getHighFence() + _tree->getRecLen(y.getHighFence()));
+    }
+
+    z.allocPage(0, leaf);
+    if (_tree->isCompressed())
+        z.setFences(&sep[0], high.empty() ? nullptr : &high[0]);
+    if (leaf)
+        z.linkLeafAfter(y);
+    else
+        z.setCursor(0, y.getCursor(m + 1));
+
+    UShort first = leaf ? m : m + 1;
+    for (UShort i = first; i < keyNum; ++i)
+        z.insertEntry(i - first, y.getKey(i), leaf ? 0 : y.getCursor(i + 1));
+
+    insertEntry(iChild, &sep[0], z.getPageNum());
+    y.setKeyNum(m); // the rest of the heap of y is reclaimed by the next compaction
+    if (_tree->isCompressed())
+        y.setFences(low.empty() ? nullptr : &low[0], &sep[0]); // a narrower range, a longer prefix
+
+    y.writePage();
+    z.writePage();
+    writePage();
+}
+
+
+bool BaseBTree::PageWrapper::rebalanceSlotted(UShort iSep, PageWrapper& left, PageWrapper& right)
+{
+    bool leaf = left.isLeaf();
+    bool compressed = _tree->isCompressed();
+    UInt curSz = leaf ? 0 : CURSOR_SZ;
+
+    // records of both pages in order, with the separator between inner ones, and their cursors;
+    // they are copied out, as the pages are rebuilt from them (and keys of a compressed page
+    // are assembled in a buffer)
+    std::vector<Byte> buf;
+    std::vector<UInt> ofs;
+    std::vector<UInt> cursors;
+    PageWrapper* sides[] = { &left, &right };
+    for (PageWrapper* pw : sides)
+    {
+        if (pw == &right && !leaf)
+        {
+            const Byte* sep = getKey(iSep);
+            ofs.push_back((UInt)buf.size());
+            buf.insert(buf.end(), sep, sep + _tree->getRecLen(sep));
+        }
+        if (!leaf)
+            cursors.push_back(pw->getCursor(0));
+        for (UShort i = 0; i < pw->getKeysNum(); ++i)
+        {
+            const Byte* rec = pw->getKey(i);
+            ofs.push_back((UInt)buf.size());
+            buf.insert(buf.end(), rec, rec + _tree->getRecLen(rec));
+            if (!leaf)
+                cursors.push_back(pw->getCursor(i + 1));
+        }
+    }
+
+    UShort num = (UShort)ofs.size();
+    std::vector<const Byte*> recs(num);
+    std::vector<UInt> lens(num + 1, 0);             // prefix sums of the record lengths
+    for (UShort i = 0; i < num; ++i)
+    {
+        recs[i] = &buf[ofs[i]];
+        lens[i + 1] = lens[i] + _tree->getRecLen(recs[i]);
+    }
+
+    std::vector<Byte> low;
+    std::vector<Byte> high;
+    if (compressed)
+    {
+        if (left.getLowFence())
+            low.assign(left.getLowFence(), left.getLowFence() + _tree->getRecLen(left.getLowFence()));
+        if (right.getHighFence())
+            high.assign(right.getHighFence(), right.getHighFence() + _tree->getRecLen(right.getHighFence()));
+    }
+    const Byte* lowFence = low.empty() ? nullptr : &low[0];
+    const Byte* highFence = high.empty() ? nullptr : &high[0];
+
+    // bytes taken by the entries [from, to) with their slots, less the common prefix of the page
+    auto bytes = [&](UShort from, UShort to, const Byte* lo, const Byte* hi) -> UInt {
+        UInt prefixLen = compressed ? _tree->getCommonPrefixLen(lo, hi) : 0;
+        return lens[to] - lens[from] - (to - from) * prefixLen + (to - from) * (curSz + SLOT_SZ);
+    };
+
+    if (bytes(0, num, lowFence, highFence) <= _tree->_keysSize)
+    {
+        // merging into the left page, the right one leaves the leaf list and the parent
+        left.setEntries(recs.data(), num, cursors.data(), lowFence, highFence);
+        if (leaf)
+        {
+            UInt next = right.getNextLeaf();
+            left.setNextLeaf(next);
+            if (next)
+            {
+                PageWrapper w(_tree);
+                w.readPage(next);
+                w.setPrevLeaf(left.getPageNum());
+                w.writePage();
+            }
+        }
+        removeKeys(iSep, 1);
+
+        left.writePage();
+        writePage();
+        _tree->freePage(right.getPageNum());
+        return true;
+    }
+
+    // as in splitSlottedChild(): left keeps [0, m), a leaf gives [m, n) to right and a copy of
+    // record m to the parent, an inner node gives (m, n) and moves record m up; the separator
+    // has to fit into the place of the old one
+    UInt room = getFreeSpace() + getEntrySize(iSep);
+    UInt parentPrefix = compressed ? getPrefixLen() : 0;
+    UShort best = 0;
+    UInt bestBytes = (UInt)-1;
+    std::vector<Byte> bestSep;
+    std::vector<Byte> sep;
+    for (UShort m = 1; m + (leaf ? 0 : 1) < num; ++m)
+    {
+        sep.assign(recs[m], recs[m] + _tree->getRecLen(recs[m]));
+        if (leaf && compressed)
+            _tree->shortenSeparator(recs[m - 1], sep);
+        if (CURSOR_SZ + sep.size() - parentPrefix > room)
+            continue;
+
+        UInt leftBytes = bytes(0, m, lowFence, &sep[0]);
+        UInt rightBytes = bytes(leaf ? m : m + 1, num, &sep[0], highFence);
+        UInt bigger = std::max(leftBytes, rightBytes);
+        if (leftBytes <= _tree->_keysSize && rightBytes <= _tree->_keysSize && bigger < bestBytes)
+        {
+            best = m;
+            bestBytes = bigger;
+            bestSep = sep;
+        }
+    }
+
+    // nothing fits, or the pages are as even as they can be
+    if (!best || best == left.getKeysNum())
+        return false;
+
+    UShort first = leaf ? best : best + 1;
+    left.setEntries(recs.data(), best, cursors.data(), lowFence, &bestSep[0]);
+    right.setEntries(recs.data() + first, num - first, cursors.data() + (leaf ? 0 : first),
+        &bestSep[0], highFence);
+    removeKeys(iSep, 1);
+    insertEntry(iSep, &bestSep[0], right.getPageNum());
+
+    left.writePage();
+    right.writePage();
+    writePage();
+    return false;
+}
+
+
+void BaseBTree::PageWrapper::setEntries(const Byte* const* recs, UShort num, const UInt* cursors,
+    const Byte* low, const Byte* high)
+{
+    setKeyNum(0, true);
+    *((UShort*)(_data + HEAP_TOP_OFS)) = 0;
+    if (_tree->isCompressed())
+        setFences(low, high);               // there are no records to squeeze yet
+    if (!isLeaf())
+        setCursor(0, cursors[0]);
+
+    for (UShort i = 0; i < num; ++i)
+        insertEntry(i, recs[i], isLeaf() ? 0 : cursors[i + 1]);
+}
+
+
+void BaseBTree::PageWrapper::removeKeys(UShort first, UShort num)
+{
+    UShort keyNum = getKeysNum();
+    if (_tree->isSlotted())
+    {
+        // a cursor leads the entry of its key, the entries stay in the heap as holes
+        // until the next compaction
+        UShort* slots = (UShort*)(_data + _tree->_slotsOfs);
+        memmove(slots + first, slots + first + num, (keyNum - first - num) * SLOT_SZ);
+    }
+    else
+    {
+        UShort slot = getSlotSize();
+        memmove(_data + KEYS_OFS + first * slot, _data + KEYS_OFS + (first + num) * slot,
+            (keyNum - first - num) * slot);
+        if (!isLeaf())
+        {
+            UInt cursorsOfs = getNodeCursorsOfs();
+            memmove(_data + cursorsOfs + (first + 1) * CURSOR_SZ,
+                _data + cursorsOfs + (first + num + 1) * CURSOR_SZ, (keyNum - first - num) * CURSOR_SZ);
+        }
+    }
+
+    setKeyNum(keyNum - num, true);
+}
+
+
+void BaseBTree::PageWrapper::linkLeafAfter(PageWrapper& prev)
+{
+    UInt next = prev.getNextLeaf();
+    setPrevLeaf(prev.getPageNum());
+    setNextLeaf(next);
+    prev.setNextLeaf(getPageNum());
+    if (next)
+    {
+        // the next leaf is latched after prev, left to right, as searches step along leaves
+        PageWrapper w(_tree);
+        w.latch(next, true);
+        w.readPage(next);
+        w.setPrevLeaf(getPageNum());
+        w.writePage();
+    }
+}
+
+
+void BaseBTree::PageWrapper::splitBLink(PageWrapper& z, Byte* sep)
+{
+    UShort t = getNodeOrder();
+    UInt link = getRightLink();
+    if (isLeaf())
+    {
+        // as in splitLeafChild(): this leaf keeps order - 1 keys, the first key of z separates
+        z.allocPage(t, true);
+        z.copyKeys(z.getKey(0), getKey(t - 1), t);
+        if (link)
+            z.setHighKey(getHighKey());
+        z.linkLeafAfter(*this);
+        memcpy(sep, z.getKey(0), _tree->_keySize);
+    }
+    else
+    {
+        // as in splitChild(): the median separates and goes up
+        z.allocPage(t - 1, false);
+        z.setLevel(getLevel());
+        z.copyKeys(z.getKey(0), getKey(t), t - 1);
+        z.copyCursors(z.getCursorPtr(0), getCursorPtr(t), t);
+        if (link)
+            z.setHighKey(getHighKey());
+        z.setRightLink(link);
+        setRightLink(z.getPageNum());
+        memcpy(sep, getKey(t - 1), _tree->_keySize);
+    }
+
+    setHighKey(sep);
+    setKeyNum(t - 1);
+}
+
+
+void BaseBTree::PageWrapper::insertRecord(UShort num, const Byte* rec)
+{
+    UShort keyNum = getKeysNum();
+    setKeyNum(keyNum + 1); // increasing number of keys in node
+    if (num < keyNum) // shifting right part to the right
+        memmove(getKey(num + 1), getKey(num), (keyNum - num) * getSlotSize());
+    copyKey(getKey(num), rec);
+}
+
+
+void BaseBTree::PageWrapper::insertChild(UShort num, const Byte* key, UInt child)
+{
+    UShort keyNum = getKeysNum();
+    UShort slot = getSlotSize();
+    UInt cursorsOfs = getNodeCursorsOfs();
+
+    setKeyNum(keyNum + 1);
+    memmove(_data + cursorsOfs + (num + 2) * CURSOR_SZ, _data + cursorsOfs + (num + 1) * CURSOR_SZ,
+        (keyNum - num) * CURSOR_SZ);
+    setCursor(num + 1, child);
+    memmove(_data + KEYS_OFS + (num + 1) * slot, _data + KEYS_OFS + num * slot,
+        (keyNum - num) * slot);
+    copyKey(getKey(num), key);
+}
+
+
+UShort BaseBTree::PageWrapper::findChild(UInt pnum)
+{
+    UShort keyNum = getKeysNum();
+    for (UShort i = 0; i <= keyNum; ++i)
+        if (getCursor(i) == pnum)
+            return i;
+
+    return keyNum + 1;
+}
+
+
+void BaseBTree::PageWrapper::setHighKey(const Byte* key)
+{
+    memcpy(_data + _tree->_linkOfs + CURSOR_SZ + LEVEL_SZ, key, _tree->_keySize);
+}
+
+
+bool BaseBTree::PageWrapper::isBeyond(const Byte* k, bool upper) const
+{
+    const Byte* high = _tree->isBLink() ? getHighKey() : nullptr;
+    if (!high)
+        return false;
+
+    IComparator* c = _tree->_comparator;
+    return upper ? !c->compare(k, high, _tree->_keySize) : c->compare(high, k, _tree->_keySize);
+}
+
+
+void BaseBTree::PageWrapper::insertNonFull(const Byte* k)
+{
+    insertNonFull(&k, 1, nullptr);
+}
+
+
+UInt BaseBTree::PageWrapper::insertNonFull(const Byte* const* recs, UInt cnt, const Byte* upper)
+{
+    if (isFull())
+        throw std::domain_error("Node is full. Can't insert");
+
+    IComparator* c = _tree->getComparator();
+    if (!c)
+        throw std::runtime_error("Comparator not set. Can't insert");
+
+    // This method is based on Cormen realisation
+    const Byte* k = recs[0];
+    UShort i = upperBound(k); // equal keys stay before the new one
+
+    if(isLeaf()) // if it's leaf, just simply insert to current node
+    {
+        // the following records of the batch belong here too, up to the separator
+        // that led to this leaf, as long as it has room for them
+        UInt num = 0;
+        do
+        {
+            if (_tree->isSlotted())
+                insertEntry(upperBound(recs[num]), recs[num], 0);
+            else
+                insertRecord(upperBound(recs[num]), recs[num]);
+            ++num;
+        } while (num < cnt && !isFull() && (!upper || c->compare(recs[num], upper, _tree->_keySize)));
+
+        writePage(); // saving changes to the store
+        unlatch();
+        return num;
+    }
+    // In case it's not a leaf, i is the child to go down to
+
+    PageWrapper s(_tree); // creating child (in near future)
+    s.latch(getCursor(i), true); // latch coupling: the child is taken before the parent is let go
+    s.readPageFromChild(*this, i); // loading child from store
+
+    if(s.isFull()) // if child is full
+    {
+        splitChild(i); // splitting this child
+
+        // researching to what sub tree we should go down; a B+ separator is the first key
+        // of the right half, so a key equal to it goes there, after the equal ones
+        bool right = _tree->isBPlus() ? !c->compare(k, getKey(i), _tree->_keySize)
+                                      : c->compare(getKey(i), k, _tree->_keySize);
+        if (right)
+        {
+            // the new sibling is reachable through this node only, so nobody waits for it
+            s.unlatch();
+            s.latch(getCursor(i + 1), true);
+            s.readPageFromChild(*this, ++i);
+        }
+        else
+            s.readPageFromChild(*this, i);
+    }
+
+    // the separator right of the child bounds the records the child may take; it is copied,
+    // as the page is let go (and a compressed key is expanded into a shared buffer)
+    std::vector<Byte> bound;
+    if (i < getKeysNum())
+    {
+        const Byte* sep = getKey(i);
+        bound.assign(sep, sep + (_tree->isSlotted() ? _tree->getRecLen(sep) : _tree->_keySize));
+        bound.resize(std::max(bound.size(), (size_t)_tree->_keySize));
+        upper = &bound[0];
+    }
+
+    unlatch(); // the child is not full now, so nothing above it changes anymore
+    return s.insertNonFull(recs, cnt, upper); // recursion to the sub tree
+}
+
+#ifdef BTREE_WITH_DELETION
+
+UInt BaseBTree::PageWrapper::removeNonMin(const Byte* k, UInt maxNum)
+{
+    IComparator* c = _tree->getComparator();
+    if (!c)
+        throw std::runtime_error("Comparator not set. Can't remove");
+
+    // This method is based on Cormen realisation (single pass, top-down)
+    UShort recSize = _tree->_recSize;
+    UShort keySize = _tree->_keySize;
+    UShort keyNum = getKeysNum();
+    UShort i = lowerBound(k);
+    bool found = i < keyNum && c->isEqual(getKey(i), k, keySize);
+
+    if (isLeaf()) // case 1: the key is simply cut out of the leaf
+    {
+        if (!found)
+            return 0;
+
+        UShort last = i; // equal keys go in a row
+        while (last < keyNum && c->isEqual(getKey(last), k, keySize))
+            ++last;
+
+        // a non-root leaf has at least order keys here, so it can give away some of them
+        UInt num = last - i;
+        UInt spare = isRoot() ? keyNum : keyNum - _tree->getMinKeys();
+        if (num > spare)
+            num = spare;
+        if (num > maxNum)
+            num = maxNum;
+
+        Byte* keys = _data + KEYS_OFS;
+        memmove(keys + i * recSize, keys + (i + num) * recSize, (keyNum - i - num) * recSize);
+        setKeyNum(keyNum - num);
+        writePage();
+        return num;
+    }
+
+    PageWrapper y(_tree); // left child of the key / child to go down to
+    y.readPageFromChild(*this, i);
+
+    if (found)
+    {
+        UShort t = _tree->getOrder();
+        if (y.getKeysNum() >= t) // case 2a: replacing the key with its predecessor
+        {
+            PageWrapper w(_tree);
+            w.readPageFromChild(*this, i);
+            while (!w.isLeaf())
+                w.readPageFromChild(w, w.getKeysNum());
+
+            std::vector<Byte> pred(w.getKey(w.getKeysNum() - 1), w.getKey(w.getKeysNum() - 1) + recSize);
+            copyKey(getKey(i), &pred[0]);
+            writePage();
+            y.removeNonMin(&pred[0], 1);
+            return 1;
+        }
+
+        PageWrapper z(_tree); // right child of the key
+        z.readPageFromChild(*this, i + 1);
+        if (z.getKeysNum() >= t) // case 2b: replacing the key with its successor
+        {
+            PageWrapper w(_tree);
+            w.readPageFromChild(*this, i + 1);
+            while (!w.isLeaf())
+                w.readPageFromChild(w, 0);
+
+            std::vector<Byte> succ(w.getKey(0), w.getKey(0) + recSize);
+            copyKey(getKey(i), &succ[0]);
+            writePage();
+            z.removeNonMin(&succ[0], 1);
+            return 1;
+        }
+
+        // case 2c: both children are minimal, the key goes down into their merge
+        mergeChildren(i, y, z);
+        return y.removeNonMin(k, maxNum);
+    }
+
+    // case 3: the key is not here, the child to go down to is made non-minimal first
+    if (y.getKeysNum() < _tree->getOrder())
+        fillChild(i, y);
+
+    return y.removeNonMin(k, maxNum);
+}
+
+
+UInt BaseBTree::PageWrapper::removeRun(const Byte* k)
+{
+    IComparator* c = _tree->getComparator();
+    if (!c)
+        throw std::runtime_error("Comparator not set. Can't remove");
+
+    UShort keySize = _tree->_keySize;
+    UShort keyNum = getKeysNum();
+    UShort a = lowerBound(k);
+    UShort b = a; // equal keys go in a row
+    while (b < keyNum && c->isEqual(getKey(b), k, keySize))
+        ++b;
+
+    if (isLeaf())
+    {
+        if (a == b)
+            return 0;
+
+        removeKeys(a, b - a); // the parent evens it out
+        writePage();
+        return b - a;
+    }
+
+    // the run goes on in children a..b, and those between two equal keys hold nothing else
+    UInt num = _tree->isBPlus() ? 0 : b - a;
+    PageWrapper child(_tree);
+    child.readPageFromChild(*this, a);
+    num += child.removeRun(k);
+    UInt left = child.getPageNum();
+    UInt right = 0;
+    if (b > a)
+    {
+        child.readPageFromChild(*this, b);
+        num += child.removeRun(k);
+        right = child.getPageNum();
+    }
+
+    if (b > a + 1)
+    {
+        UInt links[2] = { 0, 0 };
+        bool leftmost = true;
+        for (UShort j = a + 1; j < b; ++j)
+            num += _tree->freeSubtree(getCursor(j), links, leftmost);
+
+        // the leaves around the dropped ones are linked to each other
+        PageWrapper w(_tree);
+        if (links[0])
+        {
+            w.readPage(links[0]);
+            w.setNextLeaf(links[1]);
+            w.writePage();
+        }
+        if (links[1])
+        {
+            w.readPage(links[1]);
+            w.setPrevLeaf(links[0]);
+            w.writePage();
+        }
+
+        // key b - 1 (all of them are equal) stays between children a and b
+        removeKeys(a, b - a - 1);
+    }
+
+    // a B+ separator equal to k still separates the children, a record of a B-tree is
+    // replaced by its predecessor or successor, if any
+    if (!_tree->isBPlus() && b > a)
+    {
+        std::vector<Byte> rec(_tree->_recSize);
+        PageWrapper y(_tree);
+        y.readPageFromChild(*this, a);
+        PageWrapper z(_tree);
+        z.readPageFromChild(*this, a + 1);
+        if (y.removeEdge(true, &rec[0]) || z.removeEdge(false, &rec[0]))
+            copyKey(getKey(a), &rec[0]);
+        else
+        {
+            // both children are empty, the right one goes along with the key
+            UInt links[2] = { 0, 0 };
+            bool leftmost = true;
+            _tree->freeSubtree(getCursor(a + 1), links, leftmost);
+            removeKeys(a, 1);
+            right = 0;
+        }
+    }
+    writePage();
+
+    // on the way back the children of the run are evened out with their neighbours
+    UShort i = findChild(left);
+    if (i <= getKeysNum())
+        evenOutChild(i);
+    i = right ? findChild(right) : getKeysNum() + 1;
+    if (i <= getKeysNum())
+        evenOutChild(i);
+
+    return num;
+}
+
+
+UShort BaseBTree::PageWrapper::evenOutChild(UShort iChild)
+{
+    PageWrapper child(_tree);
+    child.readPageFromChild(*this, iChild);
+    while (child.isUnderfull() && getKeysNum() > 0)
+    {
+        UShort keyNum = getKeysNum();
+        iChild = fillChild(iChild, child);
+        if (!child.isLeaf())
+        {
+            // a node without keys, the child or a sibling merged into it, brings along its only
+            // child that has had no neighbours to even out with; merges there may make the
+            // child short again
+            for (UShort j = 0; j <= child.getKeysNum(); ++j)
+                j = child.evenOutChild(j);
+        }
+
+        // a slotted page is as even with its sibling as it gets unless they have been merged
+        if (_tree->isSlotted() && getKeysNum() == keyNum)
+            break;
+    }
+
+    return iChild;
+}
+
+
+bool BaseBTree::PageWrapper::removeEdge(bool last, Byte* rec)
+{
+    UShort slot = getSlotSize();
+    UShort keyNum = getKeysNum();
+
+    if (isLeaf())
+    {
+        if (keyNum == 0)
+            return false;
+
+        UShort i = last ? keyNum - 1 : 0;
+        memcpy(rec, getKey(i), _tree->_recSize);
+        removeKeys(i, 1);
+        writePage();
+        return true;
+    }
+
+    UShort iChild = last ? keyNum : 0;
+    PageWrapper child(_tree);
+    child.readPageFromChild(*this, iChild);
+    if (child.removeEdge(last, rec))
+    {
+        evenOutChild(iChild);
+        return true;
+    }
+    if (keyNum == 0)
+        return false;
+
+    // the subtree at the edge is empty, so the edge record is the own one of the node
+    UShort i = last ? keyNum - 1 : 0;
+    memcpy(rec, getKey(i), _tree->_recSize);
+    UInt links[2] = { 0, 0 };
+    bool leftmost = true;
+    _tree->freeSubtree(getCursor(iChild), links, leftmost);
+
+    UInt cursorsOfs = getNodeCursorsOfs();
+    memmove(_data + KEYS_OFS + i * slot, _data + KEYS_OFS + (i + 1) * slot, (keyNum - i - 1) * slot);
+    memmove(_data + cursorsOfs + iChild * CURSOR_SZ, _data + cursorsOfs + (iChild + 1) * CURSOR_SZ,
+        (keyNum - iChild) * CURSOR_SZ);
+    setKeyNum(keyNum - 1, true);
+    writePage();
+    return true;
+}
+
+
+UShort BaseBTree::PageWrapper::fillChild(UShort iChild, PageWrapper& child)
+{
+    if (_tree->isSlotted())
+    {
+        if (getKeysNum() == 0)
+            return iChild;
+
+        // slotted pages are evened out by bytes, with the left sibling if there is one
+        PageWrapper sib(_tree);
+        if (iChild == 0)
+        {
+            sib.readPageFromChild(*this, 1);
+            rebalanceSlotted(0, child, sib);
+            return 0;
+        }
+
+        sib.readPageFromChild(*this, iChild - 1);
+        if (!rebalanceSlotted(iChild - 1, sib, child))
+            return iChild;
+        child.readPageFromChild(*this, iChild - 1);
+        return iChild - 1;
+    }
+
+    UShort slot = child.getSlotSize();      // siblings have the same one, the parent may not
+    UShort t = child.getNodeOrder();
+    UShort keyNum = getKeysNum();
+    UShort childNum = child.getKeysNum();
+    UInt cursorsOfs = child.getNodeCursorsOfs();
+    bool bplusLeaf = _tree->isBPlus() && child.isLeaf(); // keys move directly, separators are copies
+
+    PageWrapper sib(_tree);
+
+    if (iChild > 0) // case 3a: borrowing the last key of the left sibling through the parent
+    {
+        sib.readPageFromChild(*this, iChild - 1);
+        UShort sibNum = sib.getKeysNum();
+        if (sibNum >= t)
+        {
+            child.setKeyNum(childNum + 1, true);    // may still be short after removeRun()
+            memmove(child._data + KEYS_OFS + slot, child._data + KEYS_OFS, childNum * slot);
+            child.copyKey(child.getKey(0), bplusLeaf ? sib.getKey(sibNum - 1) : getKey(iChild - 1));
+            if (!child.isLeaf())
+            {
+                memmove(child._data + cursorsOfs + CURSOR_SZ, child._data + cursorsOfs, (childNum + 1) * CURSOR_SZ);
+                copyCursor(child.getCursorPtr(0), sib.getCursorPtr(sibNum));
+            }
+
+            copyKey(getKey(iChild - 1), sib.getKey(sibNum - 1));
+            sib.setKeyNum(sibNum - 1);
+
+            sib.writePage();
+            child.writePage();
+            writePage();
+            return iChild;
+        }
+    }
+
+    if (iChild < keyNum) // case 3a: borrowing the first key of the right sibling through the parent
+    {
+        sib.readPageFromChild(*this, iChild + 1);
+        UShort sibNum = sib.getKeysNum();
+        if (sibNum >= t)
+        {
+            child.setKeyNum(childNum + 1, true);
+            child.copyKey(child.getKey(childNum), bplusLeaf ? sib.getKey(0) : getKey(iChild));
+            if (!child.isLeaf())
+                copyCursor(child.getCursorPtr(childNum + 1), sib.getCursorPtr(0));
+
+            copyKey(getKey(iChild), sib.getKey(bplusLeaf ? 1 : 0));
+            memmove(sib._data + KEYS_OFS, sib._data + KEYS_OFS + slot, (sibNum - 1) * slot);
+            if (!sib.isLeaf())
+                memmove(sib._data + cursorsOfs, sib._data + cursorsOfs + CURSOR_SZ, sibNum * CURSOR_SZ);
+            sib.setKeyNum(sibNum - 1);
+
+            sib.writePage();
+            child.writePage();
+            writePage();
+            return iChild;
+        }
+
+        // case 3b: merging with the right sibling
+        mergeChildren(iChild, child, sib);
+        return iChild;
+    }
+
+    // case 3b: merging with the left sibling (the child is the last one)
+    sib.readPageFromChild(*this, iChild - 1);
+    mergeChildren(iChild - 1, sib, child);
+    child.readPageFromChild(*this, iChild - 1);
+    return iChild - 1;
+}
+
+
+void BaseBTree::PageWrapper::mergeChildren(UShort iChild, PageWrapper& left, PageWrapper& right)
+{
+    UShort slot = getSlotSize();
+    UShort keyNum = getKeysNum();
+    UShort leftNum = left.getKeysNum();
+    UShort rightNum = right.getKeysNum();
+    UInt cursorsOfs = getNodeCursorsOfs();
+    bool bplusLeaf = _tree->isBPlus() && left.isLeaf();
+    UShort sepNum = bplusLeaf ? 0 : 1;      // a B+ separator is only a copy, it is dropped
+
+    if ((UInt)leftNum + sepNum + rightNum > left.getMaxKeysNum())
+        throw std::domain_error("Children are too big to be merged");
+
+    // median key of the parent and all keys of the right node (both may be short after removeRun())
+    left.setKeyNum(leftNum + sepNum + rightNum, true);
+    if (!bplusLeaf)
+        left.copyKey(left.getKey(leftNum), getKey(iChild));
+    left.copyKeys(left.getKey(leftNum + sepNum), right.getKey(0), rightNum);
+    if (!left.isLeaf())
+        copyCursors(left.getCursorPtr(leftNum + 1), right.getCursorPtr(0), rightNum + 1);
+
+    if (bplusLeaf) // right leaves the leaf list
+    {
+        UInt next = right.getNextLeaf();
+        left.setNextLeaf(next);
+        if (next)
+        {
+            PageWrapper w(_tree);
+            w.readPage(next);
+            w.setPrevLeaf(left.getPageNum());
+            w.writePage();
+        }
+    }
+
+    // removing the median key and the cursor to the right node from the parent
+    memmove(_data + KEYS_OFS + iChild * slot, _data + KEYS_OFS + (iChild + 1) * slot,
+        (keyNum - iChild - 1) * slot);
+    memmove(_data + cursorsOfs + (iChild + 1) * CURSOR_SZ, _data + cursorsOfs + (iChild + 2) * CURSOR_SZ,
+        (keyNum - iChild - 1) * CURSOR_SZ);
+
+    // bottom-up removals let the parent underflow, it is fixed a level up
+    setKeyNum(keyNum - 1, true);
+
+    left.writePage();
+    writePage();
+    _tree->freePage(right.getPageNum());
+}
+
+#endif // BTREE_WITH_DELETION
+
+
+UShort BaseBTree::PageWrapper::lowerBound(const Byte* key)
+{
+    if (_tree->isCompressed())
+        return compressedBound(key, false);
+
+    if (_tree->_lowerBoundFunc && !_tree->isSlotted())  // kernels need keys at a fixed stride
+        return _tree->_lowerBoundFunc(_data + KEYS_OFS, getKeysNum(), key,
+            getSlotSize(), _tree->_linearSearchThreshold);
+
+    IComparator* c = _tree->_comparator;
+    UShort keySize = _tree->_keySize;
+    UShort lo = 0;
+    UShort hi = getKeysNum();
+
+    // halving [lo, hi) while it is long, the rest is scanned linearly
+    while (hi - lo > _tree->_linearSearchThreshold)
+    {
+        UShort mid = lo + (hi - lo) / 2;
+        if (c->compare(getKey(mid), key, keySize))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    while (lo < hi && c->compare(getKey(lo), key, keySize)) // iterating to the first not less than this key
+        ++lo;
+
+    return lo;
+}
+
+
+UShort BaseBTree::PageWrapper::upperBound(const Byte* key)
+{
+    if (_tree->isCompressed())
+        return compressedBound(key, true);
+
+    if (_tree->_upperBoundFunc && !_tree->isSlotted())
+        return _tree->_upperBoundFunc(_data + KEYS_OFS, getKeysNum(), key,
+            getSlotSize(), _tree->_linearSearchThreshold);
+
+    IComparator* c = _tree->_comparator;
+    UShort keySize = _tree->_keySize;
+    UShort lo = 0;
+    UShort hi = getKeysNum();
+
+    while (hi - lo > _tree->_linearSearchThreshold)
+    {
+        UShort mid = lo + (hi - lo) / 2;
+        if (c->compare(key, getKey(mid), keySize))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    while (lo < hi && !c->compare(key, getKey(lo), keySize)) // iterating to the first bigger than this key
+        ++lo;
+
+    return lo;
+}
+
+
+bool BaseBTree::PageWrapper::searchAll(const Byte* key, IKeyVisitor& visitor, int& count)
+{
+    UShort keyNum = getKeysNum();
+    UShort first = lowerBound(key);
+
+    // all equal keys of the node go in a row; children between them (and around them)
+    // may contain equal keys too, so they are visited in order
+    UShort last = first;
+    while (last < keyNum && _tree->_comparator->isEqual(getKey(last), key, _tree->_keySize))
+        ++last;
+
+    if (isLeaf())
+    {
+        for (UShort offset = first; offset < last; ++offset)
+        {
+            ++count;
+            if (!visitor.visitKey(getKey(offset)))
+                return false;
+        }
+        return true;
+    }
+
+    PageWrapper currentNode(_tree); // creating iterative node
+    for (UShort offset = first; offset <= last; ++offset)
+    {
+        currentNode.readPageFromChild(*this, offset);
+        if (!currentNode.searchAll(key, visitor, count)) // searching in the child
+            return false;
+
+        if (offset < last)
+        {
+            ++count;
+            if (!visitor.visitKey(getKey(offset)))
+                return false;
+        }
+    }
+
+    return true;
 }
 
 
-void BaseBTree::PageWrapper::copyKey(Byte* dst, const Byte* src)
-{
-    memcpy(
-        dst,                        // куда
-        src,                        // откуда
-        _tree->getRecSize());       // размер ключа
-}
 
-void BaseBTree::PageWrapper::copyKeys(Byte* dst, const Byte* src, UShort num)
-{
-    memcpy(
-        dst,                        // куда
-        src,                        // откуда
-        _tree->getRecSize() * num   // размер: размер записи на число элементов
-        );
 
-}
+//==============================================================================
+// class BaseBTree::Cursor
+//==============================================================================
 
-void BaseBTree::PageWrapper::copyCursors(Byte* dst, const Byte* src, UShort num)
+
+BaseBTree::Cursor::Cursor(BaseBTree* tree)
+    : _tree(tree)
+    , _depth(0)
+    , _snapshot(nullptr)
 {
-    memcpy(
-        dst,                        // куда
-        src,                        // откуда
-        num * CURSOR_SZ             // размер
-        );
 }
 
-void BaseBTree::PageWrapper::copyCursor(Byte* dst, const Byte* src)
+
+BaseBTree::Cursor::Cursor(const Snapshot& snapshot)
+    : _tree(snapshot.getTree())
+    , _depth(0)
+    , _snapshot(&snapshot)
 {
-    memcpy(
-            dst,                        // куда
-            src,                        // откуда
-            CURSOR_SZ             // размер
-    );
+    if (!snapshot.isOpen())
+        throw std::logic_error("Snapshot is not open");
 }
 
-UInt BaseBTree::PageWrapper::getCursor(UShort cnum)
-{
-    //if (cnum > getKeysNum())
-    int curOfs = getCursorOfs(cnum);
-    if (curOfs == -1)
-        throw std::invalid_argument("Wrong cursor number");
 
-    return *((const UInt*)(_data + curOfs));
+UInt BaseBTree::Cursor::getRootPageNum() const
+{
+    return _snapshot ? _snapshot->getRootPageNum() : _tree->getRootPageNum();
 }
 
 
-Byte* BaseBTree::PageWrapper::getCursorPtr(UShort cnum)
+BaseBTree::PageWrapper& BaseBTree::Cursor::push(UInt pnum, UShort pos)
 {
-    int curOfs = getCursorOfs(cnum);
-    if (curOfs == -1)
-        throw std::invalid_argument("Wrong cursor number");
+    // wrappers are kept between steps, so a scan allocates page buffers only once per level
+    if (_pages.size() <= _depth)
+    {
+        _pages.push_back(std::unique_ptr<PageWrapper>(new PageWrapper(_tree)));
+        _pages.back()->setSnapshot(_snapshot);
+        _pos.push_back(0);
+    }
 
-    return (_data + curOfs);
+    PageWrapper& pw = *_pages[_depth];
+    pw.readPage(pnum);
+    _pos[_depth++] = pos;
 
+    return pw;
 }
 
-void BaseBTree::PageWrapper::setCursor(UShort cnum, UInt cval)
+
+bool BaseBTree::Cursor::descend(bool right)
 {
-    int curOfs = getCursorOfs(cnum);
-    if (curOfs == -1)
-        throw std::invalid_argument("Wrong cursor number");
+    while (!_pages[_depth - 1]->isLeaf())
+    {
+        PageWrapper& parent = *_pages[_depth - 1];
+        push(parent.getCursor(_pos[_depth - 1]), 0);
+
+        // a non-root node is never empty, so n - 1 is a valid key index
+        PageWrapper& child = *_pages[_depth - 1];
+        UShort n = child.getKeysNum();
+        if (right)
+            _pos[_depth - 1] = child.isLeaf() ? (UShort)(n - 1) : n;
+    }
 
-    *((UInt*)(_data + curOfs)) = cval;
+    return true;
 }
 
 
-int BaseBTree::PageWrapper::getCursorOfs(UShort cnum) const
+bool BaseBTree::Cursor::ascend(bool right)
 {
-    if (cnum > getKeysNum())
-        return -1;
+    // the current leaf is exhausted; an internal entry holds the number of the child we came
+    // from, so the key to the right of it is the key with the same number, to the left -- minus one
+    --_depth;
+    while (_depth)
+    {
+        UShort& c = _pos[_depth - 1];
+        if (right && c < _pages[_depth - 1]->getKeysNum())
+            return true;
+        if (!right && c > 0)
+        {
+            --c;
+            return true;
+        }
 
-    // рассчитываем смещением
-    return _tree->getCursorsOfs() + CURSOR_SZ * cnum;
+        --_depth;
+    }
+
+    return false;
 }
 
-int BaseBTree::PageWrapper::getKeyOfs(UShort num) const
-{
-    if (num >= getKeysNum())
-        return -1;
 
-    // рассчитываем смещение
-    return KEYS_OFS + _tree->getRecSize() * num;
+bool BaseBTree::Cursor::seek(const Byte* k)
+{
+    return seekPath(k) && settle();
 }
 
 
-void BaseBTree::PageWrapper::setAsRoot(bool writeFlag /*= true*/)
+bool BaseBTree::Cursor::seekPath(const Byte* k)
 {
-    _tree->_rootPageNum = _pageNum;         // ид корень по номеру страницы в памяти
+    reset();
+    push(getRootPageNum(), 0);
 
-    if (!writeFlag)
-        return;
+    // always go down to a leaf: with duplicates an equal key may also lie in the left subtree
+    for (;;)
+    {
+        PageWrapper& pw = *_pages[_depth - 1];
+        UShort c = pw.lowerBound(k);
+        _pos[_depth - 1] = c;
 
-    // если же надо записать в файл сразу...
-    if (_pageNum == 0)
-        throw std::runtime_error("Can't set a page as root until allocate a page in a file");
+        if (pw.isLeaf())
+        {
+            if (c < pw.getKeysNum())
+                return true;
+            if (!ascend(true) || !_tree->isBPlus())
+                return _depth != 0;
+
+            // B+ separators are not records, the key is the first one of the next subtree
+            ++_pos[_depth - 1];
+            return descend(false);
+        }
 
-    // если же под страницу есть номер, запишем его в файл
-    _tree->setRootPageNum(_pageNum, true);
+        push(pw.getCursor(c), 0);
+    }
 }
 
 
-
-void BaseBTree::PageWrapper::readPageFromChild(PageWrapper& pw, UShort chNum)
+bool BaseBTree::Cursor::seekFirst()
 {
-    UInt cur = pw.getCursor(chNum);
-    if (cur == 0)
-        throw std::invalid_argument("Cursor does not point to a existing node/page");
-    
-    readPage(cur);
+    reset();
+    PageWrapper& root = push(getRootPageNum(), 0);
+    if (root.getKeysNum() == 0)
+    {
+        reset();                            // empty tree
+        return false;
+    }
+
+    return descend(false) && settle();
 }
 
 
-void BaseBTree::PageWrapper::writePage()
+bool BaseBTree::Cursor::seekLast()
 {
-    if (getPageNum() == 0)
-        throw std::runtime_error("Page number not set. Can't write");
+    reset();
+    PageWrapper& root = push(getRootPageNum(), 0);
+    UShort n = root.getKeysNum();
+    if (n == 0)
+    {
+        reset();
+        return false;
+    }
 
-    _tree->writePage(getPageNum(), _data);
+    _pos[0] = root.isLeaf() ? (UShort)(n - 1) : n;
+    return descend(true) && settle();
 }
 
 
-
-void BaseBTree::PageWrapper::splitChild(UShort iChild)
+bool BaseBTree::Cursor::settle()
 {
-    if (isFull())
-        throw std::domain_error("A parent node is full, so its child can't be splitted");
-
-    if (iChild > getKeysNum())
-        throw std::invalid_argument("Cursor not exists");
-
-    // This method is based on Cormen's realization
-    PageWrapper y(_tree); // left child (in near future)
-    PageWrapper z(_tree); // right child (in near future)
+    // B+ leaves are linked, a cursor in one of them needs nothing above it
+    if (_tree->isBPlus() && _depth > 1)
+    {
+        std::swap(_pages[0], _pages[_depth - 1]);
+        _pos[0] = _pos[_depth - 1];
+        _depth = 1;
+    }
 
-    y.readPageFromChild(*this, iChild); // by now y will contain hole node we want to split
-    z.allocPage(_tree->getOrder() - 1, y.isLeaf()); // real creation of z (future sibling of y)
+    return true;
+}
 
-    for(UShort i = 0; i < _tree->getOrder() - 1; i++) // coping keys after median of y to the sibling z
-        z.copyKey(z.getKey(i), y.getKey(_tree->getOrder() + i));
 
-    if(!y.isLeaf()) // if splitting child is not leaf and has his own children
+bool BaseBTree::Cursor::stepLeaf(bool right)
+{
+    PageWrapper& pw = *_pages[0];
+    UInt pnum = right ? pw.getNextLeaf() : pw.getPrevLeaf();
+    if (!pnum)
     {
-        for (UShort i = 0; i < _tree->getOrder(); i++) // coping child after median of y to the sibling z
-            z.copyCursor(z.getCursorPtr(i), y.getCursorPtr(_tree->getOrder() + i));
+        reset();
+        return false;
     }
 
-    setKeyNum(getKeysNum() + 1); // increasing the number of keys in parent
+    // non-root leaves are never empty
+    pw.readPage(pnum);
+    _pos[0] = right ? 0 : (UShort)(pw.getKeysNum() - 1);
+    return true;
+}
 
-    for(int i = getKeysNum() - 1; i >= iChild + 1; i--) // shifting right part of parent's children to the right
-        copyCursor(getCursorPtr(i + 1), getCursorPtr(i));
 
-    setCursor(iChild + 1, z.getPageNum()); // inserting link to the new child z
+bool BaseBTree::Cursor::next()
+{
+    if (!_depth)
+        return false;
 
-    for(int i = getKeysNum() - 2; i >= iChild; i--) // shifting right part of parent keys to the right
-        copyKey(getKey(i + 1), getKey(i));
+    PageWrapper& pw = *_pages[_depth - 1];
+    UShort& c = _pos[_depth - 1];
 
-    copyKey(getKey(iChild), y.getKey(_tree->getOrder() - 1)); // inserting new key to the parent
-    y.setKeyNum(_tree->getOrder() - 1); // cutting right part of splitting node
+    // the key after an internal key is the leftmost one of its right subtree
+    if (!pw.isLeaf())
+    {
+        ++c;
+        return descend(false);
+    }
 
-    // saving changes to the storage
-    y.writePage();
-    z.writePage();
-    writePage();
+    if (++c < pw.getKeysNum())
+        return true;
+
+    return _tree->isBPlus() ? stepLeaf(true) : ascend(true);
 }
 
 
-void BaseBTree::PageWrapper::insertNonFull(const Byte* k)
+bool BaseBTree::Cursor::prev()
 {
-    if (isFull())
-        throw std::domain_error("Node is full. Can't insert");
+    if (!_depth)
+        return false;
 
-    IComparator* c = _tree->getComparator();
-    if (!c)
-        throw std::runtime_error("Comparator not set. Can't insert");
+    PageWrapper& pw = *_pages[_depth - 1];
+    UShort& c = _pos[_depth - 1];
 
-    // This method is based on Cormen realisation
-    int i = getKeysNum() - 1;
+    // the key before an internal key is the rightmost one of its left subtree (child c)
+    if (!pw.isLeaf())
+        return descend(true);
 
-    if(isLeaf()) // if it's leaf, just simply insert to current node
+    if (c > 0)
     {
-        setKeyNum(getKeysNum() + 1); // increasing number of keys in node
-        while (i >= 0 && c->compare(k, getKey(i), _tree->_recSize)) // shifting right part to the part
-        {
-            copyKey(getKey(i + 1), getKey(i));
-            i--;
-        }
-        copyKey(getKey(i + 1), k); // inserting element
-        writePage(); // saving changes to the store
-        return;
+        --c;
+        return true;
     }
-    // In case it's not a leaf
-    while (i >= 0 && c->compare(k, getKey(i), _tree->_recSize))
-        i--;
 
-    i++; // going to the last element, that fits condition
+    return _tree->isBPlus() ? stepLeaf(false) : ascend(false);
+}
 
-    PageWrapper s(_tree); // creating child (in near future)
-    s.readPageFromChild(*this, i); // loading child from store
 
-    if(s.getKeysNum() == 2 * _tree->getOrder() - 1) // if child is full
-    {
-        splitChild(i); // splitting this child
-        if(c->compare(getKey(i), k, _tree->_recSize)) // researching to what sub tree we should go down
-            s.readPageFromChild(*this, i + 1);
-        else
-            s.readPageFromChild(*this, i);
-    }
+const Byte* BaseBTree::Cursor::getKey() const
+{
+    if (!_depth)
+        return nullptr;
 
-    s.insertNonFull(k); // recursion to the sub tree
+    return _pages[_depth - 1]->getKey(_pos[_depth - 1]);
 }
 
-Byte *BaseBTree::PageWrapper::search(const Byte *key)
+
+const Byte* BaseBTree::Cursor::getValue() const
 {
-    // This method is based on Cormen implementation
-    UShort keyNum = getKeysNum();
+    const Byte* key = getKey();
+    return key ? key + _tree->getKeySize() : nullptr;
+}
 
-    UShort offset = 0; // iterating to the first bigger than this key
-    while (offset < keyNum && _tree->_comparator->compare(getKey(offset), key, _tree->_recSize))
-        ++offset;
 
-    if(offset < keyNum && _tree->_comparator->isEqual(getKey(offset), key, _tree->_recSize))
-    {
-        Byte* retPtr = new Byte();
-        copyKey(retPtr, getKey(offset));
-        return retPtr; // if this key is what we were searched for, simply return it
-    }
 
-    if(!isLeaf()) // if not and it's not a leaf, going down to specified child
-    {
-        PageWrapper currentNode(_tree); // creating iterative node
-        currentNode.readPageFromChild(*this, offset);
-        return currentNode.search(key); // starting searching in the child
-    }
 
-    return nullptr; // if nothing was found
+//==============================================================================
+// class BaseBTree::Snapshot
+//==============================================================================
+
+
+BaseBTree::Snapshot::Snapshot()
+    : _tree(nullptr)
+    , _rootPageNum(0)
+    , _epoch(0)
+{
 }
 
-int BaseBTree::PageWrapper::searchAll(const Byte* key, std::list<Byte*>& keys)
+
+BaseBTree::Snapshot::~Snapshot()
 {
-    UShort keyNum = getKeysNum();
+    release();
+}
 
-    UShort offset = 0; // iterating to the first bigger than this key
-    while (offset < keyNum && _tree->_comparator->compare(getKey(offset), key, _tree->_recSize))
-        ++offset;
 
-    std::set<UShort> offsets; // set of all suitable offsets, where in children can be desired key
-    offsets.insert(offset); // adding default offset to search
-    if(offset > 0) // needed key can be on left part
-        offsets.insert(offset - 1);
+void BaseBTree::Snapshot::release()
+{
+    if (_tree)
+        _tree->releaseSnapshot(this);
+}
 
-    while (offset < keyNum && _tree->_comparator->isEqual(getKey(offset), key, _tree->_recSize))
-    {
-        Byte* retPtr = new Byte();
-        copyKey(retPtr, getKey(offset));
-        keys.push_back(retPtr); // getting all equal keys from the current node
-        offsets.insert(++offset); // adding new possible offset to search
-    }
 
-    if(!isLeaf()) // if not and it's not a leaf, going down to specified child
-    {
-        for (const UShort item : offsets)
-        {
-            PageWrapper currentNode(_tree); // creating iterative node
-            currentNode.readPageFromChild(*this, item);
-            currentNode.searchAll(key, keys); // searching in the child
-        }
-    }
+bool BaseBTree::Snapshot::search(const Byte* k, Byte* dst) const
+{
+    if (!_tree)
+        throw std::logic_error("Snapshot is not open");
+
+    IComparator* c = _tree->getComparator();
+    if (!c)
+        throw std::runtime_error("Comparator not set. Can't search");
+
+    // the cursor finds the first not less key even past stale B+ separators; it reads only
+    // slots of the snapshot, so writers go on meanwhile
+    Cursor cur(*this);
+    if (!cur.seek(k) || !c->isEqual(cur.getKey(), k, _tree->getKeySize()))
+        return false;
 
-    return keys.size(); // returning the number of keys
+    memcpy(dst, cur.getKey(), _tree->getRecLen(cur.getKey()));
+    return true;
 }
 
 
@@ -789,18 +4291,21 @@ int BaseBTree::PageWrapper::searchAll(const Byte* key, std::list<Byte*>& keys)
 
 FileBaseBTree::FileBaseBTree()
     : BaseBTree(0, 0, nullptr, nullptr)
+    , _storageMode(smStream)
+    , _asyncDepth(0)
+    , _walEnabled(false)
 {
 }
 
 
 FileBaseBTree::FileBaseBTree(UShort order, UShort recSize, IComparator* comparator, 
-    const std::string& fileName)
+    const std::string& fileName, PageFormat format, UShort valueSize)
     : FileBaseBTree()
 {
     _comparator = comparator;
 
-    checkTreeParams(order, recSize);
-    createInternal(order, recSize, fileName);
+    checkTreeParams(order, recSize, format, valueSize);
+    createInternal(order, recSize, fileName, format, valueSize);
 }
 
 
@@ -819,38 +4324,33 @@ FileBaseBTree::~FileBaseBTree()
 
 
 void FileBaseBTree::create(UShort order, UShort recSize, //IComparator* comparator,
-    const std::string& fileName)
+    const std::string& fileName, PageFormat format, UShort valueSize)
 {
     if (isOpen())
         throw std::runtime_error("B-tree file is already open");
 
-    checkTreeParams(order, recSize);
-    createInternal(order, recSize, fileName);
+    checkTreeParams(order, recSize, format, valueSize);
+    createInternal(order, recSize, fileName, format, valueSize);
 }
 
 
 void FileBaseBTree::createInternal(UShort order, UShort recSize, // IComparator* comparator,
-    const std::string& fileName)
+    const std::string& fileName, PageFormat format, UShort valueSize)
 {
-    _fileStream.open(fileName, 
-        std::fstream::in | std::fstream::out |      // чтение запись
-        std::fstream::trunc |                       // обязательно грохнуть имеющееся (если вдруг) содержимое
-        std::fstream::binary);                      // бинарничек
-
-    // если открыть не удалось
-    if (_fileStream.fail())
-    {
-        // пытаемся закрыть и уходим
-        _fileStream.close();
-        throw std::runtime_error("Can't open file for writing");
-    }
+    openStorage(fileName, true);                    // обязательно грохнуть имеющееся содержимое
 
     // если же все ок, сохраняем параметры и двигаемся дальше
     //_comparator = comparator;
     _fileName = fileName;
-    _stream = &_fileStream;                         // привязываем к потоку
 
-    createTree(order, recSize);                     // в базовом дереве
+    try {
+        createTree(order, recSize, format, valueSize);  // в базовом дереве
+    }
+    catch (...)
+    {
+        closeStorage(0);
+        throw;
+    }
 }
 
 
@@ -865,69 +4365,215 @@ void FileBaseBTree::open(const std::string& fileName) //, IComparator* comparato
 
 void FileBaseBTree::loadInternal(const std::string& fileName) // , IComparator* comparator)
 {
-    _fileStream.open(fileName,
-        std::fstream::in | std::fstream::out |      // чтение запись
-                                                    //  здесь не должно быть trunc, чтобы сущ. не убить
-        std::fstream::binary);                      // бинарничек
-
-    // если открыть не удалось
-    if (_fileStream.fail())
-    {
-        // пытаемся закрыть и уходим
-        _fileStream.close();
-        throw std::runtime_error("Can't open file for reading");
-    }
+    openStorage(fileName, false);   // здесь не должно быть trunc, чтобы сущ. не убить
 
     // если же все ок, сохраняем параметры и двигаемся дальше
     //_comparator = comparator;
     _fileName = fileName;
-    _stream = &_fileStream;         // привязываем к потоку
 
 
+    // the file is not ours, so it is left as it was
     try {
         loadTree();
     }
-    catch (std::exception& e)
+    catch (std::exception&)
     {
-        _fileStream.close();
-        throw e;
+        closeStorage(_mappedFile.getOpenSize());
+        throw;                      // as it is, not sliced to std::exception
     }
     catch (...)                     // для левых исключений
     {
-        _fileStream.close();
+        closeStorage(_mappedFile.getOpenSize());
         throw std::runtime_error("Error when loading btree");
     }
 }
 
 
+void FileBaseBTree::openStorage(const std::string& fileName, bool trunc)
+{
+    if (_walEnabled && _storageMode == smMapped)
+        throw std::logic_error("Write-ahead log is not supported for mapped storage");
+    if (_cowEnabled && (_walEnabled || _storageMode == smMapped))
+        throw std::logic_error("Copy-on-write mode is not supported for mapped storage or with a log");
+
+    switch (_storageMode)
+    {
+    case smPosix:
+        _posixIO.open(fileName, trunc);             // кидает сама, если не открылся
+        _io = &_posixIO;
+        break;
+
+    case smMapped:
+        _mappedFile.open(fileName, trunc);
+        _io = &_mappedFile;
+        break;
+
+    default:
+        std::ios_base::openmode mode = 
+            std::fstream::in | std::fstream::out |  // чтение запись
+            std::fstream::binary;                   // бинарничек
+        if (trunc)
+            mode |= std::fstream::trunc;
+
+        _fileStream.open(fileName, mode);
+
+        // если открыть не удалось
+        if (_fileStream.fail())
+        {
+            // пытаемся закрыть и уходим
+            _fileStream.close();
+            throw std::runtime_error(trunc ? "Can't open file for writing" : "Can't open file for reading");
+        }
+
+        _streamIO.setStream(&_fileStream);          // привязываем к потоку
+        _io = &_streamIO;
+
+#ifndef _WIN32
+        // the stream has no fsync, the checkpoints and the log are durable through a descriptor
+        _posixIO.open(fileName, false);
+        _streamIO.setSyncFile(&_posixIO);
+#endif
+    }
+
+    // the log left by a crash is replayed before anything is read, a new file drops it
+    std::string logName = fileName + ".wal";
+    try {
+        if (trunc)
+            std::remove(logName.c_str());
+        else
+            WalPageIO::recover(logName, _io);
+
+        if (_walEnabled)
+        {
+            _walIO.open(logName, _io);
+            _io = &_walIO;
+        }
+
+        // io_uring reads the file itself, so it can't see what the log still keeps
+        if (_asyncDepth && _storageMode != smMapped)
+        {
+            if (_io == &_posixIO && _uringIO.open(_posixIO.getFd(), _asyncDepth))
+                _asyncIO = &_uringIO;
+            else
+            {
+                _poolIO.open(_io, _asyncDepth);
+                _asyncIO = &_poolIO;
+            }
+        }
+    }
+    catch (...)
+    {
+        closeStorage(_mappedFile.getOpenSize());
+        throw;
+    }
+}
+
+
+void FileBaseBTree::closeStorage(size_t mappedSize)
+{
+    detachWorkPages();              // work pages could look into the mapping
+
+    _uringIO.close();               // reads in flight are waited for
+    _poolIO.close();
+    _asyncIO = nullptr;
+    _walIO.close();                 // puts everything logged to the file before it is closed
+    _posixIO.close();
+    _mappedFile.close(mappedSize);
+    _fileStream.close();
+    _streamIO.setStream(nullptr);
+    _streamIO.setSyncFile(nullptr);
+
+    _io = nullptr;
+}
+
+
 void FileBaseBTree::close()
 {
     if (!isOpen())
         return;
 
+    TreeLatchGuard tree(_treeLatch, true);
     closeInternal();
 }
 
 
 void FileBaseBTree::closeInternal()
 {
-    // NOTE: возможно, перед закрытием надо что-то записать в файл? — иметь в виду!
-    _fileStream.close();
+    checkpoint();
+
+    // the mapping grows with a margin, so the file is cut to its real size
+    closeStorage(getSlotOfs(getLastSlotNum() + 1));
 
     // переводим объект в состояние сконструированного БЕЗ параметров
     resetBTree();
 }
 
-void FileBaseBTree::checkTreeParams(UShort order, UShort recSize)
+void FileBaseBTree::checkTreeParams(UShort order, UShort recSize, PageFormat format, UShort valueSize)
 {
     if (order < 1 || recSize == 0)
         throw std::invalid_argument("B-tree order can't be less than 1 and record siaze can't be 0");
 
+    if (format > pfBLink)
+        throw std::invalid_argument("Unknown page format");
+
+    if (format != pfBTree && order < 2)
+        throw std::invalid_argument("B+-tree order can't be less than 2");
+
+    if ((format == pfSlotted || format == pfCompressed) && (recSize <= VAR_LEN_SZ || valueSize != 0))
+        throw std::invalid_argument("Slotted pages need a record longer than its length field and no value");
+
+    if (valueSize >= recSize)
+        throw std::invalid_argument("Value size must leave a non-empty key in the record");
+
+}
+
+void FileBaseBTree::setStorageMode(StorageMode mode)
+{
+    if (isOpen())
+        throw std::runtime_error("Can't change the storage mode of an open B-tree");
+
+    _storageMode = mode;
+}
+
+
+void FileBaseBTree::setMappedReserve(size_t reserve)
+{
+    if (isOpen())
+        throw std::runtime_error("Can't change the mapping reserve of an open B-tree");
+
+    _mappedFile.setReserve(reserve);
+}
+
+
+void FileBaseBTree::setWalEnabled(bool enabled)
+{
+    if (isOpen())
+        throw std::runtime_error("Can't change the write-ahead log mode of an open B-tree");
+
+    _walEnabled = enabled;
+}
+
+
+void FileBaseBTree::setAsyncDepth(UInt depth)
+{
+    if (isOpen())
+        throw std::runtime_error("Can't change the asynchronous reads of an open B-tree");
+
+    _asyncDepth = depth;
+}
+
+
+void FileBaseBTree::sync()
+{
+    TreeLatchGuard tree(_treeLatch, true);
+    checkForOpenStream();
+    checkpoint();
 }
 
+
 bool FileBaseBTree::isOpen() const
 {
-    return (_fileStream.is_open()); // && _fileStream.good());
+    return (_io && _io->isOpen()); // && _fileStream.good());
 }
 
 
@@ -20,8 +20,19 @@
 #include <string>
 #include <fstream>
 #include <list>
+#include <memory>
+#include <set>
+#include <vector>
+#include <atomic>
+#include <mutex>
 
 #include "utils.h"
+#include "latch.h"
+#include "page_cache.h"
+#include "page_io.h"
+#include "async_io.h"
+#include "mapped_file.h"
+#include "wal.h"
 
 
 
@@ -41,14 +52,83 @@ namespace xi {
  *  как нетипизированная, то есть массив байт размер \c _recSize. Для типизации необходимо
  *  наследовать этот класс и в производном осуществлять приведение к нужному типу.
  *
+ *  Запись состоит из ключа (первые getKeySize() байт) и значения (последние getValueSize()
+ *  байт, по умолчанию 0). Компаратор сравнивает только ключи, а во внутренних узлах
+ *  B+-дерева хранятся одни ключи, поэтому их помещается больше (см. getInnerMaxKeys()).
+ *
+ *  В формате pfSlotted записи имеют переменную длину: запись начинается с поля длины
+ *  (VAR_LEN_SZ байт), за которым идут сами байты, а getRecSize() — лишь ее максимум.
+ *  Узел хранит каталог смещений (слотов) и кучу записей, растущую от конца страницы,
+ *  поэтому заполненность узла определяется байтами, а не числом ключей.
+ *
+ *  Формат pfCompressed дополнительно хранит в каждой странице границы (fence keys) ее
+ *  диапазона ключей и не хранит их общий префикс в записях, а разделители во внутренних
+ *  узлах укорачивает до кратчайшего префикса, отделяющего соседей. Для этого записи
+ *  должны быть упорядочены лексикографически по байтам после поля длины (более короткий
+ *  префикс — меньше), как в BTreeStringTraits.
+ *
+ *  В формате pfBLink каждая страница в конце хранит ссылку на правого соседа по уровню
+ *  (для листа это ссылка на следующий лист), свой уровень и верхний ключ — разделитель,
+ *  за которым начинается сосед; у крайней правой страницы уровня ссылки нет, а верхний
+ *  ключ — бесконечность. Поэтому вставка делит полную страницу сама, не держа родителя,
+ *  и лишь потом сообщает родителю разделитель, а поиск, попавший на страницу, ключ которого
+ *  оказался больше ее верхнего ключа, идет по правой ссылке (см. insertBLink()).
+ *
  *  Страницы везде нумеруются с 1-цы, а 0 — несуществующая страница (nullptr).
+ *
+ *  Весь ввод-вывод (заголовок и страницы) выполняется через интерфейс IPageIO по абсолютным
+ *  смещениям, конкретное хранилище (поток, pread/pwrite, отображение в память) задается
+ *  наследником. Наследник может добавить и механизм асинхронного чтения (IAsyncPageIO),
+ *  через который searchAsync() держит в полете чтения страниц многих поисков сразу.
+ *
+ *  Между страницами-обертками и хранилищем находится буферный пул BaseBTree::_cache:
+ *  все чтения страниц сначала ищутся в нем, а записанные страницы только помечаются в нем
+ *  грязными (write-back) и попадают в хранилище в порядке номеров при вытеснении, сбросе
+ *  (FileBaseBTree::sync()) или закрытии дерева. Без пула страницы пишутся сразу.
+ *
+ *  В режиме копирования при записи (setCowEnabled()) номер страницы — логический: таблица
+ *  страниц сопоставляет ему номер физического места (слота) в файле. Страница, которую
+ *  уже может видеть снимок (Snapshot) или записанная контрольная точка, не перезаписывается,
+ *  а пишется в свободный слот; новая таблица записывается на контрольной точке в свободные
+ *  слоты и публикуется вместе со слотом заголовка. Поэтому файл после сбоя всегда содержит
+ *  дерево последней контрольной точки, а снимки видят дерево на момент своего открытия,
+ *  пока в него продолжается запись.
+ *
+ *  Вставки и поиски (insert(), search(), getValue()) можно выполнять из нескольких потоков
+ *  одновременно: спуск идет со сцеплением защелок страниц (latch coupling) — защелка
+ *  ребенка захватывается до освобождения защелки родителя, а вставка отпускает родителя,
+ *  как только ребенок гарантированно не делится (он неполон или уже разделен заранее,
+ *  сверху вниз). Остальные операции, а в режиме копирования при записи
+ *  и вставки, захватывают дерево целиком (см. isConcurrent()). find(), findValue() и Cursor
+ *  смотрят в общие рабочие страницы или держат страницы между вызовами, поэтому
+ *  параллельно с изменениями дерева не используются.
+ *
+ *  В режиме оптимистичного чтения (setOptimisticReads()) поиски не захватывают защелок
+ *  вовсе: страница копируется в буфер поиска, после чего версии ее защелки и защелки
+ *  страницы, из которой к ней пришли, проверяются на отсутствие писателей за это время.
+ *  При конфликте поиск начинается заново, а после нескольких неудач идет с защелками.
  */
-class BaseBTree {
+class BaseBTree : protected IPageStore {
 public:
 
     //static const char* SIGN; // = "XIBT";
     //static const Byte SIGN_SIZE = 4;
 
+    /** \brief Формат страниц дерева. Задается при создании и хранится в заголовке файла. */
+    enum PageFormat
+    {
+        pfBTree = 0,            ///< Классическое B-дерево: записи во всех узлах.
+        pfBPlusTree = 1,        ///< B+-дерево: записи только в листьях, во внутренних узлах —
+                                ///< разделители, листья связаны в двусвязный список.
+        pfSlotted = 2,          ///< B+-дерево со страницами со слотами под записи переменной
+                                ///< длины, заполненность которых считается в байтах.
+        pfCompressed = 3,       ///< pfSlotted со сжатием общих префиксов в страницах и
+                                ///< укороченными разделителями.
+        pfBLink = 4             ///< B+-дерево, страницы которого хранят еще верхний ключ и
+                                ///< ссылку на правого соседа (B-link). Удаление не
+                                ///< поддерживается (см. remove()).
+    };
+
 #pragma pack(push, 1)                           
     /** \brief Структура заголовка файла. 
      *
@@ -57,20 +137,26 @@ public:
      *  https://gcc.gnu.org/onlinedocs/gcc/Structure-Layout-Pragmas.html
      */
     struct Header {
-        static const UInt VALID_SIGN = 0x54424958;  ///< правильная сигнатура
+        static const UInt VALID_SIGN = 0x32424958;  ///< правильная сигнатура
+        static const UInt LEGACY_SIGN = 0x54424958; ///< сигнатура файлов без номера версии
+        static const UShort FORMAT_VERSION = 1;     ///< версия формата файла
     public:
-        Header() : order(0), recSize(0), sign(0) {}
-        Header(UShort ord, UShort rs) : 
-            order(ord), recSize(rs), sign(VALID_SIGN)
+        Header() : sign(0), version(0), order(0), recSize(0), format(pfBTree), valueSize(0) {}
+        Header(UShort ord, UShort rs, UShort fmt, UShort vs) : 
+            sign(VALID_SIGN), version(FORMAT_VERSION), order(ord), recSize(rs), format(fmt),
+            valueSize(vs)
         {
         }
     public:
         /** \brief Проверяет структуру на целостность и возвращает истину, если все ок.*/
         bool checkIntegrity();
     public:
-        UInt sign;  // = 0x54424958;       // сигнатура
+        UInt sign;  // = 0x32424958;       // сигнатура
+        UShort version;     // версия формата: заголовок, слоты и страницы меняются вместе с ней
         UShort order;
         UShort recSize;
+        UShort format;      // PageFormat
+        UShort valueSize;   // длина значения в конце записи, ключ — recSize - valueSize
     }; // struct Header
 #pragma pack(pop)
 
@@ -80,24 +166,48 @@ public:
     /** \brief Размер структуры заголовка известен уже на этапе компиляции. */
     static const Byte HEADER_SIZE = sizeof(Header);
     
-    /** \brief Смещение для поля записи номера текущей свободной страницы (оно же — число страниц). */
-    static const UInt PAGE_COUNTER_OFS = HEADER_SIZE;
-    
-    /** \brief Размер поля записи номера текущей свободной страницы. */
-    static const UInt PAGE_COUNTER_SZ = 4;
+#pragma pack(push, 1)
+    /** \brief Слот изменяемой части заголовка.
+     *
+     *  Заголовок хранит два слота и на каждой контрольной точке перезаписывает тот, что
+     *  старше, поэтому оборванная сбоем запись портит только его, а действующим при открытии
+     *  считается целый слот с большим номером.
+     */
+    struct MetaSlot {
+    public:
+        MetaSlot() : seq(0), lastPageNum(0), rootPageNum(0), freePageNum(0), pageTableNum(0),
+            lastSlotNum(0), checksum(0) {}
 
-    /** \brief Размер одного курсора (номера страницы). */
-    static const UInt CURSOR_SZ = 4;
+        /** \brief Возвращает контрольную сумму (FNV-1a) всех полей, кроме нее самой. */
+        UInt calcChecksum() const;
 
+        /** \brief Проверяет слот на целостность и возвращает истину, если все ок.*/
+        bool checkIntegrity() const { return seq != 0 && checksum == calcChecksum(); }
+    public:
+        UInt seq;           // номер контрольной точки, 0 — слот не записывался
+        UInt lastPageNum;   // номер последней страницы (оно же — число страниц)
+        UInt rootPageNum;   // номер корневой страницы
+        UInt freePageNum;   // голова списка свободных страниц
+        UInt pageTableNum;  // первый слот таблицы страниц, 0 — страницы лежат в слотах со своими номерами
+        UInt lastSlotNum;   // номер последнего слота (оно же — число слотов)
+        UInt checksum;
+    }; // struct MetaSlot
+#pragma pack(pop)
 
-    /** \brief Смещение для поля записи номера корневой страницы. */
-    static const UInt ROOT_PAGE_NUM_OFS = PAGE_COUNTER_OFS + PAGE_COUNTER_SZ; //HEADER_SIZE;
+    /** \brief Смещение двух слотов изменяемой части заголовка. */
+    static const UInt META_SLOTS_OFS = HEADER_SIZE;
 
-    /** \brief Размер поля записи номера корневой страницы. */
-    static const UInt ROOT_PAGE_NUM_SZ = CURSOR_SZ; // 4;
+    /** \brief Размер слота изменяемой части заголовка. */
+    static const UInt META_SLOT_SZ = sizeof(MetaSlot);
+
+    /** \brief Размер одного курсора (номера страницы). */
+    static const UInt CURSOR_SZ = 4;
 
     /** \brief Смещение первой реальной страницы. */
-    static const UInt FIRST_PAGE_OFS = ROOT_PAGE_NUM_OFS + ROOT_PAGE_NUM_SZ;//PAGE_COUNTER_OFS + PAGE_COUNTER_SZ;
+    static const UInt FIRST_PAGE_OFS = META_SLOTS_OFS + 2 * META_SLOT_SZ;
+
+    /** \brief Наибольший размер файла: смещения в нем должны помещаться в off_t. */
+    static const ULong MAX_FILE_SIZE = 0x7FFFFFFFFFFFFFFFull;
 
     /** \brief Смещение поля информации об узле/странице. */
     static const UInt NODE_INFO_OFS = 0;
@@ -114,6 +224,51 @@ public:
     /** \brief Маска (поз.) для выделения флага, что нод — листовой. */
     static const UShort LEAF_NODE_MASK = 0x8000;
 
+    /** \brief Емкость буферного пула (в страницах) по умолчанию. */
+    static const UInt DEFAULT_CACHE_CAPACITY = 64;
+
+    /** \brief Число попыток оптимистичного поиска, после которого он идет с защелками. */
+    static const UInt OPTIMISTIC_ATTEMPTS = 8;
+
+    /** \brief Через сколько дописанных страниц массовая загрузка с журналом закрывает группу. */
+    static const UInt BULK_COMMIT_PAGES = 1024;
+
+    /** \brief Размер поля длины в начале записи переменной длины (формат pfSlotted). */
+    static const UShort VAR_LEN_SZ = 2;
+
+    /** \brief Размер слота — смещения записи в каталоге страницы формата pfSlotted. */
+    static const UInt SLOT_SZ = 2;
+
+    /** \brief Смещение начала кучи записей (0 — конец страницы) в странице формата pfSlotted. */
+    static const UInt HEAP_TOP_OFS = NODE_INFO_SZ;
+
+    /** \brief Смещение курсоров страницы формата pfSlotted: курсора 0 внутреннего узла или
+     *  ссылок на соседние листья. Остальные курсоры хранятся перед записями в куче.
+     */
+    static const UInt SLOTTED_CURSORS_OFS = HEAP_TOP_OFS + 2;
+
+    /** \brief Смещение каталога слотов в странице формата pfSlotted. */
+    static const UInt SLOTS_OFS = SLOTTED_CURSORS_OFS + 2 * CURSOR_SZ;
+
+    /** \brief Смещение длины общего префикса записей в странице формата pfCompressed. */
+    static const UInt PREFIX_LEN_OFS = SLOTS_OFS;
+
+    /** \brief Смещение маски границ диапазона страницы формата pfCompressed: бит 0 —
+     *  есть нижняя граница, бит 1 — верхняя. Отсутствующая граница — бесконечность.
+     */
+    static const UInt FENCE_MASK_OFS = PREFIX_LEN_OFS + 2;
+
+    /** \brief Смещение нижней границы (записи) в странице формата pfCompressed, за ней —
+     *  верхняя граница, затем каталог слотов (по getRecSize() байт на границу).
+     */
+    static const UInt FENCES_OFS = FENCE_MASK_OFS + 2;
+
+    /** \brief Размер поля уровня страницы (0 — лист) в странице формата pfBLink. */
+    static const UInt LEVEL_SZ = 2;
+
+    /** \brief Длина участка ключей, ниже которой поиск внутри узла ведется линейно, по умолчанию. */
+    static const UShort DEFAULT_LINEAR_SEARCH_THRESHOLD = 8;
+
     ///** \brief Маска (нег.) для выделения флага, что нод — листовой. */
     //static const UShort LEAF_NODE_NMASK = ~LEAF_NODE_PMASK;
 
@@ -125,6 +280,33 @@ public:
     //    nLeaf                   ///< Лист, нулевые курсоры на детей.
     //};
 
+    class IKeyVisitor;
+
+    /** \brief Ядро поиска внутри узла: для массива из \c keysNum ключей, идущих с шагом
+     *  \c recSize (длина ячейки ключа в узле, см. PageWrapper::getSlotSize()) с начала \c keys,
+     *  возвращает номер первого ключа, не меньшего (для lower bound)
+     *  или большего (для upper bound) ключа \c key. Участки короче \c linearThreshold
+     *  просматриваются линейно.
+     *
+     *  Позволяет адаптерам, знающим тип ключа на этапе компиляции, искать внутри узла без
+     *  виртуального вызова IComparator::compare() на каждое сравнение.
+     */
+    typedef UShort (*KeyBoundFunc)(const Byte* keys, UShort keysNum, const Byte* key,
+        UShort recSize, UShort linearThreshold);
+
+    /** \brief Таблица страниц режима копирования при записи: номер слота для каждого
+     *  логического номера страницы (элемент 0 не используется).
+     */
+    typedef std::vector<UInt> PageMap;
+
+    /** \brief Образ страницы снимка. Слот, из которого он прочитан, до закрытия снимка
+     *  не перезаписывается, поэтому образ не меняется, и читатели держат его, пока смотрят
+     *  в страницу.
+     */
+    typedef std::shared_ptr<const std::vector<Byte> > PageFrame;
+
+    class Snapshot;
+
     /** \brief Структура-обертка над сырым (raw) массивом байт.
      *
      *  Предоставляет удобный интерфейс для доступа к индивидуальным значениям страницы/ключа.
@@ -138,6 +320,22 @@ public:
         /** \brief Перераспределяет память под рабочую страницу/узел. */
         void reallocData(UInt sz);
 
+        /** \brief Привязывает врапер к внешней памяти \c data (например, к странице внутри
+         *  отображения файла в память) вместо собственного буфера. Собственный буфер
+         *  при этом сохраняется.
+         */
+        void attachData(Byte* data) { _data = data; }
+
+        /** \brief Возвращает врапер к работе с собственным буфером. */
+        void detachData()
+        {
+            _data = _ownData;
+            _frame.reset();
+        }
+
+        /** \brief Возвращает истину, если врапер работает с внешней памятью. */
+        bool isAttached() const { return _data != _ownData; }
+
         /** \brief Обнуляет массив данных. */
         void clear();
 
@@ -174,16 +372,111 @@ public:
         /** \brief Возвращает истину, если нод — листовой, ложь иначе. */
         bool isLeaf() const;
 
-        /** \brief Для заданного ключа \c k ищет первое его вхождение в поддерево (включая текущую вершину) по принципу эквивалентности.
-         *  Если ключ найден, возвращает указатель на подлежащий массив, иначе nullptr. */
-        Byte* search(const Byte* key);
+        /** \brief Возвращает истину, если узел — внутренний узел B+-дерева, хранящий только
+         *  ключи записей. Размеры и ограничения такого узла берутся из getInner...() дерева.
+         */
+        bool isInner() const { return _tree->isBPlus() && !isLeaf(); }
+
+        /** \brief Возвращает длину ячейки ключа в узле: запись целиком или только ключ.
+         *  Для страниц со слотами это максимальная длина записи.
+         */
+        UShort getSlotSize() const { return isInner() ? _tree->_keySize : _tree->_recSize; }
+
+        /** \brief Возвращает порядок узла. */
+        UShort getNodeOrder() const { return isInner() ? _tree->_innerOrder : _tree->_order; }
+
+        /** \brief Возвращает максимальное число ключей в узле. */
+        UInt getMaxKeysNum() const { return isInner() ? _tree->_innerMaxKeys : _tree->_maxKeys; }
+
+        /** \brief Возвращает минимальное число ключей в некорневом узле. */
+        UInt getMinKeysNum() const { return isInner() ? _tree->_innerMinKeys : _tree->_minKeys; }
+
+        /** \brief Возвращает истину, если некорневому узлу не хватает ключей.
+         *
+         *  Заполненность страницы со слотами считается в байтах: она недозаполнена, если
+         *  пуста или занята элементами меньше чем на четверть.
+         */
+        bool isUnderfull() const
+        {
+            if (_tree->isSlotted())
+                return getKeysNum() == 0 || 4 * (_tree->_keysSize - getFreeSpace()) < _tree->_keysSize;
+            return getKeysNum() < getMinKeysNum();
+        }
+
+        /** \brief Возвращает смещение области курсоров в узле. */
+        UInt getNodeCursorsOfs() const { return isInner() ? _tree->_innerCursorsOfs : _tree->_cursorsOfs; }
+
+        /** \brief Для листа B+-дерева возвращает номер следующего по порядку листа или 0.
+         *
+         *  Листьям курсоры на детей не нужны, поэтому ссылки на соседей хранятся в
+         *  первых двух курсорах области курсоров (независимо от числа ключей).
+         */
+        UInt getNextLeaf() const { return *((const UInt*)(_data + _tree->getCursorsOfs() + CURSOR_SZ)); }
+
+        /** \brief Задает номер следующего листа \c pnum (см. getNextLeaf()). */
+        void setNextLeaf(UInt pnum) { *((UInt*)(_data + _tree->getCursorsOfs() + CURSOR_SZ)) = pnum; }
+
+        /** \brief Для листа B+-дерева возвращает номер предыдущего по порядку листа или 0. */
+        UInt getPrevLeaf() const { return *((const UInt*)(_data + _tree->getCursorsOfs())); }
+
+        /** \brief Задает номер предыдущего листа \c pnum (см. getPrevLeaf()). */
+        void setPrevLeaf(UInt pnum) { *((UInt*)(_data + _tree->getCursorsOfs())) = pnum; }
+
+        /** \brief Для страницы формата pfBLink возвращает номер правого соседа по уровню или 0.
+         *
+         *  У листа это следующий лист, у внутреннего узла ссылка хранится в конце страницы.
+         */
+        UInt getRightLink() const
+        {
+            return isLeaf() ? getNextLeaf() : *((const UInt*)(_data + _tree->_linkOfs));
+        }
+
+        /** \brief Задает номер правого соседа внутреннего узла \c pnum (см. getRightLink()). */
+        void setRightLink(UInt pnum) { *((UInt*)(_data + _tree->_linkOfs)) = pnum; }
+
+        /** \brief Для страницы формата pfBLink возвращает ее верхний ключ или nullptr
+         *  (бесконечность), если у нее нет правого соседа.
+         */
+        const Byte* getHighKey() const
+        {
+            return getRightLink() ? _data + _tree->_linkOfs + CURSOR_SZ + LEVEL_SZ : nullptr;
+        }
+
+        /** \brief Задает верхний ключ страницы формата pfBLink (getKeySize() байт из \c key). */
+        void setHighKey(const Byte* key);
+
+        /** \brief Возвращает уровень страницы формата pfBLink: 0 — лист, у родителя на 1 больше. */
+        UShort getLevel() const { return *((const UShort*)(_data + _tree->_linkOfs + CURSOR_SZ)); }
+
+        /** \brief Задает уровень страницы формата pfBLink \c level (см. getLevel()). */
+        void setLevel(UShort level) { *((UShort*)(_data + _tree->_linkOfs + CURSOR_SZ)) = level; }
+
+        /** \brief Возвращает истину, если ключ \c k лежит правее страницы формата pfBLink:
+         *  больше ее верхнего ключа или, если \c upper, не меньше его — так вставка кладет
+         *  равный разделителю ключ в правую половину. Для других форматов — всегда ложь.
+         */
+        bool isBeyond(const Byte* k, bool upper = false) const;
+
+        /** \brief Возвращает номер первого ключа страницы, не меньшего \c key, или число ключей,
+         *  если такого нет.
+         *
+         *  Используется двоичный поиск, который на участках короче
+         *  BaseBTree::getLinearSearchThreshold() ключей заканчивается линейным.
+         */
+        UShort lowerBound(const Byte* key);
+
+        /** \brief Возвращает номер первого ключа страницы, большего \c key, или число ключей,
+         *  если такого нет. Поиск ведется так же, как в lowerBound().
+         */
+        UShort upperBound(const Byte* key);
 
         /** \brief Для заданного ключа \c k ищет все его его вхождения в поддерево (включая текущую вершину) по принципу эквивалентности.
-        *  Каждый найденный ключ добавляется в переданный список ключей \c keys.
-        *
-        *  \returns число найденных элементов
-        */
-        int searchAll(const Byte* key, std::list<Byte*>& keys);
+         *  Каждый найденный ключ передается посетителю \c visitor, \c count увеличивается
+         *  на число найденных ключей.
+         *
+         *  \returns ложь, если посетитель прервал поиск.
+         */
+        bool searchAll(const Byte* key, IKeyVisitor& visitor, int& count);
 
 
         /** \brief Возвращает указатель на массив сырых данных с возможностью записи. */
@@ -196,12 +489,18 @@ public:
          *
          *  Нумерация ключей — с нуля!!
          *  Если такого ключа нет, возвращает nullptr.
+         *
+         *  Запись сжатой страницы собирается из префикса и хранимого остатка в буфер врапера
+         *  (запись через указатель страницу не меняет), указатель действителен до второго
+         *  следующего вызова getKey() этого врапера.
          */
         Byte* getKey(UShort num);
 
         /** \brief Копирует значение ключа в адрес \c dst из адреса \c src. 
          *
          *  Ключи могут принадлежать разным страницам, но размер страницы берется из текущей.
+         *  Копируется getSlotSize() байт, поэтому из записи листа во внутренний узел B+-дерева
+         *  попадает только ключ.
          */
         inline void copyKey(Byte* dst, const Byte* src);
 
@@ -263,14 +562,67 @@ public:
 
         /** \brief Устанавливает данную страницу в дереве в качестве корневой. 
          *
-         *  Флаг \c writeFlag определяет, нужно ли записать номер корневой страницы сразу в файл.
+         *  Флаг \c writeFlag определяет, нужно ли записать номер корневой страницы в заголовок
+         *  файла (на ближайшей контрольной точке).
          *  Для (writeFlag), если под врапер не распределена страница в файле, будет 
          *  сформирована исключительная ситуация.
          */
         void setAsRoot(bool writeFlag = true);
 
-        /** \brief Возвращает истину, если узел заполнен по максимуму. */
-        bool isFull() const { return getKeysNum() == _tree->getMaxKeys(); };
+        /** \brief Возвращает истину, если узел заполнен по максимуму.
+         *
+         *  Страница со слотами заполнена, если в нее может не поместиться еще одна запись
+         *  максимальной длины вместе с курсором и слотом.
+         */
+        bool isFull() const
+        {
+            if (_tree->isSlotted())
+                return getFreeSpace() < SLOT_SZ + CURSOR_SZ + _tree->_recSize;
+            return getKeysNum() == getMaxKeysNum();
+        }
+
+        //----<Страницы со слотами (формат pfSlotted)>----
+
+        /** \brief Возвращает смещение элемента номер \c num в куче: для внутреннего узла элемент —
+         *  курсор номер <tt>num + 1</tt> и следующая за ним запись, для листа — только запись.
+         */
+        UShort getEntryOfs(UShort num) const { return ((const UShort*)(_data + _tree->_slotsOfs))[num]; }
+
+        /** \brief Возвращает длину элемента номер \c num в куче (без слота). */
+        UInt getEntrySize(UShort num) const;
+
+        /** \brief Возвращает смещение начала кучи. */
+        UInt getHeapTop() const;
+
+        /** \brief Возвращает число свободных байт страницы, включая дыры в куче. */
+        UInt getFreeSpace() const;
+
+        /** \brief Вставляет элемент из записи \c rec (и курсора \c child на правого ребенка для
+         *  внутреннего узла) под номером \c num, при нехватке непрерывного места уплотняя кучу.
+         *
+         *  Запись не может лежать в той же странице. Если места нет, кидает std::domain_error.
+         */
+        void insertEntry(UShort num, const Byte* rec, UInt child);
+
+        /** \brief Переписывает элементы в конец страницы без дыр, оставшихся от усеченных. */
+        void compactHeap();
+
+        /** \brief Возвращает длину общего префикса записей сжатой страницы (без поля длины). */
+        UShort getPrefixLen() const { return *((const UShort*)(_data + PREFIX_LEN_OFS)); }
+
+        /** \brief Возвращает нижнюю границу диапазона сжатой страницы или nullptr. */
+        const Byte* getLowFence() const;
+
+        /** \brief Возвращает верхнюю границу диапазона сжатой страницы или nullptr. */
+        const Byte* getHighFence() const;
+
+        /** \brief Задает границы диапазона сжатой страницы \c low и \c high (nullptr —
+         *  бесконечность) и пережимает ее записи под их общий префикс.
+         *
+         *  Все записи страницы должны лежать в новом диапазоне. Границы не могут лежать
+         *  в той же странице.
+         */
+        void setFences(const Byte* low, const Byte* high);
 
     public:
         //----<Прокси методы для работы со страницами и IO>----
@@ -299,10 +651,60 @@ public:
          */
         void readPage(UInt pnum)
         {
+            // in the memory-mapped mode the wrapper looks directly into the mapping
+            Byte* mp = _tree->mapPage(pnum);
+            if (mp)
+                attachData(mp);
+            else
+            {
+                detachData();
+                if (_snapshot)
+                {
+                    // the frame is never changed, so the wrapper looks into it while holding it
+                    _frame = _tree->readSnapshotPage(*_snapshot, pnum);
+                    attachData(const_cast<Byte*>(_frame->data()));
+                }
+                else
+                    _tree->readPage(pnum, _data);
+            }
+            _pageNum = pnum;
+        }
+
+        /** \brief Копирует страницу номер \c pnum в собственную память врепера, даже если файл
+         *  отображен в память: копию можно читать, пока оригинал меняют другие потоки.
+         */
+        void readPageCopy(UInt pnum)
+        {
+            detachData();
             _tree->readPage(pnum, _data);
             _pageNum = pnum;
         }
 
+        /** \brief Отводит под страницу номер \c pnum собственную память врепера и возвращает
+         *  указатель на нее: страницу туда читает сам вызывающий (например, асинхронно).
+         */
+        Byte* prepareRead(UInt pnum)
+        {
+            detachData();
+            _pageNum = pnum;
+            return _data;
+        }
+
+        /** \brief Задает снимок, страницы которого далее читает readPage(); nullptr — текущее дерево. */
+        void setSnapshot(const Snapshot* snapshot) { _snapshot = snapshot; }
+
+        /** \brief Захватывает защелку страницы \c pnum в исключительном (\c exclusive) или
+         *  разделяемом режиме. Врапер держит не больше одной защелки и отпускает ее в unlatch()
+         *  или деструкторе.
+         *
+         *  Если страницы с таким номером быть не может или защелка уже захвачена, кидает
+         *  исключение.
+         */
+        void latch(UInt pnum, bool exclusive);
+
+        /** \brief Освобождает захваченную защелку страницы, если она есть. */
+        void unlatch();
+
         /** \brief Загружает в текущую страницу дочернюю страницу (номер \c chNum) страницы \c pw. 
          *
          *  Если номер курсора неправильный, или он не указывает на правильную страницу,
@@ -323,6 +725,9 @@ public:
         
         /** \brief Для не полностью заполненного текущего узла разделяет напополам его 
          *  полностью заполненного ребенка, определяемого курсором номер \c iChild на два нода/страницы.
+         *
+         *  Лист B+-дерева делится без потери ключа: в родителя уходит копия первого ключа
+         *  правой половины, а новая страница вставляется в список листьев.
          *  
          *  Параметр \c iChild представляет индекс курсора, который не может быть 0, что означает
          *  нарушение целостности (нет страницы с таким ребенком).
@@ -335,13 +740,169 @@ public:
          */
         void splitChild(UShort iChild);
 
+        /** \brief Часть splitChild() для листа \c y B+-дерева: правая половина уходит в
+         *  новую страницу \c z, в родителя — копия ее первого ключа.
+         */
+        void splitLeafChild(UShort iChild, PageWrapper& y, PageWrapper& z);
+
+        /** \brief Часть splitChild() для страниц со слотами: \c y делится в точке, где половины
+         *  ближе всего по байтам, а не по числу ключей.
+         *
+         *  В сжатом формате в родителя от листа уходит кратчайший префикс первой записи \c z,
+         *  больший последней записи \c y, а половины получают новые границы.
+         */
+        void splitSlottedChild(UShort iChild, PageWrapper& y, PageWrapper& z);
+
+        /** \brief Выравнивает по байтам детей номер \c iSep (\c left) и <tt>iSep + 1</tt>
+         *  (\c right) страницы со слотами, разделенных ее записью \c iSep.
+         *
+         *  Если элементы обоих (для внутренних узлов — вместе с разделителем) помещаются
+         *  в одну страницу, \c right сливается в \c left и освобождается, а запись и курсор
+         *  на него удаляются из текущей страницы. Иначе элементы делятся там, где половины
+         *  ближе всего по байтам, как в splitSlottedChild(), если новый разделитель
+         *  помещается в текущую страницу. Сжатые страницы получают новые границы.
+         *
+         *  \returns истину, если дети слиты.
+         */
+        bool rebalanceSlotted(UShort iSep, PageWrapper& left, PageWrapper& right);
+
+        /** \brief Заново заполняет страницу со слотами \c num записями \c recs, курсорами
+         *  \c cursors (<tt>num + 1</tt> штук, для внутреннего узла) и, для сжатой страницы,
+         *  границами \c low и \c high. Записи не могут лежать в той же странице.
+         */
+        void setEntries(const Byte* const* recs, UShort num, const UInt* cursors,
+            const Byte* low, const Byte* high);
+
+        /** \brief Удаляет ключи (записи) с номерами <tt>[first, first + num)</tt>, а из
+         *  внутреннего узла — и курсоры справа от каждого из них, <tt>[first + 1, first + num]</tt>.
+         *
+         *  Число ключей не проверяется на минимум: узел выравнивает вызывающий.
+         */
+        void removeKeys(UShort first, UShort num);
+
+        /** \brief Вставляет текущий лист B+-дерева в список листьев сразу после листа \c prev. */
+        void linkLeafAfter(PageWrapper& prev);
+
+        /** \brief Делит полную страницу формата pfBLink, не трогая ее родителя: правая
+         *  половина уходит в новую страницу \c z, которая становится правым соседом текущей,
+         *  а разделитель половин (верхний ключ текущей) копируется в \c sep.
+         *
+         *  Страницы не записываются: вызывающий дописывает в одну из половин свой элемент
+         *  и записывает сначала \c z, затем текущую, пока держит ее защелку.
+         */
+        void splitBLink(PageWrapper& z, Byte* sep);
+
+        /** \brief Вставляет в лист (не со слотами) запись \c rec под номером \c num. */
+        void insertRecord(UShort num, const Byte* rec);
+
+        /** \brief Вставляет во внутренний узел (не со слотами) ключ \c key под номером \c num
+         *  и курсор \c child справа от него.
+         */
+        void insertChild(UShort num, const Byte* key, UInt child);
+
+        /** \brief Возвращает номер курсора, указывающего на страницу \c pnum, или число
+         *  ключей плюс 1, если такого нет.
+         */
+        UShort findChild(UInt pnum);
+
         /** \brief Вставляет в не полностью заполненный узел ключ k с учетом порядка.
          *
+         *  Узел должен быть захвачен врапером в исключительном режиме (latch()): защелка
+         *  отпускается, как только захвачен и подготовлен ребенок, в которого идет спуск,
+         *  или после записи листа.
          *  Если узел полный, кидает исключение.
          *  Если для дерева не задан компаратор, кидает исключение.
          */
         void insertNonFull(const Byte* k);        
 
+        /** \brief Вставляет в не полностью заполненный узел группу упорядоченных записей
+         *  \c recs (\c cnt штук) одним спуском и возвращает число вставленных.
+         *
+         *  Спуск идет по первой записи. В лист вслед за ней попадают следующие записи,
+         *  пока он не заполнится или очередная не окажется не меньше \c upper — разделителя
+         *  справа от пути к листу (nullptr — его нет); лист записывается один раз.
+         *  Остальные записи вставляет следующий спуск. Требования те же, что у insertNonFull().
+         */
+        UInt insertNonFull(const Byte* const* recs, UInt cnt, const Byte* upper);
+
+#ifdef BTREE_WITH_DELETION
+
+        /** \brief Удаляет из поддерева с вершиной в текущем узле до \c maxNum ключей,
+         *  эквивалентных \c k, за один спуск сверху вниз.
+         *
+         *  Текущий узел должен быть корнем или содержать не меньше order ключей: тогда при
+         *  спуске в ребенка с минимальным числом ключей его всегда можно дополнить ключом
+         *  соседа (fillChild()), и удаление не требует возврата вверх. В листе за один
+         *  спуск удаляются все найденные подряд эквивалентные ключи, которые лист может отдать,
+         *  во внутреннем узле — один.
+         *
+         *  \returns число удаленных ключей.
+         */
+        UInt removeNonMin(const Byte* k, UInt maxNum);
+
+        /** \brief Удаляет из поддерева с вершиной в текущем узле все ключи, эквивалентные
+         *  \c k, за один проход.
+         *
+         *  Эквивалентные ключи узла идут подряд, а лежащие между ними дети содержат только
+         *  такие ключи, поэтому их поддеревья освобождаются целиком (freeSubtree()), без
+         *  чтения ключей по одному. В крайних детях ряда удаление продолжается рекурсивно,
+         *  а на обратном пути они выравниваются с соседями (evenOutChild()). Ключ обычного
+         *  B-дерева между крайними детьми заменяется соседней записью (removeEdge()).
+         *
+         *  Сам узел может остаться с недостатком ключей, в том числе без ключей с единственным
+         *  ребенком; его выравнивает родитель, а корень такой — заменяется ребенком.
+         *
+         *  \returns число удаленных ключей.
+         */
+        UInt removeRun(const Byte* k);
+
+        /** \brief Выравнивает ребенка номер \c iChild, которому после removeRun() может не
+         *  хватать ключей: повторяет fillChild(), пока его не станет хватать или у текущего
+         *  узла не кончатся ключи. Страница со слотами после перераспределения по байтам
+         *  не выравнивается повторно.
+         *
+         *  Узел без ключей может иметь и единственного ребенка с недостатком ключей, поэтому
+         *  после дополнения внутреннего ребенка выравниваются и его собственные дети.
+         *
+         *  \returns номер курсора на выровненного ребенка.
+         */
+        UShort evenOutChild(UShort iChild);
+
+        /** \brief Удаляет из поддерева обычного B-дерева последнюю (\c last == true) или первую
+         *  запись, копируя ее в \c rec, и выравнивает детей по пути. Возвращает ложь, если
+         *  поддерево пусто.
+         */
+        bool removeEdge(bool last, Byte* rec);
+
+        /** \brief Дополняет ребенка номер \c iChild, содержащего минимальное число ключей,
+         *  до order ключей: забирает ключ у соседа через родителя или сливает с соседом.
+         *  Ребенку с еще меньшим числом ключей (см. removeRun()) одного вызова может
+         *  не хватить.
+         *
+         *  Страница со слотами выравнивается с соседом по байтам (rebalanceSlotted()),
+         *  с левым, если он есть. Если ни слияние, ни перераспределение невозможно,
+         *  ребенок остается как есть.
+         *
+         *  Для листьев B+-дерева ключ переходит от соседа напрямую, а разделитель в
+         *  родителе заменяется копией нового граничного ключа.
+         *
+         *  Во враппер \c child загружается узел, в котором теперь находится диапазон ключей
+         *  ребенка (при слиянии с левым соседом это левый сосед).
+         *
+         *  \returns номер курсора на этот узел.
+         */
+        UShort fillChild(UShort iChild, PageWrapper& child);
+
+        /** \brief Сливает ребенка номер \c iChild (\c left), ключ \c iChild текущего узла и
+         *  ребенка номер <tt>iChild + 1</tt> (\c right) в \c left. Ключ и курсор на правого
+         *  ребенка из текущего узла удаляются.
+         *
+         *  Листья B+-дерева сливаются без разделителя, \c right исключается из списка листьев.
+         */
+        void mergeChildren(UShort iChild, PageWrapper& left, PageWrapper& right);
+
+#endif // BTREE_WITH_DELETION
+
 
         //-/** \brief Используя компаратор, определяет, является ли \c lhv левее (меньше) \c rhv, 
         // *  и если да, возвращает истину, иначе ложь.
@@ -356,8 +917,18 @@ public:
         PageWrapper(const PageWrapper&);                        ///< КК не доступен.
         PageWrapper& operator= (PageWrapper&);                  ///< Оператор присваивания недоступен.
 
+        /** \brief Собирает запись номер \c num сжатой страницы в очередной буфер (см. getKey()). */
+        Byte* expandKey(UShort num) const;
+
+        /** \brief Поиск lowerBound() (\c upper == false) или upperBound() в сжатой странице:
+         *  ключ один раз сравнивается с общим префиксом, а дальше — только с хранимыми
+         *  остатками записей, без их сборки.
+         */
+        UShort compressedBound(const Byte* key, bool upper) const;
+
     protected:
         Byte* _data;                                            ///< Сырой массив данных.
+        Byte* _ownData;                                         ///< Собственный буфер врапера.
         BaseBTree* _tree;                                       ///< Указатель на само дерево, нужно оно.
 
         /** \brief Номер страницы в файле, ассоциированный с текущим (в)репером. 
@@ -369,10 +940,197 @@ public:
          */
         UInt _pageNum;
 
+        /** \brief Буферы для записей сжатой страницы, собираемых getKey() по очереди. */
+        mutable std::vector<Byte> _keyBufs;
+
+        /** \brief Номер буфера для следующей собираемой записи. */
+        mutable UShort _nextKeyBuf;
+
+        /** \brief Снимок, страницы которого читает врапер, nullptr — текущее дерево. */
+        const Snapshot* _snapshot;
+
+        /** \brief Образ страницы снимка, к которому привязан врапер. */
+        PageFrame _frame;
+
+        UInt _latchedPage;                                      ///< Страница захваченной защелки, 0 — нет.
+        bool _latchedExclusive;                                 ///< Режим захваченной защелки.
+
     }; // class PageWrapper
 
     friend class PageWrapper;
 
+
+    /** \brief Курсор для обхода ключей дерева по порядку в обе стороны.
+     *
+     *  Хранит путь от корня до текущего ключа: для каждого уровня — копию страницы (или
+     *  привязку к отображению файла) и номер ключа/курсора на ней. Поэтому шаги next()/prev()
+     *  поднимаются и спускаются только по соседним уровням, не начиная поиск от корня заново.
+     *
+     *  В B+-дереве курсор после установки держит только лист и переходит к соседним
+     *  листьям по ссылкам между ними.
+     *
+     *  Любое изменение дерева делает курсор недействительным, после него нужен новый seek().
+     *  Курсор над снимком (Snapshot) изменения дерева не затрагивают.
+     *
+     *  Курсор не захватывает защелок, поэтому не должен использоваться одновременно со
+     *  вставками в дерево из других потоков.
+     */
+    class Cursor {
+        friend class BaseBTree;
+    public:
+        /** \brief Конструирует недействительный курсор над деревом \c tree. */
+        Cursor(BaseBTree* tree);
+
+        /** \brief Конструирует недействительный курсор над открытым снимком \c snapshot.
+         *
+         *  Курсор обходит дерево в том виде, в каком оно было при открытии снимка, и должен
+         *  использоваться, пока снимок открыт. Если снимок не открыт, кидает исключение.
+         */
+        explicit Cursor(const Snapshot& snapshot);
+
+    protected:
+        Cursor(const Cursor&);                                  ///< КК не доступен.
+        Cursor& operator= (Cursor&);                            ///< Оператор присваивания недоступен.
+
+    public:
+
+        /** \brief Устанавливает курсор на первый ключ, не меньший \c k.
+         *
+         *  \returns истину, если такой ключ есть (курсор действителен).
+         */
+        bool seek(const Byte* k);
+
+        /** \brief Устанавливает курсор на наименьший ключ дерева. */
+        bool seekFirst();
+
+        /** \brief Устанавливает курсор на наибольший ключ дерева. */
+        bool seekLast();
+
+        /** \brief Переходит к следующему по порядку ключу.
+         *
+         *  \returns ложь, если ключей больше нет (курсор становится недействительным).
+         */
+        bool next();
+
+        /** \brief Переходит к предыдущему по порядку ключу. Аналогично next(). */
+        bool prev();
+
+        /** \brief Возвращает истину, если курсор указывает на ключ. */
+        bool isValid() const { return _depth != 0; }
+
+        /** \brief Возвращает указатель на текущий ключ или nullptr, если курсор недействителен.
+         *
+         *  Указатель смотрит внутрь страницы курсора и действителен до следующего шага.
+         */
+        const Byte* getKey() const;
+
+        /** \brief Возвращает указатель на значение текущей записи (см. getKey()). */
+        const Byte* getValue() const;
+
+        /** \brief Делает курсор недействительным. */
+        void reset() { _depth = 0; }
+
+    protected:
+
+        /** \brief Как seek(), но и в B+-дереве оставляет на пути все уровни от корня. */
+        bool seekPath(const Byte* k);
+
+        /** \brief В B+-дереве оставляет от пути только лист. Возвращает истину. */
+        bool settle();
+
+        /** \brief Переходит в B+-дереве к первому ключу следующего (\c right) или последнему
+         *  ключу предыдущего листа.
+         */
+        bool stepLeaf(bool right);
+
+        /** \brief Кладет на путь страницу \c pnum с номером \c pos и возвращает ее. */
+        PageWrapper& push(UInt pnum, UShort pos);
+
+        /** \brief Возвращает номер корневой страницы дерева или снимка. */
+        UInt getRootPageNum() const;
+
+        /** \brief Спускается от страницы на вершине пути (в ребенка с ее номером) до листа по
+         *  крайним левым (\c right == false) или правым детям.
+         */
+        bool descend(bool right);
+
+        /** \brief Поднимается по пути до первого предка, у которого есть ключ справа (\c right)
+         *  или слева от пройденного ребенка, и делает его текущим.
+         */
+        bool ascend(bool right);
+
+    protected:
+        BaseBTree* _tree;                                       ///< Дерево.
+        std::vector<std::unique_ptr<PageWrapper> > _pages;      ///< Страницы пути (распределяются один раз).
+        std::vector<UShort> _pos;                               ///< Номера на страницах пути.
+        size_t _depth;                                          ///< Длина пути, 0 — курсор недействителен.
+        const Snapshot* _snapshot;                              ///< Снимок или nullptr.
+    }; // class Cursor
+
+    friend class Cursor;
+
+
+    /** \brief Снимок дерева на момент открытия (BaseBTree::openSnapshot()) для режима
+     *  копирования при записи.
+     *
+     *  Снимок держит таблицу страниц и номер корня того момента: страницы, которые он видит,
+     *  дерево больше не перезаписывает, а слоты, освобожденные после открытия снимка, не
+     *  используются повторно до его закрытия. Поэтому чтение снимка (search(), Cursor) идет
+     *  прямо из его слотов, минуя пул и защелки дерева: оно не мешает записи в дерево, само
+     *  ею не затрагивается и может выполняться из нескольких потоков. Образы внутренних
+     *  страниц, через которые проходит каждый поиск, снимок хранит и раздает читателям.
+     *
+     *  Закрывается release() или деструктором, а также при закрытии дерева.
+     */
+    class Snapshot {
+        friend class BaseBTree;
+    public:
+        /** \brief Конструирует неоткрытый снимок. */
+        Snapshot();
+
+        /** \brief Деструктор. Закрывает снимок. */
+        ~Snapshot();
+
+    protected:
+        Snapshot(const Snapshot&);                              ///< КК не доступен.
+        Snapshot& operator= (Snapshot&);                        ///< Оператор присваивания недоступен.
+
+    public:
+        /** \brief Возвращает истину, если снимок открыт. */
+        bool isOpen() const { return _tree != nullptr; }
+
+        /** \brief Закрывает снимок, если он открыт. */
+        void release();
+
+        /** \brief Ищет в снимке запись с ключом, эквивалентным \c k, и копирует ее в \c dst.
+         *
+         *  \returns ложь, если такой записи в снимке нет.
+         */
+        bool search(const Byte* k, Byte* dst) const;
+
+        /** \brief Возвращает дерево снимка или nullptr, если снимок не открыт. */
+        BaseBTree* getTree() const { return _tree; }
+
+        /** \brief Возвращает номер корневой страницы на момент открытия снимка. */
+        UInt getRootPageNum() const { return _rootPageNum; }
+
+        /** \brief Возвращает номер последней страницы на момент открытия снимка. */
+        UInt getLastPageNum() const { return _pageMap ? (UInt)_pageMap->size() - 1 : 0; }
+
+    protected:
+        BaseBTree* _tree;                                       ///< Дерево, nullptr — снимок не открыт.
+        std::shared_ptr<const PageMap> _pageMap;                ///< Таблица страниц на момент открытия.
+        UInt _rootPageNum;                                      ///< Корень на момент открытия.
+        UInt _epoch;                                            ///< Эпоха дерева, в которой снимок открыт.
+
+        /** \brief Прочитанные образы внутренних страниц по номерам; элементы читаются и
+         *  заполняются через std::atomic_load()/std::atomic_store().
+         */
+        mutable std::vector<PageFrame> _frames;
+    }; // class Snapshot
+
+    friend class Snapshot;
+
     /** \brief Интерфейс, определяющий операцию сравнения двух ключей дерева.
      *
      *  Конкретная реализация зависит от типов ключей и подразумевает явное
@@ -383,7 +1141,8 @@ public:
         
         /** \brief Выполняет сравнение двух ключей: левого \c lhv и правого \c rhv.
          *
-         *  (Максимальный) размер ключей определяется параметром \c sz.
+         *  (Максимальный) размер ключей определяется параметром \c sz; дерево передает
+         *  getKeySize(), так что значения в конце записей не сравниваются.
          *
          *  \returns истину, если <tt>lhv < rhv<\tt>; иначе ложь.
          *
@@ -405,6 +1164,43 @@ public:
     }; // class IComparator
 
 
+    /** \brief Интерфейс посетителя ключей, найденных BaseBTree::searchAll().
+     *
+     *  Позволяет обработать найденные ключи на месте, не копируя их в отдельно распределенную память.
+     */
+    class IKeyVisitor {
+    public:
+
+        /** \brief Вызывается для каждого найденного ключа \c key.
+         *
+         *  Указатель \c key смотрит внутрь рабочей страницы дерева и действителен только
+         *  на время вызова.
+         *
+         *  \returns истину, чтобы продолжить поиск, ложь — чтобы прекратить его.
+         */
+        virtual bool visitKey(const Byte* key) = 0;
+    protected:
+        ~IKeyVisitor() {};
+
+    }; // class IKeyVisitor
+
+
+    /** \brief Интерфейс источника ключей для массовой загрузки BaseBTree::bulkLoad(). */
+    class IKeySource {
+    public:
+
+        /** \brief Возвращает указатель на очередной ключ (длиной getRecSize() байт) или nullptr,
+         *  если ключи закончились.
+         *
+         *  Указатель должен оставаться действительным до следующего вызова.
+         */
+        virtual const Byte* nextKey() = 0;
+    protected:
+        ~IKeySource() {};
+
+    }; // class IKeySource
+
+
      
 public:
     /** \brief Деструктор. */
@@ -412,17 +1208,17 @@ public:
 protected:
     /** \brief Конструирует новое B-дерево со структурой, определяемой переданными параметрами.
      *
-     *  Создает новое дерево и записывает его в поток \c stream. Если файл существует, 
+     *  Создает новое дерево и записывает его в хранилище \c io. Если файл существует, 
      *  он перезаписывается. Если файл не может быть открыт, генерируется исключительная ситуация.
      *  Параметр \c order определяет порядок дерева, параметр \c recSize определяет 
      *  размер (длину) записи ключа в байтах.
      */
-    BaseBTree(UShort order, UShort recSize, IComparator* comparator, std::iostream* stream);
+    BaseBTree(UShort order, UShort recSize, IComparator* comparator, IPageIO* io);
 
     /** \brief Конструирует заготовку под B-дерево, параметры которого будут прочитаны из
      *  существующего деревофайла.
      */
-    BaseBTree(IComparator* comparator, std::iostream* stream);
+    BaseBTree(IComparator* comparator, IPageIO* io);
 
     BaseBTree(const BaseBTree&);                        ///< КК не доступен.
     BaseBTree& operator= (BaseBTree&);                  ///< Оператор присваивания недоступен.
@@ -457,6 +1253,8 @@ public:
 
     /** \brief Записывает в файл страницу номер \c pnum из памяти \c dst.
      *
+     *  Если буферный пул включен, страница лишь помечается в нем грязной, а в файл
+     *  попадает позже (см. BaseBTree).
      *  Требования к номеру страницы с товарищами такие же, как и у readPage().
      */
     void writePage(UInt pnum, const Byte* dst);
@@ -477,26 +1275,160 @@ public:
     //UInt allocPage(UShort keysNum, NodeType nt, PageWrapper& pw);
     UInt allocPage(PageWrapper& pw, UShort keysNum, bool isLeaf = false);
 
+    /** \brief Возвращает страницу номер \c pnum в список свободных, откуда ее заберет
+     *  следующий allocPage().
+     *
+     *  Список хранится в самом файле: его голова — в заголовке (getFreePageNum()), а каждая
+     *  свободная страница хранит номер следующей в курсоре номер 0.
+     *  Если поток не готов или номер страницы неправильный, генерирует исключительную ситуацию.
+     */
+    void freePage(UInt pnum);
+
     /** \brief Распределяет страницу для нового корня. */
     UInt allocNewRootPage(PageWrapper& pw);
 
     /** \brief Вставляет в дерево ключ k с учетом порядка.
      *
+     *  Может вызываться из нескольких потоков одновременно с другими вставками и поисками.
      */
 
     void insert(const Byte* k);
+
+    /** \brief Вставляет запись из ключа \c key (getKeySize() байт) и значения \c value
+     *  (getValueSize() байт).
+     */
+    void insert(const Byte* key, const Byte* value);
+
+    /** \brief Вставляет \c n записей, лежащих подряд по \c keys (по getRecSize() байт),
+     *  и возвращает число спусков от корня, которые для этого потребовались.
+     *
+     *  Записи упорядочиваются (равные — в порядке следования, как при вставке по одной)
+     *  и вставляются группами: все записи, попадающие в один лист, вставляются одним
+     *  спуском и одной записью страницы. Заполнившийся лист делится следующим спуском,
+     *  так что группа может занять столько листьев, сколько нужно.
+     *  Каждая группа — отдельная операция, как insert(): между группами дерево доступно
+     *  другим потокам. Если записи сжатого или со слотами дерева длиннее getRecSize(),
+     *  кидает std::invalid_argument, не вставив ни одной.
+     */
+    UInt insertBatch(const Byte* keys, UInt n);
+
+    /** \brief Для ключа \c k ищет первую запись с эквивалентным ключом и возвращает указатель
+     *  на ее значение внутри рабочей страницы, или nullptr. Как и для find(), указатель
+     *  действителен до следующей операции с деревом, а сам метод — однопоточный.
+     */
+    const Byte* findValue(const Byte* k);
+
+    /** \brief Для ключа \c k копирует значение первой записи с эквивалентным ключом
+     *  в \c value (не менее getValueSize() байт).
+     *
+     *  Как и search(k, dst), может вызываться из нескольких потоков.
+     *
+     *  \returns истину, если ключ найден; иначе ложь, а \c value не меняется.
+     */
+    bool getValue(const Byte* k, Byte* value);
     
     /** \brief Для заданного ключа \c k ищет первое его вхождение в дерево по принципу эквивалентности. 
-     *  Если ключ найден, возвращает указатель на подлежащий массив, иначе nullptr.
+     *  Если ключ найден, возвращает его копию, распределенную через new[] (освобождается
+     *  вызывающим через delete[]), иначе nullptr.
+     *
+     *  Для частых поисков лучше подходят find() и search(k, dst), которые не распределяют память.
+     */
+    Byte* search(const Byte* k);
+
+    /** \brief Для заданного ключа \c k ищет первое его вхождение в дерево и копирует
+     *  найденный ключ в буфер \c dst (не менее getRecSize() байт).
+     *
+     *  Страницы читаются в собственные буферы вызова под разделяемыми защелками (или без
+     *  них, см. setOptimisticReads()), поэтому поиски можно выполнять из нескольких потоков
+     *  одновременно со вставками.
+     *
+     *  \returns истину, если ключ найден; иначе ложь, а \c dst не меняется.
+     */
+    bool search(const Byte* k, Byte* dst);
+
+    /** \brief Для заданного ключа \c k ищет первое его вхождение в дерево и возвращает
+     *  указатель на ключ внутри рабочей страницы дерева, или nullptr, если ключ не найден.
+     *
+     *  Указатель действителен только до следующей операции с деревом. Метод использует
+     *  общие рабочие страницы дерева и не может вызываться из нескольких потоков.
+     */
+    const Byte* find(const Byte* k);
+
+    /** \brief Для заданного ключа \c k ищет все его его вхождения в дерево по принципу эквивалентности.
+     *  Каждый найденный ключ копируется (через new[]) и добавляется в переданный список ключей \c keys.
+     *
+     *  \returns число элементов в списке
+     */
+    int searchAll(const Byte* k, std::list<Byte*>& keys);
+
+    /** \brief Для заданного ключа \c k ищет все его его вхождения в дерево по принципу эквивалентности
+     *  и передает каждый найденный ключ посетителю \c visitor без копирования.
+     *
+     *  В режиме оптимистичного чтения ключи сначала копируются, и посетитель получает
+     *  копии, а поиск идет параллельно со вставками; иначе он захватывает дерево целиком.
+     *
+     *  \returns число переданных посетителю ключей
+     */
+    int searchAll(const Byte* k, IKeyVisitor& visitor);
+
+    /** \brief Ищет первые вхождения \c n ключей, лежащих подряд по getKeySize() байт в \c keys,
+     *  и копирует найденную запись ключа номер i в \c dst + i * getRecSize(); в \c found[i]
+     *  пишется, найден ли ключ.
+     *
+     *  Поиски независимы и идут вперемешку: как только одному нужна страница, которой нет
+     *  в буферном пуле, ее чтение уходит в асинхронный механизм (см. getAsyncIO()), а
+     *  вызов тем временем продвигает другие, так что на устройстве одновременно находится
+     *  до его глубины чтений. Страницы проверяются по версиям защелок, как при оптимистичном
+     *  чтении, поэтому вызов можно выполнять параллельно со вставками. Без асинхронного
+     *  механизма (или для файла, отображенного в память) ключи ищутся по одному search().
+     *
+     *  \returns число найденных ключей.
+     */
+    UInt searchAsync(const Byte* keys, UInt n, Byte* dst, std::vector<bool>& found);
+
+    /** \brief Ищет первые вхождения \c n ключей, лежащих подряд по getKeySize() байт в \c keys,
+     *  за один обход дерева; результаты — как у searchAsync().
+     *
+     *  Ключи сортируются, и пакет спускается от корня целиком: во внутреннем узле он
+     *  делится на непрерывные части по детям (ключ попадает в часть одним сравнением
+     *  с разделителем), и каждая часть уходит в своего ребенка. Так любая страница
+     *  читается за вызов не больше одного раза, а не по разу на каждый попавший в нее ключ.
+     *  Ключи B+-дерева, которые нужно искать и в следующем листе, присоединяются к части
+     *  следующего ребенка.
+     *
+     *  Страницы читаются в собственные буферы вызова с проверкой версий защелок, как
+     *  при оптимистичном чтении, поэтому вызов можно выполнять параллельно со вставками;
+     *  часть, страницу которой за это время изменили, ищется по одному ключу с защелками.
+     *
+     *  \returns число найденных ключей.
      */
-    Byte* search(const Byte* k);
+    UInt multiGet(const Byte* keys, UInt n, Byte* dst, std::vector<bool>& found);
 
-    /** \brief Для заданного ключа \c k ищет все его его вхождения в дерево по принципу эквивалентности.
-     *  Каждый найденный ключ добавляется в переданный список ключей \c keys.
+    /** \brief Строит дерево снизу вверх из отсортированной по неубыванию последовательности
+     *  ключей \c src.
+     *
+     *  Узлы заполняются до доли \c fillFactor (от 0 до 1) от максимального числа ключей
+     *  (страницы со слотами — от своего размера в байтах) и дописываются в конец файла по
+     *  мере заполнения, каждый ровно один раз, так что загрузка сводится к последовательной
+     *  записи. Затем правая граница дерева, где узлы могли остаться недозаполненными,
+     *  выравнивается с левыми соседями.
+     *
+     *  Узлы уровня строятся слева направо, поэтому номер следующего узла известен заранее:
+     *  страницы формата pfBLink сразу получают правую ссылку, уровень и верхний ключ —
+     *  разделитель, уходящий в родителя.
      *
-     *  \returns число найденных элементов
+     *  Дерево должно быть пустым, иначе кидает std::runtime_error. Если ключи оказываются
+     *  не отсортированными, кидает std::invalid_argument; порядок проверяется до того, как
+     *  новые страницы становятся частью дерева, поэтому оно остается пустым, а дописанные
+     *  страницы — за его концом.
+     *
+     *  С журналом новые страницы, до смены корня недостижимые, уходят в него группами по
+     *  BULK_COMMIT_PAGES, и в памяти журнала загрузка не копится; атомарна только
+     *  заключительная группа со сменой корня и заголовком.
+     *
+     *  \returns число загруженных ключей.
      */
-    int searchAll(const Byte* k, std::list<Byte*>& keys);
+    UInt bulkLoad(IKeySource& src, float fillFactor = 1.0f);
 
 
 #ifdef BTREE_WITH_DELETION
@@ -504,6 +1436,13 @@ public:
     /** \brief Для заданного ключа \c k находит первое вхождение его в дерево по принципу эквивалентности 
      *  и удаляет его из дерева.
      *
+     *  Страница со слотами, занятая после удаления меньше чем на четверть, сливается
+     *  с соседом или делит с ним элементы по байтам (см. PageWrapper::rebalanceSlotted()).
+     *
+     *  Для формата pfBLink не поддерживается и кидает std::logic_error: слияние освобождает
+     *  страницу, на которую еще может вести правая ссылка, а вставки и поиски такого дерева
+     *  идут без защелки на все дерево и переходят по ссылкам, не поднимаясь к родителю.
+     *
      *  \returns истину, если удален, ложь иначе.
      */    
     bool remove (const Byte* k);
@@ -511,6 +1450,10 @@ public:
     /** \brief Для заданного ключа \c k находит все вхождения его в дерево по принципу эквивалентности
      *  и удаляет их.
      *
+     *  Удаление идет за один проход от корня (см. PageWrapper::removeRun()): поддеревья,
+     *  целиком состоящие из таких ключей, освобождаются без спусков в каждый лист.
+     *  Для формата pfBLink не поддерживается, как и remove().
+     *
      *  \returns Число удаленных узлов.
      */
     int removeAll(const Byte* k);
@@ -531,6 +1474,19 @@ public:
     /** \brief Возвращает минимальное число ключей в ноде. Определяется порядком дерева: <em>(_order - 1)<\em>. */
     UInt getMinKeys() const { return _minKeys; }
 
+    /** \brief Возвращает порядок внутренних узлов B+-дерева.
+     *
+     *  Такие узлы хранят только ключи, и в страницу того же размера их помещается больше;
+     *  для B-дерева и для записей без значения совпадает с getOrder().
+     */
+    UShort getInnerOrder() const { return _innerOrder; }
+
+    /** \brief Возвращает максимальное число ключей во внутреннем узле B+-дерева. */
+    UInt getInnerMaxKeys() const { return _innerMaxKeys; }
+
+    /** \brief Возвращает минимальное число ключей во внутреннем узле B+-дерева. */
+    UInt getInnerMinKeys() const { return _innerMinKeys; }
+
     /** \brief Возвращает размер области под ключи, как максимальное число ключей в ноде на их размер.
      *  Поле требуется рассчитывать для определения смещения области указателей.
      */
@@ -543,9 +1499,64 @@ public:
     /** \brief Возвращает размер всего узла, он же определяет размер страницы. */
     UInt getNodePageSize() const { return _nodePageSize; }
 
+    /** \brief Возвращает смещение в файле страницы номер \c pnum. */
+    ULong getPageOfs(UInt pnum) const { return getSlotOfs(getPageSlot(pnum)); }
+
+    /** \brief Возвращает номер слота, в котором лежит страница \c pnum: по таблице страниц
+     *  в режиме копирования при записи, иначе сам номер страницы.
+     */
+    UInt getPageSlot(UInt pnum) const
+    {
+        return _pageMap && pnum < _pageMap->size() ? (*_pageMap)[pnum] : pnum;
+    }
+
+    /** \brief Возвращает смещение в файле слота номер \c slot. */
+    ULong getSlotOfs(UInt slot) const { return FIRST_PAGE_OFS + (ULong)getNodePageSize() * (slot - 1); }
+
     /** \brief Возвращает длину записи ключа. */
     UShort getRecSize() const { return _recSize; }
 
+    /** \brief Возвращает длину ключа в начале записи. */
+    UShort getKeySize() const { return _keySize; }
+
+    /** \brief Возвращает длину значения в конце записи. */
+    UShort getValueSize() const { return _recSize - _keySize; }
+
+    /** \brief Возвращает формат страниц дерева. */
+    PageFormat getPageFormat() const { return _format; }
+
+    /** \brief Возвращает истину, если дерево хранится в формате B+-дерева (в том числе со слотами). */
+    bool isBPlus() const { return _format != pfBTree; }
+
+    /** \brief Возвращает истину, если страницы дерева — со слотами под записи переменной длины
+     *  (в том числе сжатые).
+     */
+    bool isSlotted() const { return _format == pfSlotted || _format == pfCompressed; }
+
+    /** \brief Возвращает истину, если страницы дерева — сжатые страницы со слотами. */
+    bool isCompressed() const { return _format == pfCompressed; }
+
+    /** \brief Возвращает истину, если страницы дерева хранят правые ссылки (формат pfBLink). */
+    bool isBLink() const { return _format == pfBLink; }
+
+    /** \brief Возвращает длину записи \c rec: getRecSize() или, для записей переменной длины,
+     *  VAR_LEN_SZ плюс значение поля длины в ее начале.
+     */
+    UInt getRecLen(const Byte* rec) const
+    {
+        return isSlotted() ? VAR_LEN_SZ + *((const UShort*)rec) : _recSize;
+    }
+
+    /** \brief Возвращает длину общего префикса границ \c low и \c high сжатой страницы
+     *  (0, если одной из них нет).
+     */
+    UShort getCommonPrefixLen(const Byte* low, const Byte* high) const;
+
+    /** \brief Укорачивает разделитель листьев сжатой страницы \c sep до кратчайшего
+     *  префикса, который еще больше записи \c last.
+     */
+    void shortenSeparator(const Byte* last, std::vector<Byte>& sep) const;
+
     /** \brief Возвращает номер последней записанной страницы и оно же — число записанных страниц. 
      *
      *  Страницы нумеруются с 1-цы (реальные), число 0 означает специальный случай — нулевой курсор,
@@ -557,12 +1568,29 @@ public:
     /** \brief Возвращает ненулевой номер страницы корня дерева или 0, если в д. нет ни одного узла. */
     UInt getRootPageNum() const { return _rootPageNum;  }
 
+    /** \brief Возвращает номер первой страницы в списке свободных или 0, если список пуст. */
+    UInt getFreePageNum() const { return _freePageNum; }
+
+    /** \brief Возвращает номер последней записанной контрольной точки (см. MetaSlot). */
+    UInt getMetaSeq() const { return _metaSeq; }
+
+    /** \brief Возвращает номер последнего слота файла и оно же — число слотов. Без режима
+     *  копирования при записи совпадает с getLastPageNum().
+     */
+    UInt getLastSlotNum() const { return _pageMap ? _lastSlotNum : getLastPageNum(); }
+
 
     //--- страницы в оперативной памяти
-     /** \brief Возвращает ссылку на текущую корневую страницу. */
-    PageWrapper& getRootPage() { return _rootPage; }
+     /** \brief Возвращает ссылку на текущую корневую страницу, заново прочитанную:
+     *  вставки меняют корень в собственных враперах.
+     */
+    PageWrapper& getRootPage()
+    {
+        _rootPage.readPage(_rootPageNum);
+        return _rootPage;
+    }
 
-     /** \brief Константный вариант метода getRootPage(). */
+     /** \brief Константный вариант метода getRootPage(): корень на момент последнего чтения. */
     const PageWrapper& getRootPage() const { return _rootPage; }
 
     //-/** \brief Возвращает указатель на текущую корневую страницу. */
@@ -589,6 +1617,115 @@ public:
     /** \brief Возвращает компаратор. */
     IComparator* getComparator() const { return _comparator; }
 
+    /** \brief Задает ядра поиска внутри узла \c lowerBound и \c upperBound, которые заменяют
+     *  поиск через компаратор в PageWrapper::lowerBound() и PageWrapper::upperBound().
+     *
+     *  Ядра должны упорядочивать ключи так же, как компаратор дерева. Пара nullptr
+     *  возвращает поиск через компаратор.
+     */
+    void setSearchKernel(KeyBoundFunc lowerBound, KeyBoundFunc upperBound)
+    {
+        _lowerBoundFunc = lowerBound;
+        _upperBoundFunc = upperBound;
+    }
+
+    /** \brief Возвращает истину, если поиск внутри узла выполняется заданными ядрами. */
+    bool hasSearchKernel() const { return _lowerBoundFunc && _upperBoundFunc; }
+
+
+    //--- буферный пул
+
+    /** \brief Задает емкость буферного пула в страницах; 0 — пул выключен.
+     *
+     *  Может вызываться как до открытия дерева, так и для открытого дерева. В последнем
+     *  случае содержимое пула сбрасывается (грязные страницы предварительно записываются).
+     */
+    void setCacheCapacity(UInt capacity);
+
+    /** \brief Возвращает емкость буферного пула в страницах. */
+    UInt getCacheCapacity() const { return _cacheCapacity; }
+
+    /** \brief Задает длину участка ключей узла, начиная с которой поиск внутри узла
+     *  становится линейным (0 — только двоичный поиск).
+     *
+     *  На коротких участках линейный проход дешевле из-за предсказуемых ветвлений.
+     */
+    void setLinearSearchThreshold(UShort threshold) { _linearSearchThreshold = threshold; }
+
+    /** \brief Возвращает порог перехода к линейному поиску внутри узла. */
+    UShort getLinearSearchThreshold() const { return _linearSearchThreshold; }
+
+    /** \brief Возвращает истину, если дерево работает через отображение файла в память. */
+    bool isMapped() const { return _io && _io->isMapped(); }
+
+    /** \brief Возвращает хранилище, через которое выполняется ввод-вывод, или nullptr. */
+    IPageIO* getPageIO() const { return _io; }
+
+    /** \brief Возвращает механизм асинхронного чтения страниц или nullptr, если его нет. */
+    IAsyncPageIO* getAsyncIO() const { return _asyncIO; }
+
+    /** \brief Возвращает буферный пул (для статистики). */
+    const PageCache& getCache() const { return _cache; }
+
+    /** \brief Возвращает число попаданий в буферный пул. */
+    UInt getCacheHits() const { return _cache.getHits(); }
+
+    /** \brief Возвращает число промахов буферного пула. */
+    UInt getCacheMisses() const { return _cache.getMisses(); }
+
+
+    //--- копирование при записи
+
+    /** \brief Включает для последующих create()/open() режим копирования при записи
+     *  (теневых страниц, см. описание класса).
+     *
+     *  Файл, в котором уже есть таблица страниц, открывается в этом режиме независимо от
+     *  настройки. Режим не поддерживает отображение файла в память и журнал упреждающей
+     *  записи: устойчивость к сбою он обеспечивает сам.
+     *  Если дерево открыто, генерирует исключительную ситуацию.
+     */
+    void setCowEnabled(bool enabled);
+
+    /** \brief Возвращает истину, если create()/open() включат копирование при записи. */
+    bool isCowEnabled() const { return _cowEnabled; }
+
+    /** \brief Возвращает истину, если открытое дерево работает в режиме копирования при записи. */
+    bool isCow() const { return _pageMap != nullptr; }
+
+    /** \brief Открывает в \c snap снимок текущего состояния дерева (ранее открытый в нем
+     *  снимок закрывается). Грязные страницы пула при этом записываются.
+     *
+     *  Без режима копирования при записи кидает std::logic_error.
+     */
+    void openSnapshot(Snapshot& snap);
+
+    /** \brief Возвращает число открытых снимков. */
+    UInt getSnapshotsNum() const { return (UInt)_snapshots.size(); }
+
+
+    //--- параллельный доступ
+
+    /** \brief Возвращает истину, если вставки открытого дерева выполняются параллельно
+     *  (со сцеплением защелок страниц).
+     *
+     *  В режиме копирования при записи каждая запись страницы меняет общую таблицу страниц,
+     *  поэтому в нем вставки захватывают дерево целиком; поиски параллельны всегда.
+     *  С журналом вставки параллельны, а конец группы каждая из них отмечает, когда
+     *  остальные не находятся в середине (см. commitOperation()).
+     */
+    bool isConcurrent() const { return _io && !_pageMap; }
+
+    /** \brief Включает или выключает оптимистичное чтение (см. описание класса) для search(),
+     *  getValue() и searchAll(). Вызывается до начала параллельной работы с деревом.
+     *
+     *  Действует, только пока isConcurrent(): в режиме копирования при записи чтение
+     *  страницы задевает общую таблицу страниц, и поиски идут с защелками.
+     */
+    void setOptimisticReads(bool enabled) { _optimisticReads = enabled; }
+
+    /** \brief Возвращает истину, если включено оптимистичное чтение. */
+    bool isOptimisticReads() const { return _optimisticReads; }
+
 
 protected:
  
@@ -608,14 +1745,149 @@ protected:
      *
      *  Создает дерево с нуля, создает страницу под корень и записывает их в поток.
      */
-    void createTree(UShort order, UShort recSize);
+    void createTree(UShort order, UShort recSize, PageFormat format = pfBTree, UShort valueSize = 0);
 
     /** \brief Создает и записывает корневую страницу при создании дерева с нуля. */
     void createRootPage();
 
+    /** \brief Завершает операцию над деревом: для хранилища с журналом сбрасывает в него
+     *  грязные страницы пула и отмечает конец атомарной группы записей.
+     *
+     *  Параллельная вставка передает в \c shared свою разделяемую защелку дерева: с журналом
+     *  она отпускается, и конец группы отмечается под исключительной защелкой, когда
+     *  ни одна вставка не находится в середине. Сброса журнала операция ждет без защелки.
+     */
+    void commitOperation(TreeLatchGuard* shared = nullptr);
+
+    /** \brief Сбрасывает в журнал грязные страницы пула и заголовок и отмечает конец группы;
+     *  возвращает позицию отметки (см. IPageIO::markCommit()).
+     */
+    ULong markLogged();
+
     /** \brief Метод проверяет, открыт ли поток (готово ли дерево), если нет, кидает исключение. */
     void checkForOpenStream();
 
+    /** \brief Поиск для search(k, dst): как find(), но в собственных враперах со
+     *  сцеплением разделяемых защелок страниц. Найденная запись копируется в \c dst.
+     */
+    bool findLatched(const Byte* k, Byte* dst);
+
+    /** \brief Вставка в дерево формата pfBLink (см. описание класса).
+     *
+     *  Спуск захватывает по одной странице за раз в разделяемом режиме, запоминая путь,
+     *  а лист — в исключительном; страница, разделившаяся после чтения ее родителя,
+     *  покидается по правой ссылке. Полный лист делится сам (splitBLink()), после чего
+     *  разделитель вставляется в родителя с пути (postBLink()), который так же может
+     *  разделиться. Так вставки в соседние листья не ждут друг друга на общем родителе.
+     *
+     *  Вставляет в лист первые из упорядоченных записей \c recs (\c cnt штук), пока он
+     *  не заполнится или очередная не выйдет за его верхний ключ, и возвращает их число.
+     */
+    UInt insertBLink(const Byte* const* recs, UInt cnt);
+
+    /** \brief Вставляет первые из упорядоченных записей \c recs (\c cnt штук) одним спуском
+     *  от корня и возвращает их число (не меньше одной); операция фиксируется, как insert().
+     */
+    UInt insertGroup(const Byte* const* recs, UInt cnt);
+
+    /** \brief Спускается от корня дерева формата pfBLink к странице уровня \c level для ключа
+     *  \c k и возвращает ее номер. Элемент \c path с номером уровня получает номер пройденной
+     *  на нем страницы (ниже \c level — 0).
+     *
+     *  При \c upper ребенок выбирается, как при вставке (равные разделителю ключи — правее),
+     *  иначе, как при поиске, — самый левый, где ключ может быть.
+     */
+    UInt descendBLink(const Byte* k, bool upper, UShort level, std::vector<UInt>& path);
+
+    /** \brief Вставляет в уровень над разделившейся страницей \c node разделитель \c sep и
+     *  ссылку на ее новую правую половину \c next, деля полные узлы выше, пока не найдется
+     *  неполный или не вырастет новый корень. \c path — путь спуска (см. descendBLink()).
+     *
+     *  \c node держит исключительную защелку, пока родитель не получит ссылку на правую
+     *  половину: до тех пор страница не может разделиться еще раз, и ссылки на половины
+     *  попадают в родителя в том же порядке, что и сами половины. Защелки при этом
+     *  берутся только снизу вверх и слева направо.
+     */
+    void postBLink(PageWrapper* node, PageWrapper* next, Byte* sep, std::vector<UInt>& path);
+
+    /** \brief Пока ключ \c k лежит правее страницы \c node (PageWrapper::isBeyond()),
+     *  переходит к ее правому соседу, захватывая его в режиме \c exclusive до освобождения
+     *  \c node; \c next — свободный врапер для соседа. Враперы при этом меняются местами.
+     */
+    void moveRight(PageWrapper*& node, PageWrapper*& next, const Byte* k, bool exclusive, bool upper);
+
+    /** \brief Возвращает истину, если поиски идут без защелок (см. setOptimisticReads()). */
+    bool isOptimistic() const { return _optimisticReads && isConcurrent(); }
+
+    /** \brief Копирует в \c pw страницу \c pnum для оптимистичного поиска и возвращает ее
+     *  версию в \c version.
+     *
+     *  \c fromPage — страница (с версией \c fromVersion), из ссылки которой взят номер
+     *  \c pnum; 0 — номер взят как номер корня. \c treeVersion — версия защелки дерева
+     *  на начало поиска.
+     *  \returns ложь, если за время чтения страницу, ссылку на нее или дерево менял писатель;
+     *  тогда копия не годится и поиск начинается заново.
+     */
+    bool readOptimistic(PageWrapper& pw, UInt pnum, UInt fromPage, UInt fromVersion,
+        UInt treeVersion, UInt& version);
+
+    /** \brief Попытка оптимистичного поиска для search(k, dst): как findLatched(), но без
+     *  защелок. В \c found возвращает, найден ли ключ (и скопирован в \c dst).
+     *
+     *  \returns ложь при конфликте с писателем.
+     */
+    bool findOptimistic(const Byte* k, Byte* dst, bool& found);
+
+    /** \brief Попытка оптимистичного поиска для searchAll(): копирует все записи с ключом,
+     *  равным \c k, в \c recs по getRecSize() байт на запись.
+     *
+     *  \returns ложь при конфликте с писателем.
+     */
+    bool searchAllOptimistic(const Byte* k, std::vector<Byte>& recs);
+
+    /** \brief Часть searchAllOptimistic() для B-дерева: обходит поддерево с корнем в копии
+     *  \c node (версии \c version), как PageWrapper::searchAll().
+     */
+    bool collectOptimistic(const Byte* k, PageWrapper& node, UInt version, UInt treeVersion,
+        std::vector<Byte>& recs);
+
+    /** \brief Дописывает копию записи \c rec в конец \c recs, отводя под нее getRecSize() байт. */
+    void appendRecord(std::vector<Byte>& recs, const Byte* rec) const;
+
+    /** \brief Один из поисков searchAsync(): ключ, прочитанная страница и ее версия. */
+    struct AsyncLookup;
+
+    /** \brief Продвигает поиск \c l по страницам, начиная с прочитанной (или с корня, если
+     *  поиск только начат), пока ему не понадобится страница не из пула — ее чтение
+     *  ставится в очередь с меткой \c tag, и возвращается истина — или пока поиск не
+     *  закончится: тогда возвращает ложь.
+     *
+     *  Страница, измененная писателем после взятия версии, отбрасывается, и поиск
+     *  начинается заново; после OPTIMISTIC_ATTEMPTS попыток он идет с защелками.
+     */
+    bool stepAsync(AsyncLookup& l, UInt tag);
+
+    /** \brief Пакет ключей multiGet() и куда складывать результаты. */
+    struct MultiGetBatch;
+
+    /** \brief Ищет ключи пакета с номерами \c idx[0..cnt) (по возрастанию ключей) в поддереве
+     *  со страницей \c node, прочитанной при версии защелки \c version. Ключи за верхним
+     *  ключом страницы формата pfBLink ищутся у ее правых соседей.
+     *
+     *  \returns число последних из этих ключей, которые нужно искать в следующем справа
+     *  поддереве (первые вхождения могут начинаться в следующем листе B+-дерева).
+     */
+    UInt multiGetPage(MultiGetBatch& b, PageWrapper& node, UInt version, const UInt* idx, UInt cnt);
+
+    /** \brief Часть multiGetPage() для внутреннего узла: делит ключи по детям. */
+    UInt multiGetInner(MultiGetBatch& b, PageWrapper& node, UInt version, const UInt* idx, UInt cnt);
+
+    /** \brief Часть multiGetPage() для листа. */
+    UInt multiGetLeaf(MultiGetBatch& b, PageWrapper& leaf, const UInt* idx, UInt cnt);
+
+    /** \brief Ищет ключи пакета с номерами \c idx[0..cnt) по одному, с защелками. */
+    void multiGetLatched(MultiGetBatch& b, const UInt* idx, UInt cnt);
+
     /** \brief Для заданного порядка и переданного числа ключей определяет, соответствует ли оно
      *  ограничениям на число ключей в ноде для данного порядка, или нет.
      *  
@@ -625,55 +1897,124 @@ protected:
      *  \returns true, если соответствует.
      */
     //bool checkKeysNumber(UShort keysNum, NodeType nt); // bool isRoot);
-    bool checkKeysNumber(UShort keysNum, bool isRoot);
+    bool checkKeysNumber(UShort keysNum, bool isRoot, bool isLeaf);
 
 
     /** \brief Вариант метода checkKeysNumber(), кидающий исключение для неправильного числа ключей. */
-    void checkKeysNumberExc(UShort keysNum, bool isRoot);
+    void checkKeysNumberExc(UShort keysNum, bool isRoot, bool isLeaf);
     //void checkKeysNumberExc(UShort keysNum, NodeType nt); // bool isRoot);
 
 
     /** \brief Записывает в поток (в текущую позицию!) заголовок дерева. */
     void writeHeader();
 
-    /** \brief Читает из потока заголовок дерева. */
-    void readHeader(Header& hdr);
-
+    /** \brief Читает из потока заголовок дерева. Возвращает ложь, если прочитать не удалось. */
+    bool readHeader(Header& hdr);
 
-    // /** \brief Записывает в потоктекущее значение числа страниц (последняя записанная). */
-    //void writePageCounter() { writePageCounter(_lastPageNum); }
-
-
-    /** \brief Записывает в поток поле \c pc, обозначающее число страниц (последняя записанная). */
-    void writePageCounter(); // UInt pc);
-
-    /** \brief Читает из потока поле \c pc, обозначающее число страниц (последняя записанная), в поле. */
-    //UInt 
-    void readPageCounter();
 
+    /** \brief Записывает номера последней, корневой и первой свободной страниц в старший
+     *  слот заголовка со следующим номером контрольной точки.
+     */
+    void writeMeta();
 
-    /** \brief Осуществляет запись номера страницы/нода, соответствующего корню дерева. */
-    void writeRootPageNum(); // UInt rpn);
+    /** \brief Читает номера последней, корневой и первой свободной страниц из целого слота
+     *  заголовка с большим номером. Возвращает ложь, если целых слотов нет.
+     */
+    bool readMeta();
 
-    // /** \brief Запись текущего номера корневой страницы. */
-    //void writeRootPageNum() { writeRootPageNum(_rootPageNum); }
+    /** \brief Возвращает число страниц, целиком лежащих в файле, но не меньше числа страниц
+     *  по заголовку.
+     *
+     *  Без журнала заголовок пишется только в контрольной точке, а пул вытесняет страницы,
+     *  распределенные после нее, раньше: после аварийного завершения процесса они лежат в файле
+     *  за последней страницей по заголовку, и на них могут ссылаться записанные страницы.
+     *  Чтобы их не отдать повторно, при открытии они считаются распределенными.
+     */
+    UInt countFilePages();
 
-    /** \brief Читает из потока номер страницы/нода, соответствующего корню дерева, в поле. */
-    //UInt 
-    void readRootPageNum();
+    /** \brief Выполняет контрольную точку: записывает грязные страницы пула, сбрасывает
+     *  хранилище на носитель, затем, если номера страниц изменились, записывает слот
+     *  заголовка и снова сбрасывает хранилище. Так слот никогда не ссылается на
+     *  незаписанные страницы.
+     *
+     *  В режиме копирования при записи вместе со страницами записывается новая таблица
+     *  страниц, а слоты старой освобождаются только после записи слота заголовка.
+     */
+    void checkpoint();
 
     /** \brief Устаналивает значение номера корневой страницы. 
      *
-     *  Если флаг \c writeFlag == true, тут же записывает этот номер в файл.
+     *  Если флаг \c writeFlag == true, номер будет записан в заголовок на ближайшей
+     *  контрольной точке.
      */
     void setRootPageNum(UInt pnum, bool writeFlag = true);
 
-    /** \brief Задает порядок дерва и пересчитывает связанные значения. */
-    void setOrder(UShort order, UShort recSize);
+    /** \brief Задает порядок дерва, формат и размеры записи и пересчитывает связанные значения,
+     *  включая размеры внутренних узлов B+-дерева.
+     */
+    void setOrder(UShort order, UShort recSize, UShort valueSize = 0, PageFormat format = pfBTree);
+
+    /** \brief Часть setOrder() для страниц со слотами: размер страницы по порядку и
+     *  максимальной длине записи.
+     */
+    void setSlottedOrder();
 
     /** \brief Перераспределяе память для/под рабочие страницы. */
     void reallocWorkPages();
 
+    /** \brief Отвязывает рабочие страницы от внешней памяти (отображения файла). */
+    void detachWorkPages();
+
+#ifdef BTREE_WITH_DELETION
+
+    /** \brief Удаляет за один проход от корня один (\c all == false) или все ключи,
+     *  эквивалентные \c k, и при необходимости уменьшает высоту дерева. Возвращает число
+     *  удаленных ключей.
+     */
+    UInt removeInternal(const Byte* k, bool all);
+
+    /** \brief Освобождает все страницы поддерева с вершиной \c pnum и возвращает число
+     *  записей в нем.
+     *
+     *  Для B+-дерева в \c leafLinks[0] заносится предыдущий лист самого левого листа
+     *  поддерева (если \c leftmost == true, после чего оно сбрасывается), а в
+     *  \c leafLinks[1] — следующий за самым правым.
+     */
+    UInt freeSubtree(UInt pnum, UInt* leafLinks, bool& leftmost);
+
+    /** \brief Удаление для B+-дерева: находит курсором первый эквивалентный \c k ключ,
+     *  удаляет из его листа до \c maxNum ключей и восстанавливает заполненность узлов
+     *  снизу вверх по пути курсора.
+     */
+    UInt removeBPlus(const Byte* k, UInt maxNum);
+
+#endif // BTREE_WITH_DELETION
+
+    /** \brief Открытый (заполняемый) узел одного уровня при массовой загрузке. */
+    struct BulkLevel;
+
+    /** \brief Добавляет ключ \c key (с левым поддеревом \c leftChild для внутренних уровней)
+     *  в открытый узел уровня \c level. Если узел уже заполнен до доли \c fillFactor от
+     *  своего максимума, он записывается, а ключ уходит на уровень выше.
+     */
+    void bulkPush(std::vector<std::unique_ptr<BulkLevel> >& levels, size_t level,
+        const Byte* key, UInt leftChild, float fillFactor);
+
+    /** \brief Дописывает открытый узел уровня в конец файла и начинает на уровне новый.
+     *
+     *  Сжатая страница перед записью получает границы: нижнюю, запомненную уровнем, и
+     *  \c high, которая запоминается как нижняя для следующего узла.
+     */
+    UInt bulkWriteLevel(BulkLevel& lv, const Byte* high = nullptr);
+
+    /** \brief Выравнивает последнего ребенка страницы \c pnum с его левым соседом: сливает их,
+     *  если ключи помещаются в один узел, иначе делит поровну (страницы со слотами — по
+     *  байтам, см. PageWrapper::rebalanceSlotted()).
+     *
+     *  \returns истину, если последний ребенок был недозаполнен.
+     */
+    bool rebalanceLastChild(UInt pnum);
+
 
     /** \brief Закрытая и основная часть метода readPage(). */
     void readPageInternal(UInt pnum, Byte* dst);
@@ -681,11 +2022,79 @@ protected:
     /** \brief Закрытая и основная часть метода writePage(). */
     void writePageInternal(UInt pnum, const Byte* dst);
 
-    /** \brief Позиционируется на смещение в файле, соответствующее номеру страницы \c pnum. */
-    void gotoPage(UInt pnum);
+    /** \brief Реализация IPageStore: подгрузка страницы для буферного пула. */
+    virtual void loadPage(UInt pnum, Byte* dst) override;
+
+    /** \brief Реализация IPageStore: запись страницы, вытесняемой из буферного пула. */
+    virtual void storePage(UInt pnum, const Byte* src) override;
+
+    /** \brief Для дерева, отображенного в память, возвращает указатель на страницу \c pnum
+     *  внутри отображения, иначе nullptr.
+     *
+     *  Требования к номеру страницы такие же, как и у readPage().
+     */
+    Byte* mapPage(UInt pnum);
 
     /** \brief Закрытая и основная часть метода allocPage(). */
     UInt allocPageInternal(PageWrapper& pw, UShort keysNum, bool isRoot, bool isLeaf);
+
+    /** \brief Увеличивает число страниц на одну (в режиме копирования при записи — со
+     *  слотом для нее) и возвращает номер новой страницы.
+     *
+     *  Если номера страниц (слотов) исчерпаны или файл превысил бы MAX_FILE_SIZE, кидает
+     *  std::overflow_error, ничего не изменяя.
+     */
+    UInt appendPageNum();
+
+    /** \brief Возвращает образ страницы \c pnum снимка \c snap, прочитав его из слота
+     *  по таблице снимка, если снимок его еще не хранит.
+     *
+     *  Не трогает изменяемого состояния дерева, поэтому вызывается без защелок.
+     */
+    PageFrame readSnapshotPage(const Snapshot& snap, UInt pnum);
+
+    /** \brief Начинает таблицу страниц, в которой страницы лежат в слотах со своими номерами. */
+    void initPageMap();
+
+    /** \brief Возвращает таблицу страниц для изменения, предварительно скопировав ее, если
+     *  она разделяется со снимками.
+     */
+    PageMap& getMutablePageMap();
+
+    /** \brief Перед изменением страницы \c pnum переносит ее в новый слот, если текущий
+     *  слот могут видеть снимок или контрольная точка.
+     */
+    void shadowPage(UInt pnum);
+
+    /** \brief Выделяет свободный слот или новый в конце файла. */
+    UInt allocSlot();
+
+    /** \brief Записывает грязные страницы пула и делает все слоты дерева неизменяемыми:
+     *  следующая запись любой страницы уйдет в новый слот.
+     */
+    void freezePages();
+
+    /** \brief Записывает таблицу страниц в цепочку новых слотов (в начале каждого —
+     *  номер следующего).
+     */
+    void writePageTable();
+
+    /** \brief Читает таблицу страниц из цепочки слотов, начиная со слота \c first, и
+     *  считает свободными слоты, на которые она не ссылается. Возвращает ложь, если
+     *  цепочка повреждена.
+     */
+    bool readPageTable(UInt first);
+
+    /** \brief Делает свободными освобожденные слоты, которые не видят ни открытые снимки,
+     *  ни последняя контрольная точка.
+     */
+    void reclaimSlots();
+
+    /** \brief Закрывает снимок \c snap и освобождает то, что держал только он. */
+    void releaseSnapshot(Snapshot* snap);
+
+    /** \brief Закрывает все открытые снимки дерева. */
+    void detachSnapshots();
     //UInt allocPageInternal(UShort keysNum, NodeType nt, PageWrapper& pw); // bool isLeaf);
 
     /** \brief Выполняет "сброс" параметров дерева.
@@ -723,18 +2132,88 @@ protected:
     /** \brief Определяет длину записи ключа. */
     UShort _recSize;
 
+    /** \brief Длина ключа в начале записи. */
+    UShort _keySize;
+
+    /** \brief Порядок внутренних узлов B+-дерева. */
+    UShort _innerOrder;
+
+    /** \brief Максимальное число ключей во внутреннем узле B+-дерева. */
+    UInt _innerMaxKeys;
+
+    /** \brief Минимальное число ключей во внутреннем узле B+-дерева. */
+    UInt _innerMinKeys;
+
+    /** \brief Смещение области курсоров во внутреннем узле B+-дерева. */
+    UInt _innerCursorsOfs;
+
+    /** \brief Смещение каталога слотов в странице со слотами. */
+    UInt _slotsOfs;
+
+    /** \brief Смещение ссылки на правого соседа внутреннего узла, а за ней — верхнего ключа
+     *  в странице формата pfBLink.
+     */
+    UInt _linkOfs;
+
+    /** \brief Формат страниц дерева. */
+    PageFormat _format;
+
     /** \brief Номер текущей свободной страницы и оно же — число записанных страниц + 1. */
-    UInt _lastPageNum;
+    std::atomic<UInt> _lastPageNum;
 
     /** \brief Хранит номер текущей страницы с корневым элементом дерева. */
-    UInt _rootPageNum;
+    std::atomic<UInt> _rootPageNum;
+
+    /** \brief Номер первой страницы в списке свободных, 0 — список пуст. */
+    UInt _freePageNum;
+
+    /** \brief Номер последней записанной контрольной точки (слота заголовка). */
+    UInt _metaSeq;
+
+    /** \brief Номера страниц изменились после последней записи слота заголовка. */
+    std::atomic<bool> _metaDirty;
+
+    /** \brief Включать ли копирование при записи в create()/open(). */
+    bool _cowEnabled;
+
+    /** \brief Таблица страниц, nullptr — режим копирования при записи выключен. */
+    std::shared_ptr<PageMap> _pageMap;
+
+    /** \brief Номер последнего слота файла. */
+    UInt _lastSlotNum;
+
+    /** \brief Признаки слотов, выделенных после последней заморозки (freezePages()):
+     *  такие слоты никто, кроме текущего дерева, не видит, и они перезаписываются на месте.
+     */
+    std::vector<bool> _freshSlots;
+
+    /** \brief Слоты, готовые к повторному использованию. */
+    std::vector<UInt> _freeSlots;
+
+    /** \brief Слоты, освобожденные копированием страниц, с эпохой, в которой это произошло. */
+    std::vector<std::pair<UInt, UInt> > _retiredSlots;
+
+    /** \brief Слоты таблицы страниц последней контрольной точки. */
+    std::vector<UInt> _pageTableSlots;
+
+    /** \brief Номер эпохи: увеличивается при каждой заморозке слотов. */
+    UInt _cowEpoch;
+
+    /** \brief Эпоха, начатая последней контрольной точкой. */
+    UInt _durableEpoch;
+
+    /** \brief Открытые снимки. */
+    std::set<Snapshot*> _snapshots;
 
 
     // /** \brief Минимальное число элементов — определяется порядком (order - 1) */
     //UWord _minKeyNum;
 
-    /** \brief Поток, ассоциированный с объектом, куда дерево пишется и откуда читается. */
-    std::iostream* _stream;
+    /** \brief Хранилище, ассоциированное с объектом, куда дерево пишется и откуда читается. */
+    IPageIO* _io;
+
+    /** \brief Механизм асинхронного чтения страниц поверх _io, nullptr — нет. */
+    IAsyncPageIO* _asyncIO;
 
 
     /** \brief Обертка над корневой страницей, которая всегда в памяти хранится. */
@@ -746,8 +2225,8 @@ protected:
     // */
     //PageWrapper* _rootPage;
 
-    ///** \brief Обертка над текущей рабочей страницей, предоставляющая интерфейс для удобного доступа. */
-    //PageWrapper _workPage;
+    /** \brief Обертка над текущей рабочей страницей, в которую поиск читает узлы при спуске. */
+    PageWrapper _workPage;
 
 
     //PageWrapper _wp0;               ///< TODO: рабочая страница 0
@@ -760,6 +2239,42 @@ protected:
     /** \brief Компаратор для сравнения ключей. */
     IComparator* _comparator;
 
+    /** \brief Емкость буферного пула в страницах. */
+    UInt _cacheCapacity;
+
+    /** \brief Буферный пул страниц. */
+    PageCache _cache;
+
+    /** \brief Порог перехода к линейному поиску внутри узла. */
+    UShort _linearSearchThreshold;
+
+    /** \brief Ядро поиска lower bound внутри узла, nullptr — поиск через компаратор. */
+    KeyBoundFunc _lowerBoundFunc;
+
+    /** \brief Ядро поиска upper bound внутри узла, nullptr — поиск через компаратор. */
+    KeyBoundFunc _upperBoundFunc;
+
+    /** \brief Защелка дерева: вставки и поиски берут ее в разделяемом режиме, остальные
+     *  операции (и вставки, если !isConcurrent()) — в исключительном.
+     */
+    TreeLatch _treeLatch;
+
+    /** \brief Защелка номера корня, родитель корневой страницы при спуске: вставка держит
+     *  ее исключительно, пока корень может разделиться.
+     */
+    Latch _rootLatch;
+
+    /** \brief Защелки страниц. */
+    PageLatches _pageLatches;
+
+    /** \brief Упорядочивает распределение и освобождение страниц параллельными вставками. */
+    std::mutex _allocMutex;
+
+    /** \brief Отдает механизм асинхронного чтения одному searchAsync() за раз. */
+    std::mutex _asyncMutex;
+
+    /** \brief Включено оптимистичное чтение. */
+    bool _optimisticReads;
 
 }; // class BaseBTree
 
@@ -772,6 +2287,15 @@ protected:
  *  Конкретизирует понятие дерево на случай использования файла для хранения.
  */
 class FileBaseBTree : public BaseBTree {
+public:
+    /** \brief Определяет, через что дерево работает с файлом. */
+    enum StorageMode
+    {
+        smStream,               ///< Файловый поток std::fstream (по умолчанию) с fsync() при сбросе.
+        smPosix,                ///< Позиционный ввод-вывод pread()/pwrite().
+        smMapped                ///< Отображение файла в память (mmap).
+    };
+
 public:
     /** \brief Конструктор по умолчанию.
      *
@@ -788,7 +2312,8 @@ public:
      *  Конструктор эквивалентен созданию объекта с параметрами по умолчанию с последующим
      *  открытием методом open().
      */
-    FileBaseBTree(UShort order, UShort recSize, IComparator* comparator, const std::string& fileName);
+    FileBaseBTree(UShort order, UShort recSize, IComparator* comparator, const std::string& fileName,
+        PageFormat format = pfBTree, UShort valueSize = 0);
 
 
     /** \brief Конструирует дерево на основе существующего файла B-дерева.
@@ -813,9 +2338,11 @@ public:
     /** \brief Открывает неактивное к моменту вызова метода дерево по типу конструктора с таким же
      *  набором параметров.
      *  Если дерево уже открыто, генерирует исключительную ситуацию.
+     *
+     *  Последние \c valueSize байт записи длиной \c recSize — значение, остальные — ключ.
      */
     void create(UShort order, UShort recSize, //IComparator* comparator, 
-        const std::string& fileName);
+        const std::string& fileName, PageFormat format = pfBTree, UShort valueSize = 0);
 
     /** \brief Загружает дерево из файла.
      *
@@ -829,6 +2356,70 @@ public:
      *  Если дерево не открыто, просто ничего не делает (искл. НЕ генерирует для удобства).
      */
     void close();
+
+    /** \brief Задает хранилище для последующих create()/open().
+     *
+     *  В режиме smMapped страничные обертки указывают непосредственно внутрь отображения,
+     *  а не копируют страницы в собственный буфер; буферный пул не используется.
+     *  Если дерево открыто, генерирует исключительную ситуацию.
+     */
+    void setStorageMode(StorageMode mode);
+
+    /** \brief Возвращает хранилище, которое будут использовать create()/open(). */
+    StorageMode getStorageMode() const { return _storageMode; }
+
+    /** \brief Задает для последующих create()/open() в режиме smMapped резерв адресного
+     *  пространства \c reserve, до которого может вырасти файл (см. MappedFile).
+     *  Если дерево открыто, генерирует исключительную ситуацию.
+     */
+    void setMappedReserve(size_t reserve);
+
+    /** \brief Возвращает резерв адресного пространства для режима smMapped. */
+    size_t getMappedReserve() const { return _mappedFile.getReserve(); }
+
+    /** \brief Включает для последующих create()/open() журнал упреждающей записи в файле
+     *  с именем файла дерева и суффиксом ".wal" (см. WalPageIO).
+     *
+     *  С журналом каждая вставка, удаление или массовая загрузка либо попадает в файл
+     *  целиком, либо не попадает вовсе, и завершается, когда журнал с ней сброшен на
+     *  носитель; операции, завершающиеся одновременно, делят один сброс (см. WalPageIO).
+     *  Журнал, оставшийся после аварийного завершения, open()
+     *  восстанавливает независимо от этого режима. Отображение файла в память (smMapped)
+     *  журнал не поддерживает.
+     *  Если дерево открыто, генерирует исключительную ситуацию.
+     */
+    void setWalEnabled(bool enabled);
+
+    /** \brief Возвращает истину, если create()/open() будут вести журнал. */
+    bool isWalEnabled() const { return _walEnabled; }
+
+    /** \brief Возвращает журнал (для настройки контрольных точек и статистики). */
+    WalPageIO& getWal() { return _walIO; }
+
+    /** \brief Задает для последующих create()/open() глубину асинхронного чтения страниц
+     *  (см. searchAsync()): наибольшее число чтений в полете; 0 (по умолчанию) — без него.
+     *
+     *  В режиме smPosix без журнала чтения идут через io_uring, если система его
+     *  допускает; иначе их выполняет пул потоков поверх хранилища. Для smMapped
+     *  асинхронное чтение не нужно и не включается.
+     *  Если дерево открыто, генерирует исключительную ситуацию.
+     */
+    void setAsyncDepth(UInt depth);
+
+    /** \brief Возвращает глубину асинхронного чтения для create()/open(). */
+    UInt getAsyncDepth() const { return _asyncDepth; }
+
+    /** \brief Возвращает истину, если открытое дерево читает асинхронно через io_uring. */
+    bool isUring() const { return _asyncIO == &_uringIO; }
+
+    /** \brief Делает устойчивыми к сбою все завершенные операции (контрольная точка):
+     *  записывает грязные страницы пула в порядке номеров и сбрасывает журнал или,
+     *  без журнала, сам файл на носитель.
+     *
+     *  В режиме копирования при записи публикует новую таблицу страниц; слоты, которые
+     *  занимали прежние версии страниц, до этого повторно не используются.
+     */
+    void sync();
 public:
 
     // /** \brief Возвращает истину, если дерево открыто, ложь иначе. */
@@ -841,7 +2432,7 @@ protected:
      *  и метода open() не выполняет никаких проверок, которые подразумеваются быть сделанными там.
      */
     void createInternal(UShort order, UShort recSize, // IComparator* comparator, 
-        const std::string& fileName);
+        const std::string& fileName, PageFormat format, UShort valueSize);
 
     /** \brief Загружает дерево из файла \c fileName.
      *
@@ -857,8 +2448,24 @@ protected:
      */
     void closeInternal();
 
-    /** \brief Проверяет параметры дерева и, если они некорректны, киает исключение. */
-    void checkTreeParams(UShort order, UShort recSize);
+    /** \brief Проверяет параметры дерева и, если они некорректны, киает исключение.
+     *
+     *  B+-дерево требует порядка не меньше 2, иначе при делении листа одна из половин пуста.
+     *  Для страниц со слотами порядок задает размер страницы: в нее помещается 2 * order - 1
+     *  записей максимальной длины.
+     */
+    void checkTreeParams(UShort order, UShort recSize, PageFormat format, UShort valueSize);
+
+    /** \brief Открывает файл \c fileName в хранилище, заданном _storageMode, и привязывает
+     *  его к дереву. Если \c trunc == true, содержимое файла удаляется.
+     *
+     *  Журнал существующего файла восстанавливается, журнал нового — удаляется; если
+     *  журнал включен, дерево далее пишет через него.
+     */
+    void openStorage(const std::string& fileName, bool trunc);
+
+    /** \brief Закрывает хранилище. Отображенный в память файл обрезается до \c mappedSize байт. */
+    void closeStorage(size_t mappedSize);
 
 protected:
     /** \brief Имя файла с деревом. */
@@ -866,6 +2473,33 @@ protected:
 
     /** \brief Файловый поток, храняющий дерево. */
     std::fstream _fileStream;
+
+    /** \brief Ввод-вывод через файловый поток. */
+    StreamPageIO _streamIO;
+
+    /** \brief Позиционный ввод-вывод (pread/pwrite). */
+    PosixPageIO _posixIO;
+
+    /** \brief Отображение файла в память (для соответствующего режима). */
+    MappedFile _mappedFile;
+
+    /** \brief Журнал упреждающей записи поверх одного из хранилищ выше. */
+    WalPageIO _walIO;
+
+    /** \brief Асинхронное чтение файла _posixIO через io_uring. */
+    UringPageIO _uringIO;
+
+    /** \brief Асинхронное чтение пулом потоков там, где io_uring недоступен. */
+    ThreadPoolPageIO _poolIO;
+
+    /** \brief Хранилище для create()/open(). */
+    StorageMode _storageMode;
+
+    /** \brief Глубина асинхронного чтения для create()/open(), 0 — без него. */
+    UInt _asyncDepth;
+
+    /** \brief Вести ли журнал в create()/open(). */
+    bool _walEnabled;
 }; // class FileBaseBTree
 
 
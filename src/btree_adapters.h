@@ -1,341 +1,602 @@
-﻿
-/// \file
-/// \brief     Адаптеры для некоторых типов для B-дерева.
-/// \author    Sergey Shershakov
-/// \version   0.1.0
-/// \date      01.05.2017
-///            This is a part of the course "Algorithms and Data Structures" 
-///            provided by  the School of Software Engineering of the Faculty 
-///            of Computer Science at the Higher School of Economics.
-///
-///
-////////////////////////////////////////////////////////////////////////////////
-
-
-#ifndef BTREE_BTREEADAPTERS_H_
-#define BTREE_BTREEADAPTERS_H_
-
-
-#include <string>
-#include <fstream>
-
-#include "btree.h"
-
-
-namespace xi {
-
-
-/** \brief Класс свойств (черт, traits), определяющий необходимые всопомогательные компоненты,
- *  ассоциированные с типом данных T.
- *
- *  Введение в классы свойств см. https://accu.org/index.php/journals/442
- */
-template <typename T>
-struct BTreeAdapterTraits {
-
-
-    //-----<объявляем нужные типы>-----
-
-    /** \brief Тип неизменяемого аргумента: в большинстве случаев — конст. ссылка, но для некоторых 
-        (интегральных в частности) типов дешевле передавать по значению.
-     */
-    typedef const T&                TArg;
-
-    /** \brief Тип-ссыка основного типа ключа. */
-    typedef T&                      TRef;
-
-
-    /** \brief Тип результата получения ключа. В большинстве случаев по значению, 
-     *  так как придется выполнять преобразование типов.
-     *  // TODO: Для случаев, когда дорого дважды копировать, можно рассмотреть
-     *  семантику перемещения (проверить со string)
-     */
-    typedef T                       TRes;
-
-
-    /** \brief Тип для получение значения ключа через ссылку, передаваемую в параметр метода. */
-    typedef T&                      TRefRes;
-
-
-    /** \brief Описывает константный указатель на тип. */
-    typedef const T*                TConstPtr;
-
-    
-
-
-    //-----<Константы>-----
-    /** \brief Размер записи, по умолчанию определяется размером типа. 
-     *
-     *  Константу необходимо переопределять для сложных типов, например, string
-     */
-    static const UShort REC_SIZE = sizeof(T);
-
-
-    //-----<статические методы>-----
-
-    /** \brief Выполняет сравнение двух ключей дерева B-tree, как это указано 
-     *  в компараторе BaseBTree::IComparator. Наивная реализация приводит указатели к
-     *  соответствующим указателям на типы, разыменовывает их и сравнивает без учета размера.
-     */
-    //static int compare(const Byte* lhv, const Byte* rhv, UInt sz)
-    static bool compare(const Byte* lhv, const Byte* rhv, UInt sz)
-    {
-        TConstPtr lp = (TConstPtr)lhv;
-        TConstPtr rp = (TConstPtr)rhv;
-
-        if (*lp < *rp)
-            return true;
-        return false;
-
-
-        //if (*lp < *rp)
-        //    return -1;
-        //if (*lp > *rp)
-        //    return 1;
-        //return 0;
-    }
-
-
-    // простейшая реализация — побайтное сравнение
-    static bool isEqual(const Byte* lhv, const Byte* rhv, UInt sz)
-    {
-        TConstPtr lp = (TConstPtr)lhv;
-        TConstPtr rp = (TConstPtr)rhv;
-
-        for (UInt i = 0; i < sz; ++i)
-            if (*lp != *rp)
-                return false;
-
-        return true;
-    }
-
-    /** \brief Дефолтная реализация метода преобразования потока байт в тип ключа. */
-    static void raw2keyRes(const Byte* raw, TRef key)
-    {
-        key = *((const T*)raw);
-    }
-
-    /** \brief Дефолтная реализация метода преобразования ключа (типом) в поток байт. */
-    static void key2Raw(Byte* raw, TArg key)
-    {
-        *((T*)raw) = key;
-    }
-
-
-}; //  class BTreeAdapterTraits
-
-
-
-/** \brief Реализация компаратора по умолчанию, основанная на соответствуем методе compare()
- *  из класса свойств.
- */
-template<
-    typename T,                                 // тип данных, как его видит программист
-    typename Traits = BTreeAdapterTraits<T>      // класс свойств ПО УМОЛЧАНИЮ
->
-struct BTreeComparator : public BaseBTree::IComparator {
-    
-    virtual bool compare(const Byte* lhv, const Byte* rhv, UInt sz) override 
-    {
-        // по умолчанию — передаем право выполнить сравнение классу свойств
-        return Traits::compare(lhv, rhv, sz);
-    }
-
-    // простейшая реализация — побайтное сравнение
-    virtual bool isEqual(const Byte* lhv, const Byte* rhv, UInt sz) override
-    {
-        return Traits::isEqual(lhv, rhv, sz);
-    }
-
-}; // struct BTreeComparator
-
-
-/** \brief Адаптер для B-дерева, получающий тип ключа из параметра шаблона, а дополнительную
- *  информацию из специального класса свойств (traits).
- *
- *  elaborate
- */
-template<   
-    typename T,                                 // тип данных, как его видит программист
-    typename Traits = BTreeAdapterTraits<T>,     // класс свойств ПО УМОЛЧАНИЮ
-    typename Compar = BTreeComparator<T, Traits> // компаратор
-        >
-class BTreeAdapter {
-public:
-    // основные рабочие типы берем из класса свойств!
-
-    
-    typedef typename Traits::TArg       TArg;
-    typedef typename Traits::TRes       TRes;
-
-
-public:
-    // основные рабочие константы берем из класса свойств!
-    /** \brief Размер записи, по умолчанию определяется размером типа. */
-    static const UShort REC_SIZE = Traits::REC_SIZE;
-
-
-public:
-
-    /** \brief Конструктор по умолчанию.
-     *
-     *  Для "открытия" дерева необходимо использовать метод open().
-     */
-    BTreeAdapter() { _btree.setComparator(&_comparator); };
-
-    /** \brief Конструирует дерево и загружает его содержимое из файла \c fileName. */
-    BTreeAdapter(const std::string& fileName) : BTreeAdapter()
-    {
-        openInternal(fileName);
-    }
-
-
-    /** \brief Конструирует дерево с заданным порядком \c order и и ассоциирует его с файлом \c fileName. */
-    BTreeAdapter(UShort order, const std::string& fileName) : BTreeAdapter()
-    {
-        createInternal(order, fileName);
-    }
-
-
-    /** \brief Деструктор. */
-    ~BTreeAdapter()
-    {
-        _btree.close();
-    }
-
-protected:
-    BTreeAdapter(const BTreeAdapter&);                          ///< КК не доступен.
-    BTreeAdapter& operator= (BTreeAdapter&);                    ///< Оператор присваивания недоступен.
-
-public:
-
-    /** \brief Конструирует дерево по типу конструктора BTreeAdapter(const std::string& fileName). */
-    void open(const std::string& fileName)
-    {
-        openInternal(fileName);
-    }
-
-
-    /** \brief Конструирует дерево по типу конструктора BTreeAdapter(UShort order, const std::string& fileName). */
-    void create(UShort order, const std::string& fileName)
-    {
-        createInternal(order, fileName);
-    }
-
-
-    /** \brief Прокси-хелпер для закрытия дерева. */
-    void close()
-    {
-        _btree.close();
-    }
-
-public:
-    // основные методы доступа к типизированным объектам
-    
-
-    /** \brief Получает ключ по значению, номер ключа — \c num.
-     *
-     *  Политика относительно номера ключа та же, что и для метода
-     *  BaseBTree::PageWrapper::getKey() .
-     */
-    //TRes getKeyWork(UShort num)
-    TRes getKey(BaseBTree::PageWrapper& pw, UShort num)
-    {
-        // получаем указатель на сырые данные, представляющие ключ
-        //Byte* kp = _btree.getWorkPage().getKey(num);
-        Byte* kp = pw.getKey(num);
-        
-
-        TRes res;
-        Traits::raw2keyRes(kp, res);
-
-        return res;         // вот это чуть дороговато
-    }
-
-    /** \brief Устанавливает ключ по значению, номер ключа — \c num.
-     *
-     *  Политика относительно номера ключа та же, что и для метода
-     *  BaseBTree::PageWrapper::getKey() .
-     *  В зависимости от типа в адаптере, значение для установки передается либо по ссылке,
-     *  либо по значению (опреляется типом TArg).
-     */
-
-    //void setKeyWork(UShort num, TArg key)
-    void setKey(BaseBTree::PageWrapper& pw, UShort num, TArg key)
-    {
-        // получаем указатель на сырые данные, представляющие ключ
-        //Byte* kp = _btree.getWorkPage().getKey(num);
-        Byte* kp = pw.getKey(num);
-
-        Traits::key2Raw(kp, key);
-    }
-
-
-
-//public:
-//    // некоторые прокси-методы, для удо
-
-
-
-public:
-    // сеттеры/геттеры
-
-    /** \brief Возвращает подлежащее дерево. */
-    FileBaseBTree& getTree() { return _btree;  }
-
-    /** \brief Возвращает константно подлежащее дерево. */
-    const FileBaseBTree& getTree() const { return _btree; }
-
-
-protected:
-
-    /** \brief Реализует конструктор BTreeAdapter(const std::string& fileName). */
-    void openInternal(const std::string& fileName)
-    {
-        _btree.open(fileName);  // , &_comparator);
-
-        // если открылось нормально, проверим, подходит ли дерево под параметры шаблона
-        if (_btree.getRecSize() != REC_SIZE)                // размер записи
-            throw std::runtime_error("Key size mismatch. Wrong file");
-
-        //if (_btree.getOrder() != REC_SIZE)                // размер записи
-        //    throw std::runtime_error("Key size mismatch. Wrong file")
-
-    }
-
-    /** \brief Реализует конструктор BTreeAdapter(UShort order, const std::string& fileName). */
-    void createInternal(UShort order, const std::string& fileName)
-    {
-        _btree.create(order, REC_SIZE, fileName);
-    }
-
-protected:
-
-    /** \brief Подлежащий объект-дерево. */
-    FileBaseBTree _btree;
-
-    /** \brief Компаратор, как отдельный объект */
-    Compar _comparator;
-
-}; // class Int32BTree 
-
-
-
-
-
-
-//class BTreeIntAdapter : public BTreeAdapter<>
-typedef BTreeAdapter<int> BTreeIntAdapter;
-
-
-
-
-
-} // namespace xi
-
-
-
-
-
-
-#endif // BTREE_BTREEADAPTERS_H_
+﻿
+/// \file
+/// \brief     Адаптеры для некоторых типов для B-дерева.
+/// \author    Sergey Shershakov
+/// \version   0.1.0
+/// \date      01.05.2017
+///            This is a part of the course "Algorithms and Data Structures" 
+///            provided by  the School of Software Engineering of the Faculty 
+///            of Computer Science at the Higher School of Economics.
+///
+///
+////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef BTREE_BTREEADAPTERS_H_
+#define BTREE_BTREEADAPTERS_H_
+
+
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+#include "btree.h"
+#include "node_search.h"
+
+
+namespace xi {
+
+
+/** \brief Класс свойств (черт, traits), определяющий необходимые всопомогательные компоненты,
+ *  ассоциированные с типом данных T.
+ *
+ *  Введение в классы свойств см. https://accu.org/index.php/journals/442
+ */
+template <typename T>
+struct BTreeAdapterTraits {
+
+
+    //-----<объявляем нужные типы>-----
+
+    /** \brief Тип неизменяемого аргумента: в большинстве случаев — конст. ссылка, но для некоторых 
+        (интегральных в частности) типов дешевле передавать по значению.
+     */
+    typedef const T&                TArg;
+
+    /** \brief Тип-ссыка основного типа ключа. */
+    typedef T&                      TRef;
+
+
+    /** \brief Тип результата получения ключа. В большинстве случаев по значению, 
+     *  так как придется выполнять преобразование типов.
+     *  // TODO: Для случаев, когда дорого дважды копировать, можно рассмотреть
+     *  семантику перемещения (проверить со string)
+     */
+    typedef T                       TRes;
+
+
+    /** \brief Тип для получение значения ключа через ссылку, передаваемую в параметр метода. */
+    typedef T&                      TRefRes;
+
+
+    /** \brief Описывает константный указатель на тип. */
+    typedef const T*                TConstPtr;
+
+    
+
+
+    //-----<Константы>-----
+    /** \brief Размер записи, по умолчанию определяется размером типа. 
+     *
+     *  Константу необходимо переопределять для сложных типов, например, string
+     */
+    static const UShort REC_SIZE = sizeof(T);
+
+
+    //-----<статические методы>-----
+
+    /** \brief Выполняет сравнение двух ключей дерева B-tree, как это указано 
+     *  в компараторе BaseBTree::IComparator. Наивная реализация приводит указатели к
+     *  соответствующим указателям на типы, разыменовывает их и сравнивает без учета размера.
+     */
+    //static int compare(const Byte* lhv, const Byte* rhv, UInt sz)
+    static bool compare(const Byte* lhv, const Byte* rhv, UInt sz)
+    {
+        TConstPtr lp = (TConstPtr)lhv;
+        TConstPtr rp = (TConstPtr)rhv;
+
+        if (*lp < *rp)
+            return true;
+        return false;
+
+
+        //if (*lp < *rp)
+        //    return -1;
+        //if (*lp > *rp)
+        //    return 1;
+        //return 0;
+    }
+
+
+    // простейшая реализация — побайтное сравнение
+    static bool isEqual(const Byte* lhv, const Byte* rhv, UInt sz)
+    {
+        TConstPtr lp = (TConstPtr)lhv;
+        TConstPtr rp = (TConstPtr)rhv;
+
+        for (UInt i = 0; i < sz; ++i)
+            if (*lp != *rp)
+                return false;
+
+        return true;
+    }
+
+    /** \brief Дефолтная реализация метода преобразования потока байт в тип ключа. */
+    static void raw2keyRes(const Byte* raw, TRef key)
+    {
+        key = *((const T*)raw);
+    }
+
+    /** \brief Дефолтная реализация метода преобразования ключа (типом) в поток байт. */
+    static void key2Raw(Byte* raw, TArg key)
+    {
+        *((T*)raw) = key;
+    }
+
+
+}; //  class BTreeAdapterTraits
+
+
+
+/** \brief Класс свойств для строковых ключей длиной до \c MaxLen символов.
+ *
+ *  Ключ хранится как запись переменной длины: поле длины (BaseBTree::VAR_LEN_SZ байт) и
+ *  символы без завершающего нуля. Такие записи подходят для любого формата страниц, но
+ *  только страницы со слотами (BaseBTree::pfSlotted) не хранят их дополненными до REC_SIZE.
+ *  Строки сравниваются побайтно, поэтому годится и формат BaseBTree::pfCompressed.
+ */
+template <UShort MaxLen = 255>
+struct BTreeStringTraits {
+
+    typedef const std::string&      TArg;
+    typedef std::string&            TRef;
+    typedef std::string             TRes;
+    typedef std::string&            TRefRes;
+    typedef const std::string*      TConstPtr;
+
+    /** \brief Максимальная длина записи: поле длины и MaxLen символов. */
+    static const UShort REC_SIZE = BaseBTree::VAR_LEN_SZ + MaxLen;
+
+    /** \brief Сравнивает строки лексикографически по байтам, более короткий префикс — меньше. */
+    static bool compare(const Byte* lhv, const Byte* rhv, UInt /*sz*/)
+    {
+        UShort ll = *((const UShort*)lhv);
+        UShort rl = *((const UShort*)rhv);
+        int res = memcmp(lhv + BaseBTree::VAR_LEN_SZ, rhv + BaseBTree::VAR_LEN_SZ, ll < rl ? ll : rl);
+
+        return res < 0 || (res == 0 && ll < rl);
+    }
+
+    static bool isEqual(const Byte* lhv, const Byte* rhv, UInt /*sz*/)
+    {
+        UShort ll = *((const UShort*)lhv);
+        return ll == *((const UShort*)rhv)
+            && memcmp(lhv + BaseBTree::VAR_LEN_SZ, rhv + BaseBTree::VAR_LEN_SZ, ll) == 0;
+    }
+
+    static void raw2keyRes(const Byte* raw, TRef key)
+    {
+        key.assign((const char*)raw + BaseBTree::VAR_LEN_SZ, *((const UShort*)raw));
+    }
+
+    /** \brief Записывает строку \c key; если она длиннее MaxLen, кидает std::invalid_argument. */
+    static void key2Raw(Byte* raw, TArg key)
+    {
+        if (key.size() > MaxLen)
+            throw std::invalid_argument("String key is too long");
+
+        *((UShort*)raw) = (UShort)key.size();
+        memcpy(raw + BaseBTree::VAR_LEN_SZ, key.data(), key.size());
+    }
+
+}; // struct BTreeStringTraits
+
+
+
+/** \brief Реализация компаратора по умолчанию, основанная на соответствуем методе compare()
+ *  из класса свойств.
+ */
+template<
+    typename T,                                 // тип данных, как его видит программист
+    typename Traits = BTreeAdapterTraits<T>      // класс свойств ПО УМОЛЧАНИЮ
+>
+struct BTreeComparator : public BaseBTree::IComparator {
+    
+    virtual bool compare(const Byte* lhv, const Byte* rhv, UInt sz) override 
+    {
+        // по умолчанию — передаем право выполнить сравнение классу свойств
+        return Traits::compare(lhv, rhv, sz);
+    }
+
+    // простейшая реализация — побайтное сравнение
+    virtual bool isEqual(const Byte* lhv, const Byte* rhv, UInt sz) override
+    {
+        return Traits::isEqual(lhv, rhv, sz);
+    }
+
+}; // struct BTreeComparator
+
+
+
+/** \brief Ядра поиска внутри узла (см. BaseBTree::KeyBoundFunc), сравнивающие ключи
+ *  непосредственно через Traits::compare().
+ *
+ *  Так как тип ключа известен на этапе компиляции, сравнение встраивается в цикл поиска
+ *  и не требует виртуального вызова на каждый ключ.
+ */
+template <typename Traits>
+struct BTreeNodeSearch {
+
+    /** \brief Возвращает номер первого ключа, не меньшего \c key. */
+    static UShort lowerBound(const Byte* keys, UShort keysNum, const Byte* key,
+        UShort recSize, UShort linearThreshold)
+    {
+        UShort lo = 0;
+        UShort hi = keysNum;
+        while (hi - lo > linearThreshold)
+        {
+            UShort mid = lo + (hi - lo) / 2;
+            if (Traits::compare(keys + (size_t)mid * recSize, key, recSize))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        while (lo < hi && Traits::compare(keys + (size_t)lo * recSize, key, recSize))
+            ++lo;
+
+        return lo;
+    }
+
+    /** \brief Возвращает номер первого ключа, большего \c key. */
+    static UShort upperBound(const Byte* keys, UShort keysNum, const Byte* key,
+        UShort recSize, UShort linearThreshold)
+    {
+        UShort lo = 0;
+        UShort hi = keysNum;
+        while (hi - lo > linearThreshold)
+        {
+            UShort mid = lo + (hi - lo) / 2;
+            if (Traits::compare(key, keys + (size_t)mid * recSize, recSize))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+
+        while (lo < hi && !Traits::compare(key, keys + (size_t)lo * recSize, recSize))
+            ++lo;
+
+        return lo;
+    }
+
+}; // struct BTreeNodeSearch
+
+
+/** \brief Источник ключей для BaseBTree::bulkLoad(), читающий типизированные ключи из диапазона
+ *  итераторов [first, last) и переводящий их в сырой вид через Traits::key2Raw().
+ */
+template <typename InputIt, typename Traits>
+class BTreeIterKeySource : public BaseBTree::IKeySource {
+public:
+    BTreeIterKeySource(InputIt first, InputIt last) : _cur(first), _last(last) {}
+
+    virtual const Byte* nextKey() override
+    {
+        if (_cur == _last)
+            return nullptr;
+
+        Traits::key2Raw(_raw, *_cur);
+        ++_cur;
+        return _raw;
+    }
+
+protected:
+    InputIt _cur;                                   ///< Очередной ключ.
+    InputIt _last;                                  ///< Конец диапазона.
+    Byte _raw[Traits::REC_SIZE];                    ///< Сырой вид текущего ключа.
+}; // class BTreeIterKeySource
+
+
+
+/** \brief Адаптер для B-дерева, получающий тип ключа из параметра шаблона, а дополнительную
+ *  информацию из специального класса свойств (traits).
+ *
+ *  elaborate
+ */
+template<   
+    typename T,                                 // тип данных, как его видит программист
+    typename Traits = BTreeAdapterTraits<T>,     // класс свойств ПО УМОЛЧАНИЮ
+    typename Compar = BTreeComparator<T, Traits> // компаратор
+        >
+class BTreeAdapter {
+public:
+    // основные рабочие типы берем из класса свойств!
+
+    
+    typedef typename Traits::TArg       TArg;
+    typedef typename Traits::TRes       TRes;
+    typedef typename Traits::TRefRes    TRefRes;
+
+
+public:
+    // основные рабочие константы берем из класса свойств!
+    /** \brief Размер записи, по умолчанию определяется размером типа. */
+    static const UShort REC_SIZE = Traits::REC_SIZE;
+
+
+public:
+
+    /** \brief Конструктор по умолчанию.
+     *
+     *  Для "открытия" дерева необходимо использовать метод open().
+     */
+    BTreeAdapter() { bindTree(); };
+
+    /** \brief Конструирует дерево и загружает его содержимое из файла \c fileName. */
+    BTreeAdapter(const std::string& fileName) : BTreeAdapter()
+    {
+        openInternal(fileName);
+    }
+
+
+    /** \brief Конструирует дерево с заданным порядком \c order и и ассоциирует его с файлом \c fileName. */
+    BTreeAdapter(UShort order, const std::string& fileName) : BTreeAdapter()
+    {
+        createInternal(order, fileName);
+    }
+
+
+    /** \brief Деструктор. */
+    ~BTreeAdapter()
+    {
+        _btree.close();
+    }
+
+protected:
+    BTreeAdapter(const BTreeAdapter&);                          ///< КК не доступен.
+    BTreeAdapter& operator= (BTreeAdapter&);                    ///< Оператор присваивания недоступен.
+
+public:
+
+    /** \brief Конструирует дерево по типу конструктора BTreeAdapter(const std::string& fileName). */
+    void open(const std::string& fileName)
+    {
+        openInternal(fileName);
+    }
+
+
+    /** \brief Конструирует дерево по типу конструктора BTreeAdapter(UShort order, const std::string& fileName).
+     *
+     *  Формат страниц \c format см. BaseBTree::PageFormat.
+     */
+    void create(UShort order, const std::string& fileName,
+        BaseBTree::PageFormat format = BaseBTree::pfBTree)
+    {
+        createInternal(order, fileName, format);
+    }
+
+
+    /** \brief Прокси-хелпер для закрытия дерева. */
+    void close()
+    {
+        _btree.close();
+    }
+
+public:
+    // основные методы доступа к типизированным объектам
+    
+
+    /** \brief Получает ключ по значению, номер ключа — \c num.
+     *
+     *  Политика относительно номера ключа та же, что и для метода
+     *  BaseBTree::PageWrapper::getKey() .
+     */
+    //TRes getKeyWork(UShort num)
+    TRes getKey(BaseBTree::PageWrapper& pw, UShort num)
+    {
+        // получаем указатель на сырые данные, представляющие ключ
+        //Byte* kp = _btree.getWorkPage().getKey(num);
+        Byte* kp = pw.getKey(num);
+        
+
+        TRes res;
+        Traits::raw2keyRes(kp, res);
+
+        return res;         // вот это чуть дороговато
+    }
+
+    /** \brief Устанавливает ключ по значению, номер ключа — \c num.
+     *
+     *  Политика относительно номера ключа та же, что и для метода
+     *  BaseBTree::PageWrapper::getKey() .
+     *  В зависимости от типа в адаптере, значение для установки передается либо по ссылке,
+     *  либо по значению (опреляется типом TArg).
+     */
+
+    //void setKeyWork(UShort num, TArg key)
+    void setKey(BaseBTree::PageWrapper& pw, UShort num, TArg key)
+    {
+        // получаем указатель на сырые данные, представляющие ключ
+        //Byte* kp = _btree.getWorkPage().getKey(num);
+        Byte* kp = pw.getKey(num);
+
+        Traits::key2Raw(kp, key);
+    }
+
+
+
+    /** \brief Вставляет ключ \c key в дерево. */
+    void insert(TArg key)
+    {
+        Byte raw[REC_SIZE];
+        Traits::key2Raw(raw, key);
+        _btree.insert(raw);
+    }
+
+    /** \brief Ищет ключ, эквивалентный \c key. Если найден, записывает его в \c res
+     *  и возвращает истину.
+     */
+    bool search(TArg key, TRefRes res)
+    {
+        Byte raw[REC_SIZE];
+        Traits::key2Raw(raw, key);
+
+        const Byte* found = _btree.find(raw);
+        if (!found)
+            return false;
+
+        Traits::raw2keyRes(found, res);
+        return true;
+    }
+
+    /** \brief Строит пустое дерево из отсортированного диапазона ключей [first, last).
+     *
+     *  См. BaseBTree::bulkLoad(). Возвращает число загруженных ключей.
+     */
+    template <typename InputIt>
+    UInt bulkLoad(InputIt first, InputIt last, float fillFactor = 1.0f)
+    {
+        BTreeIterKeySource<InputIt, Traits> src(first, last);
+        return _btree.bulkLoad(src, fillFactor);
+    }
+
+    /** \brief Возвращает истину, если в дереве есть ключ, эквивалентный \c key. */
+    bool contains(TArg key)
+    {
+        Byte raw[REC_SIZE];
+        Traits::key2Raw(raw, key);
+        return _btree.find(raw) != nullptr;
+    }
+
+    /** \brief Типизированный курсор для обхода ключей по порядку (см. BaseBTree::Cursor). */
+    class Cursor {
+    public:
+        /** \brief Конструирует недействительный курсор над деревом адаптера \c ad. */
+        Cursor(BTreeAdapter& ad) : _cursor(&ad.getTree()) {}
+
+    protected:
+        Cursor(const Cursor&);                                  ///< КК не доступен.
+        Cursor& operator= (Cursor&);                            ///< Оператор присваивания недоступен.
+
+    public:
+        /** \brief Устанавливает курсор на первый ключ, не меньший \c key. */
+        bool seek(TArg key)
+        {
+            Byte raw[REC_SIZE];
+            Traits::key2Raw(raw, key);
+            return _cursor.seek(raw);
+        }
+
+        bool seekFirst() { return _cursor.seekFirst(); }
+        bool seekLast() { return _cursor.seekLast(); }
+        bool next() { return _cursor.next(); }
+        bool prev() { return _cursor.prev(); }
+        bool isValid() const { return _cursor.isValid(); }
+
+        /** \brief Записывает текущий ключ в \c res; курсор должен быть действителен. */
+        void getKey(TRefRes res) const
+        {
+            Traits::raw2keyRes(_cursor.getKey(), res);
+        }
+
+        /** \brief Возвращает текущий ключ по значению; курсор должен быть действителен. */
+        TRes getKey() const
+        {
+            TRes res;
+            Traits::raw2keyRes(_cursor.getKey(), res);
+            return res;
+        }
+
+    protected:
+        BaseBTree::Cursor _cursor;                              ///< Нетипизированный курсор.
+    }; // class Cursor
+
+//public:
+//    // некоторые прокси-методы, для удо
+
+
+
+public:
+    // сеттеры/геттеры
+
+    /** \brief Возвращает подлежащее дерево. */
+    FileBaseBTree& getTree() { return _btree;  }
+
+    /** \brief Возвращает константно подлежащее дерево. */
+    const FileBaseBTree& getTree() const { return _btree; }
+
+
+protected:
+
+    /** \brief Привязывает к дереву компаратор и, если компаратор стандартный (т.е. сравнивает
+     *  через Traits), ядра поиска внутри узла BTreeNodeSearch<Traits>. Для целочисленных
+     *  типов со свойствами по умолчанию берутся векторные ядра getIntSearchKernel() под
+     *  набор инструкций процессора.
+     *
+     *  Закрытие дерева сбрасывает компаратор, поэтому вызывается перед каждым открытием.
+     */
+    void bindTree()
+    {
+        _btree.setComparator(&_comparator);
+        if (!std::is_same<Compar, BTreeComparator<T, Traits> >::value)
+            return;
+
+        BaseBTree::KeyBoundFunc lower = &BTreeNodeSearch<Traits>::lowerBound;
+        BaseBTree::KeyBoundFunc upper = &BTreeNodeSearch<Traits>::upperBound;
+        if (std::is_integral<T>::value && std::is_same<Traits, BTreeAdapterTraits<T> >::value)
+            getIntSearchKernel(sizeof(T), std::is_signed<T>::value, detectSimdIsa(), lower, upper);
+
+        _btree.setSearchKernel(lower, upper);
+    }
+
+    /** \brief Реализует конструктор BTreeAdapter(const std::string& fileName). */
+    void openInternal(const std::string& fileName)
+    {
+        bindTree();
+        _btree.open(fileName);  // , &_comparator);
+
+        // если открылось нормально, проверим, подходит ли дерево под параметры шаблона
+        if (_btree.getRecSize() != REC_SIZE)                // размер записи
+            throw std::runtime_error("Key size mismatch. Wrong file");
+
+        if (_btree.getValueSize() != 0)                     // адаптер хранит только ключи
+            throw std::runtime_error("Key/value records are not supported by adapter. Wrong file");
+
+        //if (_btree.getOrder() != REC_SIZE)                // размер записи
+        //    throw std::runtime_error("Key size mismatch. Wrong file")
+
+    }
+
+    /** \brief Реализует конструктор BTreeAdapter(UShort order, const std::string& fileName). */
+    void createInternal(UShort order, const std::string& fileName,
+        BaseBTree::PageFormat format = BaseBTree::pfBTree)
+    {
+        bindTree();
+        _btree.create(order, REC_SIZE, fileName, format);
+    }
+
+protected:
+
+    /** \brief Подлежащий объект-дерево. */
+    FileBaseBTree _btree;
+
+    /** \brief Компаратор, как отдельный объект */
+    Compar _comparator;
+
+}; // class Int32BTree 
+
+
+
+
+
+
+//class BTreeIntAdapter : public BTreeAdapter<>
+typedef BTreeAdapter<int> BTreeIntAdapter;
+
+/** \brief Адаптер для строковых ключей; создавать лучше с форматом BaseBTree::pfSlotted. */
+typedef BTreeAdapter<std::string, BTreeStringTraits<> > BTreeStringAdapter;
+
+
+
+
+
+} // namespace xi
+
+
+
+
+
+
+#endif // BTREE_BTREEADAPTERS_H_
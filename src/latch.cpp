@@ -0,0 +1,221 @@
+﻿////////////////////////////////////////////////////////////////////////////////
+// Module Name:  latch.h/cpp
+////////////////////////////////////////////////////////////////////////////////
+
+
+#include "latch.h"
+
+#include <thread>           // std::this_thread::yield
+
+
+namespace xi {
+
+
+//==============================================================================
+// class Latch
+//==============================================================================
+
+
+void Latch::lockShared()
+{
+    for (;;)
+    {
+        // a waiting writer goes first, otherwise a stream of readers could keep it out forever
+        UInt s = _state.load(std::memory_order_relaxed);
+        if (!(s & (WRITER | WAITING))
+            && _state.compare_exchange_weak(s, s + 1, std::memory_order_acquire))
+            return;
+
+        std::this_thread::yield();
+    }
+}
+
+
+void Latch::lock()
+{
+    for (;;)
+    {
+        UInt s = _state.load(std::memory_order_relaxed);
+        if ((s & ~WAITING) == 0)
+        {
+            // taking the latch clears the waiting flag, other writers set it again;
+            // optimistic readers must see it taken before any change it guards
+            if (_state.compare_exchange_weak(s, WRITER, std::memory_order_acquire))
+            {
+                std::atomic_thread_fence(std::memory_order_release);
+                return;
+            }
+            continue;
+        }
+
+        if (!(s & WAITING))
+            _state.compare_exchange_weak(s, s | WAITING, std::memory_order_relaxed);
+
+        std::this_thread::yield();
+    }
+}
+
+
+UInt Latch::readVersion() const
+{
+    for (;;)
+    {
+        UInt v = _version.load(std::memory_order_acquire);
+        if (!(_state.load(std::memory_order_acquire) & WRITER))
+            return v;
+
+        std::this_thread::yield();
+    }
+}
+
+
+bool Latch::validate(UInt version) const
+{
+    // the data were read before, whatever a writer changed meanwhile shows up here
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return !(_state.load(std::memory_order_relaxed) & WRITER)
+        && _version.load(std::memory_order_relaxed) == version;
+}
+
+
+
+//==============================================================================
+// class TreeLatch
+//==============================================================================
+
+
+void TreeLatch::lockShared()
+{
+    // a waiting writer goes first, as with Latch
+    std::unique_lock<std::mutex> lock(_mutex);
+    _canRead.wait(lock, [this]() { return !_writer && !_waitingWriters; });
+    ++_readers;
+}
+
+
+void TreeLatch::unlockShared()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (--_readers == 0 && _waitingWriters)
+        _canWrite.notify_one();
+}
+
+
+void TreeLatch::lock()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    ++_waitingWriters;
+    _canWrite.wait(lock, [this]() { return !_writer && !_readers; });
+    --_waitingWriters;
+    _writer = true;
+
+    // optimistic readers must see it taken before any change it guards
+    _writing.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+
+void TreeLatch::unlock()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _version.fetch_add(1, std::memory_order_relaxed);
+    _writing.store(false, std::memory_order_release);
+    _writer = false;
+
+    // the next writer, if any, is let in before new readers, which recheck it themselves;
+    // optimistic ones waiting in readVersion() don't care about waiting writers
+    if (_waitingWriters)
+        _canWrite.notify_one();
+    _canRead.notify_all();
+}
+
+
+UInt TreeLatch::readVersion()
+{
+    // waiting writers don't matter here: a reader holding the latch shared may ask as well
+    std::unique_lock<std::mutex> lock(_mutex);
+    _canRead.wait(lock, [this]() { return !_writer; });
+    return _version.load(std::memory_order_relaxed);
+}
+
+
+bool TreeLatch::validate(UInt version) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return !_writing.load(std::memory_order_relaxed)
+        && _version.load(std::memory_order_relaxed) == version;
+}
+
+
+
+//==============================================================================
+// class PageLatches
+//==============================================================================
+
+
+PageLatches::Dir::Dir()
+{
+    for (std::atomic<Latch*>& chunk : chunks)
+        chunk.store(nullptr, std::memory_order_relaxed);
+}
+
+
+PageLatches::PageLatches()
+{
+    for (std::atomic<Dir*>& dir : _top)
+        dir.store(nullptr, std::memory_order_relaxed);
+}
+
+
+PageLatches::~PageLatches()
+{
+    clear();
+}
+
+
+Latch& PageLatches::get(UInt pnum)
+{
+    // the first thread to need a directory or a chunk creates it, the losers of the race
+    // drop their copies and take the winner's one
+    std::atomic<Dir*>& top = _top[pnum >> (CHUNK_BITS + DIR_BITS)];
+    Dir* dir = top.load(std::memory_order_acquire);
+    if (!dir)
+    {
+        Dir* fresh = new Dir();
+        if (top.compare_exchange_strong(dir, fresh, std::memory_order_acq_rel))
+            dir = fresh;
+        else
+            delete fresh;
+    }
+
+    std::atomic<Latch*>& slot = dir->chunks[(pnum >> CHUNK_BITS) & (DIR_SIZE - 1)];
+    Latch* chunk = slot.load(std::memory_order_acquire);
+    if (!chunk)
+    {
+        Latch* fresh = new Latch[CHUNK_SIZE];
+        if (slot.compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel))
+            chunk = fresh;
+        else
+            delete[] fresh;
+    }
+
+    return chunk[pnum & (CHUNK_SIZE - 1)];
+}
+
+
+void PageLatches::clear()
+{
+    for (std::atomic<Dir*>& top : _top)
+    {
+        Dir* dir = top.exchange(nullptr, std::memory_order_relaxed);
+        if (!dir)
+            continue;
+
+        for (std::atomic<Latch*>& chunk : dir->chunks)
+            delete[] chunk.load(std::memory_order_relaxed);
+        delete dir;
+    }
+}
+
+
+} // namespace xi
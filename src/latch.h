@@ -0,0 +1,266 @@
+﻿/// \file
+/// \brief     Защелки (латчи) страниц B-дерева для параллельного доступа
+///
+/// Реализация соответствующих методов располагается в файле latch.cpp.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef BTREE_LATCH_H_
+#define BTREE_LATCH_H_
+
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#include "utils.h"
+
+
+
+namespace xi {
+
+
+/** \brief Защелка читатель-писатель: разделяемый (S) режим для чтения, исключительный (X)
+ *  для изменения.
+ *
+ *  Защелки держатся недолго (на время работы с одной-двумя страницами), поэтому ожидание
+ *  активное с уступкой процессора (yield), без системных объектов ядра. Ждущий писатель
+ *  не пропускает вперед новых читателей, чтобы поток вставок не голодал.
+ *
+ *  Защелка не рекурсивна: повторный захват тем же потоком приводит к взаимоблокировке.
+ *
+ *  Каждое освобождение исключительного захвата увеличивает версию защелки, поэтому
+ *  читатель может вовсе не захватывать ее (оптимистичное чтение): запомнить версию
+ *  readVersion(), прочитать защищаемые данные в свой буфер и проверить validate(), что
+ *  писателей за это время не было; иначе прочитанное отбрасывается.
+ */
+class Latch {
+public:
+    Latch() : _state(0), _version(0) {}
+
+protected:
+    Latch(const Latch&);                                ///< КК не доступен.
+    Latch& operator= (Latch&);                          ///< Оператор присваивания недоступен.
+
+public:
+    /** \brief Захватывает защелку в разделяемом режиме. */
+    void lockShared();
+
+    /** \brief Освобождает защелку, захваченную в разделяемом режиме. */
+    void unlockShared() { _state.fetch_sub(1, std::memory_order_release); }
+
+    /** \brief Захватывает защелку в исключительном режиме. */
+    void lock();
+
+    /** \brief Освобождает защелку, захваченную в исключительном режиме, и увеличивает версию. */
+    void unlock()
+    {
+        _version.fetch_add(1, std::memory_order_relaxed);
+        _state.fetch_and(~WRITER, std::memory_order_release);
+    }
+
+    /** \brief Дожидается, пока защелка не захвачена исключительно, и возвращает ее версию. */
+    UInt readVersion() const;
+
+    /** \brief Возвращает истину, если после получения версии \c version через readVersion()
+     *  защелка не захватывалась исключительно, то есть прочитанные под ней данные целы.
+     */
+    bool validate(UInt version) const;
+
+    /** \brief Захватывает защелку в режиме \c exclusive. */
+    void lock(bool exclusive)
+    {
+        if (exclusive)
+            lock();
+        else
+            lockShared();
+    }
+
+    /** \brief Освобождает защелку, захваченную в режиме \c exclusive. */
+    void unlock(bool exclusive)
+    {
+        if (exclusive)
+            unlock();
+        else
+            unlockShared();
+    }
+
+protected:
+    static const UInt WRITER = 0x80000000;              ///< Защелка захвачена писателем.
+    static const UInt WAITING = 0x40000000;             ///< Писатель ждет освобождения.
+
+    /** \brief Флаги WRITER и WAITING и число читателей в младших битах. */
+    std::atomic<UInt> _state;
+
+    /** \brief Число исключительных захватов. */
+    std::atomic<UInt> _version;
+}; // class Latch
+
+
+
+/** \brief Блокирующая защелка читатель-писатель для долгих захватов.
+ *
+ *  Интерфейс и порядок захвата — как у Latch (писатель в приоритете, версия для
+ *  оптимистичного чтения, нерекурсивность), но ждущий поток спит на условной переменной,
+ *  а не крутится на процессоре. Предназначена для защелки всего дерева, которую операции
+ *  над деревом целиком держат исключительно на все свое время, в том числе на время
+ *  сброса на носитель.
+ */
+class TreeLatch {
+public:
+    TreeLatch() : _readers(0), _writer(false), _waitingWriters(0), _writing(false), _version(0) {}
+
+protected:
+    TreeLatch(const TreeLatch&);                        ///< КК не доступен.
+    TreeLatch& operator= (TreeLatch&);                  ///< Оператор присваивания недоступен.
+
+public:
+    /** \brief Захватывает защелку в разделяемом режиме. */
+    void lockShared();
+
+    /** \brief Освобождает защелку, захваченную в разделяемом режиме. */
+    void unlockShared();
+
+    /** \brief Захватывает защелку в исключительном режиме. */
+    void lock();
+
+    /** \brief Освобождает защелку, захваченную в исключительном режиме, и увеличивает версию. */
+    void unlock();
+
+    /** \brief Дожидается, пока защелка не захвачена исключительно, и возвращает ее версию. */
+    UInt readVersion();
+
+    /** \brief Возвращает истину, если после получения версии \c version через readVersion()
+     *  защелка не захватывалась исключительно (см. Latch::validate()).
+     */
+    bool validate(UInt version) const;
+
+    /** \brief Захватывает защелку в режиме \c exclusive. */
+    void lock(bool exclusive)
+    {
+        if (exclusive)
+            lock();
+        else
+            lockShared();
+    }
+
+    /** \brief Освобождает защелку, захваченную в режиме \c exclusive. */
+    void unlock(bool exclusive)
+    {
+        if (exclusive)
+            unlock();
+        else
+            unlockShared();
+    }
+
+protected:
+    std::mutex _mutex;                                  ///< Защищает счетчики ниже.
+    std::condition_variable _canRead;                   ///< Писатель ушел.
+    std::condition_variable _canWrite;                  ///< Ушли все читатели и писатель.
+    UInt _readers;                                      ///< Число читателей.
+    bool _writer;                                       ///< Защелка захвачена писателем.
+    UInt _waitingWriters;                               ///< Число ждущих писателей.
+
+    /** \brief Копия _writer для оптимистичных читателей, не берущих мьютекс. */
+    std::atomic<bool> _writing;
+
+    /** \brief Число исключительных захватов. */
+    std::atomic<UInt> _version;
+}; // class TreeLatch
+
+
+
+/** \brief Захват защелки типа \c L (Latch или TreeLatch) на время жизни объекта
+ *  (или до явного unlock()).
+ */
+template <typename L>
+class BasicLatchGuard {
+public:
+    BasicLatchGuard(L& latch, bool exclusive)
+        : _latch(&latch), _exclusive(exclusive)
+    {
+        _latch->lock(_exclusive);
+    }
+
+    ~BasicLatchGuard() { unlock(); }
+
+protected:
+    BasicLatchGuard(const BasicLatchGuard&);            ///< КК не доступен.
+    BasicLatchGuard& operator= (BasicLatchGuard&);      ///< Оператор присваивания недоступен.
+
+public:
+    /** \brief Досрочно освобождает защелку. Повторный вызов ничего не делает. */
+    void unlock()
+    {
+        if (_latch)
+            _latch->unlock(_exclusive);
+        _latch = nullptr;
+    }
+
+protected:
+    L* _latch;                                          ///< Захваченная защелка, nullptr — освобождена.
+    bool _exclusive;                                    ///< Режим захвата.
+}; // class BasicLatchGuard
+
+
+/** \brief Захват защелки страницы. */
+typedef BasicLatchGuard<Latch> LatchGuard;
+
+/** \brief Захват защелки дерева. */
+typedef BasicLatchGuard<TreeLatch> TreeLatchGuard;
+
+
+
+/** \brief Таблица защелок страниц, по одной на каждый номер страницы.
+ *
+ *  Две страницы никогда не делят одну защелку, иначе спуск со сцеплением защелок мог бы
+ *  захватить ее повторно. Защелки лежат кусками по CHUNK_SIZE штук в двухуровневом
+ *  каталоге и создаются при первом обращении к куску; поиск защелки не берет блокировок.
+ */
+class PageLatches {
+public:
+    static const UInt CHUNK_BITS = 12;                  ///< Номер защелки в куске.
+    static const UInt DIR_BITS = 10;                    ///< Номер куска в каталоге второго уровня.
+    static const UInt CHUNK_SIZE = 1 << CHUNK_BITS;     ///< Защелок в куске.
+    static const UInt DIR_SIZE = 1 << DIR_BITS;         ///< Кусков в каталоге второго уровня.
+
+    /** \brief Каталогов второго уровня: вместе они покрывают все 32-битные номера страниц. */
+    static const UInt TOP_SIZE = 1 << (32 - CHUNK_BITS - DIR_BITS);
+
+public:
+    PageLatches();
+
+    /** \brief Деструктор. Освобождает все защелки. */
+    ~PageLatches();
+
+protected:
+    PageLatches(const PageLatches&);                    ///< КК не доступен.
+    PageLatches& operator= (PageLatches&);              ///< Оператор присваивания недоступен.
+
+public:
+    /** \brief Возвращает защелку страницы \c pnum. */
+    Latch& get(UInt pnum);
+
+    /** \brief Освобождает память всех защелок. Ни одна из них не должна быть захвачена,
+     *  и никто не должен обращаться к таблице одновременно.
+     */
+    void clear();
+
+protected:
+    /** \brief Каталог второго уровня. */
+    struct Dir {
+        Dir();
+
+        std::atomic<Latch*> chunks[DIR_SIZE];           ///< Куски защелок.
+    }; // struct Dir
+
+protected:
+    std::atomic<Dir*> _top[TOP_SIZE];                   ///< Каталог первого уровня.
+}; // class PageLatches
+
+
+} // namespace xi
+
+
+#endif // BTREE_LATCH_H_
@@ -0,0 +1,251 @@
+﻿////////////////////////////////////////////////////////////////////////////////
+// Module Name:  mapped_file.h/cpp
+////////////////////////////////////////////////////////////////////////////////
+
+
+#include "mapped_file.h"
+
+#include <stdexcept>        // std::runtime_error
+#include <cstring>          // memcpy
+#include <cstdint>          // SIZE_MAX
+#include <algorithm>        // std::max
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+namespace xi {
+
+
+//==============================================================================
+// class MappedFile
+//==============================================================================
+
+
+MappedFile::MappedFile()
+    : _fd(-1)
+    , _data(nullptr)
+    , _size(0)
+    , _openSize(0)
+    , _reserve((size_t)DEFAULT_RESERVE)
+    , _reserved(0)
+{
+}
+
+
+MappedFile::~MappedFile()
+{
+    release();
+}
+
+
+bool MappedFile::readAt(ULong ofs, void* dst, UInt sz)
+{
+    // reading beyond the end is reported the same way as a failed stream read
+    if (ofs + sz > (ULong)_size)
+        return false;
+
+    const Byte* src = _data + ofs;
+    if (src != dst)
+        memcpy(dst, src, sz);
+
+    return true;
+}
+
+
+void MappedFile::writeAt(ULong ofs, const void* src, UInt sz)
+{
+    // a page wrapper attached to the mapping has already modified the data in place
+    Byte* dst = map(ofs, sz);
+    if (dst != src)
+        memcpy(dst, src, sz);
+}
+
+
+Byte* MappedFile::map(ULong ofs, UInt sz)
+{
+    // the mapping never moves, so an already mapped range needs no lock
+    if (ofs + sz > (ULong)_size.load(std::memory_order_acquire))
+        grow(ofs + sz);
+    return _data + ofs;
+}
+
+
+#ifndef _WIN32
+
+
+/** \brief Размер страницы ОС, к которому выравнивается отображение. */
+static size_t osPageSize()
+{
+    static const size_t ps = (size_t)sysconf(_SC_PAGESIZE);
+    return ps;
+}
+
+
+void MappedFile::open(const std::string& fileName, bool trunc)
+{
+    if (isOpen())
+        throw std::runtime_error("Mapped file is already open");
+
+    int flags = O_RDWR | O_CREAT;
+    if (trunc)
+        flags |= O_TRUNC;
+
+    _fd = ::open(fileName.c_str(), flags, 0644);
+    if (_fd == -1)
+        throw std::runtime_error("Can't open file for mapping");
+
+    struct stat st;
+    if (fstat(_fd, &st) != 0)
+    {
+        release();
+        throw std::runtime_error("Can't stat mapped file");
+    }
+
+    // a file that doesn't fit the address space can't be mapped at all
+    size_t ps = osPageSize();
+    if ((ULong)st.st_size > (ULong)(SIZE_MAX - ps))
+    {
+        release();
+        throw std::runtime_error("Mapped file exceeds the address space");
+    }
+
+    // reserving the address range once: the file is mapped into its beginning and grows inside
+    // it; a file written in another mode may be larger than the reserve, and is opened anyway
+    _reserved = std::max(_reserve, ((size_t)st.st_size + ps - 1) / ps * ps);
+    void* res = mmap(nullptr, _reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (res == MAP_FAILED)
+    {
+        release();
+        throw std::runtime_error("Can't reserve address space for mapping");
+    }
+    _data = (Byte*)res;
+
+    // the tail of a page-unaligned file is padded with zeros, close() cuts it off
+    _openSize = (size_t)st.st_size;
+    try {
+        grow(_openSize);
+    }
+    catch (...)
+    {
+        release();
+        throw;
+    }
+}
+
+
+void MappedFile::close(size_t size)
+{
+    if (!isOpen())
+        return;
+
+    munmap(_data, _reserved);
+    _data = nullptr;
+
+    if (ftruncate(_fd, (off_t)size) != 0)
+    {
+        ::close(_fd);
+        _fd = -1;
+        _size = 0;
+        throw std::runtime_error("Can't truncate mapped file");
+    }
+
+    release();
+}
+
+
+void MappedFile::grow(ULong size)
+{
+    std::lock_guard<std::mutex> lock(_growMutex);
+    if (size <= (ULong)_size)
+        return;
+
+    if (size > (ULong)_reserved)
+        throw std::runtime_error("Mapped file exceeds the reserved address space");
+
+    // growing with a margin (doubling) so that appending pages does not remap on every page
+    size_t ps = osPageSize();
+    size_t newSize = ((size_t)size + ps - 1) / ps * ps;
+    if (newSize < 2 * _size)
+        newSize = 2 * _size;
+    if (newSize > _reserved)
+        newSize = _reserved;
+
+    if (ftruncate(_fd, (off_t)newSize) != 0)
+        throw std::runtime_error("Can't extend mapped file");
+
+    mapTail(newSize);
+}
+
+
+void MappedFile::sync()
+{
+    if (isOpen() && _size && msync(_data, _size, MS_SYNC) != 0)
+        throw std::runtime_error("Can't sync mapped file");
+}
+
+
+void MappedFile::mapTail(size_t newSize)
+{
+    // _size is always a multiple of the OS page size, so is the file offset of the tail
+    void* p = mmap(_data + _size, newSize - _size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED, _fd, (off_t)_size);
+
+    if (p == MAP_FAILED)
+        throw std::runtime_error("Can't map file");
+
+    _size.store(newSize, std::memory_order_release);
+}
+
+
+void MappedFile::release()
+{
+    if (_data)
+        munmap(_data, _reserved);
+    if (_fd != -1)
+        ::close(_fd);
+
+    _data = nullptr;
+    _fd = -1;
+    _size = 0;
+}
+
+
+#else // _WIN32
+
+
+void MappedFile::open(const std::string& fileName, bool trunc)
+{
+    throw std::runtime_error("Memory-mapped files are not supported on this platform");
+}
+
+void MappedFile::close(size_t size)
+{
+}
+
+void MappedFile::grow(ULong size)
+{
+    throw std::runtime_error("Memory-mapped files are not supported on this platform");
+}
+
+void MappedFile::sync()
+{
+}
+
+void MappedFile::mapTail(size_t newSize)
+{
+}
+
+void MappedFile::release()
+{
+}
+
+
+#endif // _WIN32
+
+
+} // namespace xi
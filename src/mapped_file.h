@@ -0,0 +1,132 @@
+﻿/// \file
+/// \brief     Отображаемый в память файл для B-дерева
+///
+/// Реализация соответствующих методов располагается в файле mapped_file.cpp.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef BTREE_MAPPED_FILE_H_
+#define BTREE_MAPPED_FILE_H_
+
+
+#include <cstddef>
+#include <string>
+#include <atomic>
+#include <mutex>
+
+#include "utils.h"
+#include "page_io.h"
+
+
+
+namespace xi {
+
+
+/** \brief Файл, целиком отображенный в память (mmap).
+ *
+ *  При открытии резервируется непрерывный диапазон адресного пространства размером
+ *  getReserve() байт (но не меньше размера файла), и файл отображается в его начало. При росте файла (grow())
+ *  новый хвост отображается в тот же диапазон сразу за уже отображенной частью, поэтому
+ *  адрес начала отображения не меняется и указатели внутрь него остаются валидными
+ *  все время, пока файл открыт.
+ *
+ *  Реальный размер файла на диске округляется вверх до размера страницы ОС (и растет
+ *  с запасом), поэтому при закрытии нужно передать логический размер данных, до
+ *  которого файл будет обрезан.
+ *
+ *  Как реализация IPageIO, читает и пишет копированием из/в отображение и дает прямой
+ *  доступ к данным через map(). Уже отображенные участки доступны из нескольких потоков
+ *  без блокировок, рост отображения выполняется под мьютексом.
+ */
+class MappedFile : public IPageIO {
+public:
+    /** \brief Резерв адресного пространства по умолчанию.
+     *
+     *  Смещения 64-битные, и файл может быть больше любого адресного пространства, поэтому
+     *  резерв ограничен им: 1 ТиБ из 128 ТиБ пользовательского пространства x86-64 позволяет
+     *  держать открытыми десятки деревьев, в 32-битной сборке — 256 МиБ. Больший файл
+     *  открывается с резервом по своему размеру, а расти дальше может после setReserve().
+     */
+    static const unsigned long long DEFAULT_RESERVE = (sizeof(void*) > 4) ? 0x10000000000ULL : 0x10000000ULL;
+
+public:
+    MappedFile();
+
+    /** \brief Деструктор. Закрывает файл без обрезки. */
+    ~MappedFile();
+
+protected:
+    MappedFile(const MappedFile&);                      ///< КК не доступен.
+    MappedFile& operator= (MappedFile&);                ///< Оператор присваивания недоступен.
+
+public:
+
+    /** \brief Открывает файл \c fileName на чтение и запись и отображает его в память.
+     *
+     *  Если \c trunc == true, файл создается заново (имеющееся содержимое удаляется).
+     *  При неудаче кидает std::runtime_error.
+     */
+    void open(const std::string& fileName, bool trunc);
+
+    /** \brief Снимает отображение и закрывает файл, предварительно обрезая его до \c size байт.
+     *
+     *  Если файл не открыт, ничего не делает.
+     */
+    void close(size_t size);
+
+    /** \brief Возвращает истину, если файл открыт. */
+    virtual bool isOpen() const override { return _fd != -1; }
+
+    /** \brief Гарантирует, что отображено не менее \c size байт, при необходимости увеличивая
+     *  файл и отображение. Адрес начала отображения при этом не меняется.
+     *
+     *  Если требуемый размер превышает резерв адресного пространства, кидает std::runtime_error.
+     */
+    void grow(ULong size);
+
+    /** \brief Сбрасывает изменения отображения на диск (msync). */
+    virtual void sync() override;
+
+    virtual bool readAt(ULong ofs, void* dst, UInt sz) override;
+    virtual void writeAt(ULong ofs, const void* src, UInt sz) override;
+    virtual bool isMapped() const override { return true; }
+    virtual Byte* map(ULong ofs, UInt sz) override;
+
+    /** \brief Возвращает указатель на начало отображения. */
+    Byte* getData() const { return _data; }
+
+    /** \brief Возвращает число байт, доступных через отображение. */
+    size_t getSize() const { return _size; }
+
+    /** \brief Возвращает размер файла на момент открытия. */
+    size_t getOpenSize() const { return _openSize; }
+
+    /** \brief Задает резерв адресного пространства. Действует при следующем открытии. */
+    void setReserve(size_t reserve) { _reserve = reserve; }
+
+    /** \brief Возвращает резерв адресного пространства. */
+    size_t getReserve() const { return _reserve; }
+
+protected:
+    /** \brief Отображает в зарезервированный диапазон участок файла [_size, newSize). */
+    void mapTail(size_t newSize);
+
+    /** \brief Освобождает все ресурсы. */
+    void release();
+
+protected:
+    int _fd;                        ///< Дескриптор файла, -1 — не открыт.
+    Byte* _data;                    ///< Начало зарезервированного диапазона/отображения.
+    std::atomic<size_t> _size;      ///< Отображенный (и существующий на диске) размер.
+    size_t _openSize;               ///< Размер файла на момент открытия.
+    size_t _reserve;                ///< Резерв для следующего открытия.
+    size_t _reserved;               ///< Размер диапазона, зарезервированного при открытии.
+    std::mutex _growMutex;          ///< Упорядочивает рост отображения.
+}; // class MappedFile
+
+
+} // namespace xi
+
+
+#endif // BTREE_MAPPED_FILE_H_
@@ -0,0 +1,257 @@
+﻿////////////////////////////////////////////////////////////////////////////////
+// Module Name:  node_search.h/cpp
+////////////////////////////////////////////////////////////////////////////////
+
+
+#include "node_search.h"
+
+#include <cstring>          // memcpy
+#include <type_traits>
+
+// vector kernels are built only for GCC-compatible compilers on x86, others get the scalar one
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define BTREE_SIMD_X86
+#include <immintrin.h>
+#endif
+
+
+namespace xi {
+
+
+/** \brief Читает ключ типа \c T из невыровненной памяти \c p. */
+template <typename T>
+static inline T loadKey(const Byte* p)
+{
+    T v;
+    memcpy(&v, p, sizeof(T));
+    return v;
+}
+
+
+/** \brief Считает среди \c n ключей \c a те, что меньше \c key (при \c KEY_GT == true)
+ *  или больше \c key (при \c KEY_GT == false).
+ */
+template <typename T, bool KEY_GT>
+static UInt countScalar(const Byte* a, UInt n, T key)
+{
+    UInt cnt = 0;
+    for (UInt i = 0; i < n; ++i)
+    {
+        T v = loadKey<T>(a + (size_t)i * sizeof(T));
+        cnt += KEY_GT ? (key > v) : (v > key);
+    }
+
+    return cnt;
+}
+
+
+/** \brief Ядро поиска (BaseBTree::KeyBoundFunc): двоичный поиск до окна SIMD_SEARCH_WINDOW
+ *  ключей, затем подсчет в окне функцией \c COUNT.
+ *
+ *  Ключи отсортированы, поэтому lower bound — это начало окна плюс число ключей окна,
+ *  меньших искомого, а upper bound — конец окна минус число ключей, больших искомого.
+ */
+template <typename T, bool UPPER, UInt (*COUNT)(const Byte*, UInt, T)>
+static UShort intBound(const Byte* keys, UShort keysNum, const Byte* key,
+    UShort /*recSize*/, UShort /*linearThreshold*/)
+{
+    T k = loadKey<T>(key);
+    UShort lo = 0;
+    UShort hi = keysNum;
+    while (hi - lo > SIMD_SEARCH_WINDOW)
+    {
+        UShort mid = lo + (hi - lo) / 2;
+        T m = loadKey<T>(keys + (size_t)mid * sizeof(T));
+        if (UPPER ? !(k < m) : (m < k))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    UInt cnt = COUNT(keys + (size_t)lo * sizeof(T), hi - lo, k);
+    return UPPER ? (UShort)(hi - cnt) : (UShort)(lo + cnt);
+}
+
+
+
+#ifdef BTREE_SIMD_X86
+
+
+/** \brief Смещение, которое переводит беззнаковые ключи в знаковые с сохранением порядка
+ *  (векторные сравнения есть только знаковые).
+ */
+template <typename T>
+static inline unsigned long long signBias()
+{
+    return std::is_signed<T>::value ? 0ULL : 1ULL << (8 * sizeof(T) - 1);
+}
+
+
+/** \brief Векторные операции для ключей длиной \c SZ байт. */
+template <int SZ>
+struct SimdOps;
+
+template <>
+struct SimdOps<1> {
+    __attribute__((target("sse4.2"))) static __m128i set1(long long v) { return _mm_set1_epi8((char)v); }
+    __attribute__((target("sse4.2"))) static __m128i gt(__m128i a, __m128i b) { return _mm_cmpgt_epi8(a, b); }
+    __attribute__((target("avx2"))) static __m256i set1x(long long v) { return _mm256_set1_epi8((char)v); }
+    __attribute__((target("avx2"))) static __m256i gtx(__m256i a, __m256i b) { return _mm256_cmpgt_epi8(a, b); }
+}; // struct SimdOps<1>
+
+template <>
+struct SimdOps<2> {
+    __attribute__((target("sse4.2"))) static __m128i set1(long long v) { return _mm_set1_epi16((short)v); }
+    __attribute__((target("sse4.2"))) static __m128i gt(__m128i a, __m128i b) { return _mm_cmpgt_epi16(a, b); }
+    __attribute__((target("avx2"))) static __m256i set1x(long long v) { return _mm256_set1_epi16((short)v); }
+    __attribute__((target("avx2"))) static __m256i gtx(__m256i a, __m256i b) { return _mm256_cmpgt_epi16(a, b); }
+}; // struct SimdOps<2>
+
+template <>
+struct SimdOps<4> {
+    __attribute__((target("sse4.2"))) static __m128i set1(long long v) { return _mm_set1_epi32((int)v); }
+    __attribute__((target("sse4.2"))) static __m128i gt(__m128i a, __m128i b) { return _mm_cmpgt_epi32(a, b); }
+    __attribute__((target("avx2"))) static __m256i set1x(long long v) { return _mm256_set1_epi32((int)v); }
+    __attribute__((target("avx2"))) static __m256i gtx(__m256i a, __m256i b) { return _mm256_cmpgt_epi32(a, b); }
+}; // struct SimdOps<4>
+
+template <>
+struct SimdOps<8> {
+    __attribute__((target("sse4.2"))) static __m128i set1(long long v) { return _mm_set1_epi64x(v); }
+    __attribute__((target("sse4.2"))) static __m128i gt(__m128i a, __m128i b) { return _mm_cmpgt_epi64(a, b); }
+    __attribute__((target("avx2"))) static __m256i set1x(long long v) { return _mm256_set1_epi64x(v); }
+    __attribute__((target("avx2"))) static __m256i gtx(__m256i a, __m256i b) { return _mm256_cmpgt_epi64(a, b); }
+}; // struct SimdOps<8>
+
+
+/** \brief То же, что countScalar(), на 128-битных векторах. */
+template <typename T, bool KEY_GT>
+__attribute__((target("sse4.2,popcnt")))
+static UInt countSse42(const Byte* a, UInt n, T key)
+{
+    typedef SimdOps<sizeof(T)> Ops;
+    const UInt per = 16 / sizeof(T);
+
+    const __m128i bias = Ops::set1((long long)signBias<T>());
+    const __m128i kv = _mm_xor_si128(Ops::set1((long long)key), bias);
+
+    // every matching key sets sizeof(T) bits of the byte mask
+    UInt bits = 0;
+    UInt i = 0;
+    for (; i + per <= n; i += per)
+    {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + (size_t)i * sizeof(T))), bias);
+        __m128i m = KEY_GT ? Ops::gt(kv, v) : Ops::gt(v, kv);
+        bits += (UInt)__builtin_popcount((unsigned)_mm_movemask_epi8(m));
+    }
+
+    return bits / sizeof(T) + countScalar<T, KEY_GT>(a + (size_t)i * sizeof(T), n - i, key);
+}
+
+
+/** \brief То же, что countScalar(), на 256-битных векторах. */
+template <typename T, bool KEY_GT>
+__attribute__((target("avx2,popcnt")))
+static UInt countAvx2(const Byte* a, UInt n, T key)
+{
+    typedef SimdOps<sizeof(T)> Ops;
+    const UInt per = 32 / sizeof(T);
+
+    const __m256i bias = Ops::set1x((long long)signBias<T>());
+    const __m256i kv = _mm256_xor_si256(Ops::set1x((long long)key), bias);
+
+    UInt bits = 0;
+    UInt i = 0;
+    for (; i + per <= n; i += per)
+    {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + (size_t)i * sizeof(T))), bias);
+        __m256i m = KEY_GT ? Ops::gtx(kv, v) : Ops::gtx(v, kv);
+        bits += (UInt)__builtin_popcount((unsigned)_mm256_movemask_epi8(m));
+    }
+
+    return bits / sizeof(T) + countScalar<T, KEY_GT>(a + (size_t)i * sizeof(T), n - i, key);
+}
+
+
+#endif // BTREE_SIMD_X86
+
+
+
+SimdIsa detectSimdIsa()
+{
+#ifdef BTREE_SIMD_X86
+    static const SimdIsa isa = []()
+    {
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("popcnt"))
+            return isaScalar;
+        if (__builtin_cpu_supports("avx2"))
+            return isaAvx2;
+        if (__builtin_cpu_supports("sse4.2"))
+            return isaSse42;
+        return isaScalar;
+    }();
+
+    return isa;
+#else
+    return isaScalar;
+#endif // BTREE_SIMD_X86
+}
+
+
+/** \brief Выбирает пару ядер для ключей типа \c T. */
+template <typename T>
+static bool selectIntKernel(SimdIsa isa, BaseBTree::KeyBoundFunc& lower, BaseBTree::KeyBoundFunc& upper)
+{
+    if (isa > detectSimdIsa())
+        return false;
+
+    switch (isa)
+    {
+    case isaScalar:
+        lower = &intBound<T, false, &countScalar<T, true> >;
+        upper = &intBound<T, true, &countScalar<T, false> >;
+        return true;
+
+#ifdef BTREE_SIMD_X86
+    case isaSse42:
+        lower = &intBound<T, false, &countSse42<T, true> >;
+        upper = &intBound<T, true, &countSse42<T, false> >;
+        return true;
+
+    case isaAvx2:
+        lower = &intBound<T, false, &countAvx2<T, true> >;
+        upper = &intBound<T, true, &countAvx2<T, false> >;
+        return true;
+#endif // BTREE_SIMD_X86
+
+    default:
+        return false;
+    }
+}
+
+
+bool getIntSearchKernel(UShort keySize, bool isSigned, SimdIsa isa,
+    BaseBTree::KeyBoundFunc& lower, BaseBTree::KeyBoundFunc& upper)
+{
+    switch (keySize)
+    {
+    case 1:
+        return isSigned ? selectIntKernel<signed char>(isa, lower, upper)
+                        : selectIntKernel<unsigned char>(isa, lower, upper);
+    case 2:
+        return isSigned ? selectIntKernel<short>(isa, lower, upper)
+                        : selectIntKernel<unsigned short>(isa, lower, upper);
+    case 4:
+        return isSigned ? selectIntKernel<int>(isa, lower, upper)
+                        : selectIntKernel<unsigned int>(isa, lower, upper);
+    case 8:
+        return isSigned ? selectIntKernel<long long>(isa, lower, upper)
+                        : selectIntKernel<unsigned long long>(isa, lower, upper);
+    default:
+        return false;
+    }
+}
+
+
+} // namespace xi
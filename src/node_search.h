@@ -0,0 +1,57 @@
+﻿/// \file
+/// \brief     Векторизованные ядра поиска внутри узла для целочисленных ключей
+///
+/// Реализация соответствующих методов располагается в файле node_search.cpp.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef BTREE_NODE_SEARCH_H_
+#define BTREE_NODE_SEARCH_H_
+
+
+#include "utils.h"
+#include "btree.h"
+
+
+
+namespace xi {
+
+
+/** \brief Набор инструкций, которым выполняется поиск внутри узла. */
+enum SimdIsa
+{
+    isaScalar,                  ///< Без векторных инструкций.
+    isaSse42,                   ///< SSE4.2 (128-битные векторы).
+    isaAvx2                     ///< AVX2 (256-битные векторы).
+};
+
+
+/** \brief Длина участка ключей, который векторное ядро просматривает целиком после того,
+ *  как двоичный поиск сузил диапазон.
+ */
+static const UShort SIMD_SEARCH_WINDOW = 64;
+
+
+/** \brief Определяет лучший набор инструкций, поддерживаемый процессором (один раз за запуск). */
+SimdIsa detectSimdIsa();
+
+
+/** \brief Возвращает ядра поиска внутри узла для целочисленных ключей длиной \c keySize
+ *  (1, 2, 4 или 8 байт) со знаком (\c isSigned) или без, использующие набор инструкций \c isa.
+ *
+ *  Ядро сужает диапазон двоичным поиском до SIMD_SEARCH_WINDOW ключей (параметр
+ *  linearThreshold игнорируется) и затем считает ключи, меньшие (не большие) искомого,
+ *  сравнением целых векторов.
+ *
+ *  \returns ложь, если такой длины ключа нет или \c isa не поддерживается процессором/сборкой;
+ *  в этом случае \c lower и \c upper не меняются.
+ */
+bool getIntSearchKernel(UShort keySize, bool isSigned, SimdIsa isa,
+    BaseBTree::KeyBoundFunc& lower, BaseBTree::KeyBoundFunc& upper);
+
+
+} // namespace xi
+
+
+#endif // BTREE_NODE_SEARCH_H_
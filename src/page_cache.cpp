@@ -0,0 +1,260 @@
+﻿////////////////////////////////////////////////////////////////////////////////
+// Module Name:  page_cache.h/cpp
+////////////////////////////////////////////////////////////////////////////////
+
+
+#include "page_cache.h"
+
+#include <stdexcept>        // std::runtime_error
+#include <cstring>          // memcpy
+#include <algorithm>        // std::sort
+
+
+namespace xi {
+
+
+//==============================================================================
+// class PageCache
+//==============================================================================
+
+
+PageCache::PageCache(IPageStore* store)
+    : _store(store)
+    , _capacity(0)
+    , _pageSize(0)
+    , _used(0)
+    , _hand(0)
+    , _hits(0)
+    , _misses(0)
+    , _evictions(0)
+{
+}
+
+
+PageCache::~PageCache()
+{
+}
+
+
+void PageCache::reset(UInt capacity, UInt pageSize)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _capacity = capacity;
+    _pageSize = pageSize;
+
+    _frames.assign(isEnabled() ? capacity : 0, Frame());
+    _data.assign(isEnabled() ? (size_t)capacity * pageSize : 0, 0);
+    _index.clear();
+    _used = 0;
+    _hand = 0;
+}
+
+
+Byte* PageCache::pin(UInt pnum, bool load /*= true*/)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    bool miss;
+    UInt fnum = lookup(pnum, load, miss);
+    ++_frames[fnum].pins;
+
+    return frameData(fnum);
+}
+
+
+void PageCache::unpin(UInt pnum, bool dirty /*= false*/)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    std::unordered_map<UInt, UInt>::iterator it = _index.find(pnum);
+    if (it == _index.end() || _frames[it->second].pins == 0)
+        throw std::invalid_argument("Page is not pinned");
+
+    Frame& f = _frames[it->second];
+    --f.pins;
+    if (dirty)
+        f.dirty = true;
+}
+
+
+void PageCache::read(UInt pnum, Byte* dst)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    bool miss;
+    UInt fnum = lookup(pnum, true, miss);
+    memcpy(dst, frameData(fnum), _pageSize);
+}
+
+
+bool PageCache::readCached(UInt pnum, Byte* dst)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    std::unordered_map<UInt, UInt>::iterator it = _index.find(pnum);
+    if (it == _index.end())
+    {
+        ++_misses;
+        return false;
+    }
+
+    ++_hits;
+    _frames[it->second].ref = true;
+    memcpy(dst, frameData(it->second), _pageSize);
+    return true;
+}
+
+
+void PageCache::fill(UInt pnum, const Byte* src)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    // whatever is in the pool already is at least as new as the copy from the store
+    if (_index.find(pnum) != _index.end())
+        return;
+
+    bool miss;
+    UInt fnum = lookup(pnum, false, miss);
+    --_misses;                                  // counted by readCached() already
+    memcpy(frameData(fnum), src, _pageSize);
+}
+
+
+void PageCache::write(UInt pnum, const Byte* src, bool dirty)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    bool miss;
+    UInt fnum = lookup(pnum, false, miss);      // old content is overwritten anyway
+    memcpy(frameData(fnum), src, _pageSize);
+
+    // a frame stays dirty until it is really written to the store
+    if (dirty)
+        _frames[fnum].dirty = true;
+}
+
+
+void PageCache::flush()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    // collecting dirty frames and writing them in page order to make I/O as sequential as possible
+    std::vector<std::pair<UInt, UInt>> dirty;
+    for (UInt i = 0; i < _frames.size(); ++i)
+        if (_frames[i].pnum && _frames[i].dirty)
+            dirty.push_back(std::make_pair(_frames[i].pnum, i));
+
+    std::sort(dirty.begin(), dirty.end());
+
+    for (const std::pair<UInt, UInt>& d : dirty)
+    {
+        _store->storePage(d.first, frameData(d.second));
+        _frames[d.second].dirty = false;
+    }
+}
+
+
+void PageCache::clear()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    for (Frame& f : _frames)
+        f = Frame();
+
+    _index.clear();
+    _used = 0;
+    _hand = 0;
+}
+
+
+bool PageCache::contains(UInt pnum) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _index.find(pnum) != _index.end();
+}
+
+
+UInt PageCache::getDirtyNum() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    UInt num = 0;
+    for (const Frame& f : _frames)
+        if (f.pnum && f.dirty)
+            ++num;
+
+    return num;
+}
+
+
+UInt PageCache::lookup(UInt pnum, bool load, bool& miss)
+{
+    if (!isEnabled())
+        throw std::runtime_error("Page cache is disabled");
+
+    std::unordered_map<UInt, UInt>::iterator it = _index.find(pnum);
+    if (it != _index.end())
+    {
+        miss = false;
+        ++_hits;
+        _frames[it->second].ref = true;
+        return it->second;
+    }
+
+    miss = true;
+    ++_misses;
+
+    // while there are never used frames, take them in order, otherwise evict somebody
+    UInt fnum = (_used < _capacity) ? _used++ : evict();
+
+    if (load)
+        _store->loadPage(pnum, frameData(fnum));
+    else
+        memset(frameData(fnum), 0, _pageSize);
+
+    Frame& f = _frames[fnum];
+    f.pnum = pnum;
+    f.pins = 0;
+    f.dirty = false;
+    f.ref = true;
+    _index[pnum] = fnum;
+
+    return fnum;
+}
+
+
+UInt PageCache::evict()
+{
+    // two full turns are enough: the first one clears the reference bits
+    for (UInt step = 0; step < 2 * _capacity; ++step)
+    {
+        UInt fnum = _hand;
+        _hand = (_hand + 1) % _capacity;
+
+        Frame& f = _frames[fnum];
+        if (f.pins)
+            continue;
+
+        if (f.ref)
+        {
+            f.ref = false;
+            continue;
+        }
+
+        // the victim is found
+        if (f.dirty)
+            _store->storePage(f.pnum, frameData(fnum));
+
+        _index.erase(f.pnum);
+        f = Frame();
+        ++_evictions;
+
+        return fnum;
+    }
+
+    throw std::runtime_error("All page cache frames are pinned");
+}
+
+
+} // namespace xi
@@ -0,0 +1,195 @@
+﻿/// \file
+/// \brief     Буферный пул (кеш страниц) для B-дерева
+///
+/// Реализация соответствующих методов располагается в файле page_cache.cpp.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef BTREE_PAGE_CACHE_H_
+#define BTREE_PAGE_CACHE_H_
+
+
+#include <cstddef>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+#include "utils.h"
+
+
+
+namespace xi {
+
+
+/** \brief Интерфейс хранилища страниц, из которого буферный пул подгружает страницы
+ *  при промахе и в которое выталкивает измененные (грязные) страницы.
+ */
+class IPageStore {
+public:
+    /** \brief Читает страницу номер \c pnum в память \c dst. */
+    virtual void loadPage(UInt pnum, Byte* dst) = 0;
+
+    /** \brief Записывает страницу номер \c pnum из памяти \c src. */
+    virtual void storePage(UInt pnum, const Byte* src) = 0;
+
+protected:
+    ~IPageStore() {};
+}; // class IPageStore
+
+
+
+/** \brief Буферный пул фиксированной емкости.
+ *
+ *  Хранит в памяти до \c capacity страниц одинакового размера, индексированных номером
+ *  страницы. Каждый фрейм пула имеет счетчик закреплений (pin) и признак "грязный".
+ *  Закрепленные фреймы не вытесняются. Для вытеснения используется политика CLOCK
+ *  (часовая стрелка идет по фреймам, сбрасывая бит обращения, и вытесняет первый
+ *  незакрепленный фрейм, к которому не было обращения за полный оборот).
+ *  Грязный фрейм перед вытеснением записывается в хранилище.
+ *
+ *  Пул с нулевой емкостью считается выключенным.
+ *
+ *  Все операции пула выполняются под его мьютексом, поэтому его можно вызывать из
+ *  нескольких потоков; согласованность содержимого одной страницы при этом обеспечивают
+ *  защелки страниц вызывающей стороны (см. PageLatches).
+ */
+class PageCache {
+public:
+    /** \brief Описание одного фрейма пула. */
+    struct Frame {
+        Frame() : pnum(0), pins(0), dirty(false), ref(false) {}
+
+        UInt pnum;                  ///< Номер страницы во фрейме, 0 — фрейм пуст.
+        UInt pins;                  ///< Число закреплений.
+        bool dirty;                 ///< Фрейм изменен и не записан в хранилище.
+        bool ref;                   ///< Бит обращения для политики CLOCK.
+    }; // struct Frame
+
+public:
+    /** \brief Конструирует выключенный пул, связанный с хранилищем \c store. */
+    PageCache(IPageStore* store);
+
+    ~PageCache();
+
+protected:
+    PageCache(const PageCache&);                        ///< КК не доступен.
+    PageCache& operator= (PageCache&);                  ///< Оператор присваивания недоступен.
+
+public:
+
+    /** \brief Задает емкость пула \c capacity (в страницах) и размер страницы \c pageSize.
+     *
+     *  Все содержимое пула (включая грязные страницы!) сбрасывается, поэтому перед вызовом
+     *  вызывающий метод должен при необходимости выполнить flush().
+     */
+    void reset(UInt capacity, UInt pageSize);
+
+    /** \brief Возвращает истину, если пул включен (ненулевая емкость и размер страницы). */
+    bool isEnabled() const { return _capacity != 0 && _pageSize != 0; }
+
+    /** \brief Закрепляет страницу \c pnum в пуле и возвращает указатель на данные фрейма.
+     *
+     *  При промахе страница подгружается из хранилища, если \c load == true; иначе
+     *  фрейм обнуляется (используется для только что распределенных страниц).
+     *  Если все фреймы закреплены, кидает std::runtime_error.
+     */
+    Byte* pin(UInt pnum, bool load = true);
+
+    /** \brief Снимает одно закрепление со страницы \c pnum.
+     *
+     *  Если \c dirty == true, страница помечается как грязная.
+     */
+    void unpin(UInt pnum, bool dirty = false);
+
+    /** \brief Копирует страницу \c pnum в \c dst, при промахе подгружая ее из хранилища. */
+    void read(UInt pnum, Byte* dst);
+
+    /** \brief Копирует страницу \c pnum в \c dst, если она есть в пуле, и возвращает истину.
+     *  При промахе ничего не подгружает: вызывающий читает страницу сам (например,
+     *  асинхронно) и может затем передать ее в fill().
+     */
+    bool readCached(UInt pnum, Byte* dst);
+
+    /** \brief Помещает в пул страницу \c pnum, прочитанную из хранилища в обход пула,
+     *  если ее там еще нет. Страница считается чистой.
+     */
+    void fill(UInt pnum, const Byte* src);
+
+    /** \brief Копирует \c src в страницу \c pnum пула.
+     *
+     *  Если \c dirty == true, страница помечается как грязная и будет записана в хранилище
+     *  при вытеснении или flush(); иначе считается, что вызывающий сам записал ее.
+     */
+    void write(UInt pnum, const Byte* src, bool dirty);
+
+    /** \brief Возвращает истину, если страница \c pnum находится в пуле. Статистику не меняет. */
+    bool contains(UInt pnum) const;
+
+    /** \brief Записывает все грязные страницы в хранилище в порядке возрастания их номеров. */
+    void flush();
+
+    /** \brief Сбрасывает все содержимое пула без записи. */
+    void clear();
+
+public:
+    // статистика
+
+    /** \brief Возвращает число попаданий. */
+    UInt getHits() const { return _hits; }
+
+    /** \brief Возвращает число промахов. */
+    UInt getMisses() const { return _misses; }
+
+    /** \brief Возвращает число вытеснений. */
+    UInt getEvictions() const { return _evictions; }
+
+    /** \brief Обнуляет статистику. */
+    void resetStats() { _hits = _misses = _evictions = 0; }
+
+    /** \brief Возвращает емкость пула в страницах. */
+    UInt getCapacity() const { return _capacity; }
+
+    /** \brief Возвращает число грязных страниц. */
+    UInt getDirtyNum() const;
+
+protected:
+
+    /** \brief Находит фрейм под страницу \c pnum, при необходимости вытесняя другую.
+     *
+     *  Возвращает индекс фрейма. Признак промаха пишется в \c miss.
+     */
+    UInt lookup(UInt pnum, bool load, bool& miss);
+
+    /** \brief Выбирает фрейм-жертву по политике CLOCK и освобождает его. */
+    UInt evict();
+
+    /** \brief Возвращает указатель на данные фрейма номер \c fnum. */
+    Byte* frameData(UInt fnum) { return &_data[(size_t)fnum * _pageSize]; }
+
+protected:
+    IPageStore* _store;                                 ///< Хранилище страниц.
+    UInt _capacity;                                     ///< Емкость (число фреймов).
+    UInt _pageSize;                                     ///< Размер страницы.
+    UInt _used;                                         ///< Число занятых фреймов.
+    UInt _hand;                                         ///< Часовая стрелка CLOCK.
+
+    std::vector<Frame> _frames;                         ///< Фреймы.
+    std::vector<Byte> _data;                            ///< Память под все фреймы одним куском.
+    std::unordered_map<UInt, UInt> _index;              ///< Номер страницы -> номер фрейма.
+
+    /** \brief Защищает фреймы, индекс и статистику; подгрузка и выталкивание страниц
+     *  при промахе тоже идут под ним.
+     */
+    mutable std::mutex _mutex;
+
+    UInt _hits;                                         ///< Число попаданий.
+    UInt _misses;                                       ///< Число промахов.
+    UInt _evictions;                                    ///< Число вытеснений.
+}; // class PageCache
+
+
+} // namespace xi
+
+
+#endif // BTREE_PAGE_CACHE_H_
@@ -0,0 +1,183 @@
+﻿////////////////////////////////////////////////////////////////////////////////
+// Module Name:  page_io.h/cpp
+////////////////////////////////////////////////////////////////////////////////
+
+
+#include "page_io.h"
+
+#include <stdexcept>        // std::runtime_error
+#include <cerrno>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+namespace xi {
+
+
+//==============================================================================
+// class StreamPageIO
+//==============================================================================
+
+
+bool StreamPageIO::readAt(ULong ofs, void* dst, UInt sz)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    // a read past the end leaves failbit set, which would turn every later seek into a no-op
+    _stream->clear();
+    _stream->seekg((std::streamoff)ofs, std::ios_base::beg);
+    _stream->read((char*)dst, sz);
+
+    return !_stream->fail();
+}
+
+
+void StreamPageIO::writeAt(ULong ofs, const void* src, UInt sz)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _stream->clear();
+    _stream->seekp((std::streamoff)ofs, std::ios_base::beg);
+    _stream->write((const char*)src, sz);
+    if (_stream->fail())
+        throw std::runtime_error("Can't write a page");
+}
+
+
+void StreamPageIO::sync()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _stream->clear();
+    _stream->flush();
+    if (_stream->fail())
+        throw std::runtime_error("Can't flush the stream");
+
+    // the buffer of the stream is in the OS now, the file descriptor takes it further
+    if (_syncFile)
+        _syncFile->sync();
+}
+
+
+
+//==============================================================================
+// class PosixPageIO
+//==============================================================================
+
+
+PosixPageIO::PosixPageIO()
+    : _fd(-1)
+{
+}
+
+
+PosixPageIO::~PosixPageIO()
+{
+    close();
+}
+
+
+#ifndef _WIN32
+
+
+void PosixPageIO::open(const std::string& fileName, bool trunc)
+{
+    if (isOpen())
+        throw std::runtime_error("File is already open");
+
+    int flags = O_RDWR | O_CREAT;
+    if (trunc)
+        flags |= O_TRUNC;
+
+    _fd = ::open(fileName.c_str(), flags, 0644);
+    if (_fd == -1)
+        throw std::runtime_error("Can't open file");
+}
+
+
+void PosixPageIO::close()
+{
+    if (_fd != -1)
+        ::close(_fd);
+
+    _fd = -1;
+}
+
+
+bool PosixPageIO::readAt(ULong ofs, void* dst, UInt sz)
+{
+    // pread can return less than asked (signals, etc.), so reading up to the end or EOF
+    UInt done = 0;
+    while (done < sz)
+    {
+        ssize_t r = pread(_fd, (char*)dst + done, sz - done, (off_t)ofs + done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+
+        done += (UInt)r;
+    }
+
+    return true;
+}
+
+
+void PosixPageIO::writeAt(ULong ofs, const void* src, UInt sz)
+{
+    UInt done = 0;
+    while (done < sz)
+    {
+        ssize_t r = pwrite(_fd, (const char*)src + done, sz - done, (off_t)ofs + done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            throw std::runtime_error("Can't write to file");
+
+        done += (UInt)r;
+    }
+}
+
+
+void PosixPageIO::sync()
+{
+    // a failed fsync may have dropped the dirty pages, so nothing written is known to be durable
+    if (_fd != -1 && fsync(_fd) != 0)
+        throw std::runtime_error("Can't sync file");
+}
+
+
+#else // _WIN32
+
+
+void PosixPageIO::open(const std::string& fileName, bool trunc)
+{
+    throw std::runtime_error("Positional I/O is not supported on this platform");
+}
+
+void PosixPageIO::close()
+{
+}
+
+bool PosixPageIO::readAt(ULong ofs, void* dst, UInt sz)
+{
+    return false;
+}
+
+void PosixPageIO::writeAt(ULong ofs, const void* src, UInt sz)
+{
+    throw std::runtime_error("Positional I/O is not supported on this platform");
+}
+
+void PosixPageIO::sync()
+{
+}
+
+
+#endif // _WIN32
+
+
+} // namespace xi
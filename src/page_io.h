@@ -0,0 +1,175 @@
+﻿/// \file
+/// \brief     Страничный ввод-вывод для B-дерева
+///
+/// Реализация соответствующих методов располагается в файле page_io.cpp.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef BTREE_PAGE_IO_H_
+#define BTREE_PAGE_IO_H_
+
+
+#include <string>
+#include <iostream>
+#include <mutex>
+
+#include "utils.h"
+
+
+
+namespace xi {
+
+
+/** \brief Интерфейс позиционного ввода-вывода, через который дерево читает и пишет
+ *  заголовок и страницы.
+ *
+ *  Все операции адресуются абсолютным смещением от начала файла и не зависят от
+ *  какой-либо "текущей позиции", поэтому реализации, у которых нет разделяемого состояния
+ *  (например, PosixPageIO), можно вызывать из нескольких потоков одновременно.
+ *  Хранилища, допускающие параллельные вставки в дерево, потокобезопасны при записи
+ *  в непересекающиеся участки; журнал (WalPageIO) защищает свое состояние сам.
+ */
+class IPageIO {
+public:
+
+    /** \brief Читает \c sz байт по смещению \c ofs в \c dst.
+     *
+     *  \returns истину, если прочитано ровно \c sz байт.
+     */
+    virtual bool readAt(ULong ofs, void* dst, UInt sz) = 0;
+
+    /** \brief Записывает \c sz байт из \c src по смещению \c ofs, при необходимости увеличивая
+     *  файл. При ошибке кидает std::runtime_error.
+     */
+    virtual void writeAt(ULong ofs, const void* src, UInt sz) = 0;
+
+    /** \brief Сбрасывает записанные данные на носитель. При ошибке кидает std::runtime_error:
+     *  после нее неизвестно, что из записанного дошло до носителя.
+     */
+    virtual void sync() = 0;
+
+    /** \brief Отмечает конец атомарной группы записей (одной операции над деревом).
+     *
+     *  Хранилища без журнала пишут сразу и ничего не делают.
+     */
+    virtual void commit() {}
+
+    /** \brief Отмечает конец атомарной группы записей, как commit(), но не ждет сброса
+     *  отметки на носитель и возвращает ее позицию для waitCommit().
+     *
+     *  Параллельные операции дерева отмечают конец группы, пока ни одна из них не
+     *  находится в середине, а ждут сброса уже порознь, деля его между собой.
+     */
+    virtual ULong markCommit() { commit(); return 0; }
+
+    /** \brief Дожидается сброса на носитель отметки с позицией \c mark из markCommit(). */
+    virtual void waitCommit(ULong /*mark*/) {}
+
+    /** \brief Возвращает истину, если хранилище ведет журнал, и все записи операции должны
+     *  попасть в него до commit().
+     */
+    virtual bool isLogged() const { return false; }
+
+    /** \brief Возвращает истину, если хранилище открыто. */
+    virtual bool isOpen() const = 0;
+
+    /** \brief Возвращает истину, если хранилище поддерживает прямой доступ к данным через map(). */
+    virtual bool isMapped() const { return false; }
+
+    /** \brief Для хранилища, отображенного в память, возвращает указатель на участок
+     *  [ofs, ofs + sz), при необходимости увеличивая файл; иначе nullptr.
+     */
+    virtual Byte* map(ULong /*ofs*/, UInt /*sz*/) { return nullptr; }
+
+protected:
+    ~IPageIO() {};
+}; // class IPageIO
+
+
+
+class PosixPageIO;
+
+
+/** \brief Ввод-вывод поверх стандартного потока: seekg + read/write.
+ *
+ *  Поток имеет единственную позицию, поэтому позиционирование вместе с чтением или записью
+ *  выполняется под мьютексом.
+ *
+ *  Стандартный поток умеет только отдать свой буфер ОС, поэтому до носителя sync() доводит
+ *  данные через отдельно открытый тот же файл (setSyncFile()); без него он лишь сбрасывает
+ *  буфер потока.
+ */
+class StreamPageIO : public IPageIO {
+public:
+    StreamPageIO(std::iostream* stream = nullptr) : _stream(stream), _syncFile(nullptr) {}
+
+    /** \brief Привязывает к потоку \c stream. */
+    void setStream(std::iostream* stream) { _stream = stream; }
+
+    /** \brief Задает файл потока \c file, через который sync() сбрасывает данные на носитель;
+     *  nullptr — не сбрасывать.
+     */
+    void setSyncFile(PosixPageIO* file) { _syncFile = file; }
+
+    /** \brief Возвращает поток. */
+    std::iostream* getStream() const { return _stream; }
+
+public:
+    virtual bool readAt(ULong ofs, void* dst, UInt sz) override;
+    virtual void writeAt(ULong ofs, const void* src, UInt sz) override;
+    virtual void sync() override;
+    virtual bool isOpen() const override { return _stream != nullptr; }
+
+protected:
+    std::iostream* _stream;                         ///< Поток.
+    PosixPageIO* _syncFile;                         ///< Тот же файл для сброса на носитель.
+    std::mutex _mutex;                              ///< Защищает позицию потока.
+}; // class StreamPageIO
+
+
+
+/** \brief Ввод-вывод на POSIX-функциях pread()/pwrite().
+ *
+ *  Не хранит позицию в файле, поэтому операции можно выполнять из нескольких потоков
+ *  без внешней синхронизации (при условии, что они не пишут в одни и те же байты).
+ */
+class PosixPageIO : public IPageIO {
+public:
+    PosixPageIO();
+
+    /** \brief Деструктор. Закрывает файл. */
+    ~PosixPageIO();
+
+protected:
+    PosixPageIO(const PosixPageIO&);                    ///< КК не доступен.
+    PosixPageIO& operator= (PosixPageIO&);              ///< Оператор присваивания недоступен.
+
+public:
+    /** \brief Открывает файл \c fileName на чтение и запись.
+     *
+     *  Если \c trunc == true, файл создается заново. При неудаче кидает std::runtime_error.
+     */
+    void open(const std::string& fileName, bool trunc);
+
+    /** \brief Закрывает файл. Если файл не открыт, ничего не делает. */
+    void close();
+
+public:
+    virtual bool readAt(ULong ofs, void* dst, UInt sz) override;
+    virtual void writeAt(ULong ofs, const void* src, UInt sz) override;
+    virtual void sync() override;
+    virtual bool isOpen() const override { return _fd != -1; }
+
+    /** \brief Возвращает дескриптор файла. */
+    int getFd() const { return _fd; }
+
+protected:
+    int _fd;                                        ///< Дескриптор файла, -1 — не открыт.
+}; // class PosixPageIO
+
+
+} // namespace xi
+
+
+#endif // BTREE_PAGE_IO_H_
@@ -15,6 +15,8 @@
 #define BTREE_UTILS_H_
 
 
+#include <cstdint>
+
 // чтобы отметить метод нежелательным
 #ifdef __GNUC__
 #define DEPRECATED __attribute__((deprecated))
@@ -35,6 +37,7 @@ namespace xi {
 typedef unsigned char Byte;
 typedef unsigned short UShort;
 typedef unsigned int UInt;
+typedef std::uint64_t ULong;
 
 
 
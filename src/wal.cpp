@@ -0,0 +1,450 @@
+﻿////////////////////////////////////////////////////////////////////////////////
+// Module Name:  wal.h/cpp
+////////////////////////////////////////////////////////////////////////////////
+
+
+#include "wal.h"
+
+#include <stdexcept>        // std::runtime_error
+#include <cstring>          // memcpy
+#include <cstdio>           // std::remove
+#include <fstream>
+#include <iterator>
+#include <algorithm>        // std::min
+
+
+namespace xi {
+
+
+//==============================================================================
+// class WalPageIO
+//==============================================================================
+
+
+WalPageIO::WalPageIO()
+    : _base(nullptr)
+    , _logSize(0)
+    , _uncommitted(false)
+    , _lsn(0)
+    , _commitLsn(0)
+    , _durableLsn(0)
+    , _syncing(false)
+    , _checkpointSize(DEFAULT_CHECKPOINT_SIZE)
+    , _commits(0)
+    , _logSyncs(0)
+{
+}
+
+
+WalPageIO::~WalPageIO()
+{
+    close();
+}
+
+
+void WalPageIO::open(const std::string& logName, IPageIO* base)
+{
+    if (isOpen())
+        throw std::runtime_error("Write-ahead log is already open");
+
+    _log.open(logName, true);                       // кидает сама, если не открылся
+    _logName = logName;
+    _base = base;
+    _logSize = 0;
+    _uncommitted = false;
+    _lsn = _commitLsn = _durableLsn = 0;
+    _commits = 0;
+    _logSyncs = 0;
+}
+
+
+void WalPageIO::close()
+{
+    if (!isOpen())
+        return;
+
+    // the log goes first, so a crash at any point below is recovered from it
+    flush();
+    _base->sync();
+
+    _log.close();
+    std::remove(_logName.c_str());
+    _base = nullptr;
+}
+
+
+UInt WalPageIO::recover(const std::string& logName, IPageIO* base)
+{
+    std::ifstream in(logName, std::ios_base::in | std::ios_base::binary);
+    if (!in)
+        return 0;                                   // no log, nothing to do
+
+    std::vector<Byte> log((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+
+    // the writes of a group are applied only when its commit record is read;
+    // the first torn or corrupted record ends the log
+    std::vector<size_t> group;                      // positions of the write records
+    UInt groups = 0;
+    size_t pos = 0;
+    while (log.size() - pos >= sizeof(RecordHeader))
+    {
+        RecordHeader hdr;
+        memcpy(&hdr, &log[pos], sizeof(RecordHeader));
+        if (hdr.size > log.size() - pos - sizeof(RecordHeader)
+            || calcChecksum(hdr, log.data() + pos + sizeof(RecordHeader)) != hdr.checksum)
+            break;
+
+        if (hdr.type == rtWrite)
+            group.push_back(pos);
+        else if (hdr.type == rtCommit)
+        {
+            for (size_t rec : group)
+            {
+                memcpy(&hdr, &log[rec], sizeof(RecordHeader));
+                base->writeAt(hdr.ofs, log.data() + rec + sizeof(RecordHeader), hdr.size);
+            }
+            group.clear();
+            ++groups;
+        }
+        else
+            break;
+
+        memcpy(&hdr, &log[pos], sizeof(RecordHeader));
+        pos += sizeof(RecordHeader) + hdr.size;
+    }
+
+    base->sync();
+    std::remove(logName.c_str());
+
+    return groups;
+}
+
+
+void WalPageIO::flush()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    // writes not closed by a commit make a group of their own
+    if (_uncommitted)
+        appendCommit();
+
+    syncLog(lock, _lsn);
+}
+
+
+void WalPageIO::checkpoint()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_uncommitted)
+        appendCommit();
+
+    syncLog(lock, _lsn);
+
+    // the restart is made by whoever is the leader, so the current one is waited for
+    while (_syncing)
+        _synced.wait(lock);
+    _syncing = true;
+    restartLog(lock);
+    _syncing = false;
+    _synced.notify_all();
+}
+
+
+bool WalPageIO::readAt(ULong ofs, void* dst, UInt sz)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    // usually the range is either a whole page written in a pending group or nothing pending
+    if (copyCovered(_pending, ofs, dst, sz))
+        return true;
+
+    std::vector<std::pair<ULong, ULong> > parts;
+    overlay(_pending, ofs, dst, sz, parts);
+    if (parts.empty())
+    {
+        if (copyCovered(_applying, ofs, dst, sz))
+            return true;
+
+        overlay(_applying, ofs, dst, sz, parts);
+        if (parts.empty())
+        {
+            // nothing to lay over: the leader only writes ranges it has in _applying
+            lock.unlock();
+            return _base->readAt(ofs, dst, sz);
+        }
+    }
+
+    // otherwise the pending writes are laid over what the storage has (a new page may be
+    // not in the storage yet); the lock keeps the leader from taking them away meanwhile
+    bool ok = _base->readAt(ofs, dst, sz);
+    if (!ok)
+        memset(dst, 0, sz);
+
+    parts.clear();
+    overlay(_applying, ofs, dst, sz, parts);
+    overlay(_pending, ofs, dst, sz, parts);
+    if (ok)
+        return true;
+
+    // without the storage, the pending writes have to cover the whole range
+    std::sort(parts.begin(), parts.end());
+    ULong covered = ofs;
+    for (const std::pair<ULong, ULong>& p : parts)
+        if (p.first <= covered)
+            covered = std::max(covered, p.second);
+
+    return covered >= ofs + sz;
+}
+
+
+void WalPageIO::writeAt(ULong ofs, const void* src, UInt sz)
+{
+    if (!sz)
+        return;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    appendRecord(rtWrite, ofs, src, sz);
+    putPending(ofs, (const Byte*)src, sz);
+    _uncommitted = true;
+}
+
+
+void WalPageIO::sync()
+{
+    flush();
+}
+
+
+void WalPageIO::commit()
+{
+    waitCommit(markCommit());
+}
+
+
+ULong WalPageIO::markCommit()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    appendCommit();
+    ++_commits;
+
+    return _commitLsn;
+}
+
+
+void WalPageIO::waitCommit(ULong mark)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    syncLog(lock, mark);
+}
+
+
+void WalPageIO::appendRecord(UInt type, ULong ofs, const void* data, UInt sz)
+{
+    RecordHeader hdr;
+    hdr.type = type;
+    hdr.ofs = ofs;
+    hdr.size = sz;
+    hdr.checksum = calcChecksum(hdr, data);
+
+    const Byte* h = (const Byte*)&hdr;
+    _buf.insert(_buf.end(), h, h + sizeof(RecordHeader));
+    if (sz)
+        _buf.insert(_buf.end(), (const Byte*)data, (const Byte*)data + sz);
+    _lsn += sizeof(RecordHeader) + sz;
+}
+
+
+void WalPageIO::appendCommit()
+{
+    appendRecord(rtCommit, 0, nullptr, 0);
+    _uncommitted = false;
+    _commitLsn = _lsn;
+}
+
+
+void WalPageIO::putPending(ULong ofs, const Byte* src, UInt sz)
+{
+    // the part gets the position of this record, so it waits for the commit of this group
+    PendingMap::iterator first = _pending.upper_bound(ofs);
+    if (first != _pending.begin())
+    {
+        PendingMap::iterator prev = std::prev(first);
+        if (prev->first + prev->second.data.size() >= ofs + sz)
+        {
+            // rewriting a page in place
+            memcpy(&prev->second.data[(size_t)(ofs - prev->first)], src, sz);
+            prev->second.lsn = _lsn;
+            return;
+        }
+        if (prev->first + prev->second.data.size() > ofs)
+            first = prev;
+    }
+
+    // the overlapped parts are merged into one, so the parts never intersect
+    ULong start = ofs;
+    ULong end = ofs + sz;
+    PendingMap::iterator last = first;
+    for (; last != _pending.end() && last->first < ofs + sz; ++last)
+    {
+        start = std::min(start, last->first);
+        end = std::max(end, last->first + (ULong)last->second.data.size());
+    }
+
+    std::vector<Byte> merged((size_t)(end - start));
+    for (PendingMap::iterator it = first; it != last; ++it)
+        memcpy(&merged[(size_t)(it->first - start)], &it->second.data[0], it->second.data.size());
+    memcpy(&merged[(size_t)(ofs - start)], src, sz);
+
+    _pending.erase(first, last);
+    PendingWrite& w = _pending[start];
+    w.data.swap(merged);
+    w.lsn = _lsn;
+}
+
+
+void WalPageIO::syncLog(std::unique_lock<std::mutex>& lock, ULong lsn)
+{
+    // the first one to find no flush going on becomes the leader and writes the log for
+    // everybody who has appended to it by then; the others wait for it, and those whose
+    // records came after it took the buffer wait for the next leader
+    while (_durableLsn < lsn)
+    {
+        if (_syncing)
+        {
+            _synced.wait(lock);
+            continue;
+        }
+
+        _syncing = true;
+        std::vector<Byte> buf;
+        buf.swap(_buf);
+        ULong end = _lsn;
+        ULong committed = _commitLsn;
+
+        lock.unlock();
+        try
+        {
+            _log.writeAt(_logSize, &buf[0], (UInt)buf.size());
+            _log.sync();                            // one fsync for the whole group
+        }
+        catch (...)
+        {
+            lock.lock();
+            _syncing = false;
+            _synced.notify_all();
+            throw;
+        }
+        lock.lock();
+
+        _logSize += buf.size();
+        _durableLsn = end;
+        ++_logSyncs;
+
+        applyPending(lock, committed);
+        if (_logSize >= _checkpointSize)
+            restartLog(lock);
+
+        _syncing = false;
+        _synced.notify_all();
+    }
+}
+
+
+void WalPageIO::applyPending(std::unique_lock<std::mutex>& lock, ULong committed)
+{
+    // a write of a group not committed yet stays in memory: the storage may get it only
+    // when the group can be replayed from the log
+    for (PendingMap::iterator it = _pending.begin(); it != _pending.end(); )
+    {
+        if (it->second.lsn <= committed)
+        {
+            _applying[it->first].data.swap(it->second.data);
+            it = _pending.erase(it);
+        }
+        else
+            ++it;
+    }
+
+    if (_applying.empty())
+        return;
+
+    // in the order of offsets, which makes the writes as sequential as possible; nobody
+    // else changes _applying, and readers still find the writes there meanwhile
+    lock.unlock();
+    for (const PendingMap::value_type& p : _applying)
+        _base->writeAt(p.first, &p.second.data[0], (UInt)p.second.data.size());
+    lock.lock();
+
+    _applying.clear();
+}
+
+
+void WalPageIO::restartLog(std::unique_lock<std::mutex>& lock)
+{
+    // the log may be dropped only when the storage has everything it could replay
+    if (!_pending.empty())
+        return;
+
+    lock.unlock();
+    _base->sync();
+    _log.close();
+    _log.open(_logName, true);
+    lock.lock();
+
+    _logSize = 0;
+}
+
+
+bool WalPageIO::copyCovered(const PendingMap& writes, ULong ofs, void* dst, UInt sz)
+{
+    PendingMap::const_iterator it = writes.upper_bound(ofs);
+    if (it == writes.begin())
+        return false;
+
+    --it;
+    if (it->first + it->second.data.size() < ofs + sz)
+        return false;
+
+    memcpy(dst, &it->second.data[(size_t)(ofs - it->first)], sz);
+    return true;
+}
+
+
+void WalPageIO::overlay(const PendingMap& writes, ULong ofs, void* dst, UInt sz,
+    std::vector<std::pair<ULong, ULong> >& parts)
+{
+    PendingMap::const_iterator it = writes.upper_bound(ofs);
+    if (it != writes.begin())
+        --it;
+
+    for (; it != writes.end() && it->first < ofs + sz; ++it)
+    {
+        ULong from = std::max(it->first, ofs);
+        ULong to = std::min(it->first + (ULong)it->second.data.size(), ofs + sz);
+        if (from < to)
+        {
+            memcpy((Byte*)dst + (from - ofs), &it->second.data[(size_t)(from - it->first)],
+                (size_t)(to - from));
+            parts.push_back(std::make_pair(from, to));
+        }
+    }
+}
+
+
+UInt WalPageIO::calcChecksum(const RecordHeader& hdr, const void* data)
+{
+    UInt h = 2166136261u;
+    const Byte* fields = (const Byte*)&hdr + sizeof(hdr.checksum);
+    for (UInt i = 0; i < sizeof(RecordHeader) - sizeof(hdr.checksum); ++i)
+        h = (h ^ fields[i]) * 16777619u;
+
+    const Byte* bytes = (const Byte*)data;
+    for (UInt i = 0; i < hdr.size; ++i)
+        h = (h ^ bytes[i]) * 16777619u;
+
+    return h;
+}
+
+
+} // namespace xi
@@ -0,0 +1,231 @@
+﻿/// \file
+/// \brief     Журнал упреждающей записи (WAL) для B-дерева
+///
+/// Реализация соответствующих методов располагается в файле wal.cpp.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef BTREE_WAL_H_
+#define BTREE_WAL_H_
+
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+
+#include "utils.h"
+#include "page_io.h"
+
+
+
+namespace xi {
+
+
+/** \brief Ввод-вывод с журналом упреждающей записи поверх другого хранилища.
+ *
+ *  Каждая запись writeAt() сначала попадает в журнал (отдельный файл) как физический образ
+ *  записываемых байт, а в основное хранилище не пишется, пока журнал не сброшен на носитель:
+ *  до того она хранится в памяти, и readAt() видит ее поверх основного хранилища.
+ *  Вызов commit() отмечает конец атомарной группы записей (одной операции над деревом)
+ *  и возвращает управление, только когда журнал с этой отметкой сброшен на носитель.
+ *
+ *  Групповая фиксация: из потоков, одновременно ждущих в commit(), сброс делает один —
+ *  ведущий, первым заставший журнал без идущего сброса. Он записывает в журнал все,
+ *  что к этому моменту в него добавлено, делает один fsync и будит остальных, чьи отметки
+ *  этим сбросом покрыты; отметки, добавленные во время сброса, уходят следующим ведущим.
+ *  После сброса записи зафиксированных групп переносятся в основное хранилище; записи
+ *  групп, еще не дошедших до commit(), ждут в памяти, так что при сбое операция теряется
+ *  целиком, но никогда — частично.
+ *
+ *  Все открытые методы можно вызывать из нескольких потоков: буфер журнала и записи,
+ *  еще не перенесенные в основное хранилище, защищены мьютексом, а сброс журнала и запись
+ *  в основное хранилище идут вне его.
+ *
+ *  Когда журнал вырастает больше getCheckpointSize() байт, основное хранилище сбрасывается
+ *  на носитель, и журнал начинается заново (контрольная точка) — как только в памяти
+ *  не остается записей, которых в основном хранилище еще нет.
+ *
+ *  Восстановление (recover()) повторяет в основном хранилище записи всех полностью
+ *  зафиксированных в журнале групп; хвост журнала, оборванный сбоем, отбрасывается
+ *  по контрольным суммам.
+ */
+class WalPageIO : public IPageIO {
+public:
+    /** \brief Размер журнала, после которого делается контрольная точка, по умолчанию. */
+    static const UInt DEFAULT_CHECKPOINT_SIZE = 4 << 20;
+
+    /** \brief Тип записи журнала. */
+    enum RecordType
+    {
+        rtWrite = 1,            ///< Образ байт, записанных по смещению.
+        rtCommit = 2            ///< Конец атомарной группы записей.
+    };
+
+#pragma pack(push, 1)
+    /** \brief Заголовок записи журнала, за которым следуют \c size байт данных. */
+    struct RecordHeader {
+        UInt checksum;          ///< Контрольная сумма остальных полей и данных.
+        UInt type;              ///< RecordType
+        ULong ofs;              ///< Смещение в основном хранилище.
+        UInt size;              ///< Число байт данных.
+    }; // struct RecordHeader
+#pragma pack(pop)
+
+public:
+    WalPageIO();
+
+    /** \brief Деструктор. Закрывает журнал. */
+    ~WalPageIO();
+
+protected:
+    WalPageIO(const WalPageIO&);                        ///< КК не доступен.
+    WalPageIO& operator= (WalPageIO&);                  ///< Оператор присваивания недоступен.
+
+public:
+    /** \brief Начинает новый журнал \c logName над открытым хранилищем \c base.
+     *
+     *  Имеющийся журнал должен быть предварительно восстановлен через recover(), иначе
+     *  его содержимое теряется. При неудаче кидает std::runtime_error.
+     */
+    void open(const std::string& logName, IPageIO* base);
+
+    /** \brief Переносит все записи в основное хранилище, сбрасывает его на носитель и
+     *  удаляет журнал. Если журнал не открыт, ничего не делает.
+     */
+    void close();
+
+    /** \brief Повторяет в хранилище \c base зафиксированные группы из журнала \c logName,
+     *  если он есть, сбрасывает хранилище на носитель и удаляет журнал.
+     *
+     *  \returns число повторенных групп.
+     */
+    static UInt recover(const std::string& logName, IPageIO* base);
+
+    /** \brief Сбрасывает журнал на носитель и переносит зафиксированные записи в основное
+     *  хранилище.
+     *
+     *  Записи, сделанные после последнего commit(), фиксируются отдельной группой, поэтому
+     *  вызывается, когда другие потоки дерево не изменяют.
+     */
+    void flush();
+
+    /** \brief Выполняет flush(), сбрасывает основное хранилище на носитель и начинает
+     *  журнал заново.
+     */
+    void checkpoint();
+
+    /** \brief Задает размер журнала, после которого делается контрольная точка. */
+    void setCheckpointSize(UInt size) { _checkpointSize = size; }
+
+    /** \brief Возвращает размер журнала, после которого делается контрольная точка. */
+    UInt getCheckpointSize() const { return _checkpointSize; }
+
+    /** \brief Возвращает число фиксаций с момента открытия. */
+    UInt getCommits() const { return _commits; }
+
+    /** \brief Возвращает число сбросов журнала на носитель с момента открытия. */
+    UInt getLogSyncs() const { return _logSyncs; }
+
+    /** \brief Возвращает имя файла журнала. */
+    const std::string& getLogName() const { return _logName; }
+
+public:
+    virtual bool readAt(ULong ofs, void* dst, UInt sz) override;
+    virtual void writeAt(ULong ofs, const void* src, UInt sz) override;
+
+    /** \brief Для журнала — то же, что flush(). */
+    virtual void sync() override;
+
+    virtual bool isOpen() const override { return _base != nullptr; }
+    virtual void commit() override;
+    virtual ULong markCommit() override;
+    virtual void waitCommit(ULong mark) override;
+    virtual bool isLogged() const override { return true; }
+
+protected:
+    /** \brief Дописывает запись журнала в буфер. */
+    void appendRecord(UInt type, ULong ofs, const void* data, UInt sz);
+
+    /** \brief Дописывает в буфер отметку конца группы. Вызывается под мьютексом. */
+    void appendCommit();
+
+    /** \brief Накладывает запись на несброшенные, сливая пересекающиеся участки. */
+    void putPending(ULong ofs, const Byte* src, UInt sz);
+
+    /** \brief Возвращает, когда журнал до позиции \c lsn сброшен на носитель, при
+     *  необходимости делая сброс ведущим. Вызывается под мьютексом \c lock.
+     */
+    void syncLog(std::unique_lock<std::mutex>& lock, ULong lsn);
+
+    /** \brief Переносит в основное хранилище записи групп, отметки которых до позиции
+     *  \c committed сброшены на носитель. Вызывается ведущим под мьютексом \c lock.
+     */
+    void applyPending(std::unique_lock<std::mutex>& lock, ULong committed);
+
+    /** \brief Начинает журнал заново, если в памяти нет записей, которых нет в основном
+     *  хранилище. Вызывается ведущим под мьютексом \c lock.
+     */
+    void restartLog(std::unique_lock<std::mutex>& lock);
+
+    /** \brief Возвращает контрольную сумму (FNV-1a) заголовка \c hdr без ее поля и \c data. */
+    static UInt calcChecksum(const RecordHeader& hdr, const void* data);
+
+protected:
+    /** \brief Запись, еще не перенесенная в основное хранилище. */
+    struct PendingWrite {
+        std::vector<Byte> data;                         ///< Байты.
+        ULong lsn;                                      ///< Конец последней записи журнала о них.
+    }; // struct PendingWrite
+
+    /** \brief Записи по смещениям; участки не пересекаются. */
+    typedef std::map<ULong, PendingWrite> PendingMap;
+
+    /** \brief Копирует в \c dst участок, если он целиком лежит в одной из записей \c writes. */
+    static bool copyCovered(const PendingMap& writes, ULong ofs, void* dst, UInt sz);
+
+    /** \brief Накладывает на \c dst пересекающиеся с участком записи \c writes и
+     *  дописывает их границы в \c parts.
+     */
+    static void overlay(const PendingMap& writes, ULong ofs, void* dst, UInt sz,
+        std::vector<std::pair<ULong, ULong> >& parts);
+
+protected:
+    IPageIO* _base;                                     ///< Основное хранилище.
+    PosixPageIO _log;                                   ///< Файл журнала.
+    std::string _logName;                               ///< Имя файла журнала.
+    ULong _logSize;                                     ///< Размер записанной части журнала.
+    bool _uncommitted;                                  ///< Есть записи после последней фиксации.
+
+    std::vector<Byte> _buf;                             ///< Еще не записанный хвост журнала.
+
+    /** \brief Позиции в журнале — число байт, добавленных в него с открытия: конец буфера,
+     *  конец последней отметки группы и конец части, сброшенной на носитель.
+     */
+    ULong _lsn, _commitLsn, _durableLsn;
+
+    /** \brief Записи, еще не перенесенные в основное хранилище. */
+    PendingMap _pending;
+
+    /** \brief Записи, которые ведущий переносит в основное хранилище прямо сейчас; читатели
+     *  видят их под записями из _pending.
+     */
+    PendingMap _applying;
+
+    bool _syncing;                                      ///< Ведущий сбрасывает журнал.
+    std::mutex _mutex;                                  ///< Защищает все, кроме самих файлов.
+    std::condition_variable _synced;                    ///< Ведущий закончил сброс.
+
+    UInt _checkpointSize;                               ///< Порог контрольной точки.
+
+    UInt _commits;                                      ///< Число фиксаций.
+    UInt _logSyncs;                                     ///< Число сбросов журнала.
+}; // class WalPageIO
+
+
+} // namespace xi
+
+
+#endif // BTREE_WAL_H_
@@ -20,6 +20,11 @@
 
 #include <gtest/gtest.h>
 
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
 #include "btree_adapters.h"
 
 
@@ -174,6 +179,175 @@ TEST_F(AdaptersTest, Reopen1)
 }
 
 
+TEST_F(AdaptersTest, IntAdBulkLoad1)
+{
+    std::string& fn = getFn("IntAdBulkLoad1.xibt");
+
+    std::vector<int> keys;
+    for (int el = -5000; el < 5000; el += 3)
+        keys.push_back(el);
+
+    BTreeIntAdapter bt;
+    bt.create(20, fn);
+    EXPECT_EQ(keys.size(), bt.bulkLoad(keys.begin(), keys.end(), 0.75f));
+
+    for (int el = -5000; el < 5000; ++el)
+        EXPECT_EQ(bt.contains(el), (el + 5000) % 3 == 0);
+
+    // the loaded tree is an ordinary one
+    bt.insert(1);
+    EXPECT_TRUE(bt.contains(1));
+    EXPECT_THROW(bt.bulkLoad(keys.begin(), keys.end()), std::runtime_error);
+}
+
+
+TEST_F(AdaptersTest, IntAdInsertSearch1)
+{
+    std::string& fn = getFn("IntAdInsertSearch1.xibt");
+
+    BTreeIntAdapter bt;
+    bt.create(50, fn);
+    EXPECT_TRUE(bt.getTree().hasSearchKernel());
+
+    for (int el = -1000; el < 1000; el += 2)
+        bt.insert(el * 7);
+
+    // the templated kernel orders ints numerically, as the comparator does
+    int res = 0;
+    for (int el = -1000; el < 1000; ++el)
+    {
+        EXPECT_EQ(bt.contains(el * 7), el % 2 == 0);
+        if (el % 2 == 0)
+        {
+            EXPECT_TRUE(bt.search(el * 7, res));
+            EXPECT_EQ(el * 7, res);
+        }
+    }
+
+    // the same tree read through the virtual comparator gives the same answers
+    bt.close();
+    bt.open(fn);
+    bt.getTree().setSearchKernel(nullptr, nullptr);
+    EXPECT_FALSE(bt.getTree().hasSearchKernel());
+    for (int el = -1000; el < 1000; ++el)
+        EXPECT_EQ(bt.contains(el * 7), el % 2 == 0);
+}
 
 
+TEST_F(AdaptersTest, IntAdCursor1)
+{
+    std::string& fn = getFn("IntAdCursor1.xibt");
 
+    BTreeIntAdapter bt;
+    bt.create(5, fn);
+    for (int el = 1000; el > -1000; el -= 4)
+        bt.insert(el);
+
+    BTreeIntAdapter::Cursor cur(bt);
+    ASSERT_TRUE(cur.seek(-3));                  // the first key not less than -3 is 0
+    EXPECT_EQ(0, cur.getKey());
+
+    int expected = 0;
+    for (bool ok = true; ok; ok = cur.next(), expected += 4)
+        EXPECT_EQ(expected, cur.getKey());
+    EXPECT_EQ(1004, expected);
+
+    int res = 0;
+    ASSERT_TRUE(cur.seekLast());
+    cur.getKey(res);
+    EXPECT_EQ(1000, res);
+    EXPECT_TRUE(cur.prev());
+    EXPECT_EQ(996, cur.getKey());
+    EXPECT_FALSE(cur.seek(1001));
+}
+
+
+TEST_F(AdaptersTest, StringAdSlotted1)
+{
+    std::mt19937 gen(3);
+    std::vector<std::string> urls;
+    for (int i = 0; i < 3000; ++i)
+    {
+        std::string url = "http://example.com/";
+        for (int len = gen() % 40; len > 0; --len)
+            url.push_back((char)('a' + gen() % 26));
+        urls.push_back(url);
+    }
+    std::multiset<std::string> sorted(urls.begin(), urls.end());
+
+    // the same keys padded to the maximum length take much more pages
+    BTreeStringAdapter fixed;
+    fixed.create(8, getFn("StringAdFixed1.xibt"), BaseBTree::pfBPlusTree);
+    BTreeStringAdapter bt;
+    bt.create(8, getFn("StringAdSlotted1.xibt"), BaseBTree::pfSlotted);
+    for (const std::string& url : urls)
+    {
+        fixed.insert(url);
+        bt.insert(url);
+    }
+    EXPECT_LT(bt.getTree().getLastPageNum() * 3, fixed.getTree().getLastPageNum());
+
+    EXPECT_THROW(bt.insert(std::string(256, 'x')), std::invalid_argument);
+    EXPECT_TRUE(bt.contains(urls[7]));
+    EXPECT_FALSE(bt.contains("http://example.com"));
+
+    bt.close();
+    bt.open(getFn("StringAdSlotted1.xibt"));
+
+    BTreeStringAdapter::Cursor cur(bt);
+    std::vector<std::string> scanned;
+    for (bool ok = cur.seekFirst(); ok; ok = cur.next())
+        scanned.push_back(cur.getKey());
+    EXPECT_EQ(std::vector<std::string>(sorted.begin(), sorted.end()), scanned);
+
+    std::string res;
+    ASSERT_TRUE(cur.seek("http://example.com/m"));
+    cur.getKey(res);
+    EXPECT_EQ(*sorted.lower_bound("http://example.com/m"), res);
+}
+
+
+TEST_F(AdaptersTest, StringAdCompressed1)
+{
+    std::mt19937 gen(5);
+    std::vector<std::string> urls;
+    for (int i = 0; i < 3000; ++i)
+    {
+        std::string url = "http://example.com/catalog/items/";
+        for (int len = 1 + gen() % 30; len > 0; --len)
+            url.push_back((char)('a' + gen() % 4));
+        urls.push_back(url);
+    }
+    std::multiset<std::string> sorted(urls.begin(), urls.end());
+
+    BTreeStringAdapter slotted;
+    slotted.create(8, getFn("StringAdSlotted2.xibt"), BaseBTree::pfSlotted);
+    BTreeStringAdapter bt;
+    bt.create(8, getFn("StringAdCompressed1.xibt"), BaseBTree::pfCompressed);
+    for (const std::string& url : urls)
+    {
+        slotted.insert(url);
+        bt.insert(url);
+    }
+
+    // the shared prefix is stored once per page, so the file is smaller despite the fences
+    FileBaseBTree& st = slotted.getTree();
+    FileBaseBTree& ct = bt.getTree();
+    EXPECT_LT((unsigned long long)ct.getLastPageNum() * ct.getNodePageSize(),
+        (unsigned long long)st.getLastPageNum() * st.getNodePageSize());
+
+    bt.close();
+    bt.open(getFn("StringAdCompressed1.xibt"));
+    EXPECT_TRUE(bt.getTree().isCompressed());
+
+    BTreeStringAdapter::Cursor cur(bt);
+    std::vector<std::string> scanned;
+    for (bool ok = cur.seekFirst(); ok; ok = cur.next())
+        scanned.push_back(cur.getKey());
+    EXPECT_EQ(std::vector<std::string>(sorted.begin(), sorted.end()), scanned);
+
+    for (int i = 0; i < 3000; i += 7)
+        EXPECT_TRUE(bt.contains(urls[i]));
+    EXPECT_FALSE(bt.contains("http://example.com/catalog/items"));
+    EXPECT_FALSE(bt.contains("http://example.com/catalog/items/e"));
+}
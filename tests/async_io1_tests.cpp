@@ -0,0 +1,144 @@
+﻿////////////////////////////////////////////////////////////////////////////////
+/// \file
+/// \brief     Unit-тесты для асинхронного чтения страниц
+///
+/// Gtest-based unit test.
+/// The naming conventions imply the name of a unit-test module is the same as
+/// the name of the corresponding tested module with _test suffix
+///
+////////////////////////////////////////////////////////////////////////////////
+
+
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "async_io.h"
+
+
+/** \brief Путь к каталогу с рабочими тестовыми файлами. */
+static const char* TEST_FILES_PATH = "../../out/";
+
+
+using namespace xi;
+
+
+static const UInt PAGE_SIZE = 512;              ///< Размер страницы тестовых файлов.
+static const UInt PAGES_NUM = 64;               ///< Число страниц в тестовом файле.
+
+
+/** \brief Тестовый класс для асинхронного чтения. */
+class AsyncIOTest : public ::testing::Test {
+public:
+    std::string getFn(const char* fn)
+    {
+        return std::string(TEST_FILES_PATH) + fn;
+    }
+
+    /** \brief Создает файл \c fn из PAGES_NUM страниц, все байты страницы i равны i. */
+    void makeFile(PosixPageIO& io, const std::string& fn)
+    {
+        io.open(fn, true);
+        std::vector<Byte> page(PAGE_SIZE);
+        for (UInt i = 0; i < PAGES_NUM; ++i)
+        {
+            page.assign(PAGE_SIZE, (Byte)i);
+            io.writeAt(i * PAGE_SIZE, &page[0], PAGE_SIZE);
+        }
+    }
+
+    /** \brief Читает через \c aio все страницы файла из makeFile() в обратном порядке,
+     *  держа в полете сколько можно, и проверяет их содержимое и метки.
+     */
+    static void checkReads(IAsyncPageIO& aio)
+    {
+        std::vector<Byte> bufs(PAGES_NUM * PAGE_SIZE);
+        std::vector<bool> done(PAGES_NUM, false);
+        UInt next = 0;
+        UInt got = 0;
+        IAsyncPageIO::Completion c;
+        while (got < PAGES_NUM)
+        {
+            for (; next < PAGES_NUM && aio.getInFlight() < aio.getDepth(); ++next)
+            {
+                UInt page = PAGES_NUM - 1 - next;
+                aio.submitRead(page * PAGE_SIZE, &bufs[page * PAGE_SIZE], PAGE_SIZE, page);
+            }
+
+            ASSERT_TRUE(aio.getCompletion(c, true));
+            ASSERT_TRUE(c.ok);
+            ASSERT_LT(c.tag, PAGES_NUM);
+            EXPECT_FALSE(done[c.tag]);
+            done[c.tag] = true;
+            ++got;
+        }
+
+        EXPECT_EQ(0, aio.getInFlight());
+        EXPECT_FALSE(aio.getCompletion(c, true));       // nothing to wait for
+        for (UInt i = 0; i < PAGES_NUM * PAGE_SIZE; ++i)
+            ASSERT_EQ((Byte)(i / PAGE_SIZE), bufs[i]);
+
+        // beyond the end of the file a read is short
+        Byte buf[PAGE_SIZE];
+        aio.submitRead(PAGES_NUM * PAGE_SIZE - PAGE_SIZE / 2, buf, PAGE_SIZE, 7);
+        ASSERT_TRUE(aio.getCompletion(c, true));
+        EXPECT_EQ(7, c.tag);
+        EXPECT_FALSE(c.ok);
+
+        // no more than the depth in flight
+        std::vector<Byte> many(aio.getDepth() * PAGE_SIZE);
+        for (UInt i = 0; i < aio.getDepth(); ++i)
+            aio.submitRead(0, &many[i * PAGE_SIZE], PAGE_SIZE, i);
+        EXPECT_THROW(aio.submitRead(0, buf, PAGE_SIZE, 0), std::logic_error);
+        while (aio.getCompletion(c, true))
+            EXPECT_TRUE(c.ok);
+    }
+}; // class AsyncIOTest
+
+
+
+TEST_F(AsyncIOTest, ThreadPool1)
+{
+    PosixPageIO io;
+    makeFile(io, getFn("AsyncThreadPool1.bin"));
+
+    ThreadPoolPageIO aio;
+    EXPECT_FALSE(aio.isOpen());
+    EXPECT_THROW(aio.open(&io, 0), std::invalid_argument);
+
+    aio.open(&io, 4);
+    EXPECT_TRUE(aio.isOpen());
+    EXPECT_EQ(4, aio.getDepth());
+    checkReads(aio);
+
+    // requests in flight are finished by close()
+    Byte buf[PAGE_SIZE];
+    aio.submitRead(PAGE_SIZE, buf, PAGE_SIZE, 0);
+    aio.close();
+    EXPECT_FALSE(aio.isOpen());
+    EXPECT_EQ(1, buf[0]);
+}
+
+
+TEST_F(AsyncIOTest, Uring1)
+{
+    PosixPageIO io;
+    makeFile(io, getFn("AsyncUring1.bin"));
+
+    // the kernel may not have io_uring or may forbid it: then the tree takes the thread pool
+    UringPageIO aio;
+    if (!aio.open(io.getFd(), 8))
+    {
+        std::cout << "io_uring is not available, skipped" << std::endl;
+        return;
+    }
+
+    EXPECT_TRUE(aio.isOpen());
+    EXPECT_THROW(aio.open(io.getFd(), 8), std::runtime_error);
+    checkReads(aio);
+
+    aio.close();
+    EXPECT_FALSE(aio.isOpen());
+}
@@ -23,6 +23,17 @@
 
 #include "btree.h"
 
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+#include <cstring>
+
 /** \brief Путь к каталогу с рабочими тестовыми файлами. */
 static const char* TEST_FILES_PATH = "../../out/";
 
@@ -624,7 +635,7 @@ struct ByteComparator : public BaseBTree::IComparator {
     virtual bool isEqual(const Byte* lhv, const Byte* rhv, UInt sz) override
     {
         for (UInt i = 0; i < sz; ++i)
-            if (*lhv != *rhv)
+            if (lhv[i] != rhv[i])
                 return false;
 
         return true;
@@ -855,7 +866,7 @@ TEST_F(BTreeTest, InsertRepeating)
 
     found.clear();
     bt.searchAll(&one, found);
-    EXPECT_EQ(found.size(), 6);
+    EXPECT_EQ(found.size(), 7);
     for (Byte* item : found) EXPECT_EQ(*item, one);
 
     found.clear();
@@ -906,5 +917,2302 @@ TEST_F(BTreeTest, InsertRepeatingUShort)
 }
 
 
+TEST_F(BTreeTest, SearchNoCopy)
+{
+    std::string& fn = getFn("SearchNoCopy.xibt");
+
+    ByteComparator comparator;
+    FileBaseBTree bt(2, 2, &comparator, fn);
+
+    for (UShort el = 0; el < 200; ++el)
+    {
+        UShort k = (UShort)(0x0101 * (el % 50));        // every key 4 times, both bytes matter
+        bt.insert((Byte*)&k);
+    }
+
+    // copying search returns the whole multi-byte record
+    UShort k = 0x2020;
+    Byte* copy = bt.search((Byte*)&k);
+    ASSERT_NE(copy, nullptr);
+    EXPECT_EQ(*(UShort*)copy, k);
+    delete[] copy;
+
+    UShort dst = 0;
+    EXPECT_TRUE(bt.search((Byte*)&k, (Byte*)&dst));
+    EXPECT_EQ(dst, k);
+
+    UShort absent = 0x2021;
+    dst = 0;
+    EXPECT_FALSE(bt.search((Byte*)&absent, (Byte*)&dst));
+    EXPECT_EQ(dst, 0);
+    EXPECT_EQ(bt.find((Byte*)&absent), nullptr);
+    EXPECT_EQ(*(const UShort*)bt.find((Byte*)&k), k);
+
+    struct CountingVisitor : public BaseBTree::IKeyVisitor {
+        CountingVisitor(UShort key, int limit) : key(key), limit(limit), visited(0) {}
+        virtual bool visitKey(const Byte* found) override
+        {
+            EXPECT_EQ(*(const UShort*)found, key);
+            return ++visited < limit;
+        }
+        UShort key;
+        int limit;
+        int visited;
+    };
+
+    CountingVisitor all(k, 100);
+    EXPECT_EQ(bt.searchAll((Byte*)&k, all), 4);
+    EXPECT_EQ(all.visited, 4);
+
+    CountingVisitor two(k, 2);                          // the visitor stops the search
+    EXPECT_EQ(bt.searchAll((Byte*)&k, two), 2);
+
+    CountingVisitor none(absent, 100);
+    EXPECT_EQ(bt.searchAll((Byte*)&absent, none), 0);
+}
+
+TEST_F(BTreeTest, LinearSearchThreshold)
+{
+    ByteComparator comparator;
+
+    // the same data is inserted with pure binary, mixed and pure linear node search
+    UShort thresholds[] = { 0, BaseBTree::DEFAULT_LINEAR_SEARCH_THRESHOLD, 1000 };
+    for (UShort threshold : thresholds)
+    {
+        std::string& fn = getFn("LinearSearchThreshold.xibt");
+        FileBaseBTree bt;
+        bt.setLinearSearchThreshold(threshold);
+        bt.create(100, 2, fn);
+        bt.setComparator(&comparator);
+        EXPECT_EQ(bt.getLinearSearchThreshold(), threshold);
+
+        for (UInt el = 0; el < 3000; ++el)
+        {
+            UShort k = (UShort)((el * 7919) % 1000);    // every key 3 times, shuffled
+            bt.insert((Byte*)&k);
+        }
+
+        for (UShort k = 0; k < 1001; ++k)
+        {
+            std::list<Byte*> found;
+            EXPECT_EQ(bt.searchAll((Byte*)&k, found), k < 1000 ? 3 : 0);
+            for (Byte* item : found)
+            {
+                EXPECT_EQ(*(UShort*)item, k);
+                delete[] item;
+            }
+        }
+    }
+}
+
+TEST_F(BTreeTest, CacheHitsMisses)
+{
+    std::string& fn = getFn("CacheHitsMisses.xibt");
+
+    ByteComparator comparator;
+    FileBaseBTree bt(2, 1, &comparator, fn);
+    EXPECT_EQ((UInt)FileBaseBTree::DEFAULT_CACHE_CAPACITY, bt.getCacheCapacity());
+
+    for (Byte el = 0; el < 30; ++el)
+        bt.insert(&el);
+
+    // all pages fit into the pool, so repeated lookups should not miss at all
+    UInt misses = bt.getCacheMisses();
+    UInt hits = bt.getCacheHits();
+    for (Byte el = 0; el < 30; ++el)
+        EXPECT_EQ(*bt.search(&el), el);
+
+    EXPECT_EQ(misses, bt.getCacheMisses());
+    EXPECT_LT(hits, bt.getCacheHits());
+}
+
+
+TEST_F(BTreeTest, CacheSmallCapacity)
+{
+    std::string& fn = getFn("CacheSmallCapacity.xibt");
+
+    ByteComparator comparator;
+    FileBaseBTree bt(2, 1, &comparator, fn);
+    bt.setCacheCapacity(3);                     // less than the number of pages
+
+    for (Byte el = 0; el < 50; ++el)
+        bt.insert(&el);
+
+    EXPECT_LT(3, bt.getLastPageNum());
+    EXPECT_LT(0, bt.getCache().getEvictions());
+
+    for (Byte el = 0; el < 50; ++el)
+        EXPECT_EQ(*bt.search(&el), el);
+
+    // and the same content must be seen without the pool after reopening
+    bt.close();
+    bt.setCacheCapacity(0);
+    bt.open(fn);
+    bt.setComparator(&comparator);
+    EXPECT_FALSE(bt.getCache().isEnabled());
+
+    for (Byte el = 0; el < 50; ++el)
+        EXPECT_EQ(*bt.search(&el), el);
+}
+
+
+TEST_F(BTreeTest, CacheWriteBack)
+{
+    std::string& fn = getFn("CacheWriteBack.xibt");
+
+    ByteComparator comparator;
+    FileBaseBTree bt(2, 1, &comparator, fn);
+    for (Byte el = 0; el < 100; ++el)
+    {
+        Byte k = (Byte)(el * 37);
+        bt.insert(&k);
+    }
+
+    // the modified pages stay in the pool until the checkpoint
+    EXPECT_LT(0, bt.getCache().getDirtyNum());
+    bt.sync();
+    EXPECT_EQ(0, bt.getCache().getDirtyNum());
+
+    std::ifstream in(fn, std::ios_base::binary);
+    std::vector<char> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    ASSERT_EQ(bt.getPageOfs(bt.getLastPageNum() + 1), file.size());
+    EXPECT_EQ(0, memcmp(&file[bt.getPageOfs(bt.getRootPageNum())], bt.getRootPage().getData(),
+        bt.getNodePageSize()));
+
+    Byte dup = 37;
+    bt.insert(&dup);
+    EXPECT_LT(0, bt.getCache().getDirtyNum());
+    bt.close();
+
+    bt.open(fn);
+    bt.setComparator(&comparator);
+    for (Byte el = 0; el < 100; ++el)
+    {
+        Byte k = (Byte)(el * 37);
+        EXPECT_EQ(*bt.search(&k), k);
+    }
+
+    std::list<Byte*> found;
+    EXPECT_EQ(2, bt.searchAll(&dup, found));
+    for (Byte* item : found)
+        delete[] item;
+}
+
+
+TEST_F(BTreeTest, HeaderSlots)
+{
+    std::string& fn = getFn("HeaderSlots.xibt");
+
+    ByteComparator comparator;
+    FileBaseBTree bt(2, 1, &comparator, fn);
+    EXPECT_EQ(1, bt.getMetaSeq());
+
+    // page allocations do not touch the header until the checkpoint
+    for (Byte el = 0; el < 20; ++el)
+        bt.insert(&el);
+    EXPECT_LT(1, bt.getLastPageNum());
+    EXPECT_EQ(1, bt.getMetaSeq());
+    bt.sync();
+    EXPECT_EQ(2, bt.getMetaSeq());
+    bt.sync();
+    EXPECT_EQ(2, bt.getMetaSeq());               // nothing has changed
+
+    UInt lastPage = bt.getLastPageNum();
+    UInt rootPage = bt.getRootPageNum();
+    for (Byte el = 20; el < 100; ++el)
+        bt.insert(&el);
+    UInt filePages = bt.getLastPageNum();
+    bt.close();                                 // the third checkpoint
+
+    // a torn write of the newest slot leaves the previous checkpoint in force
+    {
+        std::fstream f(fn, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+        f.seekp(FileBaseBTree::META_SLOTS_OFS + (3 % 2) * FileBaseBTree::META_SLOT_SZ + 6);
+        f.put('\x7f');
+    }
+    bt.open(fn);
+    EXPECT_EQ(2, bt.getMetaSeq());
+    EXPECT_EQ(rootPage, bt.getRootPageNum());
+    EXPECT_LT(lastPage, filePages);             // the pages past it are in the file already
+    EXPECT_EQ(filePages, bt.getLastPageNum());
+    bt.close();
+
+    // with both slots broken the file is refused; the last opening has written the torn one
+    // again to take the pages in
+    {
+        std::fstream f(fn, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+        f.seekp(FileBaseBTree::META_SLOTS_OFS + 6);
+        f.put('\x7f');
+        f.seekp(FileBaseBTree::META_SLOTS_OFS + FileBaseBTree::META_SLOT_SZ + 6);
+        f.put('\x7f');
+    }
+    EXPECT_THROW(bt.open(fn), std::exception);
+}
+
+
+TEST_F(BTreeTest, HeaderSlotsWriteBackCrash)
+{
+    std::string fn = getFn("HeaderSlotsWriteBackCrash.xibt");
+    std::string crashFn = getFn("HeaderSlotsWriteBackCrash1.xibt");
+
+    ByteComparator comparator;
+    FileBaseBTree bt;
+    bt.setComparator(&comparator);
+    bt.setCacheCapacity(4);                     // pages are evicted long before the checkpoint
+    bt.create(2, 1, fn);
+    for (Byte el = 0; el < 100; ++el)
+        bt.insert(&el);
+    EXPECT_EQ(1, bt.getMetaSeq());
+
+    // the process dies here: the header slot still has the page count of the creation
+    {
+        std::ifstream in(fn, std::ios_base::binary);
+        std::ofstream out(crashFn, std::ios_base::binary | std::ios_base::trunc);
+        out << in.rdbuf();
+    }
+    std::ifstream in(crashFn, std::ios_base::binary | std::ios_base::ate);
+    ULong size = (ULong)in.tellg();
+    UInt filePages = 0;
+    while (bt.getPageOfs(filePages + 2) <= size)
+        ++filePages;
+    EXPECT_LT(1, filePages);
+
+    // the evicted pages, which written ones may refer to, are never given out again
+    FileBaseBTree rec(crashFn, &comparator);
+    EXPECT_EQ(1, rec.getMetaSeq());
+    EXPECT_EQ(filePages, rec.getLastPageNum());
+    Byte k = 100;
+    rec.insert(&k);
+    EXPECT_LE(filePages, rec.getLastPageNum());
+}
+
+
+TEST_F(BTreeTest, HeaderVersion)
+{
+    std::string& fn = getFn("HeaderVersion.xibt");
+
+    ByteComparator comparator;
+    {
+        FileBaseBTree bt(2, 1, &comparator, fn);
+        for (Byte el = 0; el < 20; ++el)
+            bt.insert(&el);
+    }
+    {
+        FileBaseBTree bt(fn, &comparator);
+        EXPECT_EQ(2, bt.getOrder());
+    }
+
+    // a file of a newer version is refused rather than misread
+    UShort version = FileBaseBTree::Header::FORMAT_VERSION + 1;
+    {
+        std::fstream f(fn, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+        f.seekp(FileBaseBTree::HEADER_OFS + 4);
+        f.write((const char*)&version, sizeof(version));
+    }
+    EXPECT_THROW(FileBaseBTree(fn, &comparator), std::runtime_error);
+
+    // and so is a file of the layout before versions, which has the old signature
+    UInt sign = FileBaseBTree::Header::LEGACY_SIGN;
+    {
+        std::fstream f(fn, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+        f.seekp(FileBaseBTree::HEADER_OFS);
+        f.write((const char*)&sign, sizeof(sign));
+    }
+    EXPECT_THROW(FileBaseBTree(fn, &comparator), std::runtime_error);
+}
+
+
+TEST_F(BTreeTest, CopyOnWriteSnapshots)
+{
+    ByteComparator comparator;
+    std::mt19937 gen(7);
+    std::string& fn = getFn("CopyOnWriteSnapshots.xibt");
+
+    BaseBTree::PageFormat formats[] = { BaseBTree::pfBTree, BaseBTree::pfBPlusTree };
+    for (BaseBTree::PageFormat format : formats)
+    {
+        FileBaseBTree bt;
+        bt.setComparator(&comparator);
+        bt.setCowEnabled(true);
+        bt.create(2, 1, fn, format);
+        EXPECT_TRUE(bt.isCow());
+        EXPECT_THROW(bt.setCowEnabled(false), std::runtime_error);
+
+        std::multiset<Byte> keys;                       // the oracle of the tree
+        auto update = [&](int steps) {
+            for (int i = 0; i < steps; ++i)
+            {
+                Byte k = (Byte)(gen() % 100);
+                if (gen() % 3 != 0 || keys.empty())
+                {
+                    bt.insert(&k);
+                    keys.insert(k);
+                }
+                else if (bt.remove(&k))
+                    keys.erase(keys.find(k));
+            }
+        };
+        auto scan = [](BaseBTree::Cursor& cur) {
+            std::vector<Byte> got;
+            for (bool ok = cur.seekFirst(); ok; ok = cur.next())
+                got.push_back(*cur.getKey());
+            return got;
+        };
+
+        // every snapshot keeps seeing the tree as it was, while it is changed further
+        BaseBTree::Snapshot snaps[3];
+        std::vector<std::vector<Byte> > views;
+        for (BaseBTree::Snapshot& snap : snaps)
+        {
+            update(300);
+            bt.openSnapshot(snap);
+            views.push_back(std::vector<Byte>(keys.begin(), keys.end()));
+        }
+        update(300);
+        EXPECT_EQ(3, bt.getSnapshotsNum());
+
+        for (size_t i = 0; i < views.size(); ++i)
+        {
+            BaseBTree::Cursor cur(snaps[i]);
+            EXPECT_EQ(views[i], scan(cur));
+
+            for (int k = 0; k < 100; ++k)
+            {
+                Byte key = (Byte)k;
+                Byte found = 0;
+                EXPECT_EQ(std::binary_search(views[i].begin(), views[i].end(), key),
+                    snaps[i].search(&key, &found));
+            }
+        }
+        BaseBTree::Cursor cur(&bt);
+        EXPECT_EQ(std::vector<Byte>(keys.begin(), keys.end()), scan(cur));
+
+        // with nothing holding old versions, the slots of rewritten pages are used again
+        for (BaseBTree::Snapshot& snap : snaps)
+            snap.release();
+        EXPECT_EQ(0, bt.getSnapshotsNum());
+        for (int round = 0; round < 10; ++round)
+        {
+            update(300);
+            bt.sync();
+        }
+        EXPECT_LT(bt.getLastSlotNum(), 3 * bt.getLastPageNum());
+
+        // closing the tree closes its snapshots
+        bt.openSnapshot(snaps[0]);
+        bt.close();
+        EXPECT_FALSE(snaps[0].isOpen());
+        EXPECT_THROW(BaseBTree::Cursor c(snaps[0]), std::logic_error);
+
+        bt.open(fn);
+        EXPECT_EQ(std::vector<Byte>(keys.begin(), keys.end()), scan(cur));
+    }
+
+    FileBaseBTree plain(2, 1, &comparator, fn);
+    BaseBTree::Snapshot snap;
+    EXPECT_FALSE(plain.isCow());
+    EXPECT_THROW(plain.openSnapshot(snap), std::logic_error);
+}
+
+
+TEST_F(BTreeTest, CopyOnWriteSnapshotConcurrent)
+{
+    ByteComparator comparator;
+    std::string& fn = getFn("CopyOnWriteSnapshotConcurrent.xibt");
+
+    BaseBTree::PageFormat formats[] = { BaseBTree::pfBTree, BaseBTree::pfBPlusTree };
+    for (BaseBTree::PageFormat format : formats)
+    {
+        FileBaseBTree bt;
+        bt.setComparator(&comparator);
+        bt.setStorageMode(FileBaseBTree::smPosix);
+        bt.setCowEnabled(true);
+        bt.setCacheCapacity(4);                     // writers evict and rewrite pages all along
+        bt.create(2, 1, fn, format);
+
+        std::mt19937 gen(11);
+        std::multiset<Byte> keys;
+        for (int i = 0; i < 500; ++i)
+        {
+            Byte k = (Byte)(gen() % 100);
+            bt.insert(&k);
+            keys.insert(k);
+        }
+
+        BaseBTree::Snapshot snap;
+        bt.openSnapshot(snap);
+        const std::vector<Byte> view(keys.begin(), keys.end());
+
+        // the writer changes the tree while the scanners read the snapshot, taking no latches
+        std::atomic<bool> done(false);
+        std::thread writer([&]()
+        {
+            std::mt19937 wgen(13);
+            for (int i = 0; i < 3000; ++i)
+            {
+                Byte k = (Byte)(wgen() % 100);
+                if (wgen() % 2 == 0)
+                {
+                    bt.insert(&k);
+                    keys.insert(k);
+                }
+                else if (bt.remove(&k))
+                    keys.erase(keys.find(k));
+            }
+            done = true;
+        });
+
+        std::atomic<int> mismatches(0);
+        std::atomic<int> scans(0);
+        std::vector<std::thread> scanners;
+        for (int t = 0; t < 2; ++t)
+            scanners.push_back(std::thread([&]()
+            {
+                do
+                {
+                    std::vector<Byte> got;
+                    BaseBTree::Cursor cur(snap);
+                    for (bool ok = cur.seekFirst(); ok; ok = cur.next())
+                        got.push_back(*cur.getKey());
+                    if (got != view)
+                        ++mismatches;
+
+                    for (int k = 0; k < 100; ++k)
+                    {
+                        Byte key = (Byte)k;
+                        Byte found = 0;
+                        if (std::binary_search(view.begin(), view.end(), key) != snap.search(&key, &found))
+                            ++mismatches;
+                    }
+                    ++scans;
+                } while (!done);
+            }));
+
+        writer.join();
+        for (std::thread& th : scanners)
+            th.join();
+        EXPECT_EQ(0, mismatches.load());
+        EXPECT_LE(2, scans.load());
+
+        snap.release();
+        EXPECT_EQ(0, bt.getSnapshotsNum());
+
+        std::vector<Byte> got;
+        BaseBTree::Cursor cur(&bt);
+        for (bool ok = cur.seekFirst(); ok; ok = cur.next())
+            got.push_back(*cur.getKey());
+        EXPECT_EQ(std::vector<Byte>(keys.begin(), keys.end()), got);
+    }
+}
+
+
+TEST_F(BTreeTest, CopyOnWriteCrash)
+{
+    ByteComparator comparator;
+    std::string fn = getFn("CopyOnWriteCrash.xibt");
+    std::string crashFn = getFn("CopyOnWriteCrash1.xibt");
+
+    FileBaseBTree bt;
+    bt.setComparator(&comparator);
+    bt.setStorageMode(FileBaseBTree::smPosix);
+    bt.setCowEnabled(true);
+    for (Byte el = 0; el < 100; ++el)
+    {
+        if (el == 0)
+            bt.create(3, 1, fn);
+        bt.insert(&el);
+    }
+    bt.sync();
+
+    // whatever reaches the file after the checkpoint goes to slots it does not refer to
+    for (Byte el = 100; el < 200; ++el)
+        bt.insert(&el);
+    for (Byte el = 0; el < 50; ++el)
+        bt.remove(&el);
+    bt.setCacheCapacity(0);                     // all dirty pages are written, the header is not
+    {
+        std::ifstream in(fn, std::ios_base::binary);
+        std::ofstream out(crashFn, std::ios_base::binary | std::ios_base::trunc);
+        out << in.rdbuf();
+    }
+
+    // the file has a page table, so it is opened in the copy-on-write mode as it is
+    FileBaseBTree rec(crashFn, &comparator);
+    EXPECT_TRUE(rec.isCow());
+    for (int el = 0; el < 256; ++el)
+    {
+        Byte k = (Byte)el;
+        EXPECT_EQ(el < 100, rec.find(&k) != nullptr);
+    }
+    rec.close();
+
+    bt.close();
+    bt.setCowEnabled(false);
+    bt.open(fn);
+    bt.setComparator(&comparator);
+    EXPECT_TRUE(bt.isCow());
+    for (int el = 0; el < 256; ++el)
+    {
+        Byte k = (Byte)el;
+        EXPECT_EQ(el >= 50 && el < 200, bt.find(&k) != nullptr);
+    }
+    bt.close();
+
+    bt.setStorageMode(FileBaseBTree::smMapped);
+    EXPECT_THROW(bt.open(fn), std::exception);
+    bt.setStorageMode(FileBaseBTree::smPosix);
+    bt.setCowEnabled(true);
+    bt.setWalEnabled(true);
+    EXPECT_THROW(bt.open(fn), std::logic_error);
+}
+
+
+TEST_F(BTreeTest, MappedInsertSearch)
+{
+    std::string& fn = getFn("MappedInsertSearch.xibt");
+
+    ByteComparator comparator;
+    FileBaseBTree bt;
+    bt.setStorageMode(FileBaseBTree::smMapped);
+    bt.create(2, 1, fn);
+    bt.setComparator(&comparator);
+    EXPECT_TRUE(bt.isMapped());
+    EXPECT_FALSE(bt.getCache().isEnabled());
+
+    for (Byte el = 0; el < 100; ++el)
+    {
+        Byte k = (Byte)(el * 37);               // some shuffled order
+        bt.insert(&k);
+        EXPECT_EQ(*bt.search(&k), k);
+    }
+
+    // wrappers look directly into the mapping: no copy per page
+    FileBaseBTree::PageWrapper wp1(&bt);
+    FileBaseBTree::PageWrapper wp2(&bt);
+    wp1.readPage(2);
+    wp2.readPage(2);
+    EXPECT_TRUE(wp1.isAttached());
+    EXPECT_EQ(wp1.getData(), wp2.getData());
+
+    EXPECT_THROW(bt.setStorageMode(FileBaseBTree::smStream), std::runtime_error);
+    UInt pages = bt.getLastPageNum();
+    bt.close();
+
+    // the padded tail of the mapping is cut off on close, so the file can be read by streams
+    FileBaseBTree bt2(fn, &comparator);
+    EXPECT_FALSE(bt2.isMapped());
+    EXPECT_EQ(pages, bt2.getLastPageNum());
+    for (Byte el = 0; el < 100; ++el)
+    {
+        Byte k = (Byte)(el * 37);
+        EXPECT_EQ(*bt2.search(&k), k);
+    }
+}
+
+
+TEST_F(BTreeTest, MappedReopen)
+{
+    std::string& fn = getFn("MappedReopen.xibt");
+
+    ByteComparator comparator;
+    {
+        FileBaseBTree bt(2, 2, &comparator, fn);        // written through the stream
+        for (UShort el = 0; el < 500; el += 5)
+            bt.insert((Byte*)&el);
+    }
+
+    FileBaseBTree bt;
+    bt.setStorageMode(FileBaseBTree::smMapped);
+    bt.open(fn);
+    bt.setComparator(&comparator);
+
+    for (UShort el = 1; el < 500; el += 5)             // growing the mapped file
+        bt.insert((Byte*)&el);
+
+    for (UShort el = 0; el < 500; ++el)
+    {
+        Byte* found = bt.search((Byte*)&el);
+        if (el % 5 < 2)
+            EXPECT_EQ(*(UShort*)found, el);
+        else
+            EXPECT_EQ(found, nullptr);
+    }
+
+    bt.close();
+    bt.open(fn);
+    bt.setComparator(&comparator);
+    UShort el = 496;
+    EXPECT_EQ(*(UShort*)bt.search((Byte*)&el), el);
+    bt.close();
+
+    // a file larger than the reserve, as one written in another mode may be, is opened anyway
+    bt.setMappedReserve(1);
+    EXPECT_EQ(1, bt.getMappedReserve());
+    bt.open(fn);
+    bt.setComparator(&comparator);
+    EXPECT_EQ(*(UShort*)bt.search((Byte*)&el), el);
+    EXPECT_THROW(bt.setMappedReserve(0), std::runtime_error);
+}
+
+
+TEST_F(BTreeTest, StreamPageIOErrors)
+{
+    std::string& fn = getFn("StreamPageIOErrors.bin");
+    std::fstream f(fn, std::ios_base::in | std::ios_base::out | std::ios_base::binary
+        | std::ios_base::trunc);
+    StreamPageIO io(&f);
+
+    Byte a[16], b[16];
+    memset(a, 'a', 16);
+    io.writeAt(0, a, 16);
+
+    // a read past the end fails alone, the stream goes on working
+    EXPECT_FALSE(io.readAt(8, b, 16));
+    io.writeAt(16, a, 16);
+    ASSERT_TRUE(io.readAt(16, b, 16));
+    EXPECT_EQ(0, memcmp(a, b, 16));
+    f.close();
+
+    // a stream that can't be written to makes a write throw
+    std::fstream ro(fn, std::ios_base::in | std::ios_base::binary);
+    io.setStream(&ro);
+    EXPECT_THROW(io.writeAt(0, a, 16), std::runtime_error);
+}
+
+
+TEST_F(BTreeTest, PosixInsertSearch)
+{
+    std::string& fn = getFn("PosixInsertSearch.xibt");
+
+    ByteComparator comparator;
+    FileBaseBTree bt;
+    bt.setStorageMode(FileBaseBTree::smPosix);
+    bt.create(2, 2, fn);
+    bt.setComparator(&comparator);
+    EXPECT_FALSE(bt.isMapped());
+
+    for (UShort el = 0; el < 300; el += 3)
+        bt.insert((Byte*)&el);
+    bt.sync();                                  // the dirty pages of the pool go to the file
+
+    // pread/pwrite keep no file position: several threads read pages at once
+    UInt pages = bt.getLastPageNum();
+    UInt pageSize = bt.getNodePageSize();
+    std::vector<Byte> expected((size_t)pages * pageSize);
+    for (UInt pn = 1; pn <= pages; ++pn)
+        ASSERT_TRUE(bt.getPageIO()->readAt(bt.getPageOfs(pn), &expected[(pn - 1) * pageSize], pageSize));
+
+    std::atomic<int> mismatches(0);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t)
+        readers.push_back(std::thread([&]()
+        {
+            std::vector<Byte> buf(pageSize);
+            for (int round = 0; round < 50; ++round)
+                for (UInt pn = 1; pn <= pages; ++pn)
+                {
+                    if (!bt.getPageIO()->readAt(bt.getPageOfs(pn), &buf[0], pageSize)
+                        || memcmp(&buf[0], &expected[(pn - 1) * pageSize], pageSize) != 0)
+                        ++mismatches;
+                }
+        }));
+    for (std::thread& th : readers)
+        th.join();
+    EXPECT_EQ(0, mismatches.load());
+
+    bt.close();
+
+    // the file format does not depend on the storage mode
+    FileBaseBTree bt2(fn, &comparator);
+    EXPECT_EQ(pages, bt2.getLastPageNum());
+    for (UShort el = 0; el < 300; ++el)
+    {
+        Byte* found = bt2.search((Byte*)&el);
+        if (el % 3 == 0)
+            EXPECT_EQ(*(UShort*)found, el);
+        else
+            EXPECT_EQ(found, nullptr);
+    }
+}
+
+
+/** \brief Проверяет структуру поддерева со страницей \c pnum: число ключей в узлах, порядок
+ *  ключей, их попадание между разделителями родителя \c lo и \c hi, одинаковую глубину
+ *  листьев, а для формата pfBLink — верхние ключи, правые ссылки и уровни страниц. Листья
+ *  по порядку добавляются в \c leaves. Возвращает число записей в поддереве.
+ */
+static UInt checkSubtree(FileBaseBTree& bt, UInt pnum, int depth, int& leafDepth,
+    const Byte* lo, const Byte* hi, std::vector<UInt>& leaves)
+{
+    FileBaseBTree::PageWrapper pw(&bt);
+    pw.readPage(pnum);
+
+    BaseBTree::IComparator* c = bt.getComparator();
+    UShort n = pw.getKeysNum();
+    EXPECT_LE(n, pw.getMaxKeysNum());
+    if (!pw.isRoot())
+    {
+        EXPECT_GE(n, pw.getMinKeysNum());
+    }
+    if (bt.isSlotted() && !pw.isRoot())
+    {
+        EXPECT_GT(n, 0);                    // byte-balanced splits leave no empty nodes
+    }
+
+    // a compressed page knows the bounds its parents give it
+    if (bt.isCompressed())
+    {
+        const Byte* fences[] = { lo, pw.getLowFence(), hi, pw.getHighFence() };
+        for (int f = 0; f < 4; f += 2)
+        {
+            EXPECT_EQ(fences[f] == nullptr, fences[f + 1] == nullptr);
+            if (fences[f] && fences[f + 1])
+            {
+                EXPECT_TRUE(c->isEqual(fences[f], fences[f + 1], bt.getKeySize()));
+            }
+        }
+    }
+
+    // a B-link page ends where its parent says, the rightmost one has no right link
+    if (bt.isBLink())
+    {
+        EXPECT_EQ(hi == nullptr, pw.getHighKey() == nullptr);
+        if (hi && pw.getHighKey())
+        {
+            EXPECT_TRUE(c->isEqual(hi, pw.getHighKey(), bt.getKeySize()));
+        }
+    }
+    for (UShort i = 0; i < n; ++i)
+    {
+        if (i > 0)
+        {
+            EXPECT_FALSE(c->compare(pw.getKey(i), pw.getKey(i - 1), bt.getKeySize()));
+        }
+        if (lo)
+        {
+            EXPECT_FALSE(c->compare(pw.getKey(i), lo, bt.getKeySize()));
+        }
+        if (hi)
+        {
+            EXPECT_FALSE(c->compare(hi, pw.getKey(i), bt.getKeySize()));
+        }
+    }
+
+    if (pw.isLeaf())
+    {
+        if (leafDepth == -1)
+            leafDepth = depth;
+        EXPECT_EQ(leafDepth, depth);
+        if (bt.isBLink())
+        {
+            EXPECT_EQ(0, pw.getLevel());
+        }
+        leaves.push_back(pnum);
+        return n;
+    }
 
+    UInt total = bt.isBPlus() ? 0 : n;      // B+ separators are not records
+    for (UShort i = 0; i <= n; ++i)
+    {
+        total += checkSubtree(bt, pw.getCursor(i), depth + 1, leafDepth,
+            i > 0 ? pw.getKey(i - 1) : lo, i < n ? pw.getKey(i) : hi, leaves);
 
+        if (bt.isBLink())
+        {
+            FileBaseBTree::PageWrapper child(&bt);
+            child.readPage(pw.getCursor(i));
+            EXPECT_EQ(pw.getLevel() - 1, child.getLevel());
+            if (i < n)
+            {
+                EXPECT_EQ(pw.getCursor(i + 1), child.getRightLink());
+            }
+        }
+    }
+
+    return total;
+}
+
+
+/** \brief Проверяет структуру всего дерева, а для B+-дерева — и список листьев. */
+static UInt checkTree(FileBaseBTree& bt)
+{
+    int leafDepth = -1;
+    std::vector<UInt> leaves;
+    UInt total = checkSubtree(bt, bt.getRootPageNum(), 0, leafDepth, nullptr, nullptr, leaves);
+
+    if (bt.isBPlus())
+    {
+        FileBaseBTree::PageWrapper pw(&bt);
+        UInt prev = 0;
+        for (UInt pnum : leaves)
+        {
+            pw.readPage(pnum);
+            EXPECT_EQ(prev, pw.getPrevLeaf());
+            if (prev)
+            {
+                FileBaseBTree::PageWrapper pp(&bt);
+                pp.readPage(prev);
+                EXPECT_EQ(pnum, pp.getNextLeaf());
+            }
+            prev = pnum;
+        }
+        EXPECT_EQ(0, pw.getNextLeaf());
+    }
+
+    return total;
+}
+
+
+TEST_F(BTreeTest, ConcurrentInsertSearch)
+{
+    ByteComparator comparator;
+    const int WRITERS = 4;
+    const int READERS = 2;
+    const int PER_WRITER = 1500;
+
+    FileBaseBTree::StorageMode modes[] = { FileBaseBTree::smStream, FileBaseBTree::smPosix,
+        FileBaseBTree::smMapped };
+    BaseBTree::PageFormat formats[] = { BaseBTree::pfBTree, BaseBTree::pfBPlusTree,
+        BaseBTree::pfBLink };
+    for (FileBaseBTree::StorageMode mode : modes)
+        for (BaseBTree::PageFormat format : formats)
+        {
+            std::string fn = getFn("ConcurrentInsertSearch.xibt");
+            FileBaseBTree bt;
+            bt.setStorageMode(mode);
+            bt.setCacheCapacity(16);                // a small pool evicts pages of other threads
+            bt.create(3, 2, fn, format);
+            bt.setComparator(&comparator);
+            ASSERT_TRUE(bt.isConcurrent());
+
+            // writers insert disjoint keys and report how many are in, readers look them up
+            std::atomic<int> inserted[WRITERS];
+            for (std::atomic<int>& n : inserted)
+                n.store(0);
+            std::atomic<bool> writing(true);
+            std::atomic<int> missing(0);
+
+            std::vector<std::thread> writers;
+            for (int t = 0; t < WRITERS; ++t)
+                writers.push_back(std::thread([&, t]()
+                {
+                    for (int i = 0; i < PER_WRITER; ++i)
+                    {
+                        UShort k = (UShort)(i * WRITERS + t);
+                        bt.insert((Byte*)&k);
+                        inserted[t].store(i + 1);
+                    }
+                }));
+
+            std::vector<std::thread> readers;
+            for (int r = 0; r < READERS; ++r)
+                readers.push_back(std::thread([&, r]()
+                {
+                    std::mt19937 gen(r);
+                    while (writing.load())
+                        for (int t = 0; t < WRITERS; ++t)
+                        {
+                            int n = inserted[t].load();
+                            if (n == 0)
+                                continue;
+
+                            UShort k = (UShort)((gen() % n) * WRITERS + t);
+                            UShort found = 0;
+                            if (!bt.search((Byte*)&k, (Byte*)&found) || found != k)
+                                ++missing;
+                        }
+                }));
+
+            for (std::thread& th : writers)
+                th.join();
+            writing.store(false);
+            for (std::thread& th : readers)
+                th.join();
+
+            EXPECT_EQ(0, missing.load());
+            EXPECT_EQ(WRITERS * PER_WRITER, checkTree(bt));
+
+            bt.close();
+            bt.open(fn);
+            bt.setComparator(&comparator);
+            UShort found;
+            for (UShort k = 0; k < WRITERS * PER_WRITER; ++k)
+                ASSERT_TRUE(bt.search((Byte*)&k, (Byte*)&found));
+        }
+
+    // with a log every insert is still an atomic group of its own, and the inserts
+    // finishing together share one fsync
+    for (BaseBTree::PageFormat format : formats)
+    {
+        std::string fn = getFn("ConcurrentInsertSearch.xibt");
+        FileBaseBTree bt;
+        bt.setStorageMode(FileBaseBTree::smPosix);
+        bt.setWalEnabled(true);
+        bt.setCacheCapacity(16);
+        bt.create(3, 2, fn, format);
+        bt.setComparator(&comparator);
+        EXPECT_TRUE(bt.isConcurrent());
+        UInt commits = bt.getWal().getCommits();
+        UInt syncs = bt.getWal().getLogSyncs();
+
+        std::vector<std::thread> writers;
+        for (int t = 0; t < WRITERS; ++t)
+            writers.push_back(std::thread([&, t]()
+            {
+                for (int i = 0; i < 200; ++i)
+                {
+                    UShort k = (UShort)(i * WRITERS + t);
+                    bt.insert((Byte*)&k);
+                }
+            }));
+        for (std::thread& th : writers)
+            th.join();
+        EXPECT_EQ(WRITERS * 200, checkTree(bt));
+        EXPECT_EQ(commits + WRITERS * 200, bt.getWal().getCommits());
+        EXPECT_GT(WRITERS * 200, bt.getWal().getLogSyncs() - syncs);
+
+        bt.close();
+        bt.open(fn);
+        bt.setComparator(&comparator);
+        EXPECT_EQ(WRITERS * 200, checkTree(bt));
+    }
+}
+
+
+TEST_F(BTreeTest, OptimisticReads)
+{
+    ByteComparator comparator;
+    const int WRITERS = 3;
+    const int READERS = 2;
+    const int PER_WRITER = 1000;
+
+    FileBaseBTree::StorageMode modes[] = { FileBaseBTree::smPosix, FileBaseBTree::smMapped };
+    BaseBTree::PageFormat formats[] = { BaseBTree::pfBTree, BaseBTree::pfBPlusTree,
+        BaseBTree::pfBLink };
+    for (FileBaseBTree::StorageMode mode : modes)
+        for (BaseBTree::PageFormat format : formats)
+        {
+            std::string fn = getFn("OptimisticReads.xibt");
+            FileBaseBTree bt;
+            bt.setStorageMode(mode);
+            bt.setCacheCapacity(mode == FileBaseBTree::smMapped ? 0 : 16);
+            bt.create(3, 2, fn, format);
+            bt.setComparator(&comparator);
+            bt.setOptimisticReads(true);
+            ASSERT_TRUE(bt.isOptimisticReads());
+
+            // every key goes in twice, so searchAll() has equal keys spread over pages to find
+            std::atomic<int> inserted[WRITERS];
+            for (std::atomic<int>& n : inserted)
+                n.store(0);
+            std::atomic<bool> writing(true);
+            std::atomic<int> missing(0);
+            std::atomic<int> wrongCounts(0);
+
+            std::vector<std::thread> writers;
+            for (int t = 0; t < WRITERS; ++t)
+                writers.push_back(std::thread([&, t]()
+                {
+                    for (int i = 0; i < PER_WRITER; ++i)
+                    {
+                        UShort k = (UShort)(i * WRITERS + t);
+                        bt.insert((Byte*)&k);
+                        bt.insert((Byte*)&k);
+                        inserted[t].store(i + 1);
+                    }
+                }));
+
+            std::vector<std::thread> readers;
+            for (int r = 0; r < READERS; ++r)
+                readers.push_back(std::thread([&, r]()
+                {
+                    std::mt19937 gen(r);
+                    while (writing.load())
+                        for (int t = 0; t < WRITERS; ++t)
+                        {
+                            int n = inserted[t].load();
+                            if (n == 0)
+                                continue;
+
+                            UShort k = (UShort)((gen() % n) * WRITERS + t);
+                            UShort found = 0;
+                            if (!bt.search((Byte*)&k, (Byte*)&found) || found != k)
+                                ++missing;
+
+                            std::list<Byte*> keys;
+                            if (bt.searchAll((Byte*)&k, keys) != 2)
+                                ++wrongCounts;
+                            for (Byte* key : keys)
+                                delete[] key;
+                        }
+                }));
+
+            for (std::thread& th : writers)
+                th.join();
+            writing.store(false);
+            for (std::thread& th : readers)
+                th.join();
+
+            EXPECT_EQ(0, missing.load());
+            EXPECT_EQ(0, wrongCounts.load());
+            EXPECT_EQ(2 * WRITERS * PER_WRITER, checkTree(bt));
+        }
+
+    // copy-on-write pages are read through the shared page table, so searches keep latching
+    std::string fn = getFn("OptimisticReads.xibt");
+    FileBaseBTree bt;
+    bt.setCowEnabled(true);
+    bt.setOptimisticReads(true);
+    bt.create(3, 2, fn);
+    bt.setComparator(&comparator);
+    EXPECT_FALSE(bt.isConcurrent());
+
+    for (UShort k = 0; k < 100; ++k)
+        bt.insert((Byte*)&k);
+    UShort found;
+    for (UShort k = 0; k < 100; ++k)
+        ASSERT_TRUE(bt.search((Byte*)&k, (Byte*)&found));
+    std::list<Byte*> keys;
+    EXPECT_EQ(1, bt.searchAll((Byte*)&found, keys));
+    for (Byte* key : keys)
+        delete[] key;
+}
+
+
+TEST_F(BTreeTest, RemoveRandom)
+{
+    ByteComparator comparator;
+    std::mt19937 gen(1);
+
+    UShort orders[] = { 2, 3, 5 };
+    for (UShort order : orders)
+    {
+        std::string& fn = getFn("RemoveRandom.xibt");
+        FileBaseBTree bt(order, 1, &comparator, fn);
+        std::map<Byte, int> counts;                     // the oracle
+        UInt total = 0;
+
+        for (int step = 0; step < 3000; ++step)
+        {
+            Byte k = (Byte)(gen() % 64);
+            if (gen() % 3 != 0 || total < 10)          // inserts win, so the tree grows a few levels
+            {
+                bt.insert(&k);
+                ++counts[k];
+                ++total;
+            }
+            else
+            {
+                bool removed = bt.remove(&k);
+                EXPECT_EQ(removed, counts[k] > 0);
+                if (removed)
+                {
+                    --counts[k];
+                    --total;
+                }
+            }
+
+            if (step % 100 == 0)
+            {
+                ASSERT_EQ(total, checkTree(bt));
+            }
+        }
+
+        // removing everything brings the tree down to an empty root leaf
+        for (Byte k = 0; k < 64; ++k)
+            while (counts[k]--)
+                ASSERT_TRUE(bt.remove(&k));
+        EXPECT_EQ(0, checkTree(bt));
+        EXPECT_TRUE(bt.getRootPage().isLeaf());
+    }
+}
+
+
+TEST_F(BTreeTest, RemoveAllDuplicates)
+{
+    std::string& fn = getFn("RemoveAllDuplicates.xibt");
+
+    ByteComparator comparator;
+    FileBaseBTree bt(2, 1, &comparator, fn);
+
+    for (int el = 0; el < 400; ++el)
+    {
+        Byte k = (Byte)(el % 20);                       // every key 20 times
+        bt.insert(&k);
+    }
+
+    Byte seven = 7;
+    EXPECT_EQ(20, bt.removeAll(&seven));
+    EXPECT_EQ(0, bt.removeAll(&seven));
+    EXPECT_EQ(nullptr, bt.find(&seven));
+    EXPECT_EQ(380, checkTree(bt));
+
+    std::list<Byte*> found;
+    Byte eight = 8;
+    EXPECT_EQ(20, bt.searchAll(&eight, found));
+    for (Byte* item : found)
+        delete[] item;
+
+    // the file keeps the result
+    UInt root = bt.getRootPageNum();
+    bt.close();
+    bt.open(fn);
+    bt.setComparator(&comparator);
+    EXPECT_EQ(root, bt.getRootPageNum());
+    EXPECT_EQ(380, checkTree(bt));
+    EXPECT_FALSE(bt.remove(&seven));
+}
+
+
+TEST_F(BTreeTest, RemoveAllRuns)
+{
+    ByteComparator comparator;
+    std::mt19937 gen(11);
+
+    UShort orders[] = { 2, 3, 5 };
+    BaseBTree::PageFormat formats[] = { BaseBTree::pfBTree, BaseBTree::pfBPlusTree };
+    for (BaseBTree::PageFormat format : formats)
+        for (UShort order : orders)
+        {
+            std::string& fn = getFn("RemoveAllRuns.xibt");
+            FileBaseBTree bt(order, 1, &comparator, fn, format);
+
+            // runs of a few to several hundred keys, spanning whole subtrees
+            std::multiset<Byte> keys;
+            for (int i = 0; i < 3000; ++i)
+            {
+                Byte k = (Byte)(gen() % 4 == 0 ? gen() % 40 : gen() % 6 * 7);
+                bt.insert(&k);
+                keys.insert(k);
+            }
+
+            std::vector<Byte> order40;
+            for (int k = 0; k < 40; ++k)
+                order40.push_back((Byte)k);
+            std::shuffle(order40.begin(), order40.end(), gen);
+            for (Byte k : order40)
+            {
+                ASSERT_EQ((int)keys.count(k), bt.removeAll(&k)) << "format " << format
+                    << ", order " << order << ", key " << (int)k;
+                keys.erase(k);
+                ASSERT_EQ(keys.size(), checkTree(bt)) << "format " << format
+                    << ", order " << order << ", key " << (int)k;
+                EXPECT_EQ(nullptr, bt.find(&k));
+
+                BaseBTree::Cursor cur(&bt);
+                std::vector<Byte> got;
+                for (bool ok = cur.seekFirst(); ok; ok = cur.next())
+                    got.push_back(*cur.getKey());
+                ASSERT_EQ(std::vector<Byte>(keys.begin(), keys.end()), got);
+            }
+
+            // the freed pages are given out again
+            UInt last = bt.getLastPageNum();
+            for (int i = 0; i < 300; ++i)
+            {
+                Byte k = (Byte)i;
+                bt.insert(&k);
+            }
+            EXPECT_EQ(last, bt.getLastPageNum());
+            EXPECT_EQ(300, checkTree(bt));
+        }
+}
+
+
+TEST_F(BTreeTest, CursorScan)
+{
+    ByteComparator comparator;
+    std::mt19937 gen(3);
+
+    UShort orders[] = { 2, 3, 10 };
+    for (UShort order : orders)
+    {
+        std::string& fn = getFn("CursorScan.xibt");
+        FileBaseBTree bt(order, 1, &comparator, fn);
+
+        // an empty tree gives an invalid cursor
+        BaseBTree::Cursor cur(&bt);
+        EXPECT_FALSE(cur.seekFirst());
+        EXPECT_FALSE(cur.seekLast());
+        Byte k0 = 0;
+        EXPECT_FALSE(cur.seek(&k0));
+        EXPECT_EQ(nullptr, cur.getKey());
+
+        std::vector<Byte> sorted;                       // the oracle, with duplicates
+        for (int i = 0; i < 600; ++i)
+        {
+            Byte k = (Byte)(gen() % 200 + 20);          // nothing below 20 and above 219
+            bt.insert(&k);
+            sorted.push_back(k);
+        }
+        std::sort(sorted.begin(), sorted.end());
+
+        std::vector<Byte> fwd;
+        for (bool ok = cur.seekFirst(); ok; ok = cur.next())
+            fwd.push_back(*cur.getKey());
+        EXPECT_EQ(sorted, fwd);
+        EXPECT_FALSE(cur.isValid());
+        EXPECT_FALSE(cur.next());
+
+        std::vector<Byte> bwd;
+        for (bool ok = cur.seekLast(); ok; ok = cur.prev())
+            bwd.push_back(*cur.getKey());
+        std::reverse(bwd.begin(), bwd.end());
+        EXPECT_EQ(sorted, bwd);
+
+        // seek stops at the first key not less than the given one, then steps both ways
+        for (int k = 0; k < 256; ++k)
+        {
+            Byte key = (Byte)k;
+            size_t lb = std::lower_bound(sorted.begin(), sorted.end(), key) - sorted.begin();
+            ASSERT_EQ(lb < sorted.size(), cur.seek(&key));
+            if (lb == sorted.size())
+                continue;
+
+            EXPECT_EQ(sorted[lb], *cur.getKey());
+            if (lb + 1 < sorted.size())
+            {
+                ASSERT_TRUE(cur.next());
+                EXPECT_EQ(sorted[lb + 1], *cur.getKey());
+                ASSERT_TRUE(cur.prev());
+                EXPECT_EQ(sorted[lb], *cur.getKey());
+            }
+            EXPECT_EQ(lb > 0, cur.prev());
+            if (lb > 0)
+            {
+                EXPECT_EQ(sorted[lb - 1], *cur.getKey());
+            }
+        }
+
+        // a range [50, 60) counted through the cursor
+        Byte from = 50;
+        size_t inRange = 0;
+        for (bool ok = cur.seek(&from); ok && *cur.getKey() < 60; ok = cur.next())
+            ++inRange;
+        EXPECT_EQ((size_t)(std::lower_bound(sorted.begin(), sorted.end(), 60)
+                         - std::lower_bound(sorted.begin(), sorted.end(), 50)), inRange);
+    }
+}
+
+
+TEST_F(BTreeTest, FreePageReuse)
+{
+    std::string& fn = getFn("FreePageReuse.xibt");
+
+    ByteComparator comparator;
+    UInt pages;
+    UInt freeHead;
+    {
+        FileBaseBTree bt(2, 2, &comparator, fn);
+        EXPECT_EQ(0, bt.getFreePageNum());
+
+        for (UShort el = 0; el < 1000; ++el)
+            bt.insert((Byte*)&el);
+        pages = bt.getLastPageNum();
+
+        for (UShort el = 0; el < 900; ++el)
+            ASSERT_TRUE(bt.remove((Byte*)&el));
+        EXPECT_EQ(100, checkTree(bt));
+        EXPECT_NE(0, bt.getFreePageNum());
+        EXPECT_EQ(pages, bt.getLastPageNum());
+
+        EXPECT_THROW(bt.freePage(0), std::invalid_argument);
+        EXPECT_THROW(bt.freePage(bt.getRootPageNum()), std::invalid_argument);
+        EXPECT_THROW(bt.freePage(pages + 1), std::invalid_argument);
+        freeHead = bt.getFreePageNum();
+    }
+
+    // the list survives reopening, and new pages come from it instead of the file end
+    FileBaseBTree bt(fn, &comparator);
+    EXPECT_EQ(freeHead, bt.getFreePageNum());
+    for (UShort el = 0; el < 900; ++el)
+        bt.insert((Byte*)&el);
+    EXPECT_EQ(1000, checkTree(bt));
+    EXPECT_LE(bt.getLastPageNum(), pages + 2);
+    for (UShort el = 0; el < 1000; ++el)
+        EXPECT_EQ(*(const UShort*)bt.find((Byte*)&el), el);
+}
+
+
+/** \brief Источник ключей для массовой загрузки: числа [0, num) в big-endian, чтобы
+ *  побайтное сравнение совпадало с числовым.
+ */
+struct CountingKeySource : public BaseBTree::IKeySource {
+    CountingKeySource(UInt num) : next(0), num(num) {}
+
+    virtual const Byte* nextKey() override
+    {
+        if (next == num)
+            return nullptr;
+
+        raw[0] = (Byte)(next >> 8);
+        raw[1] = (Byte)next;
+        ++next;
+        return raw;
+    }
+
+    UInt next;
+    UInt num;
+    Byte raw[2];
+};
+
+
+TEST_F(BTreeTest, BulkLoad)
+{
+    ByteComparator comparator;
+
+    UShort orders[] = { 1, 2, 3, 10 };
+    UInt sizes[] = { 0, 1, 2, 3, 4, 5, 7, 10, 19, 20, 21, 100, 1000, 5000 };
+    float fills[] = { 0.3f, 0.7f, 1.0f };
+    BaseBTree::PageFormat formats[] = { BaseBTree::pfBTree, BaseBTree::pfBPlusTree,
+        BaseBTree::pfBLink };
+    for (BaseBTree::PageFormat format : formats)
+    for (UShort order : orders)
+        for (UInt num : sizes)
+            for (float fill : fills)
+            {
+                if (format != BaseBTree::pfBTree && order < 2)
+                    continue;
+
+                std::string& fn = getFn("BulkLoad.xibt");
+                FileBaseBTree bt(order, 2, &comparator, fn, format);
+
+                CountingKeySource src(num);
+                ASSERT_EQ(num, bt.bulkLoad(src, fill));
+                ASSERT_EQ(num, checkTree(bt)) << "format " << format << ", order " << order
+                    << ", num " << num << ", fill " << fill;
+
+                for (UInt el = 0; el < num; ++el)
+                {
+                    Byte k[2] = { (Byte)(el >> 8), (Byte)el };
+                    ASSERT_NE(nullptr, bt.find(k));
+                }
+
+                // loaded B-link pages split along their right links and high keys
+                if (format == BaseBTree::pfBLink)
+                {
+                    for (UInt el = 0; el < num; el += 3)
+                    {
+                        Byte k[2] = { (Byte)(el >> 8), (Byte)el };
+                        bt.insert(k);
+                    }
+                    ASSERT_EQ(num + (num + 2) / 3, checkTree(bt)) << "order " << order
+                        << ", num " << num << ", fill " << fill;
+                }
+            }
+}
+
+
+TEST_F(BTreeTest, BulkLoadErrors)
+{
+    std::string& fn = getFn("BulkLoadErrors.xibt");
+
+    ByteComparator comparator;
+    FileBaseBTree bt(3, 1, &comparator, fn);
+
+    struct ArraySource : public BaseBTree::IKeySource {
+        ArraySource(const Byte* keys, UInt num) : keys(keys), num(num), next(0) {}
+        virtual const Byte* nextKey() override { return next < num ? &keys[next++] : nullptr; }
+        const Byte* keys;
+        UInt num;
+        UInt next;
+    };
+
+    Byte keys[] = { 1, 2, 2, 3, 5, 8, 13, 21, 34, 55, 89, 4, 144 };
+    ArraySource bad(keys, sizeof(keys));
+    EXPECT_THROW(bt.bulkLoad(bad, 0.0f), std::invalid_argument);
+    UInt pages = bt.getLastPageNum();
+    EXPECT_THROW(bt.bulkLoad(bad), std::invalid_argument);
+
+    // nothing of the sorted head has made it into the tree, even after reopening; the pages
+    // it has written are in the file, though, and opening takes them in as a crash would
+    EXPECT_EQ(0, checkTree(bt));
+    EXPECT_EQ(pages, bt.getLastPageNum());
+    bt.close();
+    bt.open(fn);
+    bt.setComparator(&comparator);
+    EXPECT_EQ(0, checkTree(bt));
+    EXPECT_LT(pages, bt.getLastPageNum());
+
+    // so the tree still takes a load, over the pages left behind
+    ArraySource good(keys, 11);
+    EXPECT_EQ(11, bt.bulkLoad(good));
+    EXPECT_EQ(11, checkTree(bt));
+    Byte k = 89;
+    EXPECT_NE(nullptr, bt.find(&k));
+    k = 144;
+    EXPECT_EQ(nullptr, bt.find(&k));
+
+    ArraySource again(keys, 3);
+    EXPECT_THROW(bt.bulkLoad(again), std::runtime_error);
+    bt.close();
+
+    // in copy-on-write mode the slots of the dropped pages are reused: the file ends up
+    // as long as without the failed load
+    UInt slots[2];
+    for (int failed = 0; failed < 2; ++failed)
+    {
+        FileBaseBTree cow;
+        cow.setComparator(&comparator);
+        cow.setCowEnabled(true);
+        cow.create(3, 1, fn);
+        if (failed)
+        {
+            ArraySource badCow(keys, sizeof(keys));
+            EXPECT_THROW(cow.bulkLoad(badCow), std::invalid_argument);
+        }
+        ArraySource goodCow(keys, 11);
+        EXPECT_EQ(11, cow.bulkLoad(goodCow));
+        EXPECT_EQ(11, checkTree(cow));
+        slots[failed] = cow.getLastSlotNum();
+    }
+    EXPECT_EQ(slots[0], slots[1]);
+}
+
+
+TEST_F(BTreeTest, BPlusInsertRemove)
+{
+    ByteComparator comparator;
+    std::mt19937 gen(5);
+
+    std::string& fn = getFn("BPlusInsertRemove.xibt");
+    EXPECT_THROW(FileBaseBTree(1, 1, &comparator, fn, BaseBTree::pfBPlusTree), std::invalid_argument);
+
+    UShort orders[] = { 2, 3, 5 };
+    for (UShort order : orders)
+    {
+        FileBaseBTree bt(order, 1, &comparator, fn, BaseBTree::pfBPlusTree);
+        EXPECT_TRUE(bt.isBPlus());
+        std::map<Byte, int> counts;                     // the oracle
+        UInt total = 0;
+
+        for (int step = 0; step < 3000; ++step)
+        {
+            Byte k = (Byte)(gen() % 64);
+            if (gen() % 3 != 0 || total < 10)
+            {
+                bt.insert(&k);
+                ++counts[k];
+                ++total;
+            }
+            else
+            {
+                bool removed = bt.remove(&k);
+                EXPECT_EQ(removed, counts[k] > 0);
+                if (removed)
+                {
+                    --counts[k];
+                    --total;
+                }
+            }
+
+            if (step % 100 == 0)
+            {
+                ASSERT_EQ(total, checkTree(bt));
+            }
+        }
+
+        // records are only in leaves, which are scanned both ways along the list
+        std::vector<Byte> sorted;
+        for (auto& kc : counts)
+        {
+            std::list<Byte*> found;
+            EXPECT_EQ(kc.second, bt.searchAll(&kc.first, found));
+            for (Byte* item : found)
+                delete[] item;
+            EXPECT_EQ(kc.second > 0, bt.find(&kc.first) != nullptr);
+            sorted.insert(sorted.end(), kc.second, kc.first);
+        }
+
+        BaseBTree::Cursor cur(&bt);
+        std::vector<Byte> fwd;
+        for (bool ok = cur.seekFirst(); ok; ok = cur.next())
+            fwd.push_back(*cur.getKey());
+        EXPECT_EQ(sorted, fwd);
+        std::vector<Byte> bwd;
+        for (bool ok = cur.seekLast(); ok; ok = cur.prev())
+            bwd.insert(bwd.begin(), *cur.getKey());
+        EXPECT_EQ(sorted, bwd);
+
+        // the format survives reopening
+        bt.close();
+        bt.open(fn);
+        bt.setComparator(&comparator);
+        EXPECT_TRUE(bt.isBPlus());
+        EXPECT_EQ(total, checkTree(bt));
+
+        for (auto& kc : counts)
+            EXPECT_EQ(kc.second, bt.removeAll(&kc.first));
+        EXPECT_EQ(0, checkTree(bt));
+        EXPECT_TRUE(bt.getRootPage().isLeaf());
+        EXPECT_FALSE(cur.seekFirst());
+        bt.close();
+    }
+}
+
+
+TEST_F(BTreeTest, BLinkInsert)
+{
+    ByteComparator comparator;
+    std::mt19937 gen(11);
+
+    std::string& fn = getFn("BLinkInsert.xibt");
+    EXPECT_THROW(FileBaseBTree(1, 1, &comparator, fn, BaseBTree::pfBLink), std::invalid_argument);
+
+    // a one-byte key followed by the insertion step
+    UShort orders[] = { 2, 3, 5 };
+    for (UShort order : orders)
+    {
+        FileBaseBTree bt(order, 3, &comparator, fn, BaseBTree::pfBLink, 2);
+        EXPECT_TRUE(bt.isBLink());
+        EXPECT_TRUE(bt.isBPlus());
+        std::map<Byte, int> counts;                     // the oracle
+        for (UShort step = 0; step < 3000; ++step)
+        {
+            Byte k = (Byte)(gen() % 64);
+            bt.insert(&k, (const Byte*)&step);
+            ++counts[k];
+            if (step % 100 == 0)
+            {
+                ASSERT_EQ(step + 1, checkTree(bt));
+            }
+        }
+
+        for (auto& kc : counts)
+        {
+            std::list<Byte*> found;
+            EXPECT_EQ(kc.second, bt.searchAll(&kc.first, found));
+            for (Byte* item : found)
+                delete[] item;
+        }
+
+        // equal keys keep the order they came in
+        BaseBTree::Cursor cur(&bt);
+        std::vector<Byte> fwd;
+        std::map<Byte, UShort> lastSteps;
+        for (bool ok = cur.seekFirst(); ok; ok = cur.next())
+        {
+            Byte k = *cur.getKey();
+            UShort step = *(const UShort*)cur.getValue();
+            if (lastSteps.count(k))
+            {
+                EXPECT_LT(lastSteps[k], step);
+            }
+            lastSteps[k] = step;
+            fwd.push_back(k);
+        }
+        EXPECT_EQ(3000, fwd.size());
+        EXPECT_TRUE(std::is_sorted(fwd.begin(), fwd.end()));
+
+        Byte k = 1;
+        EXPECT_THROW(bt.remove(&k), std::logic_error);
+        CountingKeySource src(10);
+        EXPECT_THROW(bt.bulkLoad(src), std::runtime_error);     // the tree is not empty
+
+        bt.close();
+        bt.open(fn);
+        bt.setComparator(&comparator);
+        EXPECT_TRUE(bt.isBLink());
+        EXPECT_EQ(3000, checkTree(bt));
+        bt.close();
+    }
+
+    // a split that has not reached the parent yet leaves the keys behind the right link
+    FileBaseBTree bt(2, 1, &comparator, fn, BaseBTree::pfBLink);
+    bt.setOptimisticReads(true);
+    Byte num = 0;
+    for (;; ++num)
+    {
+        bt.insert(&num);
+        FileBaseBTree::PageWrapper root(&bt);
+        root.readPage(bt.getRootPageNum());
+        if (!root.isLeaf() && root.isFull())
+            break;
+    }
+
+    FileBaseBTree::PageWrapper y(&bt);
+    FileBaseBTree::PageWrapper z(&bt);
+    y.readPage(bt.getRootPageNum());
+    Byte sep;
+    y.splitBLink(z, &sep);
+    z.writePage();
+    y.writePage();
+    EXPECT_EQ(z.getPageNum(), y.getRightLink());
+
+    for (Byte k = 0; k <= num; ++k)
+    {
+        Byte found = 0;
+        EXPECT_TRUE(bt.search(&k, &found));
+        EXPECT_EQ(k, found);
+        EXPECT_NE(nullptr, bt.find(&k));
+    }
+}
+
+
+TEST_F(BTreeTest, SearchAsync)
+{
+    ByteComparator comparator;
+    const UShort KEYS = 2000;
+
+    // every storage has its engine: io_uring (or its fallback) for pread, the thread pool
+    // over the stream and over the log, none for the mapping
+    struct Config {
+        FileBaseBTree::StorageMode mode;
+        bool wal;
+        BaseBTree::PageFormat format;
+        UInt cache;
+    } configs[] = {
+        { FileBaseBTree::smPosix, false, BaseBTree::pfBTree, 0 },
+        { FileBaseBTree::smPosix, false, BaseBTree::pfBPlusTree, 16 },
+        { FileBaseBTree::smPosix, false, BaseBTree::pfBLink, 16 },
+        { FileBaseBTree::smStream, false, BaseBTree::pfBTree, 16 },
+        { FileBaseBTree::smPosix, true, BaseBTree::pfBTree, 16 },
+        { FileBaseBTree::smMapped, false, BaseBTree::pfBPlusTree, 0 },
+    };
+    for (const Config& cfg : configs)
+    {
+        std::string fn = getFn("SearchAsync.xibt");
+        FileBaseBTree bt;
+        bt.setStorageMode(cfg.mode);
+        bt.setWalEnabled(cfg.wal);
+        bt.setCacheCapacity(cfg.cache);
+        bt.setAsyncDepth(8);
+        EXPECT_EQ(8, bt.getAsyncDepth());
+        bt.create(3, 2, fn, cfg.format);
+        bt.setComparator(&comparator);
+        EXPECT_THROW(bt.setAsyncDepth(4), std::runtime_error);
+        EXPECT_EQ(cfg.mode == FileBaseBTree::smMapped, bt.getAsyncIO() == nullptr);
+        if (cfg.mode != FileBaseBTree::smPosix || cfg.wal)
+        {
+            EXPECT_FALSE(bt.isUring());
+        }
+
+        for (UShort k = 0; k < KEYS; ++k)
+        {
+            UShort even = 2 * k;
+            bt.insert((Byte*)&even);
+        }
+
+        // evens are there, odds are not; a batch is longer than the depth, so lookups
+        // take keys one after another
+        std::vector<UShort> keys(2 * KEYS);
+        for (UShort k = 0; k < 2 * KEYS; ++k)
+            keys[k] = (UShort)(2 * KEYS - 1 - k);
+        std::vector<UShort> recs(keys.size(), 0xFFFF);
+        std::vector<bool> found;
+        EXPECT_EQ(KEYS, bt.searchAsync((Byte*)&keys[0], (UInt)keys.size(), (Byte*)&recs[0], found));
+        ASSERT_EQ(keys.size(), found.size());
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            EXPECT_EQ(keys[i] % 2 == 0, found[i]);
+            EXPECT_EQ(keys[i] % 2 == 0 ? keys[i] : 0xFFFF, recs[i]);
+        }
+
+        // the pages read from the storage are kept by the pool
+        if (cfg.cache)
+        {
+            UInt hits = bt.getCacheHits();
+            EXPECT_EQ(KEYS, bt.searchAsync((Byte*)&keys[0], (UInt)keys.size(), (Byte*)&recs[0], found));
+            EXPECT_LT(hits, bt.getCacheHits());
+        }
+
+        EXPECT_EQ(0, bt.searchAsync(nullptr, 0, nullptr, found));
+        EXPECT_TRUE(found.empty());
+        bt.close();
+        EXPECT_EQ(nullptr, bt.getAsyncIO());
+    }
+
+    // batches go along with inserts
+    BaseBTree::PageFormat formats[] = { BaseBTree::pfBTree, BaseBTree::pfBLink };
+    for (BaseBTree::PageFormat format : formats)
+    {
+        std::string fn = getFn("SearchAsync.xibt");
+        FileBaseBTree bt;
+        bt.setStorageMode(FileBaseBTree::smPosix);
+        bt.setCacheCapacity(16);
+        bt.setAsyncDepth(4);
+        bt.create(3, 2, fn, format);
+        bt.setComparator(&comparator);
+
+        std::atomic<int> inserted(0);
+        std::thread writer([&]()
+        {
+            for (UShort k = 0; k < KEYS; ++k)
+            {
+                bt.insert((Byte*)&k);
+                inserted.store(k + 1);
+            }
+        });
+
+        int missing = 0;
+        std::vector<UShort> keys;
+        std::vector<UShort> recs;
+        std::vector<bool> found;
+        while (inserted.load() < KEYS)
+        {
+            keys.resize(inserted.load());
+            for (size_t k = 0; k < keys.size(); ++k)
+                keys[k] = (UShort)k;
+            recs.assign(keys.size(), 0);
+            UInt n = keys.empty() ? 0 : bt.searchAsync((Byte*)&keys[0], (UInt)keys.size(),
+                (Byte*)&recs[0], found);
+            missing += (int)(keys.size() - n);
+            for (size_t k = 0; k < keys.size(); ++k)
+                if (recs[k] != keys[k])
+                    ++missing;
+        }
+        writer.join();
+
+        EXPECT_EQ(0, missing);
+        EXPECT_EQ(KEYS, checkTree(bt));
+    }
+}
+
+
+TEST_F(BTreeTest, MultiGet)
+{
+    ByteComparator comparator;
+    const UShort KEYS = 1500;
+    const UInt PROBES = 3000;
+
+    // every third key is there, some of them twice with different values
+    BaseBTree::PageFormat formats[] = { BaseBTree::pfBTree, BaseBTree::pfBPlusTree,
+        BaseBTree::pfBLink };
+    for (BaseBTree::PageFormat format : formats)
+    {
+        std::string fn = getFn("MultiGet.xibt");
+        FileBaseBTree bt;
+        bt.setCacheCapacity(4096);
+        bt.create(3, 4, fn, format, 2);
+        bt.setComparator(&comparator);
+
+        for (UShort k = 0; k < KEYS; ++k)
+        {
+            UShort key = 3 * k;
+            UShort value = k;
+            bt.insert((Byte*)&key, (Byte*)&value);
+            if (k % 5 == 0)
+            {
+                ++value;
+                bt.insert((Byte*)&key, (Byte*)&value);
+            }
+        }
+
+        std::mt19937 gen(1);
+        std::vector<UShort> keys(PROBES);
+        for (UShort& k : keys)
+            k = (UShort)(gen() % (3 * KEYS + 10));
+
+        // the same records as one search() a key finds, the first of equal ones included
+        std::vector<UInt> recs(PROBES, 0);
+        std::vector<bool> found;
+        UInt reads = bt.getCacheHits() + bt.getCacheMisses();
+        UInt n = bt.multiGet((Byte*)&keys[0], PROBES, (Byte*)&recs[0], found);
+        UInt batchReads = bt.getCacheHits() + bt.getCacheMisses() - reads;
+
+        reads = bt.getCacheHits() + bt.getCacheMisses();
+        UInt expected = 0;
+        for (UInt i = 0; i < PROBES; ++i)
+        {
+            UInt rec = 0;
+            bool there = bt.search((Byte*)&keys[i], (Byte*)&rec);
+            EXPECT_EQ(there, found[i]);
+            EXPECT_EQ(rec, recs[i]);
+            expected += there;
+        }
+        UInt singleReads = bt.getCacheHits() + bt.getCacheMisses() - reads;
+        EXPECT_EQ(expected, n);
+
+        // no page is read twice, unless a B-link leaf is reached along the link as well
+        EXPECT_LT(batchReads, singleReads);
+        if (format != BaseBTree::pfBLink)
+        {
+            EXPECT_LE(batchReads, bt.getLastPageNum());
+        }
+
+        EXPECT_EQ(0, bt.multiGet(nullptr, 0, nullptr, found));
+        EXPECT_TRUE(found.empty());
+    }
+
+    // batches go along with inserts
+    BaseBTree::PageFormat concurrent[] = { BaseBTree::pfBTree, BaseBTree::pfBLink };
+    for (BaseBTree::PageFormat format : concurrent)
+    {
+        std::string fn = getFn("MultiGet.xibt");
+        FileBaseBTree bt;
+        bt.setStorageMode(FileBaseBTree::smPosix);
+        bt.setCacheCapacity(16);
+        bt.create(3, 2, fn, format);
+        bt.setComparator(&comparator);
+
+        std::atomic<int> inserted(0);
+        std::thread writer([&]()
+        {
+            for (UShort k = 0; k < KEYS; ++k)
+            {
+                bt.insert((Byte*)&k);
+                inserted.store(k + 1);
+            }
+        });
+
+        int missing = 0;
+        std::vector<UShort> keys;
+        std::vector<UShort> recs;
+        std::vector<bool> found;
+        while (inserted.load() < KEYS)
+        {
+            keys.resize(inserted.load());
+            for (size_t k = 0; k < keys.size(); ++k)
+                keys[k] = (UShort)(keys.size() - 1 - k);
+            recs.assign(keys.size(), 0);
+            UInt n = keys.empty() ? 0 : bt.multiGet((Byte*)&keys[0], (UInt)keys.size(),
+                (Byte*)&recs[0], found);
+            missing += (int)(keys.size() - n);
+            for (size_t k = 0; k < keys.size(); ++k)
+                if (recs[k] != keys[k])
+                    ++missing;
+        }
+        writer.join();
+
+        EXPECT_EQ(0, missing);
+        EXPECT_EQ(KEYS, checkTree(bt));
+    }
+}
+
+
+TEST_F(BTreeTest, KeyValueRecords)
+{
+    ByteComparator comparator;
+    std::mt19937 gen(9);
+
+    std::string& fn = getFn("KeyValueRecords.xibt");
+    EXPECT_THROW(FileBaseBTree(3, 4, &comparator, fn, BaseBTree::pfBPlusTree, 4), std::invalid_argument);
+
+    // a one-byte key followed by a nine-byte value whose first bytes hold the insertion step
+    BaseBTree::PageFormat formats[] = { BaseBTree::pfBTree, BaseBTree::pfBPlusTree };
+    for (BaseBTree::PageFormat format : formats)
+    {
+        FileBaseBTree bt(3, 10, &comparator, fn, format, 9);
+        EXPECT_EQ(1, bt.getKeySize());
+        EXPECT_EQ(9, bt.getValueSize());
+        if (format == BaseBTree::pfBPlusTree)
+            EXPECT_EQ(7, bt.getInnerOrder());       // separators without values are 5 times denser
+        else
+            EXPECT_EQ(bt.getOrder(), bt.getInnerOrder());
+
+        std::map<Byte, std::set<UInt> > steps;      // the oracle
+        UInt total = 0;
+        for (UInt step = 0; step < 1500; ++step)
+        {
+            Byte k = (Byte)(gen() % 64);
+            Byte v[9] = { 0 };
+            memcpy(v, &step, sizeof(step));
+            bt.insert(&k, v);
+            steps[k].insert(step);
+            ++total;
+        }
+        ASSERT_EQ(total, checkTree(bt));
+
+        // records with the same key and different values are equivalent
+        for (int key = 0; key < 64; ++key)
+        {
+            Byte k = (Byte)key;
+            Byte v[9];
+            bool present = steps.count(k) > 0;
+            EXPECT_EQ(present, bt.getValue(&k, v));
+            EXPECT_EQ(present, bt.findValue(&k) != nullptr);
+            if (!present)
+                continue;
+
+            UInt step = 0;
+            memcpy(&step, v, sizeof(step));
+            EXPECT_EQ(1, steps[k].count(step));
+
+            std::list<Byte*> found;
+            EXPECT_EQ(steps[k].size(), bt.searchAll(&k, found));
+            for (Byte* item : found)
+                delete[] item;
+        }
+
+        BaseBTree::Cursor cur(&bt);
+        UInt scanned = 0;
+        for (bool ok = cur.seekFirst(); ok; ok = cur.next(), ++scanned)
+        {
+            UInt step = 0;
+            memcpy(&step, cur.getValue(), sizeof(step));
+            EXPECT_EQ(1, steps[*cur.getKey()].count(step));
+        }
+        EXPECT_EQ(total, scanned);
+
+        // the split survives reopening
+        bt.close();
+        bt.open(fn);
+        bt.setComparator(&comparator);
+        EXPECT_EQ(9, bt.getValueSize());
+        EXPECT_EQ(total, checkTree(bt));
+
+        for (auto& ks : steps)
+        {
+            Byte k = ks.first;
+            EXPECT_EQ(ks.second.size(), bt.removeAll(&k));
+            total -= (UInt)ks.second.size();
+            if (k % 8 == 0)
+            {
+                ASSERT_EQ(total, checkTree(bt));
+            }
+        }
+        EXPECT_EQ(0, checkTree(bt));
+        bt.close();
+    }
+}
+
+
+// сравниватель записей переменной длины: поле длины и байты
+struct VarBytesComparator : public BaseBTree::IComparator {
+    virtual bool compare(const Byte* lhv, const Byte* rhv, UInt /*sz*/) override
+    {
+        UShort ll = *((const UShort*)lhv);
+        UShort rl = *((const UShort*)rhv);
+        int res = memcmp(lhv + BaseBTree::VAR_LEN_SZ, rhv + BaseBTree::VAR_LEN_SZ, std::min(ll, rl));
+        return res < 0 || (res == 0 && ll < rl);
+    }
+
+    virtual bool isEqual(const Byte* lhv, const Byte* rhv, UInt sz) override
+    {
+        return !compare(lhv, rhv, sz) && !compare(rhv, lhv, sz);
+    }
+};
+
+
+TEST_F(BTreeTest, InsertBatch)
+{
+    ByteComparator comparator;
+    const UInt BATCH = 3000;
+
+    // the same records inserted by one, so equal keys are expected in the same order
+    BaseBTree::PageFormat formats[] = { BaseBTree::pfBTree, BaseBTree::pfBPlusTree,
+        BaseBTree::pfBLink };
+    for (BaseBTree::PageFormat format : formats)
+    {
+        std::string fn = getFn("InsertBatch.xibt");
+        std::string twinFn = getFn("InsertBatchTwin.xibt");
+        FileBaseBTree bt(10, 4, &comparator, fn, format, 2);
+        FileBaseBTree twin(10, 4, &comparator, twinFn, format, 2);
+
+        std::mt19937 gen(5);
+        UInt total = 0;
+        for (int round = 0; round < 2; ++round)
+        {
+            // the key goes first, the value keeps the position in the batch
+            std::vector<UShort> recs(2 * BATCH);
+            for (UInt i = 0; i < BATCH; ++i)
+            {
+                recs[2 * i] = (UShort)(gen() % 1000);
+                recs[2 * i + 1] = (UShort)i;
+                twin.insert((Byte*)&recs[2 * i]);
+            }
+
+            UInt descents = bt.insertBatch((Byte*)&recs[0], BATCH);
+            total += BATCH;
+            EXPECT_LT(descents, BATCH / 4);
+            ASSERT_EQ(total, checkTree(bt));
+        }
+
+        for (UShort k = 0; k < 1000; ++k)
+        {
+            std::list<Byte*> got;
+            std::list<Byte*> expected;
+            bt.searchAll((Byte*)&k, got);
+            twin.searchAll((Byte*)&k, expected);
+
+            std::vector<UInt> gotRecs;
+            std::vector<UInt> expectedRecs;
+            for (Byte* item : got)
+            {
+                gotRecs.push_back(*(UInt*)item);
+                delete[] item;
+            }
+            for (Byte* item : expected)
+            {
+                expectedRecs.push_back(*(UInt*)item);
+                delete[] item;
+            }
+
+            // searchAll() of a B-tree goes by the structure, which differs between the two
+            if (!bt.isBPlus())
+            {
+                std::sort(gotRecs.begin(), gotRecs.end());
+                std::sort(expectedRecs.begin(), expectedRecs.end());
+            }
+            EXPECT_EQ(expectedRecs, gotRecs);
+        }
+
+        EXPECT_EQ(0, bt.insertBatch(nullptr, 0));
+    }
+
+    // records of variable length go to slotted pages in groups as well
+    VarBytesComparator varComparator;
+    BaseBTree::PageFormat slotted[] = { BaseBTree::pfSlotted, BaseBTree::pfCompressed };
+    for (BaseBTree::PageFormat format : slotted)
+    {
+        std::string fn = getFn("InsertBatch.xibt");
+        FileBaseBTree bt(3, 32, &varComparator, fn, format);
+
+        std::mt19937 gen(7);
+        std::multiset<std::string> oracle;
+        std::vector<Byte> recs(BATCH * 32);
+        for (UInt i = 0; i < BATCH; ++i)
+        {
+            std::string s(gen() % 31, 'a');
+            for (char& ch : s)
+                ch = (char)('a' + gen() % 3);
+
+            Byte* rec = &recs[i * 32];
+            *((UShort*)rec) = (UShort)s.size();
+            memcpy(rec + BaseBTree::VAR_LEN_SZ, s.data(), s.size());
+            oracle.insert(s);
+        }
+
+        EXPECT_LT(bt.insertBatch(&recs[0], BATCH), BATCH);
+        ASSERT_EQ(oracle.size(), checkTree(bt));
+
+        BaseBTree::Cursor cur(&bt);
+        std::vector<std::string> scanned;
+        for (bool ok = cur.seekFirst(); ok; ok = cur.next())
+            scanned.push_back(std::string((const char*)cur.getKey() + BaseBTree::VAR_LEN_SZ,
+                *((const UShort*)cur.getKey())));
+        EXPECT_EQ(std::vector<std::string>(oracle.begin(), oracle.end()), scanned);
+
+        // one record too long refuses the whole batch
+        *((UShort*)&recs[32 * 10]) = 31;
+        EXPECT_THROW(bt.insertBatch(&recs[0], BATCH), std::invalid_argument);
+        EXPECT_EQ(oracle.size(), checkTree(bt));
+    }
+
+    // batches go along with each other
+    BaseBTree::PageFormat concurrent[] = { BaseBTree::pfBTree, BaseBTree::pfBLink };
+    for (BaseBTree::PageFormat format : concurrent)
+    {
+        std::string fn = getFn("InsertBatch.xibt");
+        FileBaseBTree bt(3, 2, &comparator, fn, format);
+
+        const int WRITERS = 3;
+        std::vector<std::thread> writers;
+        for (int w = 0; w < WRITERS; ++w)
+            writers.push_back(std::thread([&bt, w]()
+            {
+                for (UShort from = 0; from < 1500; from += 100)
+                {
+                    std::vector<UShort> keys;
+                    for (UShort k = from; k < from + 100; ++k)
+                        keys.push_back((UShort)(k * WRITERS + w));
+                    std::reverse(keys.begin(), keys.end());
+                    bt.insertBatch((Byte*)&keys[0], (UInt)keys.size());
+                }
+            }));
+        for (std::thread& t : writers)
+            t.join();
+
+        EXPECT_EQ(WRITERS * 1500, checkTree(bt));
+        for (UShort k = 0; k < WRITERS * 1500; k += 7)
+            EXPECT_TRUE(bt.search((Byte*)&k) != nullptr);
+    }
+}
+
+
+TEST_F(BTreeTest, SlottedPages)
+{
+    VarBytesComparator comparator;
+    std::mt19937 gen(11);
+
+    std::string& fn = getFn("SlottedPages.xibt");
+    EXPECT_THROW(FileBaseBTree(1, 32, &comparator, fn, BaseBTree::pfSlotted), std::invalid_argument);
+    EXPECT_THROW(FileBaseBTree(3, 2, &comparator, fn, BaseBTree::pfSlotted), std::invalid_argument);
+    EXPECT_THROW(FileBaseBTree(3, 32, &comparator, fn, BaseBTree::pfSlotted, 4), std::invalid_argument);
+
+    // records up to 30 bytes from a small alphabet, so there are duplicates and common prefixes
+    BaseBTree::PageFormat formats[] = { BaseBTree::pfSlotted, BaseBTree::pfCompressed };
+    for (BaseBTree::PageFormat format : formats)
+    {
+        FileBaseBTree bt(3, 32, &comparator, fn, format);
+        EXPECT_TRUE(bt.isSlotted());
+        EXPECT_TRUE(bt.isBPlus());
+        EXPECT_EQ(format == BaseBTree::pfCompressed, bt.isCompressed());
+        if (!bt.isCompressed())
+        {
+            EXPECT_EQ(BaseBTree::SLOTS_OFS + 5 * (2 + 4 + 32), bt.getNodePageSize());
+        }
+
+        std::multiset<std::string> oracle;
+        Byte rec[32];
+        for (int step = 0; step < 2000; ++step)
+        {
+            std::string s(gen() % 31, 'a');
+            for (char& ch : s)
+                ch = (char)('a' + gen() % 3);
+
+            *((UShort*)rec) = (UShort)s.size();
+            memcpy(rec + BaseBTree::VAR_LEN_SZ, s.data(), s.size());
+            EXPECT_EQ(BaseBTree::VAR_LEN_SZ + s.size(), bt.getRecLen(rec));
+            bt.insert(rec);
+            oracle.insert(s);
+
+            if (step % 200 == 0)
+            {
+                ASSERT_EQ(oracle.size(), checkTree(bt));
+            }
+        }
+        EXPECT_EQ(oracle.size(), checkTree(bt));
+
+        // a record longer than the maximum is refused
+        *((UShort*)rec) = 31;
+        EXPECT_THROW(bt.insert(rec), std::invalid_argument);
+
+        // the cursor sees the records in order, searchAll sees the duplicates
+        BaseBTree::Cursor cur(&bt);
+        std::vector<std::string> scanned;
+        for (bool ok = cur.seekFirst(); ok; ok = cur.next())
+            scanned.push_back(std::string((const char*)cur.getKey() + BaseBTree::VAR_LEN_SZ,
+                *((const UShort*)cur.getKey())));
+        EXPECT_EQ(std::vector<std::string>(oracle.begin(), oracle.end()), scanned);
+
+        bt.close();
+        bt.open(fn);
+        bt.setComparator(&comparator);
+        EXPECT_EQ(format, bt.getPageFormat());
+        EXPECT_EQ(oracle.size(), checkTree(bt));
+
+        for (const std::string& s : { std::string(), std::string("ab"), std::string("cccc"), std::string("abd") })
+        {
+            *((UShort*)rec) = (UShort)s.size();
+            memcpy(rec + BaseBTree::VAR_LEN_SZ, s.data(), s.size());
+
+            std::list<Byte*> found;
+            EXPECT_EQ(oracle.count(s), bt.searchAll(rec, found));
+            for (Byte* item : found)
+            {
+                EXPECT_TRUE(comparator.isEqual(item, rec, 32));
+                delete[] item;
+            }
+            EXPECT_EQ(oracle.count(s) > 0, bt.find(rec) != nullptr);
+        }
+
+        // removals merge and even out the pages by bytes, down to an empty tree
+        UInt pages = bt.getLastPageNum();
+        for (int step = 0; !oracle.empty(); ++step)
+        {
+            std::string s(gen() % 31, 'a');
+            for (char& ch : s)
+                ch = (char)('a' + gen() % 3);
+            if (step % 3 == 0)
+                s = *oracle.lower_bound(s.substr(0, gen() % 4));    // hitting the present ones
+
+            *((UShort*)rec) = (UShort)s.size();
+            memcpy(rec + BaseBTree::VAR_LEN_SZ, s.data(), s.size());
+            if (step % 5 == 0)
+            {
+                ASSERT_EQ((int)oracle.count(s), bt.removeAll(rec));
+                oracle.erase(s);
+            }
+            else
+            {
+                ASSERT_EQ(oracle.count(s) > 0, bt.remove(rec));
+                if (oracle.count(s))
+                    oracle.erase(oracle.find(s));
+            }
+
+            if (step % 100 == 0)
+            {
+                ASSERT_EQ(oracle.size(), checkTree(bt)) << "format " << format << ", step " << step;
+            }
+        }
+        EXPECT_EQ(0, checkTree(bt));
+
+        // the freed pages are given out again
+        for (int step = 0; step < 2000; ++step)
+        {
+            std::string s(gen() % 31, 'a');
+            for (char& ch : s)
+                ch = (char)('a' + gen() % 3);
+
+            *((UShort*)rec) = (UShort)s.size();
+            memcpy(rec + BaseBTree::VAR_LEN_SZ, s.data(), s.size());
+            bt.insert(rec);
+            oracle.insert(s);
+        }
+        EXPECT_EQ(oracle.size(), checkTree(bt));
+        EXPECT_GE(pages + pages / 4, bt.getLastPageNum());
+    }
+}
+
+
+TEST_F(BTreeTest, SlottedBulkLoad)
+{
+    VarBytesComparator comparator;
+    std::mt19937 gen(5);
+
+    struct VectorSource : public BaseBTree::IKeySource {
+        VectorSource(const std::vector<std::string>& keys) : keys(keys), next(0) {}
+        virtual const Byte* nextKey() override
+        {
+            if (next == keys.size())
+                return nullptr;
+
+            // only as many bytes as the record has
+            const std::string& s = keys[next++];
+            raw.resize(BaseBTree::VAR_LEN_SZ + s.size());
+            *((UShort*)&raw[0]) = (UShort)s.size();
+            memcpy(&raw[BaseBTree::VAR_LEN_SZ], s.data(), s.size());
+            return &raw[0];
+        }
+        const std::vector<std::string>& keys;
+        size_t next;
+        std::vector<Byte> raw;
+    };
+
+    UInt sizes[] = { 0, 1, 2, 5, 40, 3000 };
+    float fills[] = { 0.3f, 0.7f, 1.0f };
+    BaseBTree::PageFormat formats[] = { BaseBTree::pfSlotted, BaseBTree::pfCompressed };
+    for (BaseBTree::PageFormat format : formats)
+        for (UInt num : sizes)
+            for (float fill : fills)
+            {
+                std::string& fn = getFn("SlottedBulkLoad.xibt");
+                FileBaseBTree bt(3, 32, &comparator, fn, format);
+
+                // records of 0 to 30 bytes with long common prefixes and duplicates
+                std::vector<std::string> keys;
+                for (UInt i = 0; i < num; ++i)
+                {
+                    std::string s(gen() % 31, 'a');
+                    for (char& ch : s)
+                        ch = (char)('a' + gen() % 3);
+                    keys.push_back(s);
+                }
+                std::sort(keys.begin(), keys.end());
+
+                VectorSource src(keys);
+                ASSERT_EQ(num, bt.bulkLoad(src, fill));
+                ASSERT_EQ(num, checkTree(bt)) << "format " << format << ", num " << num
+                    << ", fill " << fill;
+
+                BaseBTree::Cursor cur(&bt);
+                std::vector<std::string> scanned;
+                for (bool ok = cur.seekFirst(); ok; ok = cur.next())
+                    scanned.push_back(std::string((const char*)cur.getKey() + BaseBTree::VAR_LEN_SZ,
+                        *((const UShort*)cur.getKey())));
+                EXPECT_EQ(keys, scanned);
+
+                // the loaded tree takes inserts and removals as usual
+                Byte rec[32];
+                for (UInt i = 0; i < num; i += 2)
+                {
+                    *((UShort*)rec) = (UShort)keys[i].size();
+                    memcpy(rec + BaseBTree::VAR_LEN_SZ, keys[i].data(), keys[i].size());
+                    bt.insert(rec);
+                    EXPECT_TRUE(bt.remove(rec));
+                    EXPECT_TRUE(bt.remove(rec));
+                }
+                ASSERT_EQ(num / 2, checkTree(bt));
+            }
+}
@@ -0,0 +1,128 @@
+﻿////////////////////////////////////////////////////////////////////////////////
+/// \file
+/// \brief     Unit-тесты для ядер поиска внутри узла
+///
+/// Gtest-based unit test.
+/// The naming conventions imply the name of a unit-test module is the same as
+/// the name of the corresponding tested module with _test suffix
+///
+////////////////////////////////////////////////////////////////////////////////
+
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "node_search.h"
+#include "btree_adapters.h"
+
+
+/** \brief Путь к каталогу с рабочими тестовыми файлами. */
+static const char* TEST_FILES_PATH = "../../out/";
+
+
+using namespace xi;
+
+
+/** \brief Сверяет ядра для типа \c T на всех поддерживаемых наборах инструкций
+ *  с std::lower_bound/std::upper_bound на отсортированных массивах с повторами.
+ */
+template <typename T>
+void checkIntKernels()
+{
+    std::mt19937 gen(7);
+    SimdIsa isas[] = { isaScalar, isaSse42, isaAvx2 };
+
+    for (SimdIsa isa : isas)
+    {
+        BaseBTree::KeyBoundFunc lower = nullptr;
+        BaseBTree::KeyBoundFunc upper = nullptr;
+        if (!getIntSearchKernel(sizeof(T), std::is_signed<T>::value, isa, lower, upper))
+        {
+            EXPECT_GT(isa, detectSimdIsa());        // only unsupported sets may be refused
+            continue;
+        }
+
+        // lengths around the vector width and the binary search window
+        UShort lengths[] = { 0, 1, 3, 15, 16, 17, 33, 64, 65, 200, 1000 };
+        for (UShort n : lengths)
+        {
+            std::vector<T> keys(n);
+            for (T& k : keys)
+            {
+                k = (T)gen();
+                if (gen() % 4 == 0)                 // extremes, to catch sign handling
+                    k = (gen() % 2) ? std::numeric_limits<T>::min() : std::numeric_limits<T>::max();
+            }
+            if (n > 10)
+                keys[5] = keys[6] = keys[7];        // duplicates
+            std::sort(keys.begin(), keys.end());
+
+            std::vector<T> probes(keys);
+            probes.push_back(std::numeric_limits<T>::min());
+            probes.push_back(std::numeric_limits<T>::max());
+            for (int i = 0; i < 20; ++i)
+                probes.push_back((T)gen());
+
+            const Byte* raw = n ? (const Byte*)&keys[0] : nullptr;
+            for (T p : probes)
+            {
+                UShort lb = (UShort)(std::lower_bound(keys.begin(), keys.end(), p) - keys.begin());
+                UShort ub = (UShort)(std::upper_bound(keys.begin(), keys.end(), p) - keys.begin());
+                ASSERT_EQ(lb, lower(raw, n, (const Byte*)&p, sizeof(T), 0)) << "isa " << isa << ", n " << n;
+                ASSERT_EQ(ub, upper(raw, n, (const Byte*)&p, sizeof(T), 0)) << "isa " << isa << ", n " << n;
+            }
+        }
+    }
+}
+
+
+TEST(NodeSearchTest, IntKernels1)
+{
+    checkIntKernels<signed char>();
+    checkIntKernels<unsigned char>();
+    checkIntKernels<short>();
+    checkIntKernels<unsigned short>();
+    checkIntKernels<int>();
+    checkIntKernels<unsigned int>();
+    checkIntKernels<long long>();
+    checkIntKernels<unsigned long long>();
+}
+
+
+TEST(NodeSearchTest, UnsupportedSize1)
+{
+    BaseBTree::KeyBoundFunc lower = nullptr;
+    BaseBTree::KeyBoundFunc upper = nullptr;
+    EXPECT_FALSE(getIntSearchKernel(3, true, isaScalar, lower, upper));
+    EXPECT_EQ(nullptr, lower);
+    EXPECT_EQ(nullptr, upper);
+}
+
+
+TEST(NodeSearchTest, UInt64Adapter1)
+{
+    std::string fn(TEST_FILES_PATH);
+    fn.append("UInt64Adapter1.xibt");
+
+    // keys above 2^63 check that unsigned order survives the signed vector compare
+    BTreeAdapter<unsigned long long> bt;
+    bt.create(150, fn);
+    EXPECT_TRUE(bt.getTree().hasSearchKernel());
+
+    const unsigned long long base = 0xFFFFFFFFFFFF0000ULL;
+    for (unsigned long long el = 0; el < 4000; el += 2)
+    {
+        bt.insert(base + el);
+        bt.insert(el);
+    }
+
+    for (unsigned long long el = 0; el < 4000; ++el)
+    {
+        EXPECT_EQ(bt.contains(base + el), el % 2 == 0);
+        EXPECT_EQ(bt.contains(el), el % 2 == 0);
+    }
+}
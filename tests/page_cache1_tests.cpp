@@ -0,0 +1,181 @@
+﻿////////////////////////////////////////////////////////////////////////////////
+/// \file
+/// \brief     Unit-тесты для буферного пула B-деревьев
+///
+/// Gtest-based unit test.
+/// The naming conventions imply the name of a unit-test module is the same as
+/// the name of the corresponding tested module with _test suffix
+///
+////////////////////////////////////////////////////////////////////////////////
+
+
+#include <gtest/gtest.h>
+
+#include <map>
+#include <vector>
+
+#include "page_cache.h"
+
+
+using namespace xi;
+
+
+/** \brief Хранилище страниц в памяти, считающее обращения. */
+class MemPageStore : public IPageStore {
+public:
+    static const UInt PAGE_SIZE = 8;
+
+    MemPageStore() : loads(0), stores(0) {}
+
+    virtual void loadPage(UInt pnum, Byte* dst) override
+    {
+        ++loads;
+        std::vector<Byte>& p = pages[pnum];
+        p.resize(PAGE_SIZE, (Byte)pnum);
+        std::copy(p.begin(), p.end(), dst);
+    }
+
+    virtual void storePage(UInt pnum, const Byte* src) override
+    {
+        ++stores;
+        order.push_back(pnum);
+        pages[pnum].assign(src, src + PAGE_SIZE);
+    }
+
+public:
+    std::map<UInt, std::vector<Byte>> pages;
+    std::vector<UInt> order;                    ///< Порядок записи страниц.
+    int loads;
+    int stores;
+}; // class MemPageStore
+
+
+/** \brief Тестовый класс для буферного пула. */
+class PageCacheTest : public ::testing::Test {
+protected:
+    MemPageStore _store;
+}; // class PageCacheTest
+
+
+
+TEST_F(PageCacheTest, HitMiss1)
+{
+    PageCache pc(&_store);
+    EXPECT_FALSE(pc.isEnabled());
+
+    pc.reset(2, MemPageStore::PAGE_SIZE);
+    EXPECT_TRUE(pc.isEnabled());
+
+    Byte buf[MemPageStore::PAGE_SIZE];
+    pc.read(5, buf);
+    EXPECT_EQ(5, buf[0]);
+    pc.read(5, buf);
+
+    EXPECT_EQ(1, pc.getHits());
+    EXPECT_EQ(1, pc.getMisses());
+    EXPECT_EQ(1, _store.loads);
+}
+
+
+TEST_F(PageCacheTest, ClockEviction1)
+{
+    PageCache pc(&_store);
+    pc.reset(2, MemPageStore::PAGE_SIZE);
+
+    Byte buf[MemPageStore::PAGE_SIZE];
+    pc.read(1, buf);
+    pc.read(2, buf);
+    pc.read(3, buf);                            // somebody has to go away
+
+    EXPECT_EQ(1, pc.getEvictions());
+    EXPECT_TRUE(pc.contains(3));
+    EXPECT_EQ(1, (int)pc.contains(1) + (int)pc.contains(2));
+}
+
+
+TEST_F(PageCacheTest, PinnedNotEvicted1)
+{
+    PageCache pc(&_store);
+    pc.reset(2, MemPageStore::PAGE_SIZE);
+
+    Byte* p1 = pc.pin(1);
+    EXPECT_EQ(1, p1[0]);
+
+    Byte buf[MemPageStore::PAGE_SIZE];
+    for (UInt pn = 2; pn < 10; ++pn)
+    {
+        pc.read(pn, buf);
+        EXPECT_TRUE(pc.contains(1));
+    }
+
+    pc.pin(9);
+    EXPECT_THROW(pc.read(10, buf), std::runtime_error);     // everything is pinned
+
+    pc.unpin(9);
+    pc.unpin(1);
+    EXPECT_THROW(pc.unpin(1), std::invalid_argument);
+    pc.read(10, buf);
+}
+
+
+TEST_F(PageCacheTest, DirtyWriteBack1)
+{
+    PageCache pc(&_store);
+    pc.reset(3, MemPageStore::PAGE_SIZE);
+
+    Byte buf[MemPageStore::PAGE_SIZE] = { 0x42 };
+    pc.write(7, buf, true);
+    pc.write(3, buf, true);
+    pc.write(5, buf, false);
+    EXPECT_EQ(0, _store.stores);
+    EXPECT_EQ(2, pc.getDirtyNum());
+
+    Byte* p = pc.pin(5);
+    p[1] = 0x43;
+    pc.unpin(5, true);
+
+    // flushed in page order
+    pc.flush();
+    EXPECT_EQ(0, pc.getDirtyNum());
+    ASSERT_EQ(3, _store.order.size());
+    EXPECT_EQ(3, _store.order[0]);
+    EXPECT_EQ(5, _store.order[1]);
+    EXPECT_EQ(7, _store.order[2]);
+    EXPECT_EQ(0x43, _store.pages[5][1]);
+
+    // dirty victim is stored before eviction
+    pc.write(8, buf, true);
+    pc.read(1, buf);
+    pc.read(2, buf);
+    pc.read(4, buf);
+    EXPECT_EQ(8, _store.order.back());
+}
+
+
+TEST_F(PageCacheTest, ReadCachedFill1)
+{
+    PageCache pc(&_store);
+    pc.reset(2, MemPageStore::PAGE_SIZE);
+
+    // a miss loads nothing, the caller reads the page itself
+    Byte buf[MemPageStore::PAGE_SIZE] = { 0x42 };
+    EXPECT_FALSE(pc.readCached(3, buf));
+    EXPECT_EQ(0, _store.loads);
+    EXPECT_EQ(1, pc.getMisses());
+
+    pc.fill(3, buf);
+    EXPECT_EQ(0, pc.getDirtyNum());
+    Byte got[MemPageStore::PAGE_SIZE] = { 0 };
+    EXPECT_TRUE(pc.readCached(3, got));
+    EXPECT_EQ(0x42, got[0]);
+    EXPECT_EQ(1, pc.getHits());
+    EXPECT_EQ(1, pc.getMisses());
+
+    // a page already in the pool is newer than the copy
+    Byte newer[MemPageStore::PAGE_SIZE] = { 0x43 };
+    pc.write(3, newer, true);
+    pc.fill(3, buf);
+    EXPECT_TRUE(pc.readCached(3, got));
+    EXPECT_EQ(0x43, got[0]);
+    EXPECT_EQ(0, _store.loads);
+}
@@ -0,0 +1,300 @@
+﻿////////////////////////////////////////////////////////////////////////////////
+/// \file
+/// \brief     Unit-тесты для журнала упреждающей записи B-деревьев
+///
+/// Gtest-based unit test.
+/// The naming conventions imply the name of a unit-test module is the same as
+/// the name of the corresponding tested module with _test suffix
+///
+////////////////////////////////////////////////////////////////////////////////
+
+
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "wal.h"
+#include "btree_adapters.h"
+
+
+/** \brief Путь к каталогу с рабочими тестовыми файлами. */
+static const char* TEST_FILES_PATH = "../../out/";
+
+
+using namespace xi;
+
+
+/** \brief Тестовый класс для журнала упреждающей записи. */
+class WalTest : public ::testing::Test {
+public:
+    std::string getFn(const char* fn)
+    {
+        return std::string(TEST_FILES_PATH) + fn;
+    }
+
+    /** \brief Возвращает содержимое файла \c fn, пустое, если его нет. */
+    static std::vector<char> readFile(const std::string& fn)
+    {
+        std::ifstream in(fn, std::ios_base::binary);
+        return std::vector<char>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    }
+
+    /** \brief Записывает в файл \c fn первые \c sz байт \c data — так файлы выглядят после сбоя. */
+    static void writeFile(const std::string& fn, const std::vector<char>& data, size_t sz)
+    {
+        std::ofstream out(fn, std::ios_base::binary | std::ios_base::trunc);
+        out.write(data.data(), sz);
+    }
+
+    static bool exists(const std::string& fn)
+    {
+        return std::ifstream(fn).good();
+    }
+}; // class WalTest
+
+
+
+TEST_F(WalTest, PendingWrites1)
+{
+    PosixPageIO file;
+    file.open(getFn("WalPending1.bin"), true);
+    std::vector<Byte> zeros(64, 0);
+    file.writeAt(0, &zeros[0], 64);
+
+    WalPageIO wal;
+    wal.open(getFn("WalPending1.bin.wal"), &file);
+
+    // overlapping writes are merged, a new range past the end is readable before the flush
+    Byte a[16], b[16], c[8];
+    memset(a, 'a', 16);
+    memset(b, 'b', 16);
+    memset(c, 'c', 8);
+    wal.writeAt(8, a, 16);
+    wal.writeAt(20, b, 16);
+    wal.writeAt(64, c, 8);
+    wal.writeAt(10, c, 2);
+
+    Byte buf[72];
+    ASSERT_TRUE(wal.readAt(0, buf, 64));
+    ASSERT_TRUE(wal.readAt(64, buf + 64, 8));
+    std::string got((const char*)buf, 72);
+    EXPECT_EQ(std::string(8, '\0') + "aacc" + std::string(8, 'a') + std::string(16, 'b')
+        + std::string(28, '\0') + std::string(8, 'c'), got);
+
+    // nothing reaches the file until the group is committed
+    ASSERT_TRUE(file.readAt(8, buf, 8));
+    EXPECT_EQ(std::string(8, '\0'), std::string((const char*)buf, 8));
+    EXPECT_FALSE(file.readAt(64, buf, 8));
+    EXPECT_EQ(0, wal.getLogSyncs());
+
+    // the commit returns when the log is on storage, and the group is in the file then
+    wal.commit();
+    EXPECT_EQ(1, wal.getLogSyncs());
+    EXPECT_LT(0u, readFile(getFn("WalPending1.bin.wal")).size());
+    ASSERT_TRUE(file.readAt(0, buf, 72));
+    EXPECT_EQ(got, std::string((const char*)buf, 72));
+
+    wal.close();
+    EXPECT_FALSE(exists(getFn("WalPending1.bin.wal")));
+}
+
+
+TEST_F(WalTest, LargeOffsets)
+{
+    std::string fn = getFn("WalLargeOffsets.bin");
+
+    // past 4 GiB, where 32-bit offsets wrap around (the file is sparse, so it takes no room)
+    const ULong far = (5ull << 30) + 8;
+    PosixPageIO file;
+    file.open(fn, true);
+
+    WalPageIO wal;
+    wal.open(fn + ".wal", &file);
+    Byte a[16], buf[16];
+    memset(a, 'a', 16);
+    wal.writeAt(far, a, 16);
+    ASSERT_TRUE(wal.readAt(far, buf, 16));
+    EXPECT_EQ(0, memcmp(a, buf, 16));
+    EXPECT_FALSE(file.readAt(far, buf, 16));
+    EXPECT_FALSE(file.readAt(far & 0xFFFFFFFF, buf, 16));
+
+    wal.commit();
+    wal.flush();
+    std::vector<char> log = readFile(fn + ".wal");
+    ASSERT_TRUE(file.readAt(far, buf, 16));
+    EXPECT_EQ(0, memcmp(a, buf, 16));
+
+    // the log keeps the whole offset, so recovery writes the bytes where they were
+    wal.close();
+    file.close();
+    file.open(fn, true);
+    writeFile(fn + ".wal", log, log.size());
+    EXPECT_EQ(1, WalPageIO::recover(fn + ".wal", &file));
+    ASSERT_TRUE(file.readAt(far, buf, 16));
+    EXPECT_EQ(0, memcmp(a, buf, 16));
+
+    file.close();
+    file.open(fn, true);                        // the sparse file is not left behind
+}
+
+
+TEST_F(WalTest, GroupCommit1)
+{
+    std::string fn = getFn("WalGroupCommit1.xibt");
+
+    BTreeIntAdapter bt;
+    bt.getTree().setWalEnabled(true);
+    bt.create(3, fn);
+    EXPECT_TRUE(exists(fn + ".wal"));
+
+    // with nobody to share it, every insert waits for an fsync of its own
+    UInt syncs = bt.getTree().getWal().getLogSyncs();
+    for (int el = 0; el < 200; ++el)
+        bt.insert(el * 3);
+    EXPECT_EQ(200, bt.getTree().getWal().getCommits());
+    EXPECT_EQ(syncs + 200, bt.getTree().getWal().getLogSyncs());
+
+    bt.insert(1);
+    bt.getTree().sync();                        // everything is on storage already
+    EXPECT_EQ(syncs + 201, bt.getTree().getWal().getLogSyncs());
+
+    bt.close();
+    EXPECT_FALSE(exists(fn + ".wal"));
+
+    bt.getTree().setWalEnabled(false);
+    bt.open(fn);
+    for (int el = 0; el < 600; ++el)
+        EXPECT_EQ(bt.contains(el), el % 3 == 0 || el == 1);
+
+    bt.close();
+    bt.getTree().setStorageMode(FileBaseBTree::smMapped);
+    bt.getTree().setWalEnabled(true);
+    EXPECT_THROW(bt.open(fn), std::logic_error);
+}
+
+
+TEST_F(WalTest, BulkLoadGroups)
+{
+    std::string fn = getFn("WalBulkLoadGroups.xibt");
+
+    BTreeIntAdapter bt;
+    bt.getTree().setWalEnabled(true);
+    bt.create(3, fn);
+
+    // the pages go to the log in groups, the last one switches the root
+    std::vector<int> keys;
+    for (int el = 0; el < 20000; ++el)
+        keys.push_back(el * 2);
+    UInt commits = bt.getTree().getWal().getCommits();
+    EXPECT_EQ(keys.size(), bt.bulkLoad(keys.begin(), keys.end()));
+    UInt groups = bt.getTree().getLastPageNum() / BaseBTree::BULK_COMMIT_PAGES;
+    EXPECT_LT(1, groups);
+    EXPECT_LE(commits + groups + 1, bt.getTree().getWal().getCommits());
+    bt.close();
+
+    bt.getTree().setWalEnabled(false);
+    bt.open(fn);
+    for (int el = 0; el < 40000; el += 7)
+        EXPECT_EQ(bt.contains(el), el % 2 == 0);
+}
+
+
+TEST_F(WalTest, GroupCommitThreads)
+{
+    std::string fn = getFn("WalGroupCommitThreads.bin");
+    const int THREADS = 8;
+    const int COMMITS = 100;
+    const UInt PAGE = 64;
+
+    PosixPageIO file;
+    file.open(fn, true);
+    WalPageIO wal;
+    wal.open(fn + ".wal", &file);
+
+    // the committers that come while a leader flushes are covered by the next fsync
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; ++t)
+        threads.push_back(std::thread([&, t]()
+        {
+            std::vector<Byte> page(PAGE);
+            for (int i = 0; i < COMMITS; ++i)
+            {
+                memset(&page[0], t * COMMITS + i, PAGE);
+                wal.writeAt((ULong)(t * COMMITS + i) * PAGE, &page[0], PAGE);
+                wal.commit();
+
+                std::vector<Byte> got(PAGE);
+                ASSERT_TRUE(wal.readAt((ULong)(t * COMMITS + i) * PAGE, &got[0], PAGE));
+                ASSERT_EQ(page, got);
+            }
+        }));
+    for (std::thread& th : threads)
+        th.join();
+
+    EXPECT_EQ((UInt)(THREADS * COMMITS), wal.getCommits());
+    EXPECT_LT(0, wal.getLogSyncs());
+    EXPECT_GT(wal.getCommits(), wal.getLogSyncs());
+
+    // every group has reached the file by the time its commit returned
+    std::vector<Byte> page(PAGE);
+    for (int p = 0; p < THREADS * COMMITS; ++p)
+    {
+        ASSERT_TRUE(file.readAt((ULong)p * PAGE, &page[0], PAGE));
+        EXPECT_EQ(std::vector<Byte>(PAGE, (Byte)p), page);
+    }
+    wal.close();
+}
+
+
+TEST_F(WalTest, Recovery1)
+{
+    std::string fn = getFn("WalRecovery1.xibt");
+    std::string crashFn = getFn("WalRecovery1Crash.xibt");
+
+    BTreeIntAdapter bt;
+    bt.getTree().setStorageMode(FileBaseBTree::smPosix);
+    bt.getTree().setWalEnabled(true);
+    bt.create(2, fn);
+    std::vector<char> emptyTree = readFile(fn);
+
+    // the splits of these inserts reach the log, and the tree file as it was before them
+    // is what a crash right after the log fsync leaves
+    for (int el = 0; el < 300; ++el)
+        bt.insert(el);
+    bt.getTree().sync();
+    std::vector<char> log = readFile(fn + ".wal");
+    ASSERT_FALSE(log.empty());
+
+    writeFile(crashFn, emptyTree, emptyTree.size());
+    writeFile(crashFn + ".wal", log, log.size());
+
+    BTreeIntAdapter rec;
+    rec.open(crashFn);
+    EXPECT_FALSE(exists(crashFn + ".wal"));
+    for (int el = -5; el < 305; ++el)
+        EXPECT_EQ(rec.contains(el), el >= 0 && el < 300);
+    rec.close();
+
+    // a torn last record drops only the last insert
+    writeFile(crashFn, emptyTree, emptyTree.size());
+    writeFile(crashFn + ".wal", log, log.size() - 3);
+    rec.open(crashFn);
+    for (int el = -5; el < 305; ++el)
+        EXPECT_EQ(rec.contains(el), el >= 0 && el < 299);
+    rec.insert(299);
+    EXPECT_TRUE(rec.contains(299));
+    rec.close();
+
+    // a new tree never picks up a stale log
+    writeFile(crashFn + ".wal", log, log.size());
+    BTreeIntAdapter fresh;
+    fresh.create(2, crashFn);
+    EXPECT_FALSE(fresh.contains(5));
+    fresh.close();
+    fresh.open(crashFn);
+    EXPECT_FALSE(fresh.contains(5));
+}